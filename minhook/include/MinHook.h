@@ -94,6 +94,16 @@ typedef struct _FROZEN_THREADS
     UINT    size;           // Actual number of data items
 } FROZEN_THREADS, *PFROZEN_THREADS;
 
+// Contention counters of the lock that serializes all MinHook functions.
+typedef struct _MH_LOCK_STATISTICS
+{
+    UINT64 acquisitions;    // Times the lock was taken
+    UINT64 spun;            // ... after spinning because it was held
+    UINT64 yielded;         // ... after giving up the time slice
+    UINT64 blocked;         // ... after waiting in the kernel
+    UINT64 blockedTicks;    // Time spent waiting in the kernel, QueryPerformanceCounter() ticks
+} MH_LOCK_STATISTICS, *PMH_LOCK_STATISTICS;
+
 // Can be passed as a parameter to MH_EnableHook, MH_DisableHook,
 // MH_QueueEnableHook or MH_QueueDisableHook.
 #define MH_ALL_HOOKS NULL
@@ -159,6 +169,12 @@ extern "C" {
     // Applies all queued changes in one go.
     MH_STATUS WINAPI MH_ApplyQueued(VOID);
 
+    // Retrieves the contention counters of the lock, cumulative since the
+    // process started.
+    // Parameters:
+    //   pStatistics [out] Receives the counters.
+    MH_STATUS WINAPI MH_GetLockStatistics(PMH_LOCK_STATISTICS pStatistics);
+
     // export function with libportable.
     VOID WINAPI EnterSpinLock(VOID);
 
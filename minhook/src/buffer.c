@@ -30,6 +30,8 @@
 #include "buffer.h"
 
 // Size of each memory block. (= page size of VirtualAlloc)
+// Blocks are committed one by one inside regions reserved at the allocation
+// granularity, which is the smallest amount VirtualAlloc can reserve anyway.
 #define MEMORY_BLOCK_SIZE 0x1000
 
 // Max range for seeking a memory block. (= 32MB)
@@ -64,10 +66,45 @@ typedef struct _MEMORY_BLOCK
 // First element of the memory block list.
 PMEMORY_BLOCK g_pMemoryBlocks;
 
+// Address range and allocation granularity of the process.
+ULONG_PTR g_minAddress;
+ULONG_PTR g_maxAddress;
+ULONG_PTR g_granularity;
+
 //-------------------------------------------------------------------------
 VOID InitializeBuffer(VOID)
 {
-    // Nothing to do for now.
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    g_minAddress  = (ULONG_PTR)si.lpMinimumApplicationAddress;
+    g_maxAddress  = (ULONG_PTR)si.lpMaximumApplicationAddress;
+    g_granularity = si.dwAllocationGranularity;
+}
+
+//-------------------------------------------------------------------------
+// Releases the region the block was committed in once none of its blocks
+// is committed anymore.
+static VOID ReleaseRegionIfUnused(PMEMORY_BLOCK pBlock)
+{
+    MEMORY_BASIC_INFORMATION mi;
+    ULONG_PTR pRegion;
+
+    if (VirtualQuery(pBlock, &mi, sizeof(mi)) == 0)
+        return;
+
+    pRegion = (ULONG_PTR)mi.AllocationBase;
+    if (VirtualQuery((LPVOID)pRegion, &mi, sizeof(mi)) == 0)
+        return;
+
+    if (mi.State == MEM_RESERVE && (ULONG_PTR)mi.BaseAddress + mi.RegionSize >= pRegion + g_granularity)
+        VirtualFree((LPVOID)pRegion, 0, MEM_RELEASE);
+}
+
+//-------------------------------------------------------------------------
+static VOID DecommitBlock(PMEMORY_BLOCK pBlock)
+{
+    VirtualFree(pBlock, MEMORY_BLOCK_SIZE, MEM_DECOMMIT);
+    ReleaseRegionIfUnused(pBlock);
 }
 
 //-------------------------------------------------------------------------
@@ -79,22 +116,123 @@ VOID UninitializeBuffer(VOID)
     while (pBlock)
     {
         PMEMORY_BLOCK pNext = pBlock->pNext;
-        VirtualFree(pBlock, 0, MEM_RELEASE);
+        DecommitBlock(pBlock);
         pBlock = pNext;
     }
 }
 
+//-------------------------------------------------------------------------
+// Returns the start of a free region of at least g_granularity bytes
+// below pAddress, skipping whole allocations at a time.
+static ULONG_PTR FindPrevFreeRegion(ULONG_PTR pAddress, ULONG_PTR minAddr)
+{
+    ULONG_PTR tryAddr = pAddress - pAddress % g_granularity;
+
+    while (tryAddr >= minAddr + g_granularity)
+    {
+        MEMORY_BASIC_INFORMATION mi;
+
+        tryAddr -= g_granularity;
+        if (VirtualQuery((LPVOID)tryAddr, &mi, sizeof(mi)) == 0)
+            break;
+
+        if (mi.State == MEM_FREE)
+            return tryAddr;
+
+        // Continue below the allocation that covers tryAddr.
+        if ((ULONG_PTR)mi.AllocationBase < tryAddr)
+            tryAddr = (ULONG_PTR)mi.AllocationBase;
+    }
+
+    return 0;
+}
+
+//-------------------------------------------------------------------------
+// Returns the start of a free region of at least g_granularity bytes
+// above pAddress, skipping whole memory ranges at a time.
+static ULONG_PTR FindNextFreeRegion(ULONG_PTR pAddress, ULONG_PTR maxAddr)
+{
+    ULONG_PTR tryAddr = pAddress - pAddress % g_granularity + g_granularity;
+
+    while (tryAddr <= maxAddr)
+    {
+        MEMORY_BASIC_INFORMATION mi;
+
+        if (VirtualQuery((LPVOID)tryAddr, &mi, sizeof(mi)) == 0)
+            break;
+
+        if (mi.State == MEM_FREE)
+            return tryAddr;
+
+        // Continue at the first boundary behind this range.
+        tryAddr = (ULONG_PTR)mi.BaseAddress + mi.RegionSize;
+        tryAddr += g_granularity - 1;
+        tryAddr -= tryAddr % g_granularity;
+    }
+
+    return 0;
+}
+
+//-------------------------------------------------------------------------
+// Reserves a region near pOrigin and commits its first block.
+static PMEMORY_BLOCK AllocateRegion(LPVOID pOrigin, ULONG_PTR minAddr, ULONG_PTR maxAddr)
+{
+    ULONG_PTR pAlloc = (ULONG_PTR)pOrigin;
+    LPVOID    pRegion;
+
+    // Search downward first.
+    while ((pAlloc = FindPrevFreeRegion(pAlloc, minAddr)) != 0)
+    {
+        pRegion = VirtualAlloc((LPVOID)pAlloc, g_granularity, MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+        if (pRegion != NULL)
+            return (PMEMORY_BLOCK)VirtualAlloc(pRegion, MEMORY_BLOCK_SIZE, MEM_COMMIT, PAGE_EXECUTE_READWRITE);
+    }
+
+    pAlloc = (ULONG_PTR)pOrigin;
+    while ((pAlloc = FindNextFreeRegion(pAlloc, maxAddr)) != 0)
+    {
+        pRegion = VirtualAlloc((LPVOID)pAlloc, g_granularity, MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+        if (pRegion != NULL)
+            return (PMEMORY_BLOCK)VirtualAlloc(pRegion, MEMORY_BLOCK_SIZE, MEM_COMMIT, PAGE_EXECUTE_READWRITE);
+    }
+
+    return NULL;
+}
+
+//-------------------------------------------------------------------------
+// Commits a block in the region of pBlock that isn't committed yet.
+static PMEMORY_BLOCK CommitBlockInRegion(PMEMORY_BLOCK pBlock)
+{
+    MEMORY_BASIC_INFORMATION mi;
+    ULONG_PTR pRegion;
+    ULONG_PTR pAddr;
+
+    if (VirtualQuery(pBlock, &mi, sizeof(mi)) == 0)
+        return NULL;
+
+    pRegion = (ULONG_PTR)mi.AllocationBase;
+    for (pAddr = pRegion; pAddr < pRegion + g_granularity; pAddr = (ULONG_PTR)mi.BaseAddress + mi.RegionSize)
+    {
+        if (VirtualQuery((LPVOID)pAddr, &mi, sizeof(mi)) == 0 || mi.AllocationBase != (LPVOID)pRegion)
+            break;
+
+        if (mi.State == MEM_RESERVE)
+            return (PMEMORY_BLOCK)VirtualAlloc(mi.BaseAddress, MEMORY_BLOCK_SIZE, MEM_COMMIT, PAGE_EXECUTE_READWRITE);
+    }
+
+    return NULL;
+}
+
 //-------------------------------------------------------------------------
 static PMEMORY_BLOCK GetMemoryBlock(LPVOID pOrigin)
 {
     ULONG_PTR minAddr;
     ULONG_PTR maxAddr;
     PMEMORY_BLOCK pBlock;
+    PMEMORY_BLOCK pNewBlock = NULL;
 
-    SYSTEM_INFO si;
-    GetSystemInfo(&si);
-    minAddr = (ULONG_PTR)si.lpMinimumApplicationAddress;
-    maxAddr = (ULONG_PTR)si.lpMaximumApplicationAddress;
+    minAddr = g_minAddress;
+    maxAddr = g_maxAddress;
 
 #ifdef _M_X64
     // pOrigin ± 16MB
@@ -117,29 +255,21 @@ static PMEMORY_BLOCK GetMemoryBlock(LPVOID pOrigin)
             return pBlock;
     }
 
-    // Alloc a new block if not found.
+    // Commit another block in the region of a reachable one.
+    for (pBlock = g_pMemoryBlocks; pBlock != NULL && pNewBlock == NULL; pBlock = pBlock->pNext)
     {
-        ULONG_PTR pStart = ((ULONG_PTR)pOrigin / MEMORY_BLOCK_SIZE) * MEMORY_BLOCK_SIZE;
-        ULONG_PTR pAlloc;
-        for (pAlloc = pStart - MEMORY_BLOCK_SIZE; pAlloc >= minAddr; pAlloc -= MEMORY_BLOCK_SIZE)
-        {
-            pBlock = (PMEMORY_BLOCK)VirtualAlloc(
-                (LPVOID)pAlloc, MEMORY_BLOCK_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
-            if (pBlock != NULL)
-                break;
-        }
-        if (pBlock == NULL)
-        {
-            for (pAlloc = pStart + MEMORY_BLOCK_SIZE; pAlloc < maxAddr; pAlloc += MEMORY_BLOCK_SIZE)
-            {
-                pBlock = (PMEMORY_BLOCK)VirtualAlloc(
-                    (LPVOID)pAlloc, MEMORY_BLOCK_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
-                if (pBlock != NULL)
-                    break;
-            }
-        }
+#ifdef _M_X64
+        if ((ULONG_PTR)pBlock < minAddr || (ULONG_PTR)pBlock >= maxAddr)
+            continue;
+#endif
+        pNewBlock = CommitBlockInRegion(pBlock);
     }
 
+    // Reserve a new region if not found.
+    if (pNewBlock == NULL)
+        pNewBlock = AllocateRegion(pOrigin, minAddr, maxAddr);
+
+    pBlock = pNewBlock;
     if (pBlock != NULL)
     {
         // Build a linked list of all the slots.
@@ -208,7 +338,7 @@ VOID FreeBuffer(LPVOID pBuffer)
                 else
                     g_pMemoryBlocks = pBlock->pNext;
 
-                VirtualFree(pBlock, 0, MEM_RELEASE);
+                DecommitBlock(pBlock);
             }
 
             break;
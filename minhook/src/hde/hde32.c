@@ -4,7 +4,9 @@
  * All rights reserved.
  *
  */
+#ifdef _WIN32
 #include <windows.h>
+#endif
 #include "hde32.h"
 #include "table32.h"
 #include "intrin_c.h"
@@ -15,7 +17,7 @@ unsigned int hde32_disasm(const void *code, hde32s *hs)
     uint8_t *ht = hde32_table, m_mod, m_reg, m_rm, disp_size = 0;
 
     // Avoid using memset to reduce the footprint.
-    __stosb((LPBYTE)hs, 0, sizeof(hde32s));
+    __stosb((unsigned char *)hs, 0, sizeof(hde32s));
 
     for (x = 16; x; x--)
         switch (c = *p++) {
@@ -5,7 +5,9 @@
  *
  */
 
+#ifdef _WIN32
 #include <windows.h>
+#endif
 #include "hde64.h"
 #include "table64.h"
 #include "intrin_c.h"
@@ -17,7 +19,7 @@ unsigned int hde64_disasm(const void *code, hde64s *hs)
     uint8_t op64 = 0;
 
     // Avoid using memset to reduce the footprint.
-    __stosb((LPBYTE)hs, 0, sizeof(hde64s));
+    __stosb((unsigned char *)hs, 0, sizeof(hde64s));
 
     for (x = 16; x; x--)
         switch (c = *p++) {
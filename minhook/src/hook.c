@@ -26,6 +26,10 @@
  *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#ifndef _WIN32_WINNT    /* TryAcquireSRWLockExclusive() needs Windows 7 */
+#  define _WIN32_WINNT 0x0601
+#endif
+
 #include "MinHook.h"
 #include "buffer.h"
 #include "trampoline.h"
@@ -39,6 +43,21 @@
 // Initial capacity of the thread IDs buffer.
 #define INITIAL_THREAD_CAPACITY 128
 
+// Number of YieldProcessor() rounds and SwitchToThread() calls
+// EnterSpinLock() tries before it waits in the kernel.
+#define LOCK_SPIN_COUNT  1024
+#define LOCK_YIELD_COUNT 4
+
+// NtGetNextThread() from ntdll.dll, available since Windows Vista.
+typedef LONG (NTAPI *NTGETNEXTTHREAD)(
+    HANDLE ProcessHandle, HANDLE ThreadHandle, ACCESS_MASK DesiredAccess,
+    ULONG HandleAttributes, ULONG Flags, PHANDLE NewThreadHandle);
+
+// NtGetNextThread() ran out of threads.
+#ifndef STATUS_NO_MORE_ENTRIES
+#define STATUS_NO_MORE_ENTRIES ((LONG)0x8000001A)
+#endif
+
 // Special hook position values.
 #define INVALID_HOOK_POS UINT_MAX
 #define ALL_HOOKS_POS    UINT_MAX
@@ -69,13 +88,19 @@ typedef struct _HOOK_ENTRY
 // Global Variables:
 //-------------------------------------------------------------------------
 
-// Spin lock flag for EnterSpinLock()/LeaveSpinLock().
-volatile LONG g_isLocked = false;
+// Lock for EnterSpinLock()/LeaveSpinLock().
+SRWLOCK g_lock = SRWLOCK_INIT;
+
+// Contention counters of g_lock, only changed while holding it.
+MH_LOCK_STATISTICS g_lockStatistics;
 
 // Private heap handle. If not NULL, this library is initialized.
 HANDLE g_hHeap = NULL;
 
-// Hook entries.
+// Thread IDs buffer of the last Unfreeze(), reused by the next Freeze().
+LPDWORD g_pThreadCache = NULL;
+
+// Hook entries, sorted by pTarget.
 struct
 {
     PHOOK_ENTRY pItems;     // Data heap
@@ -84,22 +109,46 @@ struct
 } g_hooks;
 
 //-------------------------------------------------------------------------
-// Returns INVALID_HOOK_POS if not found.
-static UINT FindHookEntry(LPVOID pTarget)
+// Returns the position of the first entry whose target is not below pTarget.
+static UINT LowerBoundHookEntry(LPVOID pTarget)
 {
-    UINT i;
-    for (i = 0; i < g_hooks.size; ++i)
+    UINT first = 0;
+    UINT count = g_hooks.size;
+    while (count > 0)
     {
-        if ((ULONG_PTR)pTarget == (ULONG_PTR)g_hooks.pItems[i].pTarget)
-            return i;
+        UINT half = count / 2;
+        if ((ULONG_PTR)g_hooks.pItems[first + half].pTarget < (ULONG_PTR)pTarget)
+        {
+            first += half + 1;
+            count -= half + 1;
+        }
+        else
+        {
+            count = half;
+        }
     }
 
+    return first;
+}
+
+//-------------------------------------------------------------------------
+// Returns INVALID_HOOK_POS if not found.
+static UINT FindHookEntry(LPVOID pTarget)
+{
+    UINT pos = LowerBoundHookEntry(pTarget);
+    if (pos < g_hooks.size && (ULONG_PTR)g_hooks.pItems[pos].pTarget == (ULONG_PTR)pTarget)
+        return pos;
+
     return INVALID_HOOK_POS;
 }
 
 //-------------------------------------------------------------------------
-static PHOOK_ENTRY NewHookEntry()
+// Inserts an entry for pTarget at its sorted position. Positions of the
+// entries behind it move up by one.
+static PHOOK_ENTRY NewHookEntry(LPVOID pTarget)
 {
+    UINT pos;
+
     if (g_hooks.pItems == NULL)
     {
         g_hooks.capacity = INITIAL_HOOK_CAPACITY;
@@ -119,14 +168,27 @@ static PHOOK_ENTRY NewHookEntry()
         g_hooks.pItems = p;
     }
 
-    return &g_hooks.pItems[g_hooks.size++];
+    pos = LowerBoundHookEntry(pTarget);
+    if (pos < g_hooks.size)
+    {
+        memmove(&g_hooks.pItems[pos + 1], &g_hooks.pItems[pos],
+            (g_hooks.size - pos) * sizeof(HOOK_ENTRY));
+    }
+
+    g_hooks.size++;
+    g_hooks.pItems[pos].pTarget = pTarget;
+    return &g_hooks.pItems[pos];
 }
 
 //-------------------------------------------------------------------------
+// Positions of the entries behind pos move down by one.
 static void DelHookEntry(UINT pos)
 {
     if (pos < g_hooks.size - 1)
-        g_hooks.pItems[pos] = g_hooks.pItems[g_hooks.size - 1];
+    {
+        memmove(&g_hooks.pItems[pos], &g_hooks.pItems[pos + 1],
+            (g_hooks.size - 1 - pos) * sizeof(HOOK_ENTRY));
+    }
 
     g_hooks.size--;
 
@@ -225,7 +287,9 @@ static void ProcessThreadIPs(HANDLE hThread, UINT pos, UINT action)
             enable = pHook->queueEnable;
             break;
         }
-        if (pHook->isEnabled == enable)
+        // A disabled hook in the hot patch area may have left its long
+        // jump there, see EnableHookAtomicLL().
+        if (pHook->isEnabled == enable && !(pHook->patchAbove && !enable))
             continue;
 
         if (enable)
@@ -242,7 +306,85 @@ static void ProcessThreadIPs(HANDLE hThread, UINT pos, UINT action)
 }
 
 //-------------------------------------------------------------------------
-static VOID EnumerateThreads(PFROZEN_THREADS pThreads)
+// Returns FALSE if the thread IDs buffer is full and can't be grown.
+static BOOL AddThreadId(PFROZEN_THREADS pThreads, DWORD threadId)
+{
+    if (pThreads->pItems == NULL)
+    {
+        pThreads->capacity = INITIAL_THREAD_CAPACITY;
+        pThreads->pItems
+            = (LPDWORD)HeapAlloc(g_hHeap, 0, pThreads->capacity * sizeof(DWORD));
+        if (pThreads->pItems == NULL)
+            return FALSE;
+    }
+    else if (pThreads->size >= pThreads->capacity)
+    {
+        LPDWORD p = (LPDWORD)HeapReAlloc(
+            g_hHeap, 0, pThreads->pItems, (pThreads->capacity * 2) * sizeof(DWORD));
+        if (p == NULL)
+            return FALSE;
+
+        pThreads->capacity *= 2;
+        pThreads->pItems = p;
+    }
+    pThreads->pItems[pThreads->size++] = threadId;
+    return TRUE;
+}
+
+//-------------------------------------------------------------------------
+// Walks the threads of the current process only. Returns FALSE if
+// NtGetNextThread() isn't available (before Windows Vista) or fails before
+// the end of the list, e.g. with STATUS_ACCESS_DENIED under a restricted
+// token. The caller falls back to a snapshot then.
+static BOOL EnumerateProcessThreads(PFROZEN_THREADS pThreads)
+{
+    static volatile NTGETNEXTTHREAD pNtGetNextThread = NULL;
+    HANDLE hThread = NULL;
+    HANDLE hNext;
+    DWORD  currentId = GetCurrentThreadId();
+    LONG   status;
+
+    if (pNtGetNextThread == NULL)
+    {
+        HMODULE hNtdll = GetModuleHandleW(L"ntdll.dll");
+        if (hNtdll == NULL)
+            return FALSE;
+
+        pNtGetNextThread = (NTGETNEXTTHREAD)GetProcAddress(hNtdll, "NtGetNextThread");
+        if (pNtGetNextThread == NULL)
+            return FALSE;
+    }
+
+    while ((status = pNtGetNextThread(
+        GetCurrentProcess(), hThread, THREAD_QUERY_INFORMATION, 0, 0, &hNext)) >= 0)
+    {
+        DWORD threadId;
+
+        if (hThread != NULL)
+            CloseHandle(hThread);
+        hThread = hNext;
+
+        threadId = GetThreadId(hThread);
+        if (threadId != 0 && threadId != currentId && !AddThreadId(pThreads, threadId))
+            break;
+    }
+
+    if (hThread != NULL)
+        CloseHandle(hThread);
+
+    // Anything but the end of the list may have left threads out
+    if (status < 0 && status != STATUS_NO_MORE_ENTRIES)
+    {
+        pThreads->size = 0;
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+//-------------------------------------------------------------------------
+// Walks a snapshot of all threads in the system.
+static VOID EnumerateSystemThreads(PFROZEN_THREADS pThreads)
 {
     HANDLE hSnapshot = CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0);
     if (hSnapshot != INVALID_HANDLE_VALUE)
@@ -257,25 +399,8 @@ static VOID EnumerateThreads(PFROZEN_THREADS pThreads)
                     && te.th32OwnerProcessID == GetCurrentProcessId()
                     && te.th32ThreadID != GetCurrentThreadId())
                 {
-                    if (pThreads->pItems == NULL)
-                    {
-                        pThreads->capacity = INITIAL_THREAD_CAPACITY;
-                        pThreads->pItems
-                            = (LPDWORD)HeapAlloc(g_hHeap, 0, pThreads->capacity * sizeof(DWORD));
-                        if (pThreads->pItems == NULL)
-                            break;
-                    }
-                    else if (pThreads->size >= pThreads->capacity)
-                    {
-                        LPDWORD p = (LPDWORD)HeapReAlloc(
-                            g_hHeap, 0, pThreads->pItems, (pThreads->capacity * 2) * sizeof(DWORD));
-                        if (p == NULL)
-                            break;
-
-                        pThreads->capacity *= 2;
-                        pThreads->pItems = p;
-                    }
-                    pThreads->pItems[pThreads->size++] = te.th32ThreadID;
+                    if (!AddThreadId(pThreads, te.th32ThreadID))
+                        break;
                 }
 
                 te.dwSize = sizeof(THREADENTRY32);
@@ -286,11 +411,23 @@ static VOID EnumerateThreads(PFROZEN_THREADS pThreads)
 }
 
 //-------------------------------------------------------------------------
-VOID WINAPI Freezex(PFROZEN_THREADS pThreads)
+// Fills pThreads with the IDs of all other threads of the process, reusing
+// the buffer of the previous Unfreeze() if there is one.
+static VOID EnumerateThreads(PFROZEN_THREADS pThreads)
 {
-    pThreads->pItems   = NULL;
+    pThreads->pItems   = (LPDWORD)InterlockedExchangePointer((PVOID volatile *)&g_pThreadCache, NULL);
     pThreads->capacity = 0;
     pThreads->size     = 0;
+    if (pThreads->pItems != NULL)
+        pThreads->capacity = (UINT)(HeapSize(g_hHeap, 0, pThreads->pItems) / sizeof(DWORD));
+
+    if (!EnumerateProcessThreads(pThreads))
+        EnumerateSystemThreads(pThreads);
+}
+
+//-------------------------------------------------------------------------
+VOID WINAPI Freezex(PFROZEN_THREADS pThreads)
+{
     EnumerateThreads(pThreads);
 
     if (pThreads->pItems != NULL)
@@ -311,9 +448,6 @@ VOID WINAPI Freezex(PFROZEN_THREADS pThreads)
 //-------------------------------------------------------------------------
 static VOID Freeze(PFROZEN_THREADS pThreads, UINT pos, UINT action)
 {
-    pThreads->pItems   = NULL;
-    pThreads->capacity = 0;
-    pThreads->size     = 0;
     EnumerateThreads(pThreads);
 
     if (pThreads->pItems != NULL)
@@ -337,6 +471,7 @@ VOID WINAPI Unfreeze(PFROZEN_THREADS pThreads)
 {
     if (pThreads->pItems != NULL)
     {
+        LPDWORD pItems;
         UINT i;
         for (i = 0; i < pThreads->size; ++i)
         {
@@ -348,7 +483,10 @@ VOID WINAPI Unfreeze(PFROZEN_THREADS pThreads)
             }
         }
 
-        HeapFree(g_hHeap, 0, pThreads->pItems);
+        // Keep the buffer for the next Freeze().
+        pItems = (LPDWORD)InterlockedExchangePointer((PVOID volatile *)&g_pThreadCache, pThreads->pItems);
+        if (pItems != NULL)
+            HeapFree(g_hHeap, 0, pItems);
     }
 }
 
@@ -402,11 +540,81 @@ static MH_STATUS EnableHookLL(UINT pos, bool enable)
     return MH_OK;
 }
 
+//-------------------------------------------------------------------------
+// Returns TRUE if the hook can be enabled or disabled without freezing the
+// other threads: only the short jump at the target changes, no thread can be
+// in the middle of the instruction it replaces, and it doesn't straddle a
+// cache line, so other processors see either the old or the new instruction.
+static BOOL IsAtomicPatchable(PHOOK_ENTRY pHook)
+{
+    return pHook->patchAbove
+        && pHook->nIP > 1 && pHook->oldIPs[1] == sizeof(JMP_REL_SHORT)
+        && ((ULONG_PTR)pHook->pTarget & 63) != 63;
+}
+
+//-------------------------------------------------------------------------
+// Enables or disables a hook for which IsAtomicPatchable() holds. The long
+// jump above the target is left in place when disabling, as a thread may
+// have just taken the short jump to it. EnableHookLL() clears it when the
+// hook is removed or MinHook is uninitialized.
+static MH_STATUS EnableHookAtomicLL(UINT pos, bool enable)
+{
+    PHOOK_ENTRY pHook = &g_hooks.pItems[pos];
+    DWORD  oldProtect;
+    LPBYTE pPatchTarget = (LPBYTE)pHook->pTarget - sizeof(JMP_REL);
+    SIZE_T patchSize    = sizeof(JMP_REL) + sizeof(JMP_REL_SHORT);
+    UINT16 shortJmp;
+
+    if (!VirtualProtect(pPatchTarget, patchSize, PAGE_EXECUTE_READWRITE, &oldProtect))
+        return MH_ERROR_MEMORY_PROTECT;
+
+    if (enable)
+    {
+        JMP_REL jmp;
+        jmp.opcode  = 0xE9;
+        jmp.operand = (UINT32)((LPBYTE)pHook->pDetour - (pPatchTarget + sizeof(JMP_REL)));
+
+        // Still there if the hook was enabled before.
+        if (memcmp(pPatchTarget, &jmp, sizeof(jmp)) != 0)
+        {
+            memcpy(pPatchTarget, &jmp, sizeof(jmp));
+            FlushInstructionCache(GetCurrentProcess(), pPatchTarget, sizeof(jmp));
+        }
+
+        shortJmp = 0xEB | ((UINT16)(UINT8)(0 - (sizeof(JMP_REL_SHORT) + sizeof(JMP_REL))) << 8);
+    }
+    else
+    {
+        memcpy(&shortJmp, pHook->backup + sizeof(JMP_REL), sizeof(shortJmp));
+    }
+
+    *(volatile UINT16 *)pHook->pTarget = shortJmp;
+
+    VirtualProtect(pPatchTarget, patchSize, oldProtect, &oldProtect);
+    FlushInstructionCache(GetCurrentProcess(), pHook->pTarget, sizeof(JMP_REL_SHORT));
+
+    pHook->isEnabled   = enable;
+    pHook->queueEnable = enable;
+
+    return MH_OK;
+}
+
 //-------------------------------------------------------------------------
 static MH_STATUS EnableAllHooksLL(bool enable)
 {
     UINT i;
     MH_STATUS status = MH_OK;
+
+    for (i = 0; i < g_hooks.size; ++i)
+    {
+        PHOOK_ENTRY pHook = &g_hooks.pItems[i];
+        if (pHook->isEnabled != enable && IsAtomicPatchable(pHook))
+        {
+            status = EnableHookAtomicLL(i, enable);
+            if (status != MH_OK) return status;
+        }
+    }
+
     for (i = 0; i < g_hooks.size; ++i)
     {
         if (g_hooks.pItems[i].isEnabled != enable)
@@ -431,21 +639,96 @@ static MH_STATUS EnableAllHooksLL(bool enable)
 }
 
 
+//-------------------------------------------------------------------------
+// Disables every hook and puts back the hot patch area of the ones using it,
+// enabled or not: EnableHookAtomicLL() leaves its long jump there. All under
+// one freeze, like MH_RemoveHook() does for a single hook.
+static MH_STATUS RestoreAllHooksLL(VOID)
+{
+    FROZEN_THREADS threads;
+    MH_STATUS status = MH_OK;
+    UINT i;
+
+    for (i = 0; i < g_hooks.size; ++i)
+    {
+        if (g_hooks.pItems[i].isEnabled || g_hooks.pItems[i].patchAbove)
+            break;
+    }
+    if (i == g_hooks.size)
+        return MH_OK;
+
+    Freeze(&threads, ALL_HOOKS_POS, ACTION_DISABLE);
+    for (; i < g_hooks.size; ++i)
+    {
+        if (g_hooks.pItems[i].isEnabled || g_hooks.pItems[i].patchAbove)
+        {
+            status = EnableHookLL(i, false);
+            if (status != MH_OK) break;
+        }
+    }
+    Unfreeze(&threads);
+
+    return status;
+}
+
 //-------------------------------------------------------------------------
 VOID WINAPI EnterSpinLock(VOID)
 {
-    // Wait until the flag is false.
-    while (_InterlockedCompareExchange(&g_isLocked, true, false) != false)
+    // Hooks are held for a few microseconds unless threads get frozen, so
+    // spin first, then give up the time slice, and only then block.
+    LARGE_INTEGER start, end;
+    UINT i;
+
+    if (TryAcquireSRWLockExclusive(&g_lock))
+    {
+        g_lockStatistics.acquisitions++;
+        return;
+    }
+
+    for (i = 0; i < LOCK_SPIN_COUNT; ++i)
+    {
+        YieldProcessor();
+        if (TryAcquireSRWLockExclusive(&g_lock))
+        {
+            g_lockStatistics.acquisitions++;
+            g_lockStatistics.spun++;
+            return;
+        }
+    }
+
+    for (i = 0; i < LOCK_YIELD_COUNT; ++i)
     {
-        // Prevent the loop from being too busy.
-        Sleep(1);
+        SwitchToThread();
+        if (TryAcquireSRWLockExclusive(&g_lock))
+        {
+            g_lockStatistics.acquisitions++;
+            g_lockStatistics.yielded++;
+            return;
+        }
     }
+
+    QueryPerformanceCounter(&start);
+    AcquireSRWLockExclusive(&g_lock);
+    QueryPerformanceCounter(&end);
+
+    g_lockStatistics.acquisitions++;
+    g_lockStatistics.blocked++;
+    g_lockStatistics.blockedTicks += end.QuadPart - start.QuadPart;
 }
 
 //-------------------------------------------------------------------------
 VOID WINAPI LeaveSpinLock(VOID)
 {
-    _InterlockedExchange(&g_isLocked, false);
+    ReleaseSRWLockExclusive(&g_lock);
+}
+
+//-------------------------------------------------------------------------
+MH_STATUS WINAPI MH_GetLockStatistics(PMH_LOCK_STATISTICS pStatistics)
+{
+    EnterSpinLock();
+    *pStatistics = g_lockStatistics;
+    LeaveSpinLock();
+    return MH_OK;
 }
 
 //-------------------------------------------------------------------------
@@ -485,7 +768,7 @@ MH_STATUS WINAPI MH_Uninitialize(VOID)
             status = MH_ERROR_NOT_INITIALIZED;
             break;
         }
-        status = EnableAllHooksLL(false);
+        status = RestoreAllHooksLL();
         if (status != MH_OK) break;
         // Free the internal function buffer.
         // HeapFree is actually not required, but some tools detect a false
@@ -494,6 +777,8 @@ MH_STATUS WINAPI MH_Uninitialize(VOID)
         HeapFree(g_hHeap, 0, g_hooks.pItems);
         HeapDestroy(g_hHeap);
 
+        g_pThreadCache = NULL;
+
         g_hHeap = NULL;
 
         g_hooks.pItems   = NULL;
@@ -552,7 +837,7 @@ MH_STATUS WINAPI MH_CreateHook(LPVOID pTarget, LPVOID pDetour, LPVOID *ppOrigina
             break;
         }
 
-        pHook = NewHookEntry();
+        pHook = NewHookEntry(ct.pTarget);
         if (pHook == NULL)
         {
             FreeBuffer(pBuffer);
@@ -616,7 +901,7 @@ MH_STATUS WINAPI MH_RemoveHook(LPVOID pTarget)
             break;
         }
 
-        if (g_hooks.pItems[pos].isEnabled)
+        if (g_hooks.pItems[pos].isEnabled || g_hooks.pItems[pos].patchAbove)
         {
             FROZEN_THREADS threads;
             Freeze(&threads, pos, ACTION_DISABLE);
@@ -665,6 +950,12 @@ static MH_STATUS EnableHook(LPVOID pTarget, bool enable)
                 break;
             }
 
+            if (IsAtomicPatchable(&g_hooks.pItems[pos]))
+            {
+                status = EnableHookAtomicLL(pos, enable);
+                break;
+            }
+
             Freeze(&threads, pos, ACTION_ENABLE);
             status = EnableHookLL(pos, enable);
             Unfreeze(&threads);
@@ -745,6 +1036,15 @@ MH_STATUS WINAPI MH_ApplyQueued(VOID)
     }
     EnterSpinLock();
     for (i = 0; i < g_hooks.size; ++i)
+    {
+        PHOOK_ENTRY pHook = &g_hooks.pItems[i];
+        if (pHook->isEnabled != pHook->queueEnable && IsAtomicPatchable(pHook))
+        {
+            status = EnableHookAtomicLL(i, pHook->queueEnable);
+            if (status != MH_OK) break;
+        }
+    }
+    for (i = 0; status == MH_OK && i < g_hooks.size; ++i)
     {
         if (g_hooks.pItems[i].isEnabled != g_hooks.pItems[i].queueEnable)
         {
@@ -102,6 +102,8 @@ BOOL CreateTrampolineFunction(PTRAMPOLINE ct)
     UINT8     newPos   = 0;
     ULONG_PTR jmpDest  = 0;     // Destination address of an internal jump.
     BOOL      finished = FALSE; // Is the function completed?
+    BOOL      hotPatch;         // Is the function hot-patchable?
+    UINT      patchSize;        // Bytes to be overwritten at the target.
 #ifdef _M_X64
     UINT8     instBuf[16];
 #endif
@@ -109,6 +111,14 @@ BOOL CreateTrampolineFunction(PTRAMPOLINE ct)
     ct->patchAbove = FALSE;
     ct->nIP        = 0;
 
+    // Hot-patchable functions start with MOV EDI, EDI and have five bytes of
+    // padding above. Only those two bytes need to be replaced by a short jump,
+    // which can be done without freezing other threads.
+    hotPatch = ((LPBYTE)ct->pTarget)[0] == 0x8B && ((LPBYTE)ct->pTarget)[1] == 0xFF
+        && IsExecutableAddress((LPBYTE)ct->pTarget - sizeof(JMP_REL))
+        && IsCodePadding((LPBYTE)ct->pTarget - sizeof(JMP_REL), sizeof(JMP_REL));
+    patchSize = hotPatch ? sizeof(JMP_REL_SHORT) : sizeof(JMP_REL);
+
     do
     {
         HDE       hs;
@@ -122,7 +132,7 @@ BOOL CreateTrampolineFunction(PTRAMPOLINE ct)
             return FALSE;
 
         pCopySrc = (LPVOID)pOldInst;
-        if (oldPos >= sizeof(JMP_REL))
+        if (oldPos >= patchSize)
         {
             // The trampoline function is long enough.
             // Complete the function with the jump to the target function.
@@ -270,8 +280,12 @@ BOOL CreateTrampolineFunction(PTRAMPOLINE ct)
     }
     while (!finished);
 
+    if (hotPatch)
+    {
+        ct->patchAbove = TRUE;
+    }
     // Is there enough place for a long jump?
-    if (oldPos < sizeof(JMP_REL)
+    else if (oldPos < sizeof(JMP_REL)
         && !IsCodePadding((LPBYTE)ct->pTarget + oldPos, sizeof(JMP_REL) - oldPos))
     {
         // Is there enough place for a short jump?
@@ -0,0 +1,115 @@
+/*
+ * Native test of MinHook's hot patch hooks, built with the Win32 stand-ins
+ * in posix/ (make test-native).
+ *
+ * A hook that was disabled without freezing threads keeps its long jump in
+ * the padding above the target. MH_Uninitialize() has to put that padding
+ * back too, or the next hook on the same target no longer finds a hot patch
+ * area there.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "MinHook.h"
+#include "../src/buffer.h"
+
+// One page for the target, the next one for its trampoline and relay, which
+// have to be within a 32-bit jump of it.
+static LPBYTE g_pages;
+static BOOL   g_bufferUsed;
+
+VOID InitializeBuffer(VOID) {}
+VOID UninitializeBuffer(VOID) {}
+
+LPVOID AllocateBuffer(LPVOID pOrigin)
+{
+    (void)pOrigin;
+    if (g_bufferUsed)
+        return NULL;
+    g_bufferUsed = TRUE;
+    return g_pages + 4096;
+}
+
+VOID FreeBuffer(LPVOID pBuffer)
+{
+    (void)pBuffer;
+    g_bufferUsed = FALSE;
+}
+
+BOOL IsExecutableAddress(LPVOID pAddress)
+{
+    return pAddress != NULL;
+}
+
+// Five bytes of padding, then MOV EDI, EDI / XOR EAX, EAX / RET
+static const UINT8 TARGET[] = { 0xCC, 0xCC, 0xCC, 0xCC, 0xCC, 0x8B, 0xFF, 0x31, 0xC0, 0xC3 };
+#define PATCH_AREA 7 // the padding and the MOV EDI, EDI
+
+static int Detour(void)
+{
+    return 1;
+}
+
+static int Check(const char *what, MH_STATUS status)
+{
+    if (status == MH_OK)
+        return 1;
+
+    printf("FAIL: %s returned status %d\n", what, (int)status);
+    return 0;
+}
+
+int main(void)
+{
+    LPBYTE pTarget;
+    LPVOID pTrampoline;
+
+    g_pages = (LPBYTE)mmap(NULL, 2 * 4096, PROT_READ | PROT_WRITE | PROT_EXEC,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (g_pages == MAP_FAILED)
+    {
+        printf("FAIL: mmap\n");
+        return 1;
+    }
+
+    memcpy(g_pages + 64, TARGET, sizeof(TARGET));
+    pTarget = g_pages + 64 + 5;
+
+    if (!Check("MH_Initialize", MH_Initialize())
+        || !Check("MH_CreateHook", MH_CreateHook(pTarget, (LPVOID)Detour, &pTrampoline))
+        || !Check("MH_EnableHook", MH_EnableHook(pTarget)))
+        return 1;
+
+    if (pTarget[0] != 0xEB || pTarget[-5] != 0xE9)
+    {
+        printf("FAIL: not hooked through the hot patch area\n");
+        return 1;
+    }
+
+    if (!Check("MH_DisableHook", MH_DisableHook(pTarget)))
+        return 1;
+
+    // Disabled without freezing: the long jump is still there
+    if (pTarget[0] != 0x8B || pTarget[-5] != 0xE9)
+    {
+        printf("FAIL: hook wasn't disabled atomically\n");
+        return 1;
+    }
+
+    if (!Check("MH_Uninitialize", MH_Uninitialize()))
+        return 1;
+
+    if (memcmp(pTarget - 5, TARGET, PATCH_AREA) != 0)
+    {
+        printf("FAIL: hot patch area not restored:");
+        for (int i = 0; i < PATCH_AREA; ++i)
+            printf(" %02X", pTarget[i - 5]);
+        printf("\n");
+        return 1;
+    }
+
+    printf("OK: hot patch area restored after an atomic disable and MH_Uninitialize()\n");
+    return 0;
+}
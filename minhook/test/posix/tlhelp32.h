@@ -0,0 +1,19 @@
+/* See windows.h next to this file */
+
+#pragma once
+
+#include <windows.h>
+
+#define TH32CS_SNAPTHREAD 0x00000004
+
+typedef struct
+{
+    DWORD dwSize;
+    DWORD cntUsage;
+    DWORD th32ThreadID;
+    DWORD th32OwnerProcessID;
+} THREADENTRY32;
+
+static inline HANDLE CreateToolhelp32Snapshot(DWORD flags, DWORD process) { (void)flags; (void)process; return INVALID_HANDLE_VALUE; }
+static inline BOOL   Thread32First(HANDLE snapshot, THREADENTRY32 *te) { (void)snapshot; (void)te; return FALSE; }
+static inline BOOL   Thread32Next(HANDLE snapshot, THREADENTRY32 *te) { (void)snapshot; (void)te; return FALSE; }
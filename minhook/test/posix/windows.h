@@ -0,0 +1,135 @@
+/*
+ * Just enough of the Win32 API for MinHook's hook.c and trampoline.c to build
+ * and run natively, see hotpatch.c. Memory protection maps to mprotect(), the
+ * heap to malloc(), and there are no other threads to freeze.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <sys/mman.h>
+
+#define _M_X64 1
+
+#define WINAPI
+#define NTAPI
+#define VOID void
+#define TRUE  1
+#define FALSE 0
+
+typedef int            BOOL;
+typedef unsigned char  BYTE, UINT8, *LPBYTE;
+typedef unsigned short UINT16, WORD;
+typedef unsigned int   UINT, UINT32, *PUINT32, DWORD, *LPDWORD, ULONG, ACCESS_MASK;
+typedef signed char    INT8;
+typedef int            INT32, LONG;
+typedef long long      LONGLONG;
+typedef uint64_t       UINT64, DWORD64;
+typedef uintptr_t      ULONG_PTR, DWORD_PTR, SIZE_T;
+typedef intptr_t       LONG_PTR;
+typedef void          *LPVOID, *PVOID, *HANDLE, *HMODULE;
+typedef HANDLE        *PHANDLE;
+typedef const char    *LPCSTR;
+typedef const wchar_t *LPCWSTR;
+
+typedef union { struct { DWORD LowPart; LONG HighPart; } u; LONGLONG QuadPart; } LARGE_INTEGER;
+
+#define FIELD_OFFSET(type, field) offsetof(type, field)
+#define INVALID_HANDLE_VALUE ((HANDLE)(LONG_PTR)-1)
+
+/* Memory */
+
+#define PAGE_NOACCESS          0x01
+#define PAGE_READONLY          0x02
+#define PAGE_READWRITE         0x04
+#define PAGE_EXECUTE           0x10
+#define PAGE_EXECUTE_READ      0x20
+#define PAGE_EXECUTE_READWRITE 0x40
+
+static inline BOOL VirtualProtect(LPVOID address, SIZE_T size, DWORD protect, DWORD *oldProtect)
+{
+    uintptr_t page  = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)address & ~(page - 1);
+    uintptr_t end   = ((uintptr_t)address + size + page - 1) & ~(page - 1);
+    int prot = PROT_READ | PROT_EXEC;
+
+    if (protect == PAGE_EXECUTE_READWRITE || protect == PAGE_READWRITE)
+        prot |= PROT_WRITE;
+
+    /* The test only ever protects pages it mapped read/write/execute */
+    *oldProtect = PAGE_EXECUTE_READWRITE;
+    return mprotect((void *)start, end - start, prot) == 0;
+}
+
+static inline HANDLE GetCurrentProcess(void) { return (HANDLE)(LONG_PTR)-1; }
+static inline BOOL FlushInstructionCache(HANDLE process, LPVOID address, SIZE_T size)
+{
+    (void)process; (void)address; (void)size;
+    return TRUE;
+}
+
+/* Heap */
+
+static inline HANDLE HeapCreate(DWORD options, SIZE_T initial, SIZE_T maximum)
+{
+    (void)options; (void)initial; (void)maximum;
+    return (HANDLE)1;
+}
+static inline BOOL   HeapDestroy(HANDLE heap) { (void)heap; return TRUE; }
+static inline LPVOID HeapAlloc(HANDLE heap, DWORD flags, SIZE_T size) { (void)heap; (void)flags; return malloc(size); }
+static inline LPVOID HeapReAlloc(HANDLE heap, DWORD flags, LPVOID p, SIZE_T size) { (void)heap; (void)flags; return realloc(p, size); }
+static inline BOOL   HeapFree(HANDLE heap, DWORD flags, LPVOID p) { (void)heap; (void)flags; free(p); return TRUE; }
+static inline SIZE_T HeapSize(HANDLE heap, DWORD flags, LPVOID p) { (void)heap; (void)flags; return malloc_usable_size(p); }
+
+/* Locking and timing, single-threaded */
+
+typedef struct { PVOID Ptr; } SRWLOCK;
+#define SRWLOCK_INIT { 0 }
+
+static inline BOOL TryAcquireSRWLockExclusive(SRWLOCK *lock) { if (lock->Ptr) return FALSE; lock->Ptr = lock; return TRUE; }
+static inline void AcquireSRWLockExclusive(SRWLOCK *lock) { lock->Ptr = lock; }
+static inline void ReleaseSRWLockExclusive(SRWLOCK *lock) { lock->Ptr = NULL; }
+static inline BOOL SwitchToThread(void) { return sched_yield() == 0; }
+#define YieldProcessor() __asm__ __volatile__("pause")
+
+static inline BOOL QueryPerformanceCounter(LARGE_INTEGER *count)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    count->QuadPart = (LONGLONG)now.tv_sec * 1000000000 + now.tv_nsec;
+    return TRUE;
+}
+
+static inline LPVOID InterlockedExchangePointer(LPVOID volatile *target, LPVOID value)
+{
+    return __atomic_exchange_n(target, value, __ATOMIC_SEQ_CST);
+}
+
+/* Threads: there are none besides the caller, so nothing gets frozen */
+
+#define THREAD_SUSPEND_RESUME     0x0002
+#define THREAD_GET_CONTEXT        0x0008
+#define THREAD_QUERY_INFORMATION  0x0040
+#define THREAD_SET_CONTEXT        0x0010
+#define CONTEXT_CONTROL           0x00100001
+
+typedef struct { DWORD ContextFlags; DWORD64 Rip; } CONTEXT;
+
+static inline DWORD   GetCurrentThreadId(void) { return 1; }
+static inline DWORD   GetCurrentProcessId(void) { return 1; }
+static inline DWORD   GetThreadId(HANDLE thread) { (void)thread; return 0; }
+static inline HMODULE GetModuleHandleW(LPCWSTR name) { (void)name; return NULL; }
+static inline LPVOID  GetProcAddress(HMODULE module, LPCSTR name) { (void)module; (void)name; return NULL; }
+static inline HANDLE  OpenThread(DWORD access, BOOL inherit, DWORD id) { (void)access; (void)inherit; (void)id; return NULL; }
+static inline DWORD   SuspendThread(HANDLE thread) { (void)thread; return (DWORD)-1; }
+static inline DWORD   ResumeThread(HANDLE thread) { (void)thread; return (DWORD)-1; }
+static inline BOOL    GetThreadContext(HANDLE thread, CONTEXT *c) { (void)thread; (void)c; return FALSE; }
+static inline BOOL    SetThreadContext(HANDLE thread, const CONTEXT *c) { (void)thread; (void)c; return FALSE; }
+static inline BOOL    CloseHandle(HANDLE handle) { (void)handle; return TRUE; }
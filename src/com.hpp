@@ -360,7 +360,7 @@ namespace com {
                         this->AddRef();
                 }
 
-                return E_NOINTERFACE;
+                return *ppvObject ? S_OK : E_NOINTERFACE;
             }
 
             ULONG STDMETHODCALLTYPE AddRef() override
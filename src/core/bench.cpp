@@ -0,0 +1,257 @@
+// Copyright (C) 2015 Jonas Kümmerlin <rgcjonas@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+/*
+ * Micro-benchmarks for the platform-neutral core, built with the host compiler
+ *
+ * Usage: core-bench [--quick]
+ *
+ * Every kernel that replaced a pixel-by-pixel loop is first checked against that
+ * loop, then both are timed. Results are "name value" lines, nanoseconds per call.
+ */
+
+#include "pixels.hpp"
+#include "region.hpp"
+#include "protocol.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+namespace {
+    // Keeps the compiler from optimizing the measured work away
+    volatile uint64_t g_sink;
+
+    unsigned g_iterations = 2000;
+
+    // Reports the fastest of a few rounds, which is the least disturbed by
+    // whatever else the machine is doing
+    template<typename TFunc>
+    void bench(const char *name, TFunc func)
+    {
+        const unsigned rounds = 5;
+        const unsigned perRound = g_iterations / rounds + 1;
+        double best = 0.0;
+
+        // Warm up caches and branch predictors first
+        for (unsigned i = 0; i < perRound; ++i)
+            func();
+
+        for (unsigned round = 0; round < rounds; ++round) {
+            auto start = std::chrono::steady_clock::now();
+            for (unsigned i = 0; i < perRound; ++i)
+                func();
+            auto end = std::chrono::steady_clock::now();
+
+            double ns = std::chrono::duration<double, std::nano>(end - start).count() / perRound;
+            if (round == 0 || ns < best)
+                best = ns;
+        }
+
+        printf("%s.ns_per_call %.1f\n", name, best);
+    }
+
+    bool g_failed = false;
+
+    void check(bool ok, const char *what)
+    {
+        if (!ok) {
+            fprintf(stderr, "MISMATCH: %s\n", what);
+            g_failed = true;
+        }
+    }
+
+    // Some pseudo-random bytes that stay the same on every run
+    std::vector<uint8_t> pattern(std::size_t size, uint32_t seed)
+    {
+        std::vector<uint8_t> bytes(size);
+        for (auto &byte : bytes) {
+            seed = seed * 1664525 + 1013904223;
+            byte = uint8_t(seed >> 24);
+        }
+
+        return bytes;
+    }
+
+    /*********************************
+     * REFERENCE IMPLEMENTATIONS
+     * (what dd4seven-api.cpp and test-dx11.cpp did before)
+     *********************************/
+
+    bool reference_has_alpha(const uint8_t *bitmap, std::size_t stride, long width, long height)
+    {
+        bool foundAlpha = false;
+        for (long y = 0; y < height; ++y) {
+            for (long x = 0; x < width; ++x) {
+                if (bitmap[y*stride + x*4 + 3]) {
+                    foundAlpha = true;
+                    break;
+                }
+            }
+        }
+
+        return foundAlpha;
+    }
+
+    void reference_mono_cursor_to_bgra(const uint8_t *shape, std::size_t pitch, unsigned width, unsigned maskedHeight,
+                                       uint8_t *target, std::size_t targetPitch, unsigned maxWidth, unsigned maxHeight)
+    {
+        const uint8_t *and_map = shape;
+        const uint8_t *xor_map = and_map + pitch*maskedHeight/2;
+
+        for (unsigned row = 0; row < std::min(maskedHeight/2, maxHeight); ++row) {
+            const uint8_t *and_row = &and_map[row * pitch];
+            const uint8_t *xor_row = &xor_map[row * pitch];
+
+            for (unsigned col = 0; col < std::min(width, maxWidth); ++col) {
+                uint8_t *pixel = &target[row*targetPitch + col*4];
+
+                uint8_t alpha = core::get_pixel_from_row<1>(and_row, int(col)) ? 0 : 0xFF;
+                uint8_t rgb   = core::get_pixel_from_row<1>(xor_row, int(col)) ? 0xFF : 0;
+
+                pixel[0] = rgb;
+                pixel[1] = rgb;
+                pixel[2] = rgb;
+                pixel[3] = alpha;
+            }
+        }
+    }
+
+    /*********************************
+     * BENCHMARKS
+     *********************************/
+
+    void bench_pixels()
+    {
+        // Cursor shapes go up to 256x256 with large cursors enabled, and odd widths happen
+        const long width  = 255;
+        const long height = 256;
+
+        const std::size_t stride     = core::rgb32_stride(width);
+        const std::size_t maskStride = core::mono_stride(width);
+
+        check(core::mono_stride(1) == 4 && core::mono_stride(32) == 4 && core::mono_stride(33) == 8, "mono_stride");
+        check(core::next_multiple(16, 33) == 48 && core::next_multiple(16, 32) == 32, "next_multiple");
+
+        std::vector<uint8_t> mask = pattern(maskStride * std::size_t(height), 1);
+
+        // No alpha anywhere is the common case, and the expensive one
+        std::vector<uint8_t> opaque(stride * std::size_t(height), 0x80);
+        for (std::size_t i = 3; i < opaque.size(); i += 4)
+            opaque[i] = 0;
+
+        check(core::has_alpha(opaque.data(), stride, width, height) == reference_has_alpha(opaque.data(), stride, width, height), "has_alpha");
+        bench("pixels.has_alpha.reference", [&] { g_sink = reference_has_alpha(opaque.data(), stride, width, height); });
+        bench("pixels.has_alpha", [&] { g_sink = core::has_alpha(opaque.data(), stride, width, height); });
+
+        std::vector<uint8_t> actual(opaque);
+        bench("pixels.apply_and_mask", [&] { core::apply_and_mask(actual.data(), stride, width, height, mask.data(), maskStride); g_sink = actual[3]; });
+
+        // Monochrome cursors are twice as high, AND mask on top of the XOR mask
+        const unsigned cursorWidth  = 64;
+        const unsigned maskedHeight = 128;
+        const unsigned texSize      = 256;
+        std::vector<uint8_t> shape = pattern(core::mono_stride(cursorWidth) * maskedHeight, 2);
+        std::vector<uint8_t> texExpected(texSize * texSize * 4, 0), texActual(texSize * texSize * 4, 0);
+
+        reference_mono_cursor_to_bgra(shape.data(), core::mono_stride(cursorWidth), cursorWidth, maskedHeight, texExpected.data(), texSize * 4, texSize, texSize);
+        core::mono_cursor_to_bgra(shape.data(), core::mono_stride(cursorWidth), cursorWidth, maskedHeight, texActual.data(), texSize * 4, texSize, texSize);
+        check(texExpected == texActual, "mono_cursor_to_bgra");
+        bench("pixels.mono_cursor_to_bgra.reference", [&] {
+            reference_mono_cursor_to_bgra(shape.data(), core::mono_stride(cursorWidth), cursorWidth, maskedHeight, texActual.data(), texSize * 4, texSize, texSize);
+            g_sink = texActual[0];
+        });
+        bench("pixels.mono_cursor_to_bgra", [&] {
+            core::mono_cursor_to_bgra(shape.data(), core::mono_stride(cursorWidth), cursorWidth, maskedHeight, texActual.data(), texSize * 4, texSize, texSize);
+            g_sink = texActual[0];
+        });
+    }
+
+    void bench_region()
+    {
+        core::Rect output = core::make_rect(0, 0, 1920, 1080);
+        core::Rect region = core::make_rect(100, 200, 2100, 900);
+        core::Rect clipped;
+
+        check(core::intersect(clipped, region, output) && clipped == core::make_rect(100, 200, 1920, 900), "intersect");
+        check(!core::intersect(clipped, output, core::make_rect(1920, 0, 3840, 1080)) && core::is_empty(clipped), "intersect disjoint");
+        check(core::unite(core::Rect(), output) == output, "unite empty");
+        check(core::contains(output, core::make_rect(0, 0, 1920, 1080)) && !core::contains(output, region), "contains");
+
+        core::Rect bands[4];
+        int64_t bandArea = 0;
+        int count = core::subtract(bands, output, region);
+        for (int i = 0; i < count; ++i)
+            bandArea += int64_t(core::width(bands[i])) * core::height(bands[i]);
+        check(count == 3 && bandArea == 1920 * 1080 - 1820 * 700, "subtract");
+        check(core::subtract(bands, region, core::make_rect(0, 0, 10, 10)) == 1 && bands[0] == region, "subtract disjoint");
+        check(core::subtract(bands, region, output) == 1 && bands[0] == core::make_rect(1920, 200, 2100, 900), "subtract overhang");
+
+        std::vector<core::Rect> rects(1024);
+        for (std::size_t i = 0; i < rects.size(); ++i)
+            rects[i] = core::make_rect(int32_t(i % 37) * 50, int32_t(i % 23) * 40, int32_t(i % 37) * 50 + 300, int32_t(i % 23) * 40 + 200);
+
+        bench("region.intersect_1024", [&] {
+            uint64_t area = 0;
+            for (const core::Rect &r : rects) {
+                core::Rect i;
+                if (core::intersect(i, r, output))
+                    area += uint64_t(core::width(i)) * uint64_t(core::height(i));
+            }
+            g_sink = area;
+        });
+        bench("region.unite_1024", [&] {
+            core::Rect bounds = core::Rect();
+            for (const core::Rect &r : rects)
+                bounds = core::unite(bounds, r);
+            g_sink = uint64_t(core::width(bounds));
+        });
+    }
+
+    void bench_protocol()
+    {
+        static CaptureShared shared;
+        std::memset(&shared, 0, sizeof(shared));
+
+        bench("protocol.stats_write", [&] {
+            stats_write_begin(shared.dwmStats);
+            shared.dwmStats.presents++;
+            stats_write_end(shared.dwmStats);
+        });
+
+        CaptureDwmStats copy;
+        check(stats_read(shared.dwmStats, copy) && copy.presents == shared.dwmStats.presents, "stats_read");
+        bench("protocol.stats_read", [&] { g_sink = stats_read(shared.dwmStats, copy) ? copy.presents : 0; });
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1 && !std::strcmp(argv[1], "--quick"))
+        g_iterations = 20;
+
+    bench_pixels();
+    bench_region();
+    bench_protocol();
+
+    return g_failed ? 1 : 0;
+}
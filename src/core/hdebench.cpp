@@ -0,0 +1,392 @@
+// Copyright (C) 2015 Jonas Kümmerlin <rgcjonas@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+/*
+ * Decode throughput of MinHook's disassemblers over real function prologues
+ *
+ * Usage: hde-bench <corpus>... [--rounds <n>]
+ *
+ * The corpus comes from dd4seven-prologues. For every architecture in it, walks each
+ * prologue the way CreateTrampolineFunction does (until the 5 bytes of a jump are
+ * covered), once calling hde32_disasm/hde64_disasm for every instruction and once
+ * through a cache of decoded prologues keyed on their bytes, starting empty like in a
+ * freshly loaded MinHook. Both walks must decode the same. Results are "name value"
+ * lines.
+ *
+ * Builds with the host compiler (make native) as well as for Windows.
+ */
+
+#include "../../minhook/src/hde/hde32.h"
+
+// hde64.h numbers some of the flags differently, only F_ERROR (the same in both) is used here
+#undef F_DISP8
+#undef F_DISP16
+#undef F_DISP32
+#undef F_RELATIVE
+#undef F_PREFIX_ANY
+#include "../../minhook/src/hde/hde64.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+namespace {
+    // Keeps the compiler from optimizing the measured work away
+    volatile uint64_t g_sink;
+
+    // Bytes a trampoline has to cover, sizeof(JMP_REL) in trampoline.h
+    const unsigned PATCH_SIZE = 5;
+
+    // Instructions a trampoline keeps the boundaries of, ARRAYSIZE(TRAMPOLINE::oldIPs)
+    const unsigned MAX_INSTRUCTIONS = 8;
+
+    // Prologues are padded with zeroes to this, so walks never run past the end
+    const unsigned SAMPLE_SIZE = 48;
+
+    // Room for one hde32s or hde64s
+    const unsigned HS_SIZE = 40;
+
+    bool g_failed = false;
+
+    void check(bool ok, const char *what)
+    {
+        if (!ok) {
+            fprintf(stderr, "MISMATCH: %s\n", what);
+            g_failed = true;
+        }
+    }
+
+    struct Sample
+    {
+        uint8_t bytes[SAMPLE_SIZE];
+    };
+
+    struct Arch
+    {
+        const char           *name;
+        unsigned            (*decode)(const void *code, void *hs);
+        uint32_t            (*flags)(const void *hs);
+        unsigned              hsSize;
+        std::vector<Sample>   samples;
+    };
+
+    struct DecodedInstruction
+    {
+        alignas(8) uint8_t hs[HS_SIZE];
+    };
+
+    int hex_digit(char c)
+    {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+
+    // Reads "<arch> <hex bytes> [anything]" lines, skipping empty ones and # comments
+    bool load(const char *path, Arch *archs, size_t archCount)
+    {
+        FILE *file = fopen(path, "r");
+        if (!file) {
+            fprintf(stderr, "%s: can't open it\n", path);
+            return false;
+        }
+
+        char line[1024];
+        unsigned lineNumber = 0;
+        bool ok = true;
+
+        while (fgets(line, sizeof(line), file)) {
+            ++lineNumber;
+            if (line[0] == '#' || line[0] == '\n' || line[0] == '\r')
+                continue;
+
+            char name[16], hex[2 * SAMPLE_SIZE + 2];
+            if (sscanf(line, "%15s %97s", name, hex) != 2) {
+                fprintf(stderr, "%s:%u: expected <arch> <bytes>\n", path, lineNumber);
+                ok = false;
+                break;
+            }
+
+            Arch *arch = nullptr;
+            for (size_t i = 0; i < archCount; ++i) {
+                if (!strcmp(archs[i].name, name))
+                    arch = &archs[i];
+            }
+
+            Sample sample = {};
+            size_t length = strlen(hex);
+            bool valid = arch && length % 2 == 0 && length / 2 <= SAMPLE_SIZE;
+            for (size_t i = 0; valid && i < length; i += 2) {
+                int high = hex_digit(hex[i]), low = hex_digit(hex[i + 1]);
+                valid = high >= 0 && low >= 0;
+                sample.bytes[i / 2] = uint8_t(high << 4 | low);
+            }
+
+            if (!valid) {
+                fprintf(stderr, "%s:%u: unknown architecture or bad bytes\n", path, lineNumber);
+                ok = false;
+                break;
+            }
+
+            arch->samples.push_back(sample);
+        }
+
+        fclose(file);
+        return ok;
+    }
+
+    /*********************************
+     * PROLOGUE CACHE
+     * (the candidate for CreateTrampolineFunction)
+     *********************************/
+
+    // Decoded prologues, direct-mapped on their first bytes
+    class PrologueCache
+    {
+    public:
+        static const unsigned SIZE = 256;
+        static const unsigned KEY_SIZE = 8;     // decoding reads up to 15 bytes per instruction anyway
+        static const unsigned MAX_BYTES = 32;
+
+        struct Entry
+        {
+            uint8_t            size;            // bytes covered, 0 if unused
+            uint8_t            count;
+            uint8_t            bytes[MAX_BYTES];
+            DecodedInstruction instructions[MAX_INSTRUCTIONS];
+        };
+
+        uint64_t hits = 0, misses = 0;
+
+        void clear()
+        {
+            memset(m_entries, 0, sizeof(m_entries));
+            hits = misses = 0;
+        }
+
+        unsigned used() const
+        {
+            unsigned count = 0;
+            for (const Entry &entry : m_entries)
+                count += entry.size ? 1 : 0;
+
+            return count;
+        }
+
+        Entry &slot(const uint8_t *code)
+        {
+            uint32_t hash = 2166136261u;
+            for (unsigned i = 0; i < KEY_SIZE; ++i)
+                hash = (hash ^ code[i]) * 16777619u;
+
+            return m_entries[(hash ^ hash >> 16) & (SIZE - 1)];
+        }
+
+    private:
+        Entry m_entries[SIZE];
+    };
+
+    /*********************************
+     * WALKS
+     *********************************/
+
+    // What CreateTrampolineFunction does with the instructions, minus copying them
+    struct Walk
+    {
+        unsigned instructions;
+        uint32_t sum;   // of every decoded byte, to compare the walks
+    };
+
+    void add(Walk &walk, const void *hs, unsigned hsSize, bool compare)
+    {
+        walk.instructions++;
+        if (!compare)
+            return;
+
+        const uint8_t *bytes = static_cast<const uint8_t *>(hs);
+        for (unsigned i = 0; i < hsSize; ++i)
+            walk.sum = walk.sum * 31 + bytes[i];
+    }
+
+    Walk walk_raw(const Arch &arch, bool compare)
+    {
+        Walk walk = {};
+        DecodedInstruction decoded;
+
+        for (const Sample &sample : arch.samples) {
+            unsigned pos = 0;
+            for (unsigned n = 0; pos < PATCH_SIZE && n < MAX_INSTRUCTIONS; ++n) {
+                unsigned length = arch.decode(sample.bytes + pos, decoded.hs);
+                add(walk, decoded.hs, arch.hsSize, compare);
+                if (arch.flags(decoded.hs) & F_ERROR)
+                    break;
+                pos += length;
+            }
+        }
+
+        return walk;
+    }
+
+    Walk walk_cached(const Arch &arch, PrologueCache &cache, bool compare)
+    {
+        Walk walk = {};
+        DecodedInstruction decoded;
+        PrologueCache::Entry seen;
+
+        for (const Sample &sample : arch.samples) {
+            PrologueCache::Entry &entry = cache.slot(sample.bytes);
+            bool cached = entry.size && !memcmp(entry.bytes, sample.bytes, entry.size);
+
+            unsigned pos = 0, n = 0;
+            bool error = false;
+            for (; pos < PATCH_SIZE && n < MAX_INSTRUCTIONS; ++n) {
+                if (cached && n < entry.count) {
+                    memcpy(decoded.hs, entry.instructions[n].hs, arch.hsSize);
+                    cache.hits++;
+                } else {
+                    arch.decode(sample.bytes + pos, decoded.hs);
+                    cache.misses++;
+                }
+
+                seen.instructions[n] = decoded;
+                add(walk, decoded.hs, arch.hsSize, compare);
+                if (arch.flags(decoded.hs) & F_ERROR) {
+                    error = true;
+                    break;
+                }
+                pos += decoded.hs[0];   // len is the first member of hde32s and hde64s
+            }
+
+            // A hot-patchable target stops earlier than another with the same bytes, keep the longer walk
+            if (!error && pos <= PrologueCache::MAX_BYTES && !(cached && n <= entry.count)) {
+                memcpy(entry.instructions, seen.instructions, n * sizeof(DecodedInstruction));
+                memcpy(entry.bytes, sample.bytes, pos);
+                entry.count = uint8_t(n);
+                entry.size  = uint8_t(pos);
+            }
+        }
+
+        return walk;
+    }
+
+    // Times one walk over the whole corpus after an untimed <prepare>, reports the fastest of all rounds
+    template<typename TPrepare, typename TFunc>
+    double bench(unsigned rounds, TPrepare prepare, TFunc func)
+    {
+        double best = 0.0;
+        for (unsigned round = 0; round < rounds; ++round) {
+            prepare();
+            auto start = std::chrono::steady_clock::now();
+            g_sink = func();
+            auto end = std::chrono::steady_clock::now();
+
+            double ns = std::chrono::duration<double, std::nano>(end - start).count();
+            if (round == 0 || ns < best)
+                best = ns;
+        }
+
+        return best;
+    }
+
+    void bench_arch(const Arch &arch, unsigned rounds)
+    {
+        if (arch.samples.empty())
+            return;
+
+        static PrologueCache cache;
+
+        // Both walks have to see the same instructions, from an empty and from a full cache
+        cache.clear();
+        Walk raw = walk_raw(arch, true);
+        for (int pass = 0; pass < 2; ++pass) {
+            Walk cached = walk_cached(arch, cache, true);
+            check(raw.instructions == cached.instructions && raw.sum == cached.sum, arch.name);
+        }
+
+        cache.clear();
+        walk_cached(arch, cache, false);
+        uint64_t hits = cache.hits, misses = cache.misses;
+        unsigned used = cache.used();
+
+        double rawNs = bench(rounds, [] {}, [&] { return walk_raw(arch, false).instructions; });
+        double coldNs = bench(rounds, [&] { cache.clear(); },
+                              [&] { return walk_cached(arch, cache, false).instructions; });
+        double warmNs = bench(rounds, [] {}, [&] { return walk_cached(arch, cache, false).instructions; });
+
+        double prologues = double(arch.samples.size());
+        printf("%s.prologues %u\n", arch.name, unsigned(arch.samples.size()));
+        printf("%s.instructions %u\n", arch.name, raw.instructions);
+        printf("%s.raw.ns_per_prologue %.1f\n", arch.name, rawNs / prologues);
+        printf("%s.raw.ns_per_instruction %.1f\n", arch.name, rawNs / raw.instructions);
+        printf("%s.cached.ns_per_prologue %.1f\n", arch.name, coldNs / prologues);
+        printf("%s.cached.hit_rate %.3f\n", arch.name, hits + misses ? double(hits) / double(hits + misses) : 0.0);
+        printf("%s.cached.entries_used %u\n", arch.name, used);
+        printf("%s.cached_warm.ns_per_prologue %.1f\n", arch.name, warmNs / prologues);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    unsigned rounds = 50;
+    std::vector<const char *> paths;
+
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--rounds") && i + 1 < argc) {
+            rounds = unsigned(strtoul(argv[++i], nullptr, 10));
+        } else if (argv[i][0] == '-') {
+            paths.clear();
+            break;
+        } else {
+            paths.push_back(argv[i]);
+        }
+    }
+
+    if (paths.empty() || rounds < 1) {
+        fprintf(stderr, "Usage: %s <corpus>... [--rounds <n>]\n", argv[0]);
+        return 2;
+    }
+
+    Arch archs[] = {
+        { "x86",
+          [](const void *code, void *hs) { return hde32_disasm(code, static_cast<hde32s *>(hs)); },
+          [](const void *hs) { return static_cast<const hde32s *>(hs)->flags; },
+          sizeof(hde32s), {} },
+        { "x64",
+          [](const void *code, void *hs) { return hde64_disasm(code, static_cast<hde64s *>(hs)); },
+          [](const void *hs) { return static_cast<const hde64s *>(hs)->flags; },
+          sizeof(hde64s), {} },
+    };
+    const size_t archCount = sizeof(archs) / sizeof(archs[0]);
+
+    static_assert(sizeof(hde32s) <= HS_SIZE && sizeof(hde64s) <= HS_SIZE, "HS_SIZE is too small");
+
+    for (const char *path : paths) {
+        if (!load(path, archs, archCount))
+            return 2;
+    }
+
+    for (const Arch &arch : archs)
+        bench_arch(arch, rounds);
+
+    return g_failed ? 1 : 0;
+}
@@ -0,0 +1,97 @@
+// Copyright (C) 2015 Jonas Kümmerlin <rgcjonas@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+/*
+ * Frame pacing for captures with a frame interval: decides on which Presents
+ * a copy is due. All times are in QueryPerformanceCounter ticks, or whatever
+ * else the caller counts in, as long as it's the same everywhere.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+namespace core {
+    struct Pacing
+    {
+        int64_t intervalTicks; // CaptureConfig::frameInterval, 0 means every Present
+        int64_t nextDue;       // when the next copy is due
+        int64_t lastPresent;
+        int64_t presentPeriod; // moving average of the time between two Presents
+    };
+
+    // Moving average over roughly the last eight samples, starting at the first one
+    inline int64_t smooth(int64_t average, int64_t sample)
+    {
+        return average ? (7 * average + sample) / 8 : sample;
+    }
+
+    // 100ns units to ticks, without overflowing on fast counters
+    inline int64_t interval_to_ticks(uint32_t interval, int64_t frequency)
+    {
+        int64_t i = interval;
+
+        return i / 10000000 * frequency + i % 10000000 * frequency / 10000000;
+    }
+
+    inline void set_interval(Pacing &p, int64_t ticks)
+    {
+        if (ticks != p.intervalTicks) {
+            p.intervalTicks = ticks;
+            p.nextDue       = 0; // start over with the next Present
+        }
+    }
+
+    // Keeps track of how often the swap chain presents
+    inline void update_present_period(Pacing &p, int64_t now, int64_t frequency)
+    {
+        int64_t period = now - p.lastPresent;
+        p.lastPresent = now;
+
+        // The DWM stops presenting when nothing changes, these gaps would skew the average
+        if (period <= 0 || period > frequency / 10)
+            return;
+
+        p.presentPeriod = smooth(p.presentPeriod, period);
+    }
+
+    // Whether a copy is due on the Present at now
+    inline bool is_due(const Pacing &p, int64_t now)
+    {
+        if (!p.intervalTicks)
+            return true;
+
+        // Presents never arrive exactly on time. Half a period early is still closer
+        // to the due time than the Present after it.
+        return now + p.presentPeriod / 2 >= p.nextDue;
+    }
+
+    // Moves the due time on after a copy. It advances in whole intervals rather
+    // than from now, so early and late Presents even out instead of adding up.
+    inline void advance_due(Pacing &p, int64_t now)
+    {
+        if (!p.intervalTicks)
+            return;
+
+        p.nextDue += p.intervalTicks;
+        if (p.nextDue <= now) // fell behind by more than an interval, start over
+            p.nextDue = now + p.intervalTicks;
+    }
+}; // namespace core
@@ -0,0 +1,144 @@
+// Copyright (C) 2015 Jonas Kümmerlin <rgcjonas@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+/*
+ * Pixel kernels for cursor shapes and other small bitmaps.
+ *
+ * Part of the platform-neutral core, which builds without Windows, so it can be
+ * tested and benchmarked with the host compiler (see the native target in the Makefile).
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace core {
+    /**
+     * return the next multiple of @param n being >= @param arg
+     */
+    template<typename T>
+    inline T next_multiple(T n, T arg)
+    {
+        if (arg % n == 0) return arg;
+        else return (arg / n) * n + n;
+    }
+
+    /**
+     * return the pixel value in an indexed pixel format with a bpp <= 8
+     */
+    template<unsigned bpp>
+    inline uint8_t get_pixel_from_row(const uint8_t *row, int x) {
+        return (row[x * bpp / 8] >> (8 - bpp - (x % (8 / bpp)) * bpp)) & ((1 << bpp) - 1);
+    }
+
+    // Bytes per line of a 1bpp DIB, whose lines are padded to 32 bits
+    inline std::size_t mono_stride(long width)
+    {
+        return std::size_t((width - 1) / 32 + 1) * 4;
+    }
+
+    inline std::size_t mono_size(long width, long height)
+    {
+        return mono_stride(width) * std::size_t(height);
+    }
+
+    // Bytes per line of a 32bpp DIB
+    inline std::size_t rgb32_stride(long width)
+    {
+        return std::size_t(width) * 4;
+    }
+
+    inline std::size_t rgb32_size(long width, long height)
+    {
+        return rgb32_stride(width) * std::size_t(height);
+    }
+
+    // Whether any pixel of a BGRA image has an alpha value other than 0
+    inline bool has_alpha(const uint8_t *bgra, std::size_t stride, long width, long height)
+    {
+        for (long y = 0; y < height; ++y) {
+            const uint8_t *row = bgra + std::size_t(y) * stride;
+
+            // Checking once per row is cheaper than branching on every pixel
+            uint8_t alpha = 0;
+            for (long x = 0; x < width; ++x)
+                alpha |= row[x * 4 + 3];
+
+            if (alpha)
+                return true;
+        }
+
+        return false;
+    }
+
+    /**
+     * Sets the alpha of a BGRA image from a 1bpp AND mask of the same size:
+     * transparent where the mask is set, opaque where it isn't.
+     */
+    inline void apply_and_mask(uint8_t *bgra, std::size_t stride, long width, long height,
+                               const uint8_t *mask, std::size_t maskStride)
+    {
+        for (long y = 0; y < height; ++y) {
+            uint8_t       *alpha   = bgra + std::size_t(y) * stride + 3;
+            const uint8_t *maskRow = mask + std::size_t(y) * maskStride;
+
+            for (long x = 0; x < width; ++x)
+                alpha[x * 4] = get_pixel_from_row<1>(maskRow, int(x)) ? 0 : 0xFF;
+        }
+    }
+
+    /**
+     * Converts a monochrome cursor shape (the AND mask above the XOR mask, both
+     * with the given pitch) into BGRA, as if it was drawn onto black: the XOR mask
+     * gives the color, the AND mask the transparency. maskedHeight is the height of
+     * both masks together, like DXGI_OUTDUPL_POINTER_SHAPE_INFO::Height.
+     * At most maxWidth x maxHeight pixels are written.
+     */
+    inline void mono_cursor_to_bgra(const uint8_t *shape, std::size_t pitch, unsigned width, unsigned maskedHeight,
+                                    uint8_t *target, std::size_t targetPitch, unsigned maxWidth, unsigned maxHeight)
+    {
+        const uint8_t *andMap = shape;
+        const uint8_t *xorMap = shape + pitch * (maskedHeight / 2);
+
+        unsigned rows    = maskedHeight / 2 < maxHeight ? maskedHeight / 2 : maxHeight;
+        unsigned columns = width < maxWidth ? width : maxWidth;
+
+        for (unsigned row = 0; row < rows; ++row) {
+            const uint8_t *andRow    = andMap + row * pitch;
+            const uint8_t *xorRow    = xorMap + row * pitch;
+            uint32_t      *targetRow = reinterpret_cast<uint32_t*>(target + row * targetPitch);
+
+            for (unsigned column = 0; column < columns; column += 8) {
+                uint8_t  andBits = andRow[column / 8];
+                uint8_t  xorBits = xorRow[column / 8];
+                unsigned end     = columns - column < 8 ? columns - column : 8;
+
+                for (unsigned bit = 0; bit < end; ++bit) {
+                    uint32_t alpha = (andBits & (0x80 >> bit)) ? 0 : 0xFF000000;
+                    uint32_t rgb   = (xorBits & (0x80 >> bit)) ? 0x00FFFFFF : 0;
+
+                    targetRow[column + bit] = alpha | rgb;
+                }
+            }
+        }
+    }
+}; // namespace core
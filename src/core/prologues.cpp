@@ -0,0 +1,284 @@
+// Copyright (C) 2015 Jonas Kümmerlin <rgcjonas@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+/*
+ * Extracts the prologues of the functions exported by DLLs into a corpus for hdebench
+ *
+ * Usage: dd4seven-prologues <dll>... [--bytes <n>] > corpus.txt
+ *
+ * The DLLs are read as plain files, so images copied off a Windows system (e.g. all of
+ * %WINDIR%\System32\*.dll, or SysWOW64 for 32bit ones) work on any machine. Prints one
+ * line per function: the architecture (x86 or x64), the first bytes of the function in
+ * hex (32 unless --bytes says otherwise, fewer at the end of a section) and where they
+ * came from. Forwarded and data exports are skipped, and so are aliases of a function.
+ *
+ * Builds with the host compiler (make native) as well as for Windows.
+ */
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace {
+    const uint32_t SCN_CNT_CODE    = 0x00000020;
+    const uint32_t SCN_MEM_EXECUTE = 0x20000000;
+
+    struct Section
+    {
+        uint32_t address;  // RVA
+        uint32_t size;     // in memory
+        uint32_t raw;      // file offset
+        uint32_t rawSize;
+        uint32_t flags;
+    };
+
+    class Image
+    {
+        std::vector<uint8_t> m_data;
+        std::vector<Section> m_sections;
+        const char          *m_arch { nullptr };
+        uint32_t             m_exportAddress { 0 };
+        uint32_t             m_exportSize { 0 };
+
+    public:
+        // Reads past the end come back as 0, so a broken image just finds nothing
+        uint32_t u16(size_t offset) const
+        {
+            return offset + 2 <= m_data.size() ? uint32_t(m_data[offset] | m_data[offset + 1] << 8) : 0;
+        }
+
+        uint32_t u32(size_t offset) const
+        {
+            return offset + 4 <= m_data.size() ? u16(offset) | u16(offset + 2) << 16 : 0;
+        }
+
+        const char *arch() const { return m_arch; }
+        uint32_t exportAddress() const { return m_exportAddress; }
+        uint32_t exportSize() const { return m_exportSize; }
+
+        bool load(const char *path, std::string &error)
+        {
+            FILE *file = fopen(path, "rb");
+            if (!file) {
+                error = "can't open it";
+                return false;
+            }
+
+            uint8_t buffer[65536];
+            size_t  read;
+            while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0)
+                m_data.insert(m_data.end(), buffer, buffer + read);
+            fclose(file);
+
+            if (u16(0) != 0x5A4D) { // "MZ"
+                error = "not an executable";
+                return false;
+            }
+
+            uint32_t pe = u32(0x3C);
+            if (u32(pe) != 0x00004550) { // "PE\0\0"
+                error = "not a PE image";
+                return false;
+            }
+
+            switch (u16(pe + 4)) {
+                case 0x014C: m_arch = "x86"; break;
+                case 0x8664: m_arch = "x64"; break;
+                default:
+                    error = "neither x86 nor x64";
+                    return false;
+            }
+
+            uint32_t sectionCount = u16(pe + 6);
+            uint32_t optional     = pe + 24;
+            uint32_t optionalSize = u16(pe + 20);
+
+            // Data directories follow the fixed part of the optional header, which is longer for PE32+
+            uint32_t directories;
+            switch (u16(optional)) {
+                case 0x010B: directories = optional + 96; break;
+                case 0x020B: directories = optional + 112; break;
+                default:
+                    error = "unknown optional header";
+                    return false;
+            }
+
+            if (u32(directories - 4) > 0) { // NumberOfRvaAndSizes, the export table is the first
+                m_exportAddress = u32(directories);
+                m_exportSize    = u32(directories + 4);
+            }
+
+            for (uint32_t i = 0; i < sectionCount; ++i) {
+                size_t header = optional + optionalSize + i * 40;
+                m_sections.push_back(Section {
+                    u32(header + 12),
+                    u32(header + 8),
+                    u32(header + 20),
+                    u32(header + 16),
+                    u32(header + 36)
+                });
+            }
+
+            return true;
+        }
+
+        // File offset of an RVA and how many bytes of its section follow it, nullptr if it isn't in the file
+        const Section *locate(uint32_t rva, size_t &offset, size_t &available) const
+        {
+            for (const Section &section : m_sections) {
+                if (rva < section.address || rva - section.address >= section.rawSize)
+                    continue;
+
+                offset    = size_t(section.raw) + (rva - section.address);
+                available = std::min<size_t>(section.rawSize - (rva - section.address),
+                                             offset < m_data.size() ? m_data.size() - offset : 0);
+                return &section;
+            }
+
+            return nullptr;
+        }
+
+        std::string string(uint32_t rva) const
+        {
+            size_t offset, available;
+            if (!locate(rva, offset, available))
+                return std::string();
+
+            std::string result;
+            for (size_t i = 0; i < available && m_data[offset + i]; ++i)
+                result += char(m_data[offset + i]);
+
+            return result;
+        }
+
+        const uint8_t *bytes(size_t offset) const { return &m_data[offset]; }
+    };
+
+    const char *base_name(const char *path)
+    {
+        const char *name = path;
+        for (const char *p = path; *p; ++p) {
+            if (*p == '/' || *p == '\\')
+                name = p + 1;
+        }
+
+        return name;
+    }
+
+    // Prints the prologues of one DLL, returns how many
+    unsigned extract(const char *path, unsigned maxBytes)
+    {
+        Image image;
+        std::string error;
+        if (!image.load(path, error)) {
+            fprintf(stderr, "%s: %s\n", path, error.c_str());
+            return 0;
+        }
+
+        uint32_t directory = image.exportAddress();
+        size_t   offset, available;
+        if (!directory || !image.locate(directory, offset, available) || available < 40)
+            return 0; // exports nothing
+
+        uint32_t base      = image.u32(offset + 16);
+        uint32_t functions = image.u32(offset + 20);
+        uint32_t names     = image.u32(offset + 24);
+
+        size_t functionTable, nameTable = 0, ordinalTable = 0, unused;
+        if (!image.locate(image.u32(offset + 28), functionTable, unused))
+            return 0;
+        bool haveNames = names && image.locate(image.u32(offset + 32), nameTable, unused)
+                               && image.locate(image.u32(offset + 36), ordinalTable, unused);
+
+        // Index into AddressOfFunctions -> name
+        std::vector<std::string> functionNames(functions);
+        for (uint32_t i = 0; haveNames && i < names; ++i) {
+            uint32_t index = image.u16(ordinalTable + i * 2);
+            if (index < functions && functionNames[index].empty())
+                functionNames[index] = image.string(image.u32(nameTable + i * 4));
+        }
+
+        std::set<uint32_t> seen;
+        unsigned count = 0;
+
+        for (uint32_t i = 0; i < functions; ++i) {
+            uint32_t rva = image.u32(functionTable + i * 4);
+            if (!rva || !seen.insert(rva).second)
+                continue;
+
+            // Forwarders point at a "dll.function" string inside the export directory
+            if (rva >= directory && rva - directory < image.exportSize())
+                continue;
+
+            size_t code, length;
+            const Section *section = image.locate(rva, code, length);
+            if (!section || !(section->flags & (SCN_CNT_CODE | SCN_MEM_EXECUTE)) || !length)
+                continue;
+
+            length = std::min<size_t>(length, maxBytes);
+
+            printf("%s ", image.arch());
+            for (size_t b = 0; b < length; ++b)
+                printf("%02x", image.bytes(code)[b]);
+            if (functionNames[i].empty())
+                printf(" %s!#%u\n", base_name(path), unsigned(base + i));
+            else
+                printf(" %s!%s\n", base_name(path), functionNames[i].c_str());
+
+            ++count;
+        }
+
+        return count;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    unsigned maxBytes = 32;
+    std::vector<const char *> paths;
+
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--bytes") && i + 1 < argc) {
+            maxBytes = unsigned(strtoul(argv[++i], nullptr, 10));
+        } else if (argv[i][0] == '-') {
+            paths.clear();
+            break;
+        } else {
+            paths.push_back(argv[i]);
+        }
+    }
+
+    if (paths.empty() || maxBytes < 1 || maxBytes > 256) {
+        fprintf(stderr, "Usage: %s <dll>... [--bytes <n>] > corpus.txt\n", argv[0]);
+        return 2;
+    }
+
+    unsigned total = 0;
+    for (const char *path : paths)
+        total += extract(path, maxBytes);
+
+    fprintf(stderr, "%u prologues from %u files\n", total, unsigned(paths.size()));
+    return total ? 0 : 1;
+}
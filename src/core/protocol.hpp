@@ -0,0 +1,231 @@
+// Copyright (C) 2015 Jonas Kümmerlin <rgcjonas@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+/*
+ * Wire format between dd4seven-api.dll (client) and dd4seven-dwm.dll (DWM).
+ *
+ * A 32bit client may talk to a 64bit DWM, so everything in here must have
+ * the same layout on both architectures: fixed-size types only, no pointers.
+ * It also builds without Windows, for the tools that replay or benchmark it.
+ */
+
+#pragma once
+
+#include "region.hpp"
+
+#include <cstdint>
+#include <cstring>
+
+#ifdef _WIN32
+typedef LONG    shared_long; // what the Interlocked functions want, 32 bits on Windows
+typedef wchar_t wire_char;
+#else
+typedef int32_t  shared_long;
+typedef char16_t wire_char;
+#endif
+
+static_assert(sizeof(shared_long) == 4 && sizeof(wire_char) == 2, "the wire format needs 32bit longs and 16bit characters");
+
+inline void shared_increment(volatile shared_long *value)
+{
+#ifdef _WIN32
+    InterlockedIncrement(value);
+#else
+    __atomic_add_fetch(value, 1, __ATOMIC_SEQ_CST);
+#endif
+}
+
+inline void shared_barrier()
+{
+#ifdef _WIN32
+    MemoryBarrier();
+#else
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+#endif
+}
+
+inline void shared_relax()
+{
+#if defined(_WIN32)
+    YieldProcessor();
+#elif defined(__i386__) || defined(__x86_64__)
+    __builtin_ia32_pause();
+#endif
+}
+
+// Maximum number of textures a capture can rotate through
+constexpr unsigned MAX_CAPTURE_TARGETS = 8;
+
+// Capture parameters that can be changed while the capture is running
+#define CAPTURE_FLAG_PAUSED 0x1 // don't copy anything for now
+
+// Who gets copied first when the DWM runs out of time, see sched::ClientClass
+#define CAPTURE_CLASS_DEFAULT     0
+#define CAPTURE_CLASS_INTERACTIVE 1
+#define CAPTURE_CLASS_BACKGROUND  2
+
+struct CaptureConfig
+{
+    core::Rect region;        // part of the output to capture, relative to its top-left corner. Empty means everything.
+    uint32_t   flags;         // CAPTURE_FLAG_*
+    uint32_t   frameInterval; // minimum time between two copies in 100ns units, 0 means on every Present
+    uint32_t   clientClass;   // CAPTURE_CLASS_*
+};
+
+// Sent once per capture via WM_COPYDATA
+#pragma pack(push,1)
+struct CaptureRequest
+{
+    core::Rect    monitor;
+    wire_char     outputName[32];                      // DXGI_OUTPUT_DESC::DeviceName, survives mode changes
+    wire_char     imageMutex[56];
+    wire_char     imageEvent[56];
+    wire_char     keepAliveMutex[56];
+    wire_char     sharedState[56];                     // name of the CaptureShared file mapping
+    uint32_t      captureTargetCount;
+    uint32_t      captureTargets[MAX_CAPTURE_TARGETS]; // D3D pseudo-handles
+    CaptureConfig config;                              // applied right away, before the first copy
+};
+#pragma pack(pop)
+
+static_assert(sizeof(CaptureRequest) == 592, "CaptureRequest must look the same everywhere");
+
+/*
+ * Statistics are written by one side only, without locking: the writer makes
+ * sequence odd while it updates them, and readers retry until they saw the
+ * same even sequence before and after copying.
+ */
+template<typename TStats>
+inline void stats_write_begin(TStats &stats)
+{
+    shared_increment(&stats.sequence);
+}
+
+template<typename TStats>
+inline void stats_write_end(TStats &stats)
+{
+    shared_increment(&stats.sequence);
+}
+
+// Returns false if the writer seems to have died in the middle of an update
+template<typename TStats>
+inline bool stats_read(const TStats &stats, TStats &copy)
+{
+    for (int attempt = 0; attempt < 1000; ++attempt) {
+        shared_long before = stats.sequence;
+        shared_barrier();
+        std::memcpy(&copy, &stats, sizeof(TStats));
+        shared_barrier();
+
+        if (!(before & 1) && before == stats.sequence)
+            return true;
+
+        shared_relax();
+    }
+
+    return false;
+}
+
+// Bucket 0 counts copies below 1us, bucket n > 0 the ones from 2^(n-1)us
+// up to 2^n us, and the last one everything longer.
+constexpr unsigned GPU_HISTOGRAM_BUCKETS = 16;
+
+// Written by the DWM on every Present. Times are in QueryPerformanceCounter ticks.
+struct CaptureDwmStats
+{
+    volatile shared_long sequence;
+    uint32_t budget;             // scheduler budget in microseconds, 0 if there is none
+    uint64_t presents;           // Presents of the captured swap chain
+    uint64_t copies;             // copies made for this capture
+    uint64_t skippedLocked;      // copies skipped because the client held the image mutex
+    uint64_t deferred;           // copies the scheduler pushed to a later Present to stay within the budget
+    uint64_t keepAliveChecks;    // times the DWM made sure the client is still there
+    uint64_t copyTicks;          // CPU time spent copying for this capture
+    uint64_t throttledPresents;  // Presents on which the scheduler deferred anything, for all captures
+    uint64_t overBudgetPresents; // Presents on which copying took longer than the budget, for all captures
+    uint32_t lastCost;           // what copying took on the latest measured Present, in microseconds
+    uint32_t estimatedCost;      // what a copy for this capture is expected to take, in microseconds
+
+    // Only with CaptureGpuTiming enabled, and only for copies the DWM got around to measure
+    uint64_t gpuCopies;                           // copies with a GPU time
+    uint64_t gpuCopyTime;                         // their total GPU time, in microseconds
+    uint64_t gpuHistogram[GPU_HISTOGRAM_BUCKETS]; // their GPU time, see GPU_HISTOGRAM_BUCKETS
+};
+
+// Written by the client. Times are in QueryPerformanceCounter ticks.
+struct CaptureClientStats
+{
+    volatile shared_long sequence;
+    uint32_t reserved;
+    uint64_t acquires;     // frames handed to the application
+    uint64_t timeouts;     // AcquireNextFrame calls that timed out
+    uint64_t holdTicks;    // total time between AcquireNextFrame and ReleaseFrame
+    uint64_t maxHoldTicks; // longest time between AcquireNextFrame and ReleaseFrame
+};
+
+// Lives in a file mapping created by the client and mapped into the DWM
+struct CaptureShared
+{
+    // Index of the capture target the DWM wrote last.
+    // Only written by the DWM while it holds the image mutex.
+    volatile shared_long latestTarget;
+
+    // Index of the capture target currently handed out to the application,
+    // or -1 if none. Only used with more than one capture target, because
+    // then the client doesn't hold the image mutex while a frame is acquired.
+    volatile shared_long heldTarget;
+
+    // Area of the output the latest target contains, relative to its top-left corner.
+    // Written together with latestTarget.
+    core::Rect latestRegion;
+
+    // The client bumps configGeneration after changing config, and the DWM
+    // applies the new config on its next Present. Both are only touched while
+    // holding the image mutex.
+    volatile shared_long configGeneration;
+    CaptureConfig config;
+
+    // The DWM bumps modeGeneration when the output changed its size or position,
+    // with the new desktop coordinates in monitor. Until the client answers by
+    // putting targets of the new size into targets[] and bumping targetsGeneration,
+    // nothing is copied. All of it is only touched while holding the image mutex.
+    volatile shared_long modeGeneration;
+    core::Rect           monitor;
+    volatile shared_long targetsGeneration;
+    uint32_t             targetCount;
+    uint32_t             targets[MAX_CAPTURE_TARGETS]; // D3D pseudo-handles
+
+    // See stats_read()
+    CaptureDwmStats    dwmStats;
+    CaptureClientStats clientStats;
+};
+
+// The target the DWM writes into next: the one after the latest, but never
+// the one the application is holding right now
+inline shared_long next_target(shared_long latest, shared_long held, uint32_t count)
+{
+    shared_long target = (latest + 1) % shared_long(count);
+    if (target < 0)
+        target = 0;
+    if (target == held)
+        target = (target + 1) % shared_long(count);
+
+    return target;
+}
@@ -0,0 +1,101 @@
+// Copyright (C) 2015 Jonas Kümmerlin <rgcjonas@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+/*
+ * What dd4seven-dwm.dll records about its Presents when the DWORD CaptureRecording
+ * in HKLM\SOFTWARE\dd4seven is set (to the size of the recording in megabytes).
+ *
+ * Unlike the trace (trace.hpp), which is for reading along, a recording holds
+ * everything the capture scheduler and the pacing based their decisions on, so
+ * dd4seven-replay can make them again without a DWM or a GPU, with the code of
+ * today and e.g. another budget.
+ *
+ * The file is a header followed by a ring of fixed-size records. Times are in
+ * QueryPerformanceCounter ticks of the recording machine, see Header::frequency.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+namespace recording {
+    // Never reuse or renumber these, old recordings would be replayed wrong
+    enum Type : uint16_t {
+        RECORD_NONE               = 0,
+        RECORD_PRESENT            = 1,  // swap chain, captures
+        RECORD_SWAP_CHAIN         = 2,  // swap chain, width, height, format, sample count (created or resized)
+        RECORD_CAPTURE_REGISTERED = 3,  // capture id, width, height, targets
+        RECORD_CAPTURE_REMOVED    = 4,  // capture id
+        RECORD_CAPTURE_BOUND      = 5,  // capture id, swap chain
+        RECORD_CONFIG             = 6,  // capture id, flags, frame interval, client class
+        RECORD_MODE_CHANGE        = 7,  // capture id, width, height
+        RECORD_NEW_TARGETS        = 8,  // capture id, targets
+        RECORD_SKIPPED_LOCKED     = 9,  // capture id                       (image mutex was held)
+        RECORD_COPY               = 10, // capture id, target, CPU ticks, cost sample (CPU ticks + estimated GPU ticks)
+        RECORD_DEFERRED           = 11, // capture id
+        RECORD_COST               = 12, // measured cost of copying on an earlier Present (CPU + GPU ticks)
+    };
+
+    constexpr uint32_t MAGIC   = 0x43455244; // "DREC"
+    constexpr uint32_t VERSION = 1;
+
+    struct Header
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t capacity;   // number of records following the header
+        uint32_t process;
+        int64_t  frequency;  // of QueryPerformanceCounter
+        int64_t  budget;     // of the scheduler, in ticks, 0 if there is none
+        uint64_t next;       // index of the next record, counts up forever
+        uint8_t  reserved[24];
+    };
+
+    struct Record
+    {
+        int64_t  timestamp;
+        uint16_t type;       // Type
+        uint16_t reserved;
+        uint32_t args[5];
+    };
+
+    static_assert(sizeof(Header) == 64, "recording header layout");
+    static_assert(sizeof(Record) == 32, "recording record layout");
+
+    // Human-readable name of a record type
+    inline const char *type_name(uint16_t type)
+    {
+        switch (type) {
+            case RECORD_PRESENT:            return "present";
+            case RECORD_SWAP_CHAIN:         return "swap-chain";
+            case RECORD_CAPTURE_REGISTERED: return "capture-registered";
+            case RECORD_CAPTURE_REMOVED:    return "capture-removed";
+            case RECORD_CAPTURE_BOUND:      return "capture-bound";
+            case RECORD_CONFIG:             return "config";
+            case RECORD_MODE_CHANGE:        return "mode-change";
+            case RECORD_NEW_TARGETS:        return "new-targets";
+            case RECORD_SKIPPED_LOCKED:     return "skipped-locked";
+            case RECORD_COPY:               return "copy";
+            case RECORD_DEFERRED:           return "deferred";
+            case RECORD_COST:               return "cost";
+            default:                        return "unknown";
+        }
+    }
+}; // namespace recording
@@ -0,0 +1,169 @@
+// Copyright (C) 2015 Jonas Kümmerlin <rgcjonas@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+/*
+ * Rectangle algebra, the way Windows does it: right and bottom are exclusive,
+ * and a rectangle without area is empty.
+ *
+ * On Windows, core::Rect is RECT itself, so these work on anything from the
+ * Win32 or DXGI APIs. Elsewhere it's a struct with the same layout.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+namespace core {
+#ifdef _WIN32
+    typedef RECT Rect;
+#else
+    struct Rect
+    {
+        int32_t left;
+        int32_t top;
+        int32_t right;
+        int32_t bottom;
+    };
+#endif
+
+    static_assert(sizeof(Rect) == 16, "Rect must have the layout of RECT");
+
+    inline Rect make_rect(int32_t left, int32_t top, int32_t right, int32_t bottom)
+    {
+        Rect r;
+        r.left   = left;
+        r.top    = top;
+        r.right  = right;
+        r.bottom = bottom;
+
+        return r;
+    }
+
+    inline int32_t width(const Rect &r)  { return r.right - r.left; }
+    inline int32_t height(const Rect &r) { return r.bottom - r.top; }
+
+    inline bool is_empty(const Rect &r)
+    {
+        return r.right <= r.left || r.bottom <= r.top;
+    }
+
+    inline bool equal(const Rect &r1, const Rect &r2)
+    {
+        return r1.left   == r2.left
+            && r1.top    == r2.top
+            && r1.right  == r2.right
+            && r1.bottom == r2.bottom;
+    }
+
+    // The same size, at (0, 0)
+    inline Rect at_origin(const Rect &r)
+    {
+        return make_rect(0, 0, width(r), height(r));
+    }
+
+    inline Rect offset(const Rect &r, int32_t dx, int32_t dy)
+    {
+        return make_rect(r.left + dx, r.top + dy, r.right + dx, r.bottom + dy);
+    }
+
+    /**
+     * Stores the intersection of r1 and r2 in out, which may be one of them.
+     * Like IntersectRect, returns false and makes out empty if there is none.
+     */
+    inline bool intersect(Rect &out, const Rect &r1, const Rect &r2)
+    {
+        Rect i = make_rect(r1.left   > r2.left   ? r1.left   : r2.left,
+                           r1.top    > r2.top    ? r1.top    : r2.top,
+                           r1.right  < r2.right  ? r1.right  : r2.right,
+                           r1.bottom < r2.bottom ? r1.bottom : r2.bottom);
+
+        if (is_empty(i)) {
+            out = make_rect(0, 0, 0, 0);
+            return false;
+        }
+
+        out = i;
+        return true;
+    }
+
+    // The smallest rectangle containing both, ignoring empty ones
+    inline Rect unite(const Rect &r1, const Rect &r2)
+    {
+        if (is_empty(r1))
+            return r2;
+        if (is_empty(r2))
+            return r1;
+
+        return make_rect(r1.left   < r2.left   ? r1.left   : r2.left,
+                         r1.top    < r2.top    ? r1.top    : r2.top,
+                         r1.right  > r2.right  ? r1.right  : r2.right,
+                         r1.bottom > r2.bottom ? r1.bottom : r2.bottom);
+    }
+
+    // Whether inner lies completely within outer
+    inline bool contains(const Rect &outer, const Rect &inner)
+    {
+        return inner.left >= outer.left && inner.top >= outer.top
+            && inner.right <= outer.right && inner.bottom <= outer.bottom;
+    }
+
+    /**
+     * Splits what's left of r after cutting out hole into at most four
+     * non-overlapping bands (top, left, right, bottom) and returns how many.
+     */
+    inline int subtract(Rect (&out)[4], const Rect &r, const Rect &hole)
+    {
+        Rect cut;
+        if (!intersect(cut, r, hole)) {
+            if (is_empty(r))
+                return 0;
+
+            out[0] = r;
+            return 1;
+        }
+
+        int count = 0;
+        if (cut.top > r.top)
+            out[count++] = make_rect(r.left, r.top, r.right, cut.top);
+        if (cut.left > r.left)
+            out[count++] = make_rect(r.left, cut.top, cut.left, cut.bottom);
+        if (cut.right < r.right)
+            out[count++] = make_rect(cut.right, cut.top, r.right, cut.bottom);
+        if (cut.bottom < r.bottom)
+            out[count++] = make_rect(r.left, cut.bottom, r.right, r.bottom);
+
+        return count;
+    }
+}; // namespace core
+
+// Outside the namespace, so they're found for RECT, too
+inline bool operator==(const core::Rect &r1, const core::Rect &r2)
+{
+    return core::equal(r1, r2);
+}
+
+inline bool operator!=(const core::Rect &r1, const core::Rect &r2)
+{
+    return !core::equal(r1, r2);
+}
@@ -0,0 +1,499 @@
+// Copyright (C) 2015 Jonas Kümmerlin <rgcjonas@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+/*
+ * Replays a recording of dd4seven-dwm.dll (see recording.hpp) without a DWM or a GPU
+ *
+ * Usage: dd4seven-replay <recording> [--budget <us>] [--repeat <n>] [--dump]
+ *
+ * Goes through the recorded Presents and, for each of them, makes the decisions
+ * the DWM makes with today's code: which captures are bound and due (pacing),
+ * which ones the client kept locked (taken from the recording), which ones the
+ * scheduler copies within the budget, and what ends up in the shared state and
+ * the statistics the client reads. Copies cost what they cost when recorded.
+ *
+ * Prints the outcome next to what was recorded as "name value" lines, per capture
+ * as well. With the recorded budget and unchanged code, both should match; with
+ * --budget, they show what another budget would have done to the same frames.
+ * --repeat replays that many times and reports the fastest, to benchmark the logic.
+ * --dump prints the records instead.
+ *
+ * Builds with the host compiler (make native) as well as for Windows.
+ */
+
+#include "pacing.hpp"
+#include "protocol.hpp"
+#include "recording.hpp"
+#include "scheduler.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+namespace {
+    struct ReplayCapture
+    {
+        uint32_t id { 0 };
+        uint32_t chain { 0 };
+        bool     bound { false };
+        bool     waitingForTargets { false };
+        uint32_t targetCount { 1 };
+
+        CaptureConfig config;
+        core::Pacing  pacing { 0, 0, 0, 0 };
+        int64_t       lastCopy { 0 };
+        int64_t       costTicks { 0 };  // the estimate the scheduler gets
+        int64_t       costSample { 0 }; // what a copy cost when it was last recorded
+
+        CaptureShared shared; // as the DWM would have written it
+
+        // What the DWM did in the recording
+        uint64_t recordedCopies { 0 };
+        uint64_t recordedDeferred { 0 };
+        uint64_t recordedSkipped { 0 };
+
+        ReplayCapture()
+        {
+            std::memset(&config, 0, sizeof(config));
+            std::memset(&shared, 0, sizeof(shared));
+            shared.latestTarget = -1;
+            shared.heldTarget   = -1;
+        }
+    };
+
+    struct Totals
+    {
+        uint64_t presents { 0 };
+        uint64_t copies { 0 };
+        uint64_t deferred { 0 };
+        uint64_t skipped { 0 };
+        uint64_t recordedCopies { 0 };
+        uint64_t recordedDeferred { 0 };
+        uint64_t recordedSkipped { 0 };
+        uint64_t mismatchedPresents { 0 }; // where the set of copied captures differs from the recording
+    };
+
+    class Replay
+    {
+        const recording::Header            &m_header;
+        const std::vector<recording::Record> &m_records;
+
+        std::vector<ReplayCapture> m_captures;
+        sched::Scheduler           m_scheduler;
+        Totals                     m_totals;
+
+        // Scratch space for one Present
+        std::vector<uint32_t>         m_locked;
+        std::vector<uint32_t>         m_recordedCopies;
+        std::vector<uint32_t>         m_copies;
+        std::vector<ReplayCapture*>   m_ready;
+        std::vector<sched::Candidate> m_candidates;
+
+        // Captures registered before the oldest record still in the ring
+        // show up out of nowhere, they are created when first seen
+        ReplayCapture &capture(uint32_t id)
+        {
+            for (ReplayCapture &cap : m_captures) {
+                if (cap.id == id)
+                    return cap;
+            }
+
+            m_captures.push_back(ReplayCapture());
+            m_captures.back().id = id;
+
+            return m_captures.back();
+        }
+
+        void remove(uint32_t id)
+        {
+            for (size_t i = 0; i < m_captures.size(); ++i) {
+                if (m_captures[i].id == id) {
+                    m_captures.erase(m_captures.begin() + std::ptrdiff_t(i));
+                    return;
+                }
+            }
+        }
+
+        static bool has(const std::vector<uint32_t> &ids, uint32_t id)
+        {
+            return std::find(ids.begin(), ids.end(), id) != ids.end();
+        }
+
+        /*
+         * Applies everything that happened around one Present, except for the
+         * decisions, which are made again. These records come between the Present
+         * and the next one, except for registrations, which come before it.
+         * Without a Present (chain 0), the decisions belong to one that's not in
+         * the recording anymore and are left out.
+         */
+        void applyRecords(size_t begin, size_t end, uint32_t chain)
+        {
+            m_locked.clear();
+            m_recordedCopies.clear();
+
+            for (size_t i = begin; i < end; ++i) {
+                const recording::Record &r = m_records[i];
+
+                switch (r.type) {
+                    case recording::RECORD_CAPTURE_REGISTERED: {
+                        ReplayCapture &cap = capture(r.args[0]);
+                        cap.targetCount = std::max<uint32_t>(1, std::min<uint32_t>(r.args[3], MAX_CAPTURE_TARGETS));
+                        break;
+                    }
+                    case recording::RECORD_CAPTURE_REMOVED:
+                        remove(r.args[0]);
+                        break;
+                    case recording::RECORD_CAPTURE_BOUND: {
+                        ReplayCapture &cap = capture(r.args[0]);
+                        cap.bound = true;
+                        cap.chain = r.args[1];
+                        break;
+                    }
+                    case recording::RECORD_CONFIG: {
+                        ReplayCapture &cap = capture(r.args[0]);
+                        cap.config.flags         = r.args[1];
+                        cap.config.frameInterval = r.args[2];
+                        cap.config.clientClass   = r.args[3];
+                        core::set_interval(cap.pacing, core::interval_to_ticks(cap.config.frameInterval, m_header.frequency));
+                        break;
+                    }
+                    case recording::RECORD_MODE_CHANGE:
+                        capture(r.args[0]).waitingForTargets = true;
+                        break;
+                    case recording::RECORD_NEW_TARGETS: {
+                        ReplayCapture &cap = capture(r.args[0]);
+                        cap.waitingForTargets = false;
+                        cap.targetCount = std::max<uint32_t>(1, std::min<uint32_t>(r.args[1], MAX_CAPTURE_TARGETS));
+                        break;
+                    }
+                    case recording::RECORD_SKIPPED_LOCKED:
+                    case recording::RECORD_COPY:
+                    case recording::RECORD_DEFERRED: {
+                        if (!chain)
+                            break;
+
+                        // Whatever got this far was bound to the presenting swap chain
+                        ReplayCapture &cap = capture(r.args[0]);
+                        if (!cap.bound) {
+                            cap.bound = true;
+                            cap.chain = chain;
+                        }
+
+                        if (r.type == recording::RECORD_SKIPPED_LOCKED) {
+                            m_locked.push_back(cap.id);
+                            cap.recordedSkipped++;
+                        } else if (r.type == recording::RECORD_COPY) {
+                            m_recordedCopies.push_back(cap.id);
+                            cap.costSample = r.args[3];
+                            cap.recordedCopies++;
+                        } else {
+                            cap.recordedDeferred++;
+                        }
+                        break;
+                    }
+                    case recording::RECORD_COST:
+                        // Measured on an earlier Present, reported before scheduling this one
+                        if (chain)
+                            m_scheduler.reportCost(r.args[0]);
+                        break;
+                    default:
+                        break;
+                }
+            }
+        }
+
+        // BeforePresent and PrepareCapture in dd4seven-dwm.cpp, minus D3D and the mutexes
+        void present(int64_t now, uint32_t chain)
+        {
+            m_ready.clear();
+            m_candidates.clear();
+            m_copies.clear();
+
+            for (ReplayCapture &cap : m_captures) {
+                stats_write_begin(cap.shared.dwmStats);
+                cap.shared.dwmStats.keepAliveChecks++;
+                stats_write_end(cap.shared.dwmStats);
+
+                if (!cap.bound || cap.chain != chain)
+                    continue;
+
+                stats_write_begin(cap.shared.dwmStats);
+                cap.shared.dwmStats.presents++;
+                stats_write_end(cap.shared.dwmStats);
+
+                if (cap.waitingForTargets)
+                    continue;
+
+                core::update_present_period(cap.pacing, now, m_header.frequency);
+
+                if ((cap.config.flags & CAPTURE_FLAG_PAUSED) || !core::is_due(cap.pacing, now))
+                    continue;
+
+                // The client's locking isn't ours to decide, it's taken from the recording
+                if (has(m_locked, cap.id)) {
+                    stats_write_begin(cap.shared.dwmStats);
+                    cap.shared.dwmStats.skippedLocked++;
+                    stats_write_end(cap.shared.dwmStats);
+                    m_totals.skipped++;
+                    continue;
+                }
+
+                m_ready.push_back(&cap);
+                m_candidates.push_back(sched::Candidate {
+                    cap.config.clientClass,
+                    now - cap.lastCopy,
+                    cap.costTicks,
+                    false
+                });
+            }
+
+            m_scheduler.schedule(m_candidates);
+
+            for (size_t i = 0; i < m_ready.size(); ++i) {
+                ReplayCapture &cap = *m_ready[i];
+
+                if (!m_candidates[i].selected) {
+                    stats_write_begin(cap.shared.dwmStats);
+                    cap.shared.dwmStats.deferred++;
+                    stats_write_end(cap.shared.dwmStats);
+                    m_totals.deferred++;
+                    continue;
+                }
+
+                // CopyCapture, without the copy
+                cap.shared.latestTarget = next_target(cap.shared.latestTarget, cap.shared.heldTarget, cap.targetCount);
+                core::advance_due(cap.pacing, now);
+                cap.lastCopy = now;
+
+                stats_write_begin(cap.shared.dwmStats);
+                cap.shared.dwmStats.copies++;
+                cap.shared.dwmStats.copyTicks += uint64_t(cap.costSample);
+                stats_write_end(cap.shared.dwmStats);
+                cap.costTicks = core::smooth(cap.costTicks, cap.costSample);
+
+                m_copies.push_back(cap.id);
+                m_totals.copies++;
+            }
+
+            std::sort(m_copies.begin(), m_copies.end());
+            std::sort(m_recordedCopies.begin(), m_recordedCopies.end());
+            if (m_copies != m_recordedCopies)
+                m_totals.mismatchedPresents++;
+
+            m_totals.presents++;
+        }
+
+    public:
+        Replay(const recording::Header &header, const std::vector<recording::Record> &records, int64_t budget)
+            : m_header(header)
+            , m_records(records)
+        {
+            m_scheduler.setBudget(budget);
+        }
+
+        void run()
+        {
+            size_t i = 0;
+
+            // Everything before the first Present is only state
+            while (i < m_records.size() && m_records[i].type != recording::RECORD_PRESENT)
+                ++i;
+            applyRecords(0, i, 0);
+
+            while (i < m_records.size()) {
+                const recording::Record &p = m_records[i];
+
+                size_t end = i + 1;
+                while (end < m_records.size() && m_records[end].type != recording::RECORD_PRESENT)
+                    ++end;
+
+                applyRecords(i + 1, end, p.args[0]);
+                present(p.timestamp, p.args[0]);
+
+                i = end;
+            }
+
+            for (const ReplayCapture &cap : m_captures) {
+                m_totals.recordedCopies   += cap.recordedCopies;
+                m_totals.recordedDeferred += cap.recordedDeferred;
+                m_totals.recordedSkipped  += cap.recordedSkipped;
+            }
+        }
+
+        const Totals &totals() const { return m_totals; }
+        const sched::Counters &counters() const { return m_scheduler.counters(); }
+        const std::vector<ReplayCapture> &captures() const { return m_captures; }
+    };
+
+    double ticks_to_microseconds(int64_t ticks, int64_t frequency)
+    {
+        return frequency ? double(ticks) * 1000000.0 / double(frequency) : 0.0;
+    }
+
+    // Reads the ring in the order it was written
+    bool load(const char *path, recording::Header &header, std::vector<recording::Record> &records)
+    {
+        FILE *file = std::fopen(path, "rb");
+        if (!file) {
+            fprintf(stderr, "Couldn't open %s\n", path);
+            return false;
+        }
+
+        bool ok = std::fread(&header, sizeof(header), 1, file) == 1
+                  && header.magic == recording::MAGIC
+                  && header.version == recording::VERSION
+                  && header.capacity > 0;
+
+        std::vector<recording::Record> ring;
+        if (ok) {
+            ring.resize(header.capacity);
+            ok = std::fread(ring.data(), sizeof(recording::Record), ring.size(), file) == ring.size();
+        }
+
+        std::fclose(file);
+
+        if (!ok) {
+            fprintf(stderr, "%s is not a recording\n", path);
+            return false;
+        }
+
+        uint64_t count = std::min<uint64_t>(header.next, header.capacity);
+        uint64_t first = header.next - count;
+
+        records.clear();
+        records.reserve(size_t(count));
+        for (uint64_t i = first; i < header.next; ++i)
+            records.push_back(ring[size_t(i % header.capacity)]);
+
+        return true;
+    }
+
+    void dump(const recording::Header &header, const std::vector<recording::Record> &records)
+    {
+        int64_t start = records.empty() ? 0 : records.front().timestamp;
+
+        for (const recording::Record &r : records) {
+            printf("%12.1f %-18s %u %u %u %u %u\n",
+                   ticks_to_microseconds(r.timestamp - start, header.frequency), recording::type_name(r.type),
+                   r.args[0], r.args[1], r.args[2], r.args[3], r.args[4]);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const char *path    = nullptr;
+    long        budget  = -1; // microseconds, -1 for the recorded one
+    unsigned    repeat  = 1;
+    bool        dumping = false;
+
+    for (int i = 1; i < argc; ++i) {
+        if (!std::strcmp(argv[i], "--budget") && i + 1 < argc) {
+            budget = std::strtol(argv[++i], nullptr, 10);
+        } else if (!std::strcmp(argv[i], "--repeat") && i + 1 < argc) {
+            repeat = unsigned(std::strtoul(argv[++i], nullptr, 10));
+        } else if (!std::strcmp(argv[i], "--dump")) {
+            dumping = true;
+        } else if (argv[i][0] != '-' && !path) {
+            path = argv[i];
+        } else {
+            path = nullptr;
+            break;
+        }
+    }
+
+    if (!path || !repeat) {
+        fprintf(stderr, "Usage: %s <recording> [--budget <us>] [--repeat <n>] [--dump]\n", argv[0]);
+        return 2;
+    }
+
+    recording::Header header;
+    std::vector<recording::Record> records;
+    if (!load(path, header, records))
+        return 1;
+
+    if (dumping) {
+        dump(header, records);
+        return 0;
+    }
+
+    int64_t budgetTicks = budget < 0 ? header.budget : int64_t(budget) * header.frequency / 1000000;
+
+    // Every round starts from scratch, the last one is reported
+    double  best   = 0.0;
+    Replay *replay = nullptr;
+    for (unsigned round = 0; round < repeat; ++round) {
+        delete replay;
+        replay = new Replay(header, records, budgetTicks);
+
+        auto start = std::chrono::steady_clock::now();
+        replay->run();
+        auto end = std::chrono::steady_clock::now();
+
+        double ns = std::chrono::duration<double, std::nano>(end - start).count();
+        if (round == 0 || ns < best)
+            best = ns;
+    }
+
+    const Totals &totals = replay->totals();
+    const sched::Counters &counters = replay->counters();
+
+    double seconds = records.empty() ? 0.0 : ticks_to_microseconds(records.back().timestamp - records.front().timestamp, header.frequency) / 1000000.0;
+
+    printf("recording.records %llu\n", (unsigned long long)records.size());
+    printf("recording.lost_records %llu\n", (unsigned long long)(header.next - records.size()));
+    printf("recording.seconds %.3f\n", seconds);
+    printf("recording.budget_us %.0f\n", ticks_to_microseconds(header.budget, header.frequency));
+    printf("recording.copies %llu\n", (unsigned long long)totals.recordedCopies);
+    printf("recording.deferred %llu\n", (unsigned long long)totals.recordedDeferred);
+    printf("recording.skipped_locked %llu\n", (unsigned long long)totals.recordedSkipped);
+
+    printf("replay.budget_us %.0f\n", ticks_to_microseconds(budgetTicks, header.frequency));
+    printf("replay.presents %llu\n", (unsigned long long)totals.presents);
+    printf("replay.copies %llu\n", (unsigned long long)totals.copies);
+    printf("replay.deferred %llu\n", (unsigned long long)totals.deferred);
+    printf("replay.skipped_locked %llu\n", (unsigned long long)totals.skipped);
+    printf("replay.throttled_presents %llu\n", (unsigned long long)counters.throttledPresents);
+    printf("replay.over_budget_presents %llu\n", (unsigned long long)counters.overBudgetPresents);
+    printf("replay.mismatched_presents %llu\n", (unsigned long long)totals.mismatchedPresents);
+    printf("replay.ns_per_present %.1f\n", totals.presents ? best / double(totals.presents) : 0.0);
+
+    // Read back the way the client would
+    for (const ReplayCapture &cap : replay->captures()) {
+        CaptureDwmStats stats;
+        if (!stats_read(cap.shared.dwmStats, stats))
+            continue;
+
+        printf("capture%u.presents %llu\n", cap.id, (unsigned long long)stats.presents);
+        printf("capture%u.copies %llu\n", cap.id, (unsigned long long)stats.copies);
+        printf("capture%u.deferred %llu\n", cap.id, (unsigned long long)stats.deferred);
+        printf("capture%u.skipped_locked %llu\n", cap.id, (unsigned long long)stats.skippedLocked);
+        printf("capture%u.recorded_copies %llu\n", cap.id, (unsigned long long)cap.recordedCopies);
+        printf("capture%u.recorded_deferred %llu\n", cap.id, (unsigned long long)cap.recordedDeferred);
+    }
+
+    delete replay;
+
+    return 0;
+}
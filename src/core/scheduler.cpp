@@ -0,0 +1,92 @@
+// Copyright (C) 2015 Jonas Kümmerlin <rgcjonas@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "scheduler.hpp"
+
+#include <algorithm>
+
+namespace {
+    // How much faster staleness counts for each client class
+    int64_t class_weight(uint32_t clientClass)
+    {
+        switch (clientClass) {
+            case sched::CLASS_INTERACTIVE: return 4;
+            case sched::CLASS_BACKGROUND:  return 1;
+            default:                       return 2;
+        }
+    }
+}
+
+void sched::Scheduler::schedule(std::vector<Candidate> &candidates)
+{
+    if (candidates.empty())
+        return;
+
+    m_counters.presents++;
+
+    int64_t total = 0;
+    for (const Candidate &c : candidates)
+        total += c.cost;
+
+    if (!m_budget || total <= m_budget) {
+        // The common case: everything fits
+        for (Candidate &c : candidates)
+            c.selected = true;
+
+        m_counters.copies += candidates.size();
+        return;
+    }
+
+    // Most urgent first. Deferred candidates get staler every Present,
+    // so even background captures get their turn eventually.
+    m_order.clear();
+    for (Candidate &c : candidates) {
+        c.selected = false;
+        m_order.push_back(&c);
+    }
+
+    std::sort(m_order.begin(), m_order.end(), [](const Candidate *a, const Candidate *b) {
+        return a->staleness * class_weight(a->clientClass) > b->staleness * class_weight(b->clientClass);
+    });
+
+    // The most urgent one is copied even if it alone blows the budget,
+    // otherwise an expensive capture would never get anything.
+    int64_t used = 0;
+    for (Candidate *c : m_order) {
+        if (used && used + c->cost > m_budget)
+            continue;
+
+        c->selected = true;
+        used += c->cost;
+        m_counters.copies++;
+    }
+
+    m_counters.deferred += uint64_t(std::count_if(candidates.begin(), candidates.end(),
+                                                  [](const Candidate &c) { return !c.selected; }));
+    m_counters.throttledPresents++;
+}
+
+void sched::Scheduler::reportCost(int64_t cost)
+{
+    m_counters.lastCost = cost;
+
+    if (m_budget && cost > m_budget)
+        m_counters.overBudgetPresents++;
+}
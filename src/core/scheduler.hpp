@@ -0,0 +1,80 @@
+// Copyright (C) 2015 Jonas Kümmerlin <rgcjonas@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+/*
+ * Decides which captures get a copy on a Present when copying all of them
+ * would take longer than the DWM can afford.
+ *
+ * Knows nothing about D3D: all times are in whatever ticks the caller uses
+ * (QueryPerformanceCounter in the DWM), and costs are estimates the caller
+ * keeps up to date.
+ */
+namespace sched {
+    // Keep in sync with CAPTURE_CLASS_* in protocol.hpp
+    enum ClientClass : uint32_t {
+        CLASS_DEFAULT     = 0,
+        CLASS_INTERACTIVE = 1, // remote desktop, streaming: someone is watching
+        CLASS_BACKGROUND  = 2, // thumbnails, recording: a late frame hurts nobody
+    };
+
+    struct Candidate
+    {
+        uint32_t clientClass; // ClientClass
+        int64_t  staleness;   // time since the capture got its last copy
+        int64_t  cost;        // expected time a copy for it takes
+        bool     selected;    // output of Scheduler::schedule
+    };
+
+    struct Counters
+    {
+        uint64_t presents;           // Presents that had anything to copy
+        uint64_t copies;             // candidates selected
+        uint64_t deferred;           // candidates pushed to a later Present
+        uint64_t throttledPresents;  // Presents on which anything was deferred
+        uint64_t overBudgetPresents; // Presents whose measured cost exceeded the budget
+        int64_t  lastCost;           // latest measured cost of a Present
+    };
+
+    class Scheduler
+    {
+    public:
+        // 0 disables the budget, everything is copied every time
+        void setBudget(int64_t budget) { m_budget = budget; }
+        int64_t budget() const { return m_budget; }
+
+        // Sets Candidate::selected for the ones to copy on this Present
+        void schedule(std::vector<Candidate> &candidates);
+
+        // Reports what copying on a Present actually cost, once it is known
+        void reportCost(int64_t cost);
+
+        const Counters &counters() const { return m_counters; }
+
+    private:
+        int64_t  m_budget { 0 };
+        Counters m_counters { 0, 0, 0, 0, 0, 0 };
+        std::vector<Candidate*> m_order; // scratch space, to not allocate on every Present
+    };
+}
@@ -22,6 +22,10 @@
 #include "com.hpp"
 #include "util.hpp"
 #include "logger.hpp"
+#include "protocol.hpp"
+#include "trace.hpp"
+#include "core/pixels.hpp"
+#include "core/region.hpp"
 
 #include <atomic>
 #include <iostream>
@@ -48,15 +52,9 @@ static std::size_t calculate_bitmap_size_mono(HBITMAP bmp)
     if (!GetDIBits(hdc, bmp, 0, 0, nullptr, (BITMAPINFO*)&bmi, DIB_RGB_COLORS))
         return 0;
 
-    auto w = bmi.h.biWidth;
-    auto h = std::abs(bmi.h.biHeight);
-
-    auto bpl = ((w-1)/32 + 1)*4; // bytes per line
-    auto size = bpl * h;
-
     DeleteDC(hdc);
 
-    return std::size_t(size);
+    return core::mono_size(bmi.h.biWidth, std::abs(bmi.h.biHeight));
 }
 
 // Saves a top-down monochrome dib to *out
@@ -84,7 +82,7 @@ static bool export_bitmap_to_mono(HBITMAP bmp, uint8_t *pixels, LONG *pWidth = n
 
     if (pWidth)  *pWidth  = bmi.h.biWidth;
     if (pHeight) *pHeight = std::abs(bmi.h.biHeight);
-    if (pStride) *pStride = ((bmi.h.biWidth-1)/32 + 1)*4;
+    if (pStride) *pStride = LONG(core::mono_stride(bmi.h.biWidth));
 
     DeleteDC(hdc);
 
@@ -104,15 +102,9 @@ static std::size_t calculate_bitmap_size_rgb32(HBITMAP bmp)
     if (!GetDIBits(hdc, bmp, 0, 0, nullptr, (BITMAPINFO*)&bih, DIB_RGB_COLORS))
         return 0;
 
-    auto w = bih.biWidth;
-    auto h = std::abs(bih.biHeight);
-
-    auto bpl = w * 4; // bytes per line
-    auto size = bpl * h;
-
     DeleteDC(hdc);
 
-    return std::size_t(size);
+    return core::rgb32_size(bih.biWidth, std::abs(bih.biHeight));
 }
 
 // Saves a top-down rgb32 dib to *out
@@ -139,30 +131,115 @@ static bool export_bitmap_to_rgb32(HBITMAP bmp, uint8_t *pixels, LONG *pWidth =
 
     if (pWidth)  *pWidth  = bih.biWidth;
     if (pHeight) *pHeight = std::abs(bih.biHeight);
-    if (pStride) *pStride = 4*bih.biWidth;
+    if (pStride) *pStride = LONG(core::rgb32_stride(bih.biWidth));
 
     DeleteDC(hdc);
 
     return true;
 }
 
-//KEEP THIS IN SYNC WITH dd4seven-dwm.cpp
-#pragma pack(push,1)
-struct CaptureRequest
+// Fills a 56 character buffer with "<prefix><GUID>", which makes for a unique object name
+static void format_object_name(wchar_t *buffer, const wchar_t *prefix, const GUID &guid)
 {
-    RECT     monitor;
-    wchar_t  imageMutex[56];
-    wchar_t  imageEvent[56];
-    wchar_t  keepAliveMutex[56];
-    uint32_t captureTarget; //D3D pseudo-handle
-};
-#pragma pack(pop)
+    _snwprintf(buffer, 56, L"%ls%08lX-%04hX-%04hX-%02hhX%02hhX-%02hhX%02hhX%02hhX%02hhX%02hhX%02hhX",
+               prefix,
+               guid.Data1, guid.Data2, guid.Data3,
+               guid.Data4[0], guid.Data4[1], guid.Data4[2], guid.Data4[3],
+               guid.Data4[4], guid.Data4[5], guid.Data4[6], guid.Data4[7]);
+    buffer[55] = 0;
+}
+
+// Checks whether an application-provided texture can be written by the DWM
+static HRESULT check_capture_target(IUnknown *texture, UINT width, UINT height)
+{
+    if (!texture)
+        return E_INVALIDARG;
+
+    struct {
+        UINT        width, height, mipLevels, arraySize, samples;
+        DXGI_FORMAT format;
+        bool        usageDefault, shared;
+    } d;
+
+    com::ptr<ID3D10Texture2D> texture10;
+    com::ptr<ID3D11Texture2D> texture11;
+    if SUCCEEDED(texture->QueryInterface(IID_PPV_ARGS(com::out_arg(texture10)))) {
+        D3D10_TEXTURE2D_DESC desc;
+        texture10->GetDesc(&desc);
+
+        d = { desc.Width, desc.Height, desc.MipLevels, desc.ArraySize, desc.SampleDesc.Count, desc.Format,
+              desc.Usage == D3D10_USAGE_DEFAULT, (desc.MiscFlags & D3D10_RESOURCE_MISC_SHARED) != 0 };
+    } else if SUCCEEDED(texture->QueryInterface(IID_PPV_ARGS(com::out_arg(texture11)))) {
+        D3D11_TEXTURE2D_DESC desc;
+        texture11->GetDesc(&desc);
+
+        d = { desc.Width, desc.Height, desc.MipLevels, desc.ArraySize, desc.SampleDesc.Count, desc.Format,
+              desc.Usage == D3D11_USAGE_DEFAULT, (desc.MiscFlags & D3D11_RESOURCE_MISC_SHARED) != 0 };
+    } else {
+        logger << "Capture target is no D3D10/D3D11 texture" << std::endl;
+        return E_INVALIDARG;
+    }
+
+    // The DWM writes with CopyResource/ResolveSubresource, which dictates most of this
+    if (d.width != width || d.height != height) {
+        logger << "Capture target has size " << d.width << "x" << d.height << ", expected " << width << "x" << height << std::endl;
+        return E_INVALIDARG;
+    }
+
+    if (d.format != DXGI_FORMAT_B8G8R8A8_UNORM && d.format != DXGI_FORMAT_B8G8R8A8_TYPELESS) {
+        logger << "Capture target has unsupported format " << d.format << std::endl;
+        return E_INVALIDARG;
+    }
+
+    if (d.mipLevels != 1 || d.arraySize != 1 || d.samples != 1 || !d.usageDefault || !d.shared) {
+        logger << "Capture target must be a shared, single-sampled D3D_USAGE_DEFAULT texture without mipmaps" << std::endl;
+        return E_INVALIDARG;
+    }
+
+    return S_OK;
+}
+
+// Checks whether a capture config makes sense for an output with the given desktop coordinates
+static HRESULT check_config(const DD4SEVEN_CAPTURE_CONFIG &config, const RECT &monitor)
+{
+    if (config.Flags & ~DD4SEVEN_CAPTURE_PAUSED)
+        return E_INVALIDARG;
+
+    if (config.ClientClass > DD4SEVEN_CLASS_BACKGROUND)
+        return E_INVALIDARG;
+
+    if (!core::is_empty(config.Region) && !core::contains(core::at_origin(monitor), config.Region))
+        return E_INVALIDARG;
+
+    return S_OK;
+}
+
+// Converts QueryPerformanceCounter ticks to microseconds without overflowing
+static uint64_t ticks_to_microseconds(uint64_t ticks)
+{
+    static LARGE_INTEGER frequency;
+    static BOOL qpcAvailable = QueryPerformanceFrequency(&frequency);
+    if (!qpcAvailable)
+        return 0;
+
+    uint64_t f = uint64_t(frequency.QuadPart);
+    return ticks / f * 1000000 + ticks % f * 1000000 / f;
+}
+
+static_assert(GPU_HISTOGRAM_BUCKETS == DD4SEVEN_GPU_HISTOGRAM_BUCKETS, "histogram size must match");
+
+// Lets our own exports find the implementation behind an IDXGIOutputDuplication
+// {5C1A2F6E-3B7D-4E8A-9D21-7F0B6C4E8A13}
+static const GUID IID_DD4SevenOutputDuplication = { 0x5c1a2f6e, 0x3b7d, 0x4e8a, { 0x9d, 0x21, 0x7f, 0x0b, 0x6c, 0x4e, 0x8a, 0x13 } };
 
 class DD4SevenOutputDuplication : public IDXGIOutputDuplication, public com::obj_impl_base
 {
 protected:
     void *_queryInterface(REFIID iid)
     {
+        if (iid == IID_DD4SevenOutputDuplication)
+            return static_cast<DD4SevenOutputDuplication*>(this);
+
         return com::query_impl<IDXGIOutputDuplication, IDXGIObject>::on(this, iid);
     }
 public:
@@ -249,22 +326,53 @@ public:
         HANDLE objects[2] = { m_imageEvent, m_imageMutex };
         switch (WaitForMultipleObjects(2, objects, TRUE, TimeoutInMilliseconds)) {
             case WAIT_TIMEOUT:
+                stats_write_begin(m_shared->clientStats);
+                m_shared->clientStats.timeouts++;
+                stats_write_end(m_shared->clientStats);
+
                 m_timeoutMsecs += TimeoutInMilliseconds;
-                if (m_timeoutMsecs > 5000)
+                trace::write(trace::EVENT_ACQUIRE_TIMEOUT, uint32_t(m_timeoutMsecs));
+                if (m_timeoutMsecs > 5000 + m_frameIntervalMsecs)
                     return DXGI_ERROR_ACCESS_LOST;
 
                 return DXGI_ERROR_WAIT_TIMEOUT;
             case WAIT_OBJECT_0:
                 m_timeoutMsecs = 0;
 
+                if (m_shared->modeGeneration != m_modeGeneration) {
+                    // The DWM only woke us up to tell us about the new mode
+                    HRESULT hr = updateMode();
+                    ReleaseMutex(m_imageMutex);
+                    trace::write(trace::EVENT_CLIENT_MODE_CHANGE, uint32_t(m_monitor.right - m_monitor.left), uint32_t(m_monitor.bottom - m_monitor.top), uint32_t(hr));
+                    return hr;
+                }
+
                 // The DWM prepared an image for us
                 QueryPerformanceCounter(&pFrameInfo->LastPresentTime);
                 pFrameInfo->AccumulatedFrames = /*FIXME*/ 1;
                 pFrameInfo->RectsCoalesced = FALSE;
                 pFrameInfo->ProtectedContentMaskedOut = FALSE;
 
+                m_acquiredTarget = m_shared->latestTarget;
+                if (m_acquiredTarget < 0 || m_acquiredTarget >= LONG(m_targetCount))
+                    m_acquiredTarget = 0;
+                m_frameRegion = m_shared->latestRegion;
+
+                if (m_targetCount > 1) {
+                    // The DWM can keep writing into the other targets, so we only pin
+                    // the one we're handing out and let go of the image mutex right away.
+                    InterlockedExchange(&m_shared->heldTarget, m_acquiredTarget);
+                    ReleaseMutex(m_imageMutex);
+                }
+
                 m_desktopImageAcquired = true;
-                *ppDesktopResource = m_desktopImage.get();
+                *ppDesktopResource = m_targets[m_acquiredTarget].get();
+
+                stats_write_begin(m_shared->clientStats);
+                m_shared->clientStats.acquires++;
+                stats_write_end(m_shared->clientStats);
+                QueryPerformanceCounter(&m_acquireTime);
+                trace::write(trace::EVENT_ACQUIRE, uint32_t(m_acquiredTarget));
                 (*ppDesktopResource)->AddRef();
 
                 // The mouse might have been changed
@@ -281,8 +389,8 @@ public:
                         GetIconInfo(m_lastCursor, &m_cursorInfo);
                     }
 
-                    pFrameInfo->PointerPosition.Position.x = info.ptScreenPos.x - m_cursorInfo.xHotspot - m_monitor.left;
-                    pFrameInfo->PointerPosition.Position.y = info.ptScreenPos.y - m_cursorInfo.yHotspot - m_monitor.top;
+                    pFrameInfo->PointerPosition.Position.x = info.ptScreenPos.x - m_cursorInfo.xHotspot - m_monitor.left - m_frameRegion.left;
+                    pFrameInfo->PointerPosition.Position.y = info.ptScreenPos.y - m_cursorInfo.yHotspot - m_monitor.top - m_frameRegion.top;
 
                     // We are required to estimate the space needed for the bitmaps here
                     if (m_cursorInfo.hbmColor) {
@@ -305,11 +413,13 @@ public:
             case WAIT_ABANDONED_0:
                 // We should just die here
                 m_isGood = false;
+                trace::write(trace::EVENT_ACQUIRE_FAILED, uint32_t(DXGI_ERROR_ACCESS_LOST));
                 return DXGI_ERROR_ACCESS_LOST;
 
             case WAIT_FAILED:
             default:
                 logger << "WaitForMultipleObjects failed: " << util::hresult_to_utf8(HRESULT_FROM_WIN32(GetLastError())) << std::endl;
+                trace::write(trace::EVENT_ACQUIRE_FAILED, uint32_t(E_FAIL));
                 return E_FAIL;
         }
     }
@@ -333,8 +443,8 @@ public:
 
         pDirtyRectsBuffer->left = 0;
         pDirtyRectsBuffer->top  = 0;
-        pDirtyRectsBuffer->right = m_monitor.right - m_monitor.left;
-        pDirtyRectsBuffer->bottom = m_monitor.bottom - m_monitor.top;
+        pDirtyRectsBuffer->right = m_frameRegion.right - m_frameRegion.left;
+        pDirtyRectsBuffer->bottom = m_frameRegion.bottom - m_frameRegion.top;
 
         return S_OK;
     }
@@ -375,7 +485,6 @@ public:
                 return DXGI_ERROR_MORE_DATA;
 
             // If we're lucky, the color bitmap contains alpha data
-            bool foundAlpha = false;
             LONG width  = 0;
             LONG height = 0;
             LONG stride = 0;
@@ -383,20 +492,8 @@ public:
             if (!export_bitmap_to_rgb32(m_cursorInfo.hbmColor, (uint8_t *)pPointerShapeBuffer, &width, &height, &stride))
                 return E_FAIL;
 
-            // try to find an alpha value
             uint8_t *bitmap = (uint8_t*)pPointerShapeBuffer;
-            for (LONG y = 0; y < height; ++y) {
-                for (LONG x = 0; x < width; ++x) {
-                    uint8_t *pixel = &bitmap[y*stride + x*4];
-
-                    if (pixel[3]) {
-                        foundAlpha = true;
-                        break;
-                    }
-                }
-            }
-
-            if (!foundAlpha) {
+            if (!core::has_alpha(bitmap, std::size_t(stride), width, height)) {
                 // If there is no alpha, we have to consider the mask
                 std::unique_ptr<uint8_t[]> and_mask(new (std::nothrow) uint8_t[calculate_bitmap_size_mono(m_cursorInfo.hbmMask)]);
                 if (!and_mask)
@@ -408,16 +505,8 @@ public:
                 if (!export_bitmap_to_mono(m_cursorInfo.hbmMask, and_mask.get(), &andWidth, &andHeight, &andStride))
                     return E_FAIL;
 
-                for (LONG y = 0; y < andHeight; ++y) {
-                    uint8_t *source_row = &and_mask[y*andStride];
-
-                    for (LONG x = 0; x < andWidth; ++x) {
-                        uint8_t *target_pixel = &bitmap[y*stride + x*4];
-                        uint8_t alpha = util::get_pixel_from_row<1>(source_row, x) ? 0 : 0xFF;
-
-                        target_pixel[3] = alpha;
-                    }
-                }
+                core::apply_and_mask(bitmap, std::size_t(stride), std::min(andWidth, width), std::min(andHeight, height),
+                                     and_mask.get(), std::size_t(andStride));
             }
 
             pPointerShapeInfo->Height = UINT(height);
@@ -470,7 +559,24 @@ public:
             return DXGI_ERROR_INVALID_CALL;
 
         m_desktopImageAcquired = false;
-        ReleaseMutex(m_imageMutex);
+
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+        uint64_t hold = uint64_t(now.QuadPart - m_acquireTime.QuadPart);
+
+        CaptureClientStats &stats = m_shared->clientStats;
+        stats_write_begin(stats);
+        stats.holdTicks += hold;
+        if (hold > stats.maxHoldTicks)
+            stats.maxHoldTicks = hold;
+        stats_write_end(stats);
+
+        trace::write(trace::EVENT_RELEASE, uint32_t(std::min<uint64_t>(ticks_to_microseconds(hold), UINT32_MAX)));
+
+        if (m_targetCount > 1)
+            InterlockedExchange(&m_shared->heldTarget, -1);
+        else
+            ReleaseMutex(m_imageMutex);
 
         return S_OK;
     }
@@ -478,10 +584,18 @@ public:
     /*** Our own methods ***/
     bool good() { return m_isGood; }
 
-    DD4SevenOutputDuplication(IUnknown *device, IDXGIOutput *output)
+    /**
+     * Without capture targets, we create a texture of our own on device.
+     * Otherwise the DWM writes straight into the given targets, which must
+     * have passed check_capture_target(). The optional config must have passed check_config().
+     */
+    DD4SevenOutputDuplication(IDXGIOutput *output, IUnknown *device, UINT targetCount, IUnknown * const *targets,
+                              const DD4SEVEN_CAPTURE_CONFIG *config)
     {
         HRESULT hr;
 
+        trace::init();
+
         // Read the output coordinates
         DXGI_OUTPUT_DESC desc;
         hr = output->GetDesc(&desc);
@@ -495,8 +609,230 @@ public:
             return;
         }
         m_monitor = desc.DesktopCoordinates;
+        m_frameRegion = core::at_origin(m_monitor);
+
+        if (targetCount) {
+            // The application brought its own textures
+            for (UINT i = 0; i < targetCount; ++i) {
+                if (!shareTarget(targets[i]))
+                    return;
+            }
+        } else {
+            // Keep the device around, we need it again when the display mode changes
+            if FAILED(device->QueryInterface(IID_PPV_ARGS(com::out_arg(m_device))))
+                return;
+
+            if (!createTarget(device))
+                return;
+        }
+
+        // Set up synchronization primitives
+        GUID guid;
+        if FAILED(CoCreateGuid(&guid))
+            return;
+
+        format_object_name(m_imageEventName,     L"dd4seven-event-", guid);
+        format_object_name(m_imageMutexName,     L"dd4seven-mutex-", guid);
+        format_object_name(m_keepAliveMutexName, L"dd4seven-kamtx-", guid);
+        format_object_name(m_sharedStateName,    L"dd4seven-share-", guid);
+
+        m_imageEvent = CreateEvent(nullptr, FALSE, FALSE, m_imageEventName);
+        m_imageMutex = CreateMutex(nullptr, FALSE, m_imageMutexName);
+        m_keepAliveMutex = CreateMutex(nullptr, FALSE, m_keepAliveMutexName);
+        m_sharedMapping = CreateFileMapping(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, sizeof(CaptureShared), m_sharedStateName);
+
+        if (!m_imageEvent || !m_imageMutex || !m_keepAliveMutex || !m_sharedMapping)
+            return;
+
+        m_shared = (CaptureShared*)MapViewOfFile(m_sharedMapping, FILE_MAP_READ|FILE_MAP_WRITE, 0, 0, sizeof(CaptureShared));
+        if (!m_shared)
+            return;
+
+        m_shared->latestTarget = -1;
+        m_shared->heldTarget   = -1;
+        m_shared->latestRegion = m_frameRegion;
+        m_shared->monitor      = m_monitor;
+        publishTargets();
+
+        if (config) {
+            m_shared->config.region        = config->Region;
+            m_shared->config.flags         = config->Flags;
+            m_shared->config.frameInterval = config->FrameInterval;
+            m_shared->config.clientClass   = config->ClientClass;
+            m_frameIntervalMsecs = config->FrameInterval / 10000;
+        }
+
+        WaitForSingleObject(m_keepAliveMutex, INFINITE);
+
+        // Send textures and synchronization to the DWM
+        HWND dwm = FindWindowEx(HWND_MESSAGE, NULL, DD4SEVEN_WINDOW_NAME, DD4SEVEN_WINDOW_NAME);
+        if (!dwm) { // no DWM!? sacrilege!
+            logger << "DWM Not present :(" << std::endl;
+            return;
+        }
+
+        CaptureRequest req;
+        std::memset(&req, 0, sizeof(req));
+        req.monitor = m_monitor;
+        std::wcsncpy(req.outputName, desc.DeviceName, 32);
+        req.outputName[31] = 0;
+        std::wcsncpy(req.imageEvent, m_imageEventName, 56);
+        std::wcsncpy(req.imageMutex, m_imageMutexName, 56);
+        std::wcsncpy(req.keepAliveMutex, m_keepAliveMutexName, 56);
+        std::wcsncpy(req.sharedState, m_sharedStateName, 56);
+        req.captureTargetCount = m_targetCount;
+        for (UINT i = 0; i < m_targetCount; ++i)
+            req.captureTargets[i] = (uint32_t)PtrToUlong(m_targetHandles[i]);
+        req.config = m_shared->config;
+
+        COPYDATASTRUCT copy = {
+            .dwData = 0,
+            .cbData = sizeof(CaptureRequest),
+            .lpData = &req
+        };
+
+        if (!SendMessageTimeout(dwm, WM_COPYDATA, 0, (LPARAM)&copy, SMTO_BLOCK, 1000, nullptr)) {
+            logger << "FAILED: SendMessageTimeout: " << util::hresult_to_utf8(HRESULT_FROM_WIN32(GetLastError())) << std::endl;
+            return;
+        }
+
+        m_isGood = true;
+        trace::write(trace::EVENT_DUPLICATION_CREATED, uint32_t(m_monitor.right - m_monitor.left), uint32_t(m_monitor.bottom - m_monitor.top), m_targetCount);
+    }
+
+    HRESULT reconfigure(const DD4SEVEN_CAPTURE_CONFIG &config)
+    {
+        if (!m_isGood)
+            return DXGI_ERROR_ACCESS_LOST;
+
+        HRESULT hr = check_config(config, m_monitor);
+        if FAILED(hr)
+            return hr;
+
+        // The DWM only looks at the config while holding the image mutex
+        switch (WaitForSingleObject(m_imageMutex, 1000)) {
+            case WAIT_OBJECT_0:
+                break;
+            case WAIT_TIMEOUT:
+                return DXGI_ERROR_WAIT_TIMEOUT;
+            case WAIT_ABANDONED:
+                ReleaseMutex(m_imageMutex);
+                m_isGood = false;
+                return DXGI_ERROR_ACCESS_LOST;
+            default:
+                logger << "WaitForSingleObject failed: " << util::hresult_to_utf8(HRESULT_FROM_WIN32(GetLastError())) << std::endl;
+                return E_FAIL;
+        }
+
+        m_shared->config.region = config.Region;
+        m_shared->config.flags  = config.Flags;
+        m_shared->config.frameInterval = config.FrameInterval;
+        m_shared->config.clientClass   = config.ClientClass;
+        m_shared->configGeneration++;
+        m_frameIntervalMsecs = config.FrameInterval / 10000;
+        trace::write(trace::EVENT_RECONFIGURE, config.Flags, config.FrameInterval, uint32_t(S_OK));
+
+        ReleaseMutex(m_imageMutex);
+
+        return S_OK;
+    }
+
+    HRESULT statistics(DD4SEVEN_DUPLICATION_STATISTICS &out)
+    {
+        if (!m_shared)
+            return DXGI_ERROR_ACCESS_LOST;
+
+        CaptureDwmStats    dwm;
+        CaptureClientStats client;
+        if (!stats_read(m_shared->dwmStats, dwm) || !stats_read(m_shared->clientStats, client))
+            return DXGI_ERROR_WAIT_TIMEOUT;
+
+        out.FramesPresented     = dwm.presents;
+        out.FramesCopied        = dwm.copies;
+        out.FramesSkippedLocked = dwm.skippedLocked;
+        out.FramesDeferred      = dwm.deferred;
+        out.KeepAliveChecks     = dwm.keepAliveChecks;
+        out.CopyTimeUs          = ticks_to_microseconds(dwm.copyTicks);
+        out.FramesAcquired      = client.acquires;
+        out.AcquireTimeouts     = client.timeouts;
+        out.HoldTimeUs          = ticks_to_microseconds(client.holdTicks);
+        out.MaxHoldTimeUs       = ticks_to_microseconds(client.maxHoldTicks);
+        out.ThrottledPresents   = dwm.throttledPresents;
+        out.OverBudgetPresents  = dwm.overBudgetPresents;
+        out.BudgetUs            = dwm.budget;
+        out.LastCostUs          = dwm.lastCost;
+        out.EstimatedCostUs     = dwm.estimatedCost;
+        out.GpuCopiesTimed      = dwm.gpuCopies;
+        out.GpuCopyTimeUs       = dwm.gpuCopyTime;
+        for (unsigned i = 0; i < GPU_HISTOGRAM_BUCKETS; ++i)
+            out.GpuCopyHistogram[i] = dwm.gpuHistogram[i];
+
+        return S_OK;
+    }
+
+    ~DD4SevenOutputDuplication()
+    {
+        clearCursorInfo();
+
+        if (m_keepAliveMutex) ReleaseMutex(m_keepAliveMutex);
+
+        if (m_shared)         UnmapViewOfFile(m_shared);
+        if (m_sharedMapping)  CloseHandle(m_sharedMapping);
+        if (m_imageEvent)     CloseHandle(m_imageEvent);
+        if (m_imageMutex)     CloseHandle(m_imageMutex);
+        if (m_keepAliveMutex) CloseHandle(m_keepAliveMutex);
+    }
+
+private:
+
+    // Puts the handles of our targets where the DWM can pick them up after a mode change
+    void publishTargets()
+    {
+        m_shared->targetCount = m_targetCount;
+        for (UINT i = 0; i < m_targetCount; ++i)
+            m_shared->targets[i] = (uint32_t)PtrToUlong(m_targetHandles[i]);
+    }
+
+    // Called with the image mutex held after the DWM reported a new display mode
+    HRESULT updateMode()
+    {
+        m_modeGeneration = m_shared->modeGeneration;
+        m_monitor = m_shared->monitor;
+        m_frameRegion = core::at_origin(m_monitor);
+
+        logger << "Display mode changed, output is now " << m_frameRegion.right << "x" << m_frameRegion.bottom << std::endl;
+
+        if (!m_device) {
+            // The textures belong to the application, it has to bring new ones
+            m_isGood = false;
+            return DXGI_ERROR_ACCESS_LOST;
+        }
+
+        // Resize our texture in place, the DWM waits for it before copying anything
+        for (UINT i = 0; i < m_targetCount; ++i) {
+            m_targets[i].reset();
+            m_targetHandles[i] = nullptr;
+        }
+        m_targetCount = 0;
+
+        if (!createTarget(m_device)) {
+            m_isGood = false;
+            return DXGI_ERROR_ACCESS_LOST;
+        }
+
+        publishTargets();
+        m_shared->latestTarget = -1;
+        m_shared->latestRegion = m_frameRegion;
+        m_shared->targetsGeneration++;
+
+        return DXGI_ERROR_MODE_CHANGE_IN_PROGRESS;
+    }
+
+    // Creates a shared desktop texture on the application's device
+    bool createTarget(IUnknown *device)
+    {
+        HRESULT hr;
 
-        // Create the desktop texture
         com::ptr<ID3D10Device> device10;
         com::ptr<ID3D11Device> device11;
         if SUCCEEDED(device->QueryInterface(IID_PPV_ARGS(com::out_arg(device10)))) {
@@ -523,23 +859,10 @@ public:
 
             if FAILED(hr) {
                 logger << "Failed: CreateTexture2D: " << util::hresult_to_utf8(hr) << std::endl;
-                return;
-            }
-
-            // Pass texture handle to the injected side
-            auto res = texture.query<IDXGIResource>();
-            if (!res) {
-                logger << "Failed: QueryInterface<IDXGIResource>: " << util::hresult_to_utf8(hr) << std::endl;
-                return;
+                return false;
             }
 
-            hr = res->GetSharedHandle(&m_sharedHandle);
-            if FAILED(hr) {
-                logger << "Failed: GetSharedHandle: " << util::hresult_to_utf8(hr) << std::endl;
-                return;
-            }
-
-            m_desktopImage = texture.query<IDXGIResource>(); // should always succeed
+            return shareTarget(texture);
         } else if SUCCEEDED(device->QueryInterface(IID_PPV_ARGS(com::out_arg(device11)))) {
             // we have a d3d11 device, create the texture
             com::ptr<ID3D11Texture2D> texture;
@@ -564,97 +887,42 @@ public:
 
             if FAILED(hr) {
                 logger << "Failed: CreateTexture2D: " << util::hresult_to_utf8(hr) << std::endl;
-                return;
-            }
-
-            // Pass texture handle to the injected side
-            auto res = texture.query<IDXGIResource>();
-            if (!res) {
-                logger << "Failed: QueryInterface<IDXGIResource>: " << util::hresult_to_utf8(hr) << std::endl;
-                return;
-            }
-
-            hr = res->GetSharedHandle(&m_sharedHandle);
-            if FAILED(hr) {
-                logger << "Failed: GetSharedHandle: " << util::hresult_to_utf8(hr) << std::endl;
-                return;
+                return false;
             }
 
-            m_desktopImage = texture.query<IDXGIResource>(); // should always succeed
+            return shareTarget(texture);
         } else {
             logger << "WARNING: Invalid device passed :(" << std::endl;
-            return;
+            return false;
         }
+    }
 
-        // Set up synchronization primitives
-        GUID guid;
-        if FAILED(CoCreateGuid(&guid))
-            return;
-
-        _snwprintf(m_imageEventName, 56, L"dd4seven-event-%08lX-%04hX-%04hX-%02hhX%02hhX-%02hhX%02hhX%02hhX%02hhX%02hhX%02hhX",
-                   guid.Data1, guid.Data2, guid.Data3,
-                   guid.Data4[0], guid.Data4[1], guid.Data4[2], guid.Data4[3],
-                   guid.Data4[4], guid.Data4[5], guid.Data4[6], guid.Data4[7]);
-        _snwprintf(m_imageMutexName, 56, L"dd4seven-mutex-%08lX-%04hX-%04hX-%02hhX%02hhX-%02hhX%02hhX%02hhX%02hhX%02hhX%02hhX",
-                   guid.Data1, guid.Data2, guid.Data3,
-                   guid.Data4[0], guid.Data4[1], guid.Data4[2], guid.Data4[3],
-                   guid.Data4[4], guid.Data4[5], guid.Data4[6], guid.Data4[7]);
-        _snwprintf(m_keepAliveMutexName, 56, L"dd4seven-kamtx-%08lX-%04hX-%04hX-%02hhX%02hhX-%02hhX%02hhX%02hhX%02hhX%02hhX%02hhX",
-                   guid.Data1, guid.Data2, guid.Data3,
-                   guid.Data4[0], guid.Data4[1], guid.Data4[2], guid.Data4[3],
-                   guid.Data4[4], guid.Data4[5], guid.Data4[6], guid.Data4[7]);
-
-        m_imageEvent = CreateEvent(nullptr, FALSE, FALSE, m_imageEventName);
-        m_imageMutex = CreateMutex(nullptr, FALSE, m_imageMutexName);
-        m_keepAliveMutex = CreateMutex(nullptr, FALSE, m_keepAliveMutexName);
-
-        if (!m_imageEvent || !m_imageMutex || !m_keepAliveMutex)
-            return;
-
-        WaitForSingleObject(m_keepAliveMutex, INFINITE);
+    // Appends a texture to the capture targets, so its handle gets passed to the injected side
+    bool shareTarget(IUnknown *texture)
+    {
+        HRESULT hr;
+        com::ptr<IDXGIResource> res;
+        HANDLE handle = nullptr;
 
-        // Send texture and synchronization to the DWM
-        const wchar_t *dwmWinId = L"dd4seven-window-4B3A8226-9F55-4E9E-A276-9DE174B36166";
-        HWND dwm = FindWindowEx(HWND_MESSAGE, NULL, dwmWinId, dwmWinId);
-        if (!dwm) { // no DWM!? sacrilege!
-            logger << "DWM Not present :(" << std::endl;
-            return;
+        hr = texture->QueryInterface(IID_PPV_ARGS(com::out_arg(res)));
+        if FAILED(hr) {
+            logger << "Failed: QueryInterface<IDXGIResource>: " << util::hresult_to_utf8(hr) << std::endl;
+            return false;
         }
 
-        CaptureRequest req;
-        req.monitor = m_monitor;
-        std::wcsncpy(req.imageEvent, m_imageEventName, 56);
-        std::wcsncpy(req.imageMutex, m_imageMutexName, 56);
-        std::wcsncpy(req.keepAliveMutex, m_keepAliveMutexName, 56);
-        req.captureTarget = (uint32_t)PtrToUlong(m_sharedHandle);
-
-        COPYDATASTRUCT copy = {
-            .dwData = 0,
-            .cbData = sizeof(CaptureRequest),
-            .lpData = &req
-        };
-
-        if (!SendMessageTimeout(dwm, WM_COPYDATA, 0, (LPARAM)&copy, SMTO_BLOCK, 1000, nullptr)) {
-            logger << "FAILED: SendMessageTimeout: " << util::hresult_to_utf8(HRESULT_FROM_WIN32(GetLastError())) << std::endl;
-            return;
+        hr = res->GetSharedHandle(&handle);
+        if FAILED(hr) {
+            logger << "Failed: GetSharedHandle: " << util::hresult_to_utf8(hr) << std::endl;
+            return false;
         }
 
-        m_isGood = true;
-    }
+        m_targets[m_targetCount]       = res;
+        m_targetHandles[m_targetCount] = handle;
+        ++m_targetCount;
 
-    ~DD4SevenOutputDuplication()
-    {
-        clearCursorInfo();
-
-        if (m_keepAliveMutex) ReleaseMutex(m_keepAliveMutex);
-
-        if (m_imageEvent)     CloseHandle(m_imageEvent);
-        if (m_imageMutex)     CloseHandle(m_imageMutex);
-        if (m_keepAliveMutex) CloseHandle(m_keepAliveMutex);
+        return true;
     }
 
-private:
-
     void clearCursorInfo()
     {
         DeleteObject(m_cursorInfo.hbmColor);
@@ -664,15 +932,21 @@ private:
 
     bool    m_isGood { false };
     RECT    m_monitor { 0, 0, 0, 0 };
+    RECT    m_frameRegion { 0, 0, 0, 0 }; // part of m_monitor in the acquired frame
 
     // Mouse cursor
     HCURSOR  m_lastCursor { nullptr };
     ICONINFO m_cursorInfo { 0, 0, 0, 0, 0 };
 
-    // Desktop Image
-    com::ptr<IDXGIResource> m_desktopImage;
-    HANDLE                  m_sharedHandle { nullptr };
+    // Desktop Images
+    com::ptr<IDXGIResource> m_targets[MAX_CAPTURE_TARGETS];
+    HANDLE                  m_targetHandles[MAX_CAPTURE_TARGETS] { nullptr };
+    UINT                    m_targetCount { 0 };
+    LONG                    m_acquiredTarget { -1 };
+    com::ptr<IUnknown>      m_device; // only set if the targets are ours
+    LONG                    m_modeGeneration { 0 };
     bool    m_desktopImageAcquired = false;
+    LARGE_INTEGER m_acquireTime { };
 
     // Synchronization
     HANDLE  m_imageEvent { nullptr };
@@ -682,24 +956,26 @@ private:
     wchar_t m_imageMutexName[56]; // "dd4seven-mutex-" + 36char GUID
     wchar_t m_keepAliveMutexName[56]; // "dd4seven-kamtx-" + 36char GUID
 
+    // State shared with the DWM
+    HANDLE         m_sharedMapping { nullptr };
+    CaptureShared *m_shared { nullptr };
+    wchar_t        m_sharedStateName[56]; // "dd4seven-share-" + 36char GUID
+
     unsigned long m_timeoutMsecs { 0 };
+    unsigned long m_frameIntervalMsecs { 0 }; // the DWM stays silent this long on purpose
 };
 
-HRESULT
-__stdcall
-DuplicateOutput(IDXGIOutput *output, IUnknown *device, IDXGIOutputDuplication **duplication)
+static HRESULT create_duplication(IDXGIOutput *output, IUnknown *device, UINT targetCount, IUnknown * const *targets,
+                                  const DD4SEVEN_CAPTURE_CONFIG *config, IDXGIOutputDuplication **duplication)
 {
-    if (!output || !device || !duplication)
-        return E_INVALIDARG;
-
-    auto dupl = com::make_object<DD4SevenOutputDuplication>(device, output);
+    auto dupl = com::make_object<DD4SevenOutputDuplication>(output, device, targetCount, targets, config);
     if (dupl->good()) {
         *duplication = dupl.release();
 
         return S_OK;
     } else {
         *duplication = nullptr;
-        
+
         logger << "Failed to create duplication interface :(" << std::endl;
 
         //FIXME: or should we return DXGI_ERROR_UNSUPPORTED ???
@@ -707,6 +983,89 @@ DuplicateOutput(IDXGIOutput *output, IUnknown *device, IDXGIOutputDuplication **
     }
 }
 
+HRESULT
+__stdcall
+DuplicateOutput(IDXGIOutput *output, IUnknown *device, IDXGIOutputDuplication **duplication)
+{
+    if (!output || !device || !duplication)
+        return E_INVALIDARG;
+
+    return create_duplication(output, device, 0, nullptr, nullptr, duplication);
+}
+
+HRESULT
+__stdcall
+DuplicateOutputEx(IDXGIOutput *output, IUnknown *device, UINT targetCount, IUnknown * const *targets,
+                  const DD4SEVEN_CAPTURE_CONFIG *config, IDXGIOutputDuplication **duplication)
+{
+    if (!output || !duplication || targetCount > MAX_CAPTURE_TARGETS)
+        return E_INVALIDARG;
+
+    if (targetCount ? !targets : !device)
+        return E_INVALIDARG;
+
+    DXGI_OUTPUT_DESC desc;
+    HRESULT hr = output->GetDesc(&desc);
+    if FAILED(hr)
+        return hr;
+
+    UINT width  = UINT(desc.DesktopCoordinates.right - desc.DesktopCoordinates.left);
+    UINT height = UINT(desc.DesktopCoordinates.bottom - desc.DesktopCoordinates.top);
+    for (UINT i = 0; i < targetCount; ++i) {
+        hr = check_capture_target(targets[i], width, height);
+        if FAILED(hr)
+            return hr;
+    }
+
+    if (config) {
+        hr = check_config(*config, desc.DesktopCoordinates);
+        if FAILED(hr)
+            return hr;
+    }
+
+    return create_duplication(output, targetCount ? nullptr : device, targetCount, targets, config, duplication);
+}
+
+HRESULT
+__stdcall
+DuplicateOutputInto(IDXGIOutput *output, UINT targetCount, IUnknown * const *targets, IDXGIOutputDuplication **duplication)
+{
+    if (!targets || targetCount < 1)
+        return E_INVALIDARG;
+
+    return DuplicateOutputEx(output, nullptr, targetCount, targets, nullptr, duplication);
+}
+
+HRESULT
+__stdcall
+Reconfigure(IDXGIOutputDuplication *duplication, const DD4SEVEN_CAPTURE_CONFIG *config)
+{
+    if (!duplication || !config)
+        return E_INVALIDARG;
+
+    com::ptr<DD4SevenOutputDuplication> impl;
+    duplication->QueryInterface(IID_DD4SevenOutputDuplication, com::out_arg_void(impl));
+    if (!impl)
+        return E_INVALIDARG;
+
+    return impl->reconfigure(*config);
+}
+
+HRESULT
+__stdcall
+GetDuplicationStatistics(IDXGIOutputDuplication *duplication, DD4SEVEN_DUPLICATION_STATISTICS *statistics)
+{
+    if (!duplication || !statistics)
+        return E_INVALIDARG;
+
+    com::ptr<DD4SevenOutputDuplication> impl;
+    duplication->QueryInterface(IID_DD4SevenOutputDuplication, com::out_arg_void(impl));
+    if (!impl)
+        return E_INVALIDARG;
+
+    return impl->statistics(*statistics);
+}
+
 HINSTANCE g_instance = nullptr;
 
 BOOLEAN WINAPI DllMain(HINSTANCE hDllHandle,
@@ -8,9 +8,36 @@
 
 extern "C" {
 
+/**
+ * Capture parameters that can be changed with Reconfigure
+ */
+#define DD4SEVEN_CAPTURE_PAUSED 0x1 // Don't deliver any frames until unpaused
+
+// When the DWM can't copy for all clients without making the desktop stutter,
+// it lets the more important ones go first. Whoever waited longest wins within a class.
+#define DD4SEVEN_CLASS_DEFAULT     0
+#define DD4SEVEN_CLASS_INTERACTIVE 1 // Someone is watching: remote desktop, streaming
+#define DD4SEVEN_CLASS_BACKGROUND  2 // Late frames hurt nobody: thumbnails, recording
+
+typedef struct DD4SEVEN_CAPTURE_CONFIG
+{
+    RECT Region; // Part of the output to capture, relative to its top-left corner. Leave empty to capture everything.
+    UINT Flags;  // DD4SEVEN_CAPTURE_*
+
+    // Minimum time between two frames in 100ns units, 0 to get every frame the DWM composes.
+    // The DWM skips copying in between, so a low frame rate is cheaper than dropping frames yourself.
+    UINT FrameInterval;
+
+    UINT ClientClass; // DD4SEVEN_CLASS_*
+} DD4SEVEN_CAPTURE_CONFIG;
+
 /**
  * Works like IDXGIOutput1::DuplicateOutput
  *
+ * When the output changes its size or position, AcquireNextFrame returns
+ * DXGI_ERROR_MODE_CHANGE_IN_PROGRESS once. The duplication stays usable: call GetDesc
+ * for the new size, and the following frames come in a new texture of that size.
+ *
  * Might return the following error codes:
  * - E_INVALIDARG: output is NULL, duplication is NULL, device is no D3D10/D3D11 device
  * - DXGI_ERROR_NOT_CURRENTLY_AVAILABLE: If the DWM is not cooperating with us
@@ -20,4 +47,102 @@ HRESULT
 __stdcall
 DuplicateOutput(IDXGIOutput *output, IUnknown *device, IDXGIOutputDuplication **duplication);
 
+/**
+ * Like DuplicateOutput, but the DWM writes straight into the given textures
+ * instead of a texture allocated by us, so there's no need to copy the acquired
+ * image into a texture of your own.
+ *
+ * Every target must be a D3D10 or D3D11 texture of the output size, created with
+ * DXGI_FORMAT_B8G8R8A8_UNORM or DXGI_FORMAT_B8G8R8A8_TYPELESS, default usage,
+ * a single mip level and sample and the RESOURCE_MISC_SHARED flag. Bind flags are up to you.
+ *
+ * With more than one target (up to 8), the targets are used as a ring: AcquireNextFrame
+ * returns the one written last, and the DWM keeps writing the others while you hold it.
+ *
+ * The targets can't follow a display mode change, so AcquireNextFrame returns
+ * DXGI_ERROR_ACCESS_LOST right away when that happens.
+ *
+ * Might return the following error codes:
+ * - E_INVALIDARG: output, targets or duplication is NULL, targetCount is out of range,
+ *                 or a target doesn't fit the above requirements
+ * - DXGI_ERROR_NOT_CURRENTLY_AVAILABLE: If the DWM is not cooperating with us
+ */
+HRESULT
+__stdcall
+DuplicateOutputInto(IDXGIOutput *output, UINT targetCount, IUnknown * const *targets, IDXGIOutputDuplication **duplication);
+
+/**
+ * Combines DuplicateOutput and DuplicateOutputInto, and starts with the given config
+ * instead of capturing everything on every frame. Pass either a device
+ * (with targetCount 0) or the targets; config may be NULL.
+ *
+ * Might return the error codes of DuplicateOutputInto, and E_INVALIDARG if
+ * config isn't accepted by Reconfigure.
+ */
+HRESULT
+__stdcall
+DuplicateOutputEx(IDXGIOutput *output, IUnknown *device, UINT targetCount, IUnknown * const *targets,
+                  const DD4SEVEN_CAPTURE_CONFIG *config, IDXGIOutputDuplication **duplication);
+
+/**
+ * Changes the parameters of a running duplication, the DWM picks them up on its next frame.
+ * The desktop textures stay the same size; a region is written to their top-left corner,
+ * and GetFrameDirtyRects and the pointer position of that frame are relative to it.
+ *
+ * Might return the following error codes:
+ * - E_INVALIDARG: duplication wasn't created by us, config is NULL or
+ *                 the region isn't inside the output
+ * - DXGI_ERROR_WAIT_TIMEOUT: Another thread has been holding a frame for too long
+ * - DXGI_ERROR_ACCESS_LOST: The duplication is dead
+ */
+HRESULT
+__stdcall
+Reconfigure(IDXGIOutputDuplication *duplication, const DD4SEVEN_CAPTURE_CONFIG *config);
+
+/**
+ * Counters of a duplication since it was created, see GetDuplicationStatistics
+ */
+#define DD4SEVEN_GPU_HISTOGRAM_BUCKETS 16
+
+typedef struct DD4SEVEN_DUPLICATION_STATISTICS
+{
+    // Written by the DWM
+    UINT64 FramesPresented;     // Frames the DWM composed for the output
+    UINT64 FramesCopied;        // Frames copied for this duplication
+    UINT64 FramesSkippedLocked; // Frames not copied because the previous one was still acquired
+    UINT64 FramesDeferred;      // Frames not copied because the DWM ran out of time, see CaptureBudget
+    UINT64 KeepAliveChecks;     // Times the DWM checked this duplication is still alive
+    UINT64 CopyTimeUs;          // CPU time the DWM spent copying for this duplication
+    UINT64 ThrottledPresents;   // Frames on which the DWM had to defer copies, for all duplications
+    UINT64 OverBudgetPresents;  // Frames on which copying took longer than the budget, for all duplications
+    UINT   BudgetUs;            // CaptureBudget, 0 if there is none
+    UINT   LastCostUs;          // What copying for all duplications took on a recent frame, CPU and GPU
+    UINT   EstimatedCostUs;     // What a copy for this duplication is expected to take, CPU and GPU
+
+    // Only if the DWORD CaptureGpuTiming in HKLM\SOFTWARE\dd4seven isn't 0, and only for some copies
+    UINT64 GpuCopiesTimed;      // Copies the GPU time was measured for
+    UINT64 GpuCopyTimeUs;       // Their total GPU time
+    UINT64 GpuCopyHistogram[DD4SEVEN_GPU_HISTOGRAM_BUCKETS]; // Bucket 0: below 1us, bucket n: 2^(n-1)us up to 2^n us,
+                                                             // the last one also counts everything longer
+
+    // Written by us
+    UINT64 FramesAcquired;      // Successful AcquireNextFrame calls
+    UINT64 AcquireTimeouts;     // AcquireNextFrame calls that returned DXGI_ERROR_WAIT_TIMEOUT
+    UINT64 HoldTimeUs;          // Total time between AcquireNextFrame and ReleaseFrame
+    UINT64 MaxHoldTimeUs;       // Longest time between AcquireNextFrame and ReleaseFrame
+} DD4SEVEN_DUPLICATION_STATISTICS;
+
+/**
+ * Takes a snapshot of the counters of a duplication. This never waits for
+ * the DWM or other threads, so it's fine to call it as often as you like.
+ *
+ * Might return the following error codes:
+ * - E_INVALIDARG: duplication wasn't created by us or statistics is NULL
+ * - DXGI_ERROR_WAIT_TIMEOUT: The counters kept changing, or the DWM died while updating them
+ * - DXGI_ERROR_ACCESS_LOST: The duplication is dead
+ */
+HRESULT
+__stdcall
+GetDuplicationStatistics(IDXGIOutputDuplication *duplication, DD4SEVEN_DUPLICATION_STATISTICS *statistics);
+
 } // extern "C"
\ No newline at end of file
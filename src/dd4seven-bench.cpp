@@ -0,0 +1,630 @@
+// Copyright (C) 2015 Jonas Kümmerlin <rgcjonas@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+/*
+ * Headless capture benchmark
+ *
+ * Usage: dd4seven-bench.exe [--driver hardware|warp] [--output <n>]... [--seconds <n>]
+ *                           [--timeout <ms>] [--into <n>] [--no-copy]
+ *
+ * Duplicates every output (or only the ones given with --output, numbered across
+ * all adapters) without opening a window, one thread and one D3D11 device per output,
+ * and acquires frames from them as fast as they come. Each frame goes through the
+ * stages a real consumer has: acquire, fetch the metadata, copy the desktop image
+ * into a texture of our own and wait for the GPU to finish that, release.
+ *
+ * Everything is printed as "name value" lines, so runs can be compared across
+ * commits: per output the frame rate, the duration of every stage, how long frames
+ * were held and the CPU time of its thread, then the CPU usage of the whole process
+ * and what GetDuplicationStatistics has to say. With --into, the DWM copies into
+ * <n> textures of ours (DuplicateOutputInto) instead.
+ *
+ * Falls back to IDXGIOutput1::DuplicateOutput if dd4seven-api.dll is missing,
+ * which makes the numbers comparable to those of Windows 8 and later.
+ */
+
+#include <dxgi.h>
+#include <dxgi1_2.h>
+#include <d3d11.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <vector>
+
+#include "com.hpp"
+#include "util.hpp"
+#include "dd4seven-api.hpp"
+
+typedef HRESULT (__stdcall *DuplicateFunc)(IDXGIOutput *, IUnknown *, IDXGIOutputDuplication **);
+typedef HRESULT (__stdcall *DuplicateIntoFunc)(IDXGIOutput *, UINT, IUnknown * const *, IDXGIOutputDuplication **);
+typedef HRESULT (__stdcall *StatisticsFunc)(IDXGIOutputDuplication *, DD4SEVEN_DUPLICATION_STATISTICS *);
+typedef HRESULT (__stdcall *CreateDeviceFunc)(IDXGIAdapter *,
+                                              D3D_DRIVER_TYPE,
+                                              HMODULE,
+                                              UINT,
+                                              const D3D_FEATURE_LEVEL *,
+                                              UINT,
+                                              UINT,
+                                              ID3D11Device **,
+                                              D3D_FEATURE_LEVEL *,
+                                              ID3D11DeviceContext **);
+
+struct Options
+{
+    bool     warp     { false };
+    unsigned seconds  { 10 };
+    UINT     timeout  { 100 };  // for AcquireNextFrame, in milliseconds
+    UINT     into     { 0 };    // 0: DuplicateOutput, otherwise the number of textures for DuplicateOutputInto
+    bool     copy     { true };
+
+    // nullptr if dd4seven-api.dll isn't there
+    DuplicateFunc     duplicate     { nullptr };
+    DuplicateIntoFunc duplicateInto { nullptr };
+    StatisticsFunc    statistics    { nullptr };
+    CreateDeviceFunc  createDevice  { nullptr };
+};
+
+static double ticks_to_microseconds(LONGLONG ticks)
+{
+    static LARGE_INTEGER frequency;
+    static BOOL qpcAvailable = QueryPerformanceFrequency(&frequency);
+
+    return qpcAvailable ? double(ticks) * 1000000.0 / double(frequency.QuadPart) : 0.0;
+}
+
+static LONGLONG now()
+{
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+
+    return counter.QuadPart;
+}
+
+static double filetime_to_milliseconds(const FILETIME &time)
+{
+    return double((uint64_t(time.dwHighDateTime) << 32) | time.dwLowDateTime) / 10000.0;
+}
+
+static double percentile(const std::vector<double> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0.0;
+
+    return sorted[std::min(sorted.size() - 1, size_t(p * double(sorted.size())))];
+}
+
+// Prints <prefix>.<name>_us_{avg,p50,p99,max}
+static void print_samples(const char *prefix, const char *name, std::vector<double> samples)
+{
+    std::sort(samples.begin(), samples.end());
+
+    double sum = 0.0;
+    for (double sample : samples)
+        sum += sample;
+
+    printf("%s.%s_us_avg %.2f\n", prefix, name, samples.empty() ? 0.0 : sum / double(samples.size()));
+    printf("%s.%s_us_p50 %.2f\n", prefix, name, percentile(samples, 0.50));
+    printf("%s.%s_us_p99 %.2f\n", prefix, name, percentile(samples, 0.99));
+    printf("%s.%s_us_max %.2f\n", prefix, name, samples.empty() ? 0.0 : samples.back());
+}
+
+/*********************************
+ * ONE OUTPUT, ONE THREAD
+ *********************************/
+
+struct OutputBench
+{
+    const Options         *options { nullptr };
+    UINT                   index   { 0 };
+    com::ptr<IDXGIAdapter> adapter;
+    com::ptr<IDXGIOutput>  output;
+    DXGI_OUTPUT_DESC       desc;
+
+    HANDLE                 ready  { nullptr };   // set once the duplication exists (or couldn't be created)
+    HANDLE                 start  { nullptr };   // shared, set by the main thread
+    volatile LONG         *stop   { nullptr };   // shared, set by the main thread
+    HANDLE                 thread { nullptr };
+
+    com::ptr<ID3D11Device>           device;
+    com::ptr<ID3D11DeviceContext>    context;
+    com::ptr<IDXGIOutputDuplication> duplication;
+    std::vector<com::ptr<ID3D11Texture2D>> targets;  // for DuplicateOutputInto
+    com::ptr<ID3D11Texture2D>        copy;           // what the desktop gets copied into
+    com::ptr<ID3D11Query>            copyDone;
+
+    // Results, only touched by the thread until it exits
+    bool     good        { false };
+    uint64_t frames      { 0 };
+    uint64_t accumulated { 0 };   // frames the DWM presented that we didn't get on their own
+    uint64_t timeouts    { 0 };
+    uint64_t modeChanges { 0 };
+    uint64_t accessLost  { 0 };
+    double   seconds     { 0.0 };
+    double   cpuMs       { 0.0 };
+
+    std::vector<double> acquire;   // AcquireNextFrame, including the wait for the frame
+    std::vector<double> metadata;  // move and dirty rects, pointer shape
+    std::vector<double> copying;   // CopyResource until the GPU is done with it
+    std::vector<double> release;   // ReleaseFrame
+    std::vector<double> hold;      // AcquireNextFrame returning until ReleaseFrame
+    std::vector<double> interval;  // between two acquired frames
+
+    DD4SEVEN_DUPLICATION_STATISTICS stats;
+    bool     haveStats   { false };
+
+    bool createDevice()
+    {
+        // WARP can't see the adapter's outputs anyway, so it doesn't get one
+        HRESULT hr = options->createDevice(options->warp ? nullptr : adapter.get(),
+                                           options->warp ? D3D_DRIVER_TYPE_WARP : D3D_DRIVER_TYPE_UNKNOWN,
+                                           nullptr, D3D11_CREATE_DEVICE_BGRA_SUPPORT,
+                                           nullptr, 0, D3D11_SDK_VERSION,
+                                           com::out_arg(device), nullptr, com::out_arg(context));
+        if FAILED(hr) {
+            fprintf(stderr, "output%u: Couldn't create a %s device: %s\n", index,
+                    options->warp ? "WARP" : "hardware", util::hresult_to_utf8(hr).c_str());
+            return false;
+        }
+
+        D3D11_QUERY_DESC queryDesc = { D3D11_QUERY_EVENT, 0 };
+        hr = device->CreateQuery(&queryDesc, com::out_arg(copyDone));
+        if FAILED(hr) {
+            fprintf(stderr, "output%u: Couldn't create a query: %s\n", index, util::hresult_to_utf8(hr).c_str());
+            return false;
+        }
+
+        return true;
+    }
+
+    bool createTargets()
+    {
+        D3D11_TEXTURE2D_DESC texDesc;
+        memset(&texDesc, 0, sizeof(texDesc));
+        texDesc.Width            = UINT(desc.DesktopCoordinates.right - desc.DesktopCoordinates.left);
+        texDesc.Height           = UINT(desc.DesktopCoordinates.bottom - desc.DesktopCoordinates.top);
+        texDesc.MipLevels        = 1;
+        texDesc.ArraySize        = 1;
+        texDesc.Format           = DXGI_FORMAT_B8G8R8A8_UNORM;
+        texDesc.SampleDesc.Count = 1;
+        texDesc.Usage            = D3D11_USAGE_DEFAULT;
+        texDesc.BindFlags        = D3D11_BIND_RENDER_TARGET | D3D11_BIND_SHADER_RESOURCE;
+        texDesc.MiscFlags        = D3D11_RESOURCE_MISC_SHARED;
+
+        targets.clear();
+        targets.resize(options->into);
+
+        for (UINT t = 0; t < options->into; ++t) {
+            HRESULT hr = device->CreateTexture2D(&texDesc, nullptr, com::out_arg(targets[t]));
+            if FAILED(hr) {
+                fprintf(stderr, "output%u: Couldn't create a shared texture: %s\n", index, util::hresult_to_utf8(hr).c_str());
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    bool duplicate()
+    {
+        HRESULT hr;
+
+        duplication.reset();
+
+        if (options->into) {
+            if (!options->duplicateInto) {
+                fprintf(stderr, "output%u: --into needs dd4seven-api.dll\n", index);
+                return false;
+            }
+
+            if (targets.empty() && !createTargets())
+                return false;
+
+            std::vector<IUnknown*> raw;
+            for (auto &target : targets)
+                raw.push_back(target.get());
+
+            hr = options->duplicateInto(output.get(), UINT(raw.size()), raw.data(), com::out_arg(duplication));
+        } else if (options->duplicate) {
+            hr = options->duplicate(output.get(), device.get(), com::out_arg(duplication));
+        } else {
+            com::ptr<IDXGIOutput1> output1 = output.query<IDXGIOutput1>();
+            if (!output1) {
+                fprintf(stderr, "output%u: Neither dd4seven-api.dll nor IDXGIOutput1 available\n", index);
+                return false;
+            }
+
+            hr = output1->DuplicateOutput(device.get(), com::out_arg(duplication));
+        }
+
+        if FAILED(hr) {
+            fprintf(stderr, "output%u: Couldn't duplicate: %s\n", index, util::hresult_to_utf8(hr).c_str());
+            return false;
+        }
+
+        return true;
+    }
+
+    // Copies the desktop image like an encoder would and waits until the GPU is done with it
+    void consume(com::ptr<IDXGIResource> &resource)
+    {
+        com::ptr<ID3D11Texture2D> texture = resource.query<ID3D11Texture2D>();
+        if (!texture)
+            return;
+
+        D3D11_TEXTURE2D_DESC texDesc;
+        texture->GetDesc(&texDesc);
+
+        if (copy) {
+            D3D11_TEXTURE2D_DESC copyDesc;
+            copy->GetDesc(&copyDesc);
+
+            if (copyDesc.Width != texDesc.Width || copyDesc.Height != texDesc.Height || copyDesc.Format != texDesc.Format)
+                copy.reset();
+        }
+
+        if (!copy) {
+            texDesc.Usage          = D3D11_USAGE_DEFAULT;
+            texDesc.BindFlags      = D3D11_BIND_SHADER_RESOURCE;
+            texDesc.CPUAccessFlags = 0;
+            texDesc.MiscFlags      = 0;
+
+            if FAILED(device->CreateTexture2D(&texDesc, nullptr, com::out_arg(copy)))
+                return;
+        }
+
+        context->CopyResource(copy.get(), texture.get());
+        context->End(copyDone.get());
+
+        while (context->GetData(copyDone.get(), nullptr, 0, 0) == S_FALSE)
+            YieldProcessor();
+    }
+
+    void fetchMetadata(const DXGI_OUTDUPL_FRAME_INFO &info, std::vector<BYTE> &buffer)
+    {
+        UINT required = 0;
+
+        if (info.TotalMetadataBufferSize) {
+            buffer.resize(std::max<size_t>(buffer.size(), info.TotalMetadataBufferSize));
+
+            duplication->GetFrameMoveRects(UINT(buffer.size()), (DXGI_OUTDUPL_MOVE_RECT*)buffer.data(), &required);
+            duplication->GetFrameDirtyRects(UINT(buffer.size()), (RECT*)buffer.data(), &required);
+        }
+
+        if (info.PointerShapeBufferSize) {
+            buffer.resize(std::max<size_t>(buffer.size(), info.PointerShapeBufferSize));
+
+            DXGI_OUTDUPL_POINTER_SHAPE_INFO shapeInfo;
+            duplication->GetFramePointerShape(UINT(buffer.size()), buffer.data(), &required, &shapeInfo);
+        }
+    }
+
+    void run()
+    {
+        std::vector<BYTE> buffer;
+        LONGLONG lastFrame = 0;
+
+        WaitForSingleObject(start, INFINITE);
+
+        const LONGLONG begin = now();
+
+        while (!InterlockedCompareExchange(stop, 0, 0)) {
+            DXGI_OUTDUPL_FRAME_INFO  info;
+            com::ptr<IDXGIResource> resource;
+
+            LONGLONG t0 = now();
+            HRESULT hr = duplication->AcquireNextFrame(options->timeout, &info, com::out_arg(resource));
+            LONGLONG t1 = now();
+
+            if (hr == DXGI_ERROR_WAIT_TIMEOUT) {
+                timeouts++;
+                continue;
+            }
+
+            if (hr == DXGI_ERROR_MODE_CHANGE_IN_PROGRESS) {
+                modeChanges++;
+                continue;
+            }
+
+            if (hr == DXGI_ERROR_ACCESS_LOST) {
+                // Happens on a mode change with DuplicateOutputInto or on Windows 8, start over
+                accessLost++;
+                targets.clear();
+                if (!duplicate())
+                    break;
+
+                continue;
+            }
+
+            if FAILED(hr) {
+                fprintf(stderr, "output%u: AcquireNextFrame failed: %s\n", index, util::hresult_to_utf8(hr).c_str());
+                break;
+            }
+
+            fetchMetadata(info, buffer);
+            LONGLONG t2 = now();
+
+            if (options->copy)
+                consume(resource);
+            LONGLONG t3 = now();
+
+            resource.reset();
+            duplication->ReleaseFrame();
+            LONGLONG t4 = now();
+
+            frames++;
+            if (info.AccumulatedFrames > 1)
+                accumulated += info.AccumulatedFrames - 1;
+
+            acquire.push_back(ticks_to_microseconds(t1 - t0));
+            metadata.push_back(ticks_to_microseconds(t2 - t1));
+            copying.push_back(ticks_to_microseconds(t3 - t2));
+            release.push_back(ticks_to_microseconds(t4 - t3));
+            hold.push_back(ticks_to_microseconds(t3 - t1));
+            if (lastFrame)
+                interval.push_back(ticks_to_microseconds(t1 - lastFrame));
+
+            lastFrame = t1;
+        }
+
+        seconds = ticks_to_microseconds(now() - begin) / 1000000.0;
+
+        FILETIME creation, exited, kernel, user;
+        if (GetThreadTimes(GetCurrentThread(), &creation, &exited, &kernel, &user))
+            cpuMs = filetime_to_milliseconds(kernel) + filetime_to_milliseconds(user);
+
+        if (options->statistics && duplication)
+            haveStats = SUCCEEDED(options->statistics(duplication.get(), &stats));
+    }
+
+    static DWORD WINAPI thread_main(void *param)
+    {
+        OutputBench *self = static_cast<OutputBench*>(param);
+
+        self->good = self->createDevice() && self->duplicate();
+        SetEvent(self->ready);
+
+        if (self->good)
+            self->run();
+
+        // The device belongs to this thread, don't let it outlive it
+        self->duplication.reset();
+        self->targets.clear();
+        self->copy.reset();
+        self->copyDone.reset();
+        self->context.reset();
+        self->device.reset();
+
+        return 0;
+    }
+
+    void print()
+    {
+        char prefix[32];
+        snprintf(prefix, sizeof(prefix), "output%u", index);
+
+        printf("%s.width %ld\n", prefix, long(desc.DesktopCoordinates.right - desc.DesktopCoordinates.left));
+        printf("%s.height %ld\n", prefix, long(desc.DesktopCoordinates.bottom - desc.DesktopCoordinates.top));
+        printf("%s.frames %llu\n", prefix, (unsigned long long)frames);
+        printf("%s.frames_accumulated %llu\n", prefix, (unsigned long long)accumulated);
+        printf("%s.timeouts %llu\n", prefix, (unsigned long long)timeouts);
+        printf("%s.mode_changes %llu\n", prefix, (unsigned long long)modeChanges);
+        printf("%s.access_lost %llu\n", prefix, (unsigned long long)accessLost);
+        printf("%s.fps %.2f\n", prefix, seconds > 0 ? double(frames) / seconds : 0.0);
+        printf("%s.cpu_percent %.2f\n", prefix, seconds > 0 ? cpuMs / (seconds * 10.0) : 0.0);
+
+        print_samples(prefix, "acquire", acquire);
+        print_samples(prefix, "metadata", metadata);
+        print_samples(prefix, "copy", copying);
+        print_samples(prefix, "release", release);
+        print_samples(prefix, "hold", hold);
+        print_samples(prefix, "interval", interval);
+
+        if (haveStats) {
+            printf("%s.dwm.presents %llu\n", prefix, (unsigned long long)stats.FramesPresented);
+            printf("%s.dwm.copies %llu\n", prefix, (unsigned long long)stats.FramesCopied);
+            printf("%s.dwm.skipped_locked %llu\n", prefix, (unsigned long long)stats.FramesSkippedLocked);
+            printf("%s.dwm.deferred %llu\n", prefix, (unsigned long long)stats.FramesDeferred);
+            printf("%s.dwm.copy_us_avg %.2f\n", prefix, stats.FramesCopied ? double(stats.CopyTimeUs) / double(stats.FramesCopied) : 0.0);
+            printf("%s.dwm.last_cost_us %u\n", prefix, stats.LastCostUs);
+        }
+    }
+};
+
+/*********************************
+ * MAIN
+ *********************************/
+
+// All outputs of all adapters, in the order --output counts them
+static bool enumerate_outputs(std::vector<OutputBench> &outputs)
+{
+    util::dll_func<HRESULT (REFIID, void **)> createFactory { L"dxgi.dll", "CreateDXGIFactory1" };
+
+    com::ptr<IDXGIFactory1> factory;
+    if (!createFactory || FAILED(createFactory(__uuidof(IDXGIFactory1), com::out_arg_void(factory)))) {
+        fprintf(stderr, "Couldn't create a DXGI factory\n");
+        return false;
+    }
+
+    com::ptr<IDXGIAdapter1> adapter;
+    for (UINT a = 0; SUCCEEDED(factory->EnumAdapters1(a, com::out_arg(adapter))); ++a) {
+        com::ptr<IDXGIOutput> output;
+        for (UINT o = 0; SUCCEEDED(adapter->EnumOutputs(o, com::out_arg(output))); ++o) {
+            outputs.push_back(OutputBench());
+
+            OutputBench &bench = outputs.back();
+            bench.index   = UINT(outputs.size() - 1);
+            bench.adapter = adapter;
+            bench.output  = output;
+            output->GetDesc(&bench.desc);
+        }
+    }
+
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    Options options;
+    std::vector<UINT> selected;
+
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--driver") && i + 1 < argc && !strcmp(argv[i + 1], "hardware")) {
+            options.warp = false;
+            ++i;
+        } else if (!strcmp(argv[i], "--driver") && i + 1 < argc && !strcmp(argv[i + 1], "warp")) {
+            options.warp = true;
+            ++i;
+        } else if (!strcmp(argv[i], "--output") && i + 1 < argc) {
+            selected.push_back(UINT(strtoul(argv[++i], nullptr, 10)));
+        } else if (!strcmp(argv[i], "--seconds") && i + 1 < argc) {
+            options.seconds = unsigned(strtoul(argv[++i], nullptr, 10));
+        } else if (!strcmp(argv[i], "--timeout") && i + 1 < argc) {
+            options.timeout = UINT(strtoul(argv[++i], nullptr, 10));
+        } else if (!strcmp(argv[i], "--into") && i + 1 < argc) {
+            options.into = UINT(strtoul(argv[++i], nullptr, 10));
+        } else if (!strcmp(argv[i], "--no-copy")) {
+            options.copy = false;
+        } else {
+            fprintf(stderr, "Usage: %s [--driver hardware|warp] [--output <n>]... [--seconds <n>] [--timeout <ms>] [--into <n>] [--no-copy]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    util::dll_func<HRESULT (IDXGIOutput *, IUnknown *, IDXGIOutputDuplication **)> duplicate { L"dd4seven-api.dll", "DuplicateOutput" };
+    util::dll_func<HRESULT (IDXGIOutput *, UINT, IUnknown * const *, IDXGIOutputDuplication **)> duplicateInto { L"dd4seven-api.dll", "DuplicateOutputInto" };
+    util::dll_func<HRESULT (IDXGIOutputDuplication *, DD4SEVEN_DUPLICATION_STATISTICS *)> statistics { L"dd4seven-api.dll", "GetDuplicationStatistics" };
+    util::dll_func<HRESULT (IDXGIAdapter *,
+                            D3D_DRIVER_TYPE,
+                            HMODULE,
+                            UINT,
+                            const D3D_FEATURE_LEVEL *,
+                            UINT,
+                            UINT,
+                            ID3D11Device **,
+                            D3D_FEATURE_LEVEL *,
+                            ID3D11DeviceContext **)> createDevice { L"d3d11.dll", "D3D11CreateDevice" };
+
+    if (!createDevice) {
+        fprintf(stderr, "Couldn't load d3d11.dll\n");
+        return 1;
+    }
+
+    options.createDevice  = createDevice.raw_func_ptr();
+    options.duplicate     = duplicate ? duplicate.raw_func_ptr() : nullptr;
+    options.duplicateInto = duplicateInto ? duplicateInto.raw_func_ptr() : nullptr;
+    options.statistics    = statistics ? statistics.raw_func_ptr() : nullptr;
+
+    std::vector<OutputBench> all;
+    if (!enumerate_outputs(all))
+        return 1;
+
+    std::vector<OutputBench> outputs;
+    if (selected.empty()) {
+        outputs.swap(all);
+    } else {
+        for (UINT index : selected) {
+            if (index >= all.size()) {
+                fprintf(stderr, "There is no output %u\n", index);
+                return 1;
+            }
+
+            outputs.push_back(all[index]);
+        }
+    }
+
+    if (outputs.empty()) {
+        fprintf(stderr, "No outputs to duplicate\n");
+        return 1;
+    }
+
+    volatile LONG stop = 0;
+    HANDLE start = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+
+    // outputs doesn't change size from here on, so the threads can keep pointers into it
+    for (auto &bench : outputs) {
+        bench.options = &options;
+        bench.start   = start;
+        bench.stop    = &stop;
+        bench.ready   = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+        bench.thread  = CreateThread(nullptr, 0, &OutputBench::thread_main, &bench, 0, nullptr);
+
+        if (!bench.thread) {
+            fprintf(stderr, "Couldn't start a thread (error %lu)\n", (unsigned long)GetLastError());
+            return 1;
+        }
+    }
+
+    bool good = true;
+    for (auto &bench : outputs) {
+        WaitForSingleObject(bench.ready, INFINITE);
+        good = good && bench.good;
+    }
+
+    if (!good)
+        InterlockedExchange(&stop, 1);
+
+    FILETIME creation, exited, kernel0, user0, kernel1, user1;
+    GetProcessTimes(GetCurrentProcess(), &creation, &exited, &kernel0, &user0);
+    const LONGLONG begin = now();
+
+    SetEvent(start);
+    if (good)
+        Sleep(options.seconds * 1000);
+    InterlockedExchange(&stop, 1);
+
+    for (auto &bench : outputs) {
+        WaitForSingleObject(bench.thread, INFINITE);
+        CloseHandle(bench.thread);
+        CloseHandle(bench.ready);
+    }
+
+    const double elapsed = ticks_to_microseconds(now() - begin) / 1000000.0;
+    GetProcessTimes(GetCurrentProcess(), &creation, &exited, &kernel1, &user1);
+    CloseHandle(start);
+
+    if (!good)
+        return 1;
+
+    const double kernelMs = filetime_to_milliseconds(kernel1) - filetime_to_milliseconds(kernel0);
+    const double userMs   = filetime_to_milliseconds(user1) - filetime_to_milliseconds(user0);
+
+    uint64_t frames = 0;
+    for (auto &bench : outputs)
+        frames += bench.frames;
+
+    printf("bench.driver %s\n", options.warp ? "warp" : "hardware");
+    printf("bench.api %s\n", options.duplicate ? (options.into ? "dd4seven-into" : "dd4seven") : "dxgi");
+    printf("bench.outputs %u\n", unsigned(outputs.size()));
+    printf("bench.seconds %.3f\n", elapsed);
+    printf("bench.frames %llu\n", (unsigned long long)frames);
+    printf("bench.fps %.2f\n", elapsed > 0 ? double(frames) / elapsed : 0.0);
+    printf("cpu.user_ms %.1f\n", userMs);
+    printf("cpu.kernel_ms %.1f\n", kernelMs);
+    printf("cpu.percent %.2f\n", elapsed > 0 ? (userMs + kernelMs) / (elapsed * 10.0) : 0.0);
+
+    for (auto &bench : outputs)
+        bench.print();
+
+    fflush(stdout);
+
+    return 0;
+}
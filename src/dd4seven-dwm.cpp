@@ -25,6 +25,13 @@
 #include "com.hpp"
 #include "util.hpp"
 #include "logger.hpp"
+#include "protocol.hpp"
+#include "core/pacing.hpp"
+#include "core/scheduler.hpp"
+#include "recording.hpp"
+#include "trace.hpp"
+#include "vtable.hpp"
+#include "imports.hpp"
 
 #include <d3d10_1.h>
 #include <dxgi.h>
@@ -32,7 +39,10 @@
 #include <MinHook.h>
 
 #include <list>
+#include <vector>
 #include <algorithm>
+#include <cstring>
+#include <cwchar>
 
 std::ostream& operator<<(std::ostream& os, const RECT& r)
 {
@@ -41,20 +51,6 @@ std::ostream& operator<<(std::ostream& os, const RECT& r)
     return os;
 }
 
-bool operator==(const RECT &r1, const RECT &r2)
-{
-    return r1.left   == r2.left
-        && r1.top    == r2.top
-        && r1.right  == r2.right
-        && r1.bottom == r2.bottom;
-}
-bool operator!=(const RECT &r1, const RECT &r2)
-{
-    return r1.left   != r2.left
-        || r1.top    != r2.top
-        || r1.right  != r2.right
-        || r1.bottom != r2.bottom;
-}
 
 
 HINSTANCE g_instance;
@@ -63,43 +59,82 @@ HINSTANCE g_instance;
  * ACTUAL FUNCTIONALITY
  *********************************/
 
-//KEEP THIS IN SYNC WITH dd4seven-api.cpp
-#pragma pack(push,1)
-struct CaptureRequest
-{
-    RECT     monitor;
-    wchar_t  imageMutex[56];
-    wchar_t  imageEvent[56];
-    wchar_t  keepAliveMutex[56];
-    uint32_t captureTarget; //D3D pseudo-handle
-};
-#pragma pack(pop)
-
 struct Capture
 {
     IDXGISwapChainDWM *capturedChain { nullptr };
-    com::ptr<ID3D10Texture2D> captureTarget;
+    com::ptr<ID3D10Texture2D> captureTargets[MAX_CAPTURE_TARGETS];
+    HANDLE captureTargetHandles[MAX_CAPTURE_TARGETS] { nullptr }; //D3D pseudo-handles
+    UINT   captureTargetCount { 0 };
     HANDLE imageMutex { nullptr };
     HANDLE imageEvent { nullptr };
     HANDLE keepAliveMutex { nullptr };
-    HANDLE captureTargetHandle { nullptr }; //D3D pseudo-handle
+    HANDLE sharedMapping { nullptr };
+    CaptureShared *shared { nullptr };
     RECT   monitor { 0, 0, 0, 0 };
+    wchar_t outputName[32] { 0 };
+    uint32_t id { 0 }; // unique within the DWM, for things that can't hold on to the Capture
+    com::ptr<ID3D10Device> device; // the one captureTargets were opened on
+    CaptureRequest request;        // as the client sent it, for handing the capture over
+
+    // Set when the bound swap chain might have changed its size,
+    // the output is looked at again on the next Present.
+    bool   outputChanged { false };
+
+    // After telling the client about a mode change, nothing is copied until
+    // it bumps CaptureShared::targetsGeneration past this one.
+    bool   waitingForTargets { false };
+    LONG   targetsGeneration { 0 };
+
+    // The currently applied configuration
+    LONG          configGeneration { 0 };
+    CaptureConfig config { { 0, 0, 0, 0 }, 0, 0 };
+
+    // Frame pacing, in QueryPerformanceCounter ticks
+    core::Pacing pacing { 0, 0, 0, 0 };
+
+    // Scheduling, in QueryPerformanceCounter ticks as well
+    LONGLONG lastCopy { 0 };
+    LONGLONG costTicks { 0 }; // moving average of what a copy costs, CPU and GPU
+
+    // Multisampled back buffers can only be resolved as a whole,
+    // so we need somewhere to put them when only copying a region
+    com::ptr<ID3D10Texture2D> resolveScratch;
 
     Capture() = default;
     Capture(const Capture &other) = delete;
     Capture(Capture &&other)
     {
         std::swap(capturedChain, other.capturedChain);
-        std::swap(captureTarget, other.captureTarget);
+        std::swap(captureTargets, other.captureTargets);
+        std::swap(captureTargetHandles, other.captureTargetHandles);
+        std::swap(captureTargetCount, other.captureTargetCount);
         std::swap(imageMutex, other.imageMutex);
         std::swap(imageEvent, other.imageEvent);
         std::swap(keepAliveMutex, other.keepAliveMutex);
-        std::swap(captureTargetHandle, other.captureTargetHandle);
+        std::swap(sharedMapping, other.sharedMapping);
+        std::swap(shared, other.shared);
         std::swap(monitor, other.monitor);
+        std::swap(outputName, other.outputName);
+        std::swap(id, other.id);
+        std::swap(device, other.device);
+        std::swap(request, other.request);
+        std::swap(outputChanged, other.outputChanged);
+        std::swap(waitingForTargets, other.waitingForTargets);
+        std::swap(targetsGeneration, other.targetsGeneration);
+        std::swap(configGeneration, other.configGeneration);
+        std::swap(config, other.config);
+        std::swap(pacing, other.pacing);
+        std::swap(lastCopy, other.lastCopy);
+        std::swap(costTicks, other.costTicks);
+        std::swap(resolveScratch, other.resolveScratch);
     }
 
     ~Capture()
     {
+        if (shared)
+            UnmapViewOfFile(shared);
+        if (sharedMapping)
+            CloseHandle(sharedMapping);
         if (imageMutex)
             CloseHandle(imageMutex);
         if (imageEvent)
@@ -119,11 +154,118 @@ struct Capture
 
 std::list<Capture> g_capturing;
 
+// Swap chains created through OurCreateSwapChain, until they are destroyed.
+// Present and ResizeBuffers are hooked in their vtable, which isn't
+// necessarily theirs alone.
+vtable::object_filter<DD4SEVEN_HANDOVER_SWAP_CHAINS> g_swapChains;
+
+LONGLONG QpcFrequency()
+{
+    static LONGLONG frequency = 0;
+    if (!frequency) {
+        LARGE_INTEGER f;
+        QueryPerformanceFrequency(&f);
+        frequency = f.QuadPart;
+    }
+
+    return frequency;
+}
+
+// Swap chains are told apart by (the low bits of) their address in recordings
+uint32_t ChainId(IDXGISwapChainDWM *swap)
+{
+    return uint32_t(uintptr_t(swap));
+}
+
+void RecordConfig(const Capture &cap)
+{
+    recording::write(recording::RECORD_CONFIG, cap.id, cap.config.flags, cap.config.frameInterval, cap.config.clientClass);
+}
+
+// Makes cap.config usable after it was taken over from the client
+void SanitizeConfig(Capture &cap)
+{
+    // Don't trust the client too much, the region has to be inside the output
+    core::Rect output = core::at_origin(cap.monitor);
+    if (!core::intersect(cap.config.region, cap.config.region, output) || cap.config.region == output)
+        cap.config.region = core::Rect();
+
+    core::set_interval(cap.pacing, core::interval_to_ticks(cap.config.frameInterval, QpcFrequency()));
+}
+
+// Opens what the client named in <req> and takes over the rest
+bool OpenCapture(CaptureRequest &req, Capture &cap)
+{
+    // Sanitize sero-terminated strings
+    req.imageEvent[55] = 0;
+    req.imageMutex[55] = 0;
+    req.keepAliveMutex[55] = 0;
+    req.sharedState[55] = 0;
+    req.outputName[31] = 0;
+
+    if (req.captureTargetCount < 1 || req.captureTargetCount > MAX_CAPTURE_TARGETS) {
+        logger << "Illegal capture target count " << req.captureTargetCount << std::endl;
+        return false;
+    }
+
+    // Open the synchronization primitives
+    cap.imageMutex = CreateMutex(nullptr, FALSE, req.imageMutex);
+    if (!cap.imageMutex) {
+        logger << "Couldn't create image mutex " << util::wcsdup_to_utf8(req.imageMutex) << std::endl;
+        return false;
+    }
+
+    cap.keepAliveMutex = CreateMutex(nullptr, FALSE, req.keepAliveMutex);
+    if (!cap.keepAliveMutex) {
+        logger << "Couldn't create keep-alive mutex " << util::wcsdup_to_utf8(req.keepAliveMutex) << std::endl;
+        return false;
+    }
+
+    cap.imageEvent = CreateEvent(nullptr, FALSE, FALSE, req.imageEvent);
+    if (!cap.imageEvent) {
+        logger << "Couldn't create image event " << util::wcsdup_to_utf8(req.imageEvent) << std::endl;
+        return false;
+    }
+
+    cap.sharedMapping = OpenFileMapping(FILE_MAP_READ|FILE_MAP_WRITE, FALSE, req.sharedState);
+    if (!cap.sharedMapping) {
+        logger << "Couldn't open shared state " << util::wcsdup_to_utf8(req.sharedState) << std::endl;
+        return false;
+    }
+
+    cap.shared = (CaptureShared*)MapViewOfFile(cap.sharedMapping, FILE_MAP_READ|FILE_MAP_WRITE, 0, 0, sizeof(CaptureShared));
+    if (!cap.shared) {
+        logger << "Couldn't map shared state " << util::wcsdup_to_utf8(req.sharedState) << std::endl;
+        return false;
+    }
+
+    // Copy the monitor and texture handles
+    cap.monitor = req.monitor;
+    std::wcsncpy(cap.outputName, req.outputName, 32);
+    cap.captureTargetCount = req.captureTargetCount;
+    for (UINT i = 0; i < cap.captureTargetCount; ++i)
+        cap.captureTargetHandles[i] = (HANDLE)ULongToPtr(req.captureTargets[i]);
+
+    cap.config = req.config;
+    SanitizeConfig(cap);
+
+    cap.request = req;
+
+    return true;
+}
+
+uint32_t g_nextCaptureId = 1;
+
+BOOL UpgradeTo(HWND window, const COPYDATASTRUCT *copy);
+
 LRESULT __stdcall CommunicationWindowProc(HWND hwnd, UINT msg, WPARAM wp, LPARAM lp)
 {
     if (msg == WM_COPYDATA) {
         COPYDATASTRUCT *copy = (COPYDATASTRUCT*)lp;
 
+        if (copy->dwData == DD4SEVEN_COPYDATA_UPGRADE)
+            return UpgradeTo(hwnd, copy);
+
         if (copy->cbData != sizeof(CaptureRequest)) {
             logger << "Illegal data: expected size " << sizeof(CaptureRequest) << " got " << copy->cbData << std::endl;
             return FALSE;
@@ -134,35 +276,15 @@ LRESULT __stdcall CommunicationWindowProc(HWND hwnd, UINT msg, WPARAM wp, LPARAM
         Capture cap;
         std::memcpy(&req, copy->lpData, sizeof(CaptureRequest));
 
-        // Sanitize sero-terminated strings
-        req.imageEvent[55] = 0;
-        req.imageMutex[55] = 0;
-        req.keepAliveMutex[55] = 0;
-
-        // Open the synchronization primitives
-        cap.imageMutex = CreateMutex(nullptr, FALSE, req.imageMutex);
-        if (!cap.imageMutex) {
-            logger << "Couldn't create image mutex " << util::wcsdup_to_utf8(req.imageMutex) << std::endl;
-            return FALSE;
-        }
-
-        cap.keepAliveMutex = CreateMutex(nullptr, FALSE, req.keepAliveMutex);
-        if (!cap.keepAliveMutex) {
-            logger << "Couldn't create keep-alive mutex " << util::wcsdup_to_utf8(req.keepAliveMutex) << std::endl;
-            return FALSE;
-        }
-
-        cap.imageEvent = CreateEvent(nullptr, FALSE, FALSE, req.imageEvent);
-        if (!cap.imageEvent) {
-            logger << "Couldn't create image event " << util::wcsdup_to_utf8(req.imageEvent) << std::endl;
+        if (!OpenCapture(req, cap))
             return FALSE;
-        }
 
-        // Copy the monitor and texture handle
-        cap.monitor = req.monitor;
-        cap.captureTargetHandle = (HANDLE)ULongToPtr(req.captureTarget);
+        cap.id = g_nextCaptureId++;
 
-        logger << "Registering capture on " << cap.monitor << std::endl;
+        logger << "Registering capture on " << cap.monitor << " with interval " << cap.config.frameInterval << std::endl;
+        trace::write(trace::EVENT_CAPTURE_REGISTERED, cap.id, uint32_t(cap.monitor.right - cap.monitor.left), uint32_t(cap.monitor.bottom - cap.monitor.top));
+        recording::write(recording::RECORD_CAPTURE_REGISTERED, cap.id, uint32_t(cap.monitor.right - cap.monitor.left), uint32_t(cap.monitor.bottom - cap.monitor.top), cap.captureTargetCount);
+        RecordConfig(cap);
 
         // Save the new capture
         g_capturing.push_back(std::move(cap));
@@ -181,7 +303,7 @@ HWND InitializeWindow()
     wcex.cbSize        = sizeof(wcex);
     wcex.lpfnWndProc   = CommunicationWindowProc;
     wcex.hInstance     = g_instance;
-    wcex.lpszClassName = L"dd4seven-window-4B3A8226-9F55-4E9E-A276-9DE174B36166";
+    wcex.lpszClassName = DD4SEVEN_WINDOW_NAME;
 
     if (!RegisterClassEx(&wcex)) {
         logger << "Failed: RegisterClassEx: " << GetLastError() << std::endl;
@@ -189,7 +311,7 @@ HWND InitializeWindow()
     }
 
     HWND ourwin = CreateWindow(wcex.lpszClassName,
-                               L"dd4seven-window-4B3A8226-9F55-4E9E-A276-9DE174B36166",
+                               DD4SEVEN_WINDOW_NAME,
                                0,
                                0, 0, 0, 0,
                                HWND_MESSAGE,
@@ -206,8 +328,8 @@ HWND InitializeWindow()
     return ourwin;
 }
 
-// Copies the back buffer into the given target
-void CopyBackBuffer(IDXGISwapChainDWM *swap, ID3D10Resource *target)
+// Copies the back buffer (or the configured region of it) into the given target
+void CopyBackBuffer(IDXGISwapChainDWM *swap, Capture &cap, ID3D10Resource *target)
 {
     HRESULT hr;
     com::ptr<ID3D10Device>   device;
@@ -233,11 +355,95 @@ void CopyBackBuffer(IDXGISwapChainDWM *swap, ID3D10Resource *target)
         return;
     }
 
-    if (swpdsc.SampleDesc.Count > 1) {
+    const core::Rect &region = cap.config.region;
+    bool wholeBuffer = core::is_empty(region);
+
+    if (wholeBuffer && swpdsc.SampleDesc.Count > 1) {
+        // Capture targets are either B8G8R8A8_UNORM or B8G8R8A8_TYPELESS, both resolve fine as UNORM
         ID3D10Device_ResolveSubresource(device, target, 0, backBuffer, 0, DXGI_FORMAT_B8G8R8A8_UNORM);
-    } else {
+    } else if (wholeBuffer) {
         ID3D10Device_CopyResource(device, target, backBuffer);
+    } else {
+        ID3D10Resource *source = backBuffer;
+
+        if (swpdsc.SampleDesc.Count > 1) {
+            // (Re-)create the scratch texture only if it doesn't fit anymore
+            D3D10_TEXTURE2D_DESC scratchdsc;
+            if (cap.resolveScratch)
+                ID3D10Texture2D_GetDesc(cap.resolveScratch, &scratchdsc);
+
+            if (!cap.resolveScratch
+                || scratchdsc.Width != swpdsc.BufferDesc.Width
+                || scratchdsc.Height != swpdsc.BufferDesc.Height)
+            {
+                D3D10_TEXTURE2D_DESC texdsc = {
+                    .Width = swpdsc.BufferDesc.Width,
+                    .Height = swpdsc.BufferDesc.Height,
+                    .MipLevels = 1,
+                    .ArraySize = 1,
+                    .Format = DXGI_FORMAT_B8G8R8A8_UNORM,
+                    .SampleDesc = {
+                        .Count = 1,
+                        .Quality = 0
+                    },
+                    .Usage = D3D10_USAGE_DEFAULT,
+                    .BindFlags = 0,
+                    .CPUAccessFlags = 0,
+                    .MiscFlags = 0
+                };
+
+                hr = ID3D10Device_CreateTexture2D(device, &texdsc, nullptr, com::out_arg(cap.resolveScratch));
+                if FAILED(hr) {
+                    logger << "Failed to create resolve scratch texture: " << util::hresult_to_utf8(hr) << std::endl;
+                    return;
+                }
+            }
+
+            source = (ID3D10Resource*)cap.resolveScratch.get();
+            ID3D10Device_ResolveSubresource(device, source, 0, backBuffer, 0, DXGI_FORMAT_B8G8R8A8_UNORM);
+        }
+
+        D3D10_BOX box = {
+            .left   = UINT(region.left),
+            .top    = UINT(region.top),
+            .front  = 0,
+            .right  = UINT(region.right),
+            .bottom = UINT(region.bottom),
+            .back   = 1
+        };
+        ID3D10Device_CopySubresourceRegion(device, target, 0, 0, 0, 0, source, 0, &box);
+    }
+}
+
+// Takes over the configuration the client left in the shared state.
+// Must be called with the image mutex held.
+void ApplyConfig(Capture &cap)
+{
+    cap.configGeneration = cap.shared->configGeneration;
+    cap.config = cap.shared->config;
+    SanitizeConfig(cap);
+
+    logger << "Applying config " << cap.configGeneration << " on " << cap.monitor
+           << ": region " << cap.config.region << " flags " << cap.config.flags
+           << " interval " << cap.config.frameInterval << std::endl;
+    trace::write(trace::EVENT_CONFIG_APPLIED, cap.id, cap.config.flags, cap.config.frameInterval);
+    RecordConfig(cap);
+}
+
+// Opens the client's textures on the device of the bound swap chain
+bool OpenTargets(Capture &cap)
+{
+    HRESULT hr;
+
+    for (UINT i = 0; i < cap.captureTargetCount; ++i) {
+        hr = ID3D10Device_OpenSharedResource(cap.device, cap.captureTargetHandles[i], IID_ID3D10Texture2D, com::out_arg_void(cap.captureTargets[i]));
+        if FAILED(hr) {
+            logger << "Failed to open shared texture " << i << ": " << util::hresult_to_utf8(hr) << std::endl;
+            return false;
+        }
     }
+
+    return true;
 }
 
 void TrySetupCapturing(IDXGISwapChainDWM *swap, Capture &cap)
@@ -262,7 +468,10 @@ void TrySetupCapturing(IDXGISwapChainDWM *swap, Capture &cap)
     if (!desc.AttachedToDesktop)
         return;
 
-    if (desc.DesktopCoordinates != cap.monitor)
+    // The device name stays the same when the display mode changes, the coordinates don't
+    bool ours = cap.outputName[0] ? std::wcscmp(desc.DeviceName, cap.outputName) == 0
+                                  : desc.DesktopCoordinates == cap.monitor;
+    if (!ours)
         return; // Not our swap chain :(
 
     hr = IDXGISwapChainDWM_GetDevice(swap, IID_ID3D10Device, com::out_arg_void(device));
@@ -271,222 +480,1473 @@ void TrySetupCapturing(IDXGISwapChainDWM *swap, Capture &cap)
         return;
     }
 
-    hr = ID3D10Device_OpenSharedResource(device, cap.captureTargetHandle, IID_ID3D10Texture2D, com::out_arg_void(cap.captureTarget));
-    if FAILED(hr) {
-        logger << "Failed to open shared texture: " << util::hresult_to_utf8(hr) << std::endl;
+    cap.device = device;
+
+    if (desc.DesktopCoordinates != cap.monitor) {
+        // The textures have the wrong size, the client has to send new ones first
+        logger << "Output " << cap.monitor << " moved to " << desc.DesktopCoordinates << std::endl;
+        cap.outputChanged = true;
+    } else if (!cap.waitingForTargets && !OpenTargets(cap)) {
         return;
     }
 
     // we're done! set the swap chain to mark this
     cap.capturedChain = swap;
+    trace::write(trace::EVENT_CAPTURE_BOUND, cap.id);
+    recording::write(recording::RECORD_CAPTURE_BOUND, cap.id, ChainId(swap));
 }
 
-
-void BeforePresent(IDXGISwapChainDWM *swap)
+// Looks at the output of the bound swap chain again and, if it changed, asks the
+// client for new targets. Returns false as long as the capture can't copy anything.
+bool CheckOutput(IDXGISwapChainDWM *swap, Capture &cap)
 {
-    // Create window on first call
-    static HWND window = 0;
-    if (!window)
-        window = InitializeWindow();
+    HRESULT hr;
+    com::ptr<IDXGIOutput> output;
+    DXGI_OUTPUT_DESC desc;
 
-    // Ghetto message loop
-    MSG msg;
-    ZeroMemory(&msg, sizeof(MSG));
-    while (PeekMessage(&msg, window, 0, 0, PM_REMOVE)) {
-        TranslateMessage(&msg);
-        DispatchMessage(&msg);
+    hr = IDXGISwapChainDWM_GetContainingOutput(swap, com::out_arg(output));
+    if SUCCEEDED(hr)
+        hr = IDXGIOutput_GetDesc(output, &desc);
+    if FAILED(hr) {
+        logger << "Failed to retrieve output description: " << util::hresult_to_utf8(hr) << std::endl;
+        return false;
     }
 
-    // Iterate over all capture tasks, and process the one that are alive
-    for (auto it = g_capturing.begin(); it != g_capturing.end();) {
-        Capture &cap = *it;
+    if (desc.DesktopCoordinates == cap.monitor) {
+        cap.outputChanged = false;
+        return true;
+    }
 
-        // Check keep-alive mutex, remove if necessary
-        if (WaitForSingleObject(cap.keepAliveMutex, 0) != WAIT_TIMEOUT) {
-            // If we get this, the remote client is dead.
+    if (WaitForSingleObject(cap.imageMutex, 0) != WAIT_OBJECT_0)
+        return false; // try again on the next Present
 
-            logger << "Remote client left: " << cap.monitor << std::endl;
+    logger << "Mode change on " << cap.monitor << ", now " << desc.DesktopCoordinates << std::endl;
 
-            // remove the capture
-            it = g_capturing.erase(it);
-        } else {
-            // the remote client still lives, on to the next one
-            ++it;
-        }
+    cap.monitor = desc.DesktopCoordinates;
+    for (auto &target : cap.captureTargets)
+        target.reset();
 
-        if (cap.capturedChain == swap) {
-            if (WaitForSingleObject(cap.imageMutex, 0) != WAIT_OBJECT_0)
-                continue; // the image is locked, skip it
+    trace::write(trace::EVENT_MODE_CHANGE, cap.id, uint32_t(cap.monitor.right - cap.monitor.left), uint32_t(cap.monitor.bottom - cap.monitor.top));
+    recording::write(recording::RECORD_MODE_CHANGE, cap.id, uint32_t(cap.monitor.right - cap.monitor.left), uint32_t(cap.monitor.bottom - cap.monitor.top));
 
-            // Copy image
-            CopyBackBuffer(swap, (ID3D10Resource*)cap.captureTarget.get());
+    cap.outputChanged     = false;
+    cap.waitingForTargets = true;
+    cap.targetsGeneration = cap.shared->targetsGeneration;
 
-            // Send event
-            SetEvent(cap.imageEvent);
+    cap.shared->latestTarget = -1;
+    cap.shared->monitor      = cap.monitor;
+    cap.shared->modeGeneration++;
 
-            // Unlock image
-            ReleaseMutex(cap.imageMutex);
-        } else if (!cap.capturedChain) {
-            TrySetupCapturing(swap, cap);
-        }
+    // The region has to be clamped to the new output size
+    ApplyConfig(cap);
+
+    // Wake the client up, so it notices right away
+    SetEvent(cap.imageEvent);
+    ReleaseMutex(cap.imageMutex);
+
+    return false;
+}
+
+// Picks up the targets the client created after a mode change.
+// Returns false as long as there are none.
+bool TakeNewTargets(Capture &cap)
+{
+    if (cap.shared->targetsGeneration == cap.targetsGeneration)
+        return false;
+
+    if (WaitForSingleObject(cap.imageMutex, 0) != WAIT_OBJECT_0)
+        return false;
+
+    cap.targetsGeneration = cap.shared->targetsGeneration;
+    UINT count = cap.shared->targetCount;
+    if (count >= 1 && count <= MAX_CAPTURE_TARGETS) {
+        cap.captureTargetCount = count;
+        for (UINT i = 0; i < count; ++i)
+            cap.captureTargetHandles[i] = (HANDLE)ULongToPtr(cap.shared->targets[i]);
+    } else {
+        logger << "Illegal capture target count " << count << std::endl;
+        count = 0;
     }
+
+    ReleaseMutex(cap.imageMutex);
+
+    // On failure, just wait until the client gives up or tries again
+    if (!count || !OpenTargets(cap))
+        return false;
+
+    logger << "Got " << count << " new capture targets for " << cap.monitor << std::endl;
+    recording::write(recording::RECORD_NEW_TARGETS, cap.id, count);
+
+    cap.waitingForTargets = false;
+    return true;
 }
 
-/*********************************
- * DXGI HOOKING
- *********************************/
-bool g_presentHooked = false;
-HRESULT (__stdcall *g_truePresent)(IDXGISwapChainDWM* swap, UINT sync_interval, UINT flags);
+// Gets a capture ready for a copy on this Present. Returns true if it wants
+// one, and then holds the image mutex until the copy or its deferral.
+bool PrepareCapture(IDXGISwapChainDWM *swap, Capture &cap, LONGLONG now)
+{
+    if (!cap.capturedChain) {
+        TrySetupCapturing(swap, cap);
+        if (cap.capturedChain != swap)
+            return false;
+    } else if (cap.capturedChain != swap) {
+        return false;
+    }
 
-HRESULT __stdcall OverriddenPresent(IDXGISwapChainDWM *swap, UINT sync_interval, UINT flags)
+    stats_write_begin(cap.shared->dwmStats);
+    cap.shared->dwmStats.presents++;
+    stats_write_end(cap.shared->dwmStats);
+
+    if (cap.outputChanged && !CheckOutput(swap, cap))
+        return false;
+
+    if (cap.waitingForTargets && !TakeNewTargets(cap))
+        return false;
+
+    core::update_present_period(cap.pacing, now, QpcFrequency());
+
+    bool configChanged = cap.shared->configGeneration != cap.configGeneration;
+    if (((cap.config.flags & CAPTURE_FLAG_PAUSED) || !core::is_due(cap.pacing, now)) && !configChanged)
+        return false; // paused or not due yet, don't even bother locking
+
+    if (WaitForSingleObject(cap.imageMutex, 0) != WAIT_OBJECT_0) {
+        stats_write_begin(cap.shared->dwmStats);
+        cap.shared->dwmStats.skippedLocked++;
+        stats_write_end(cap.shared->dwmStats);
+        trace::write(trace::EVENT_COPY_SKIPPED, cap.id);
+        recording::write(recording::RECORD_SKIPPED_LOCKED, cap.id);
+        return false; // the image is locked, skip it
+    }
+
+    if (configChanged)
+        ApplyConfig(cap);
+
+    if ((cap.config.flags & CAPTURE_FLAG_PAUSED) || !core::is_due(cap.pacing, now)) {
+        ReleaseMutex(cap.imageMutex);
+        return false;
+    }
+
+    return true;
+}
+
+// Number of pixels a copy for the capture moves
+uint64_t CapturePixels(const Capture &cap)
 {
-    BeforePresent(swap);
+    const core::Rect &r = core::is_empty(cap.config.region) ? cap.monitor : cap.config.region;
 
-    return g_truePresent(swap, sync_interval, flags);
+    return uint64_t(core::width(r)) * uint64_t(core::height(r));
 }
 
-bool g_createSwapChainHooked = false;
-HRESULT(__stdcall *g_trueCreateSwapChain)(IDXGIFactoryDWM *factory,
-                                          IUnknown *pDevice,
-                                          DXGI_SWAP_CHAIN_DESC *pDesc,
-                                          IDXGIOutput *pOutput,
-                                          IDXGISwapChainDWM **ppSwapChainDWM);
-HRESULT __stdcall OurCreateSwapChain(IDXGIFactoryDWM *factory,
-                                     IUnknown *pDevice,
-                                     DXGI_SWAP_CHAIN_DESC *pDesc,
-                                     IDXGIOutput *pOutput,
-                                     IDXGISwapChainDWM **ppSwapChainDWM)
+// Copies into the next target, tells the client and lets go of the image mutex.
+// Returns what the copy cost the CPU.
+LONGLONG CopyCapture(IDXGISwapChainDWM *swap, Capture &cap, LONGLONG now)
 {
-    if (!ppSwapChainDWM)
-        return E_INVALIDARG;
+    LONG target = next_target(cap.shared->latestTarget, cap.shared->heldTarget, cap.captureTargetCount);
 
-    logger << "Hook: CreateSwapChain" << std::endl;
+    // Copy image
+    LARGE_INTEGER before, after;
+    QueryPerformanceCounter(&before);
+    CopyBackBuffer(swap, cap, (ID3D10Resource*)cap.captureTargets[target].get());
+    QueryPerformanceCounter(&after);
 
-    HRESULT hr;
-    hr = g_trueCreateSwapChain(factory, pDevice, pDesc, pOutput, ppSwapChainDWM);
+    cap.shared->latestTarget = target;
+    cap.shared->latestRegion = core::is_empty(cap.config.region) ? core::at_origin(cap.monitor) : cap.config.region;
 
-    if (SUCCEEDED(hr) && !g_presentHooked) {
-        // now hook the present function
-        MH_STATUS status;
+    core::advance_due(cap.pacing, now);
+    cap.lastCopy = now;
 
-        status = MH_CreateHook((void*)(*ppSwapChainDWM)->lpVtbl->Present, (void*)OverriddenPresent, (void**)&g_truePresent);
-        if (status) {
-            logger << "MH_CreateHook() returned status " << status << std::endl;
-            return hr;
-        }
+    // Send event
+    SetEvent(cap.imageEvent);
 
-        status = MH_EnableHook((void*)(*ppSwapChainDWM)->lpVtbl->Present);
-        if (status) {
-            logger << "MH_EnableHook() returned status " << status << std::endl;
-            return hr;
-        }
+    // Unlock image
+    ReleaseMutex(cap.imageMutex);
+
+    return after.QuadPart - before.QuadPart;
+}
 
-        g_presentHooked = true;
+// Reads a DWORD from HKLM\SOFTWARE\dd4seven. Changes take effect when the DWM restarts.
+DWORD ReadSetting(const wchar_t *name, DWORD fallback)
+{
+    DWORD result = fallback;
+    HKEY  key;
+
+    if (RegOpenKeyEx(HKEY_LOCAL_MACHINE, L"SOFTWARE\\dd4seven", 0, KEY_QUERY_VALUE, &key) == ERROR_SUCCESS) {
+        DWORD value, type, size = sizeof(value);
+        if (RegQueryValueEx(key, name, nullptr, &type, (BYTE*)&value, &size) == ERROR_SUCCESS && type == REG_DWORD)
+            result = value;
+        RegCloseKey(key);
     }
 
-    return hr;
+    logger << "Setting " << util::wcsdup_to_utf8(name) << ": " << result << std::endl;
+
+    return result;
 }
 
-bool g_createDXGIFactoryHooked = false;
-HRESULT (__stdcall *g_trueCreateDXGIFactory)(REFIID iid, void **iface);
-HRESULT __stdcall OurCreateDXGIFactory(REFIID iid, void **iface)
+/*
+ * Measures how long the GPU spends on our copies, without ever waiting for it:
+ * a few sets of timestamp queries are in flight, and are read back once the
+ * GPU got to them. Presents that find no free set just aren't measured.
+ *
+ * A set always has a timestamp before the first and after the last copy. With
+ * per-copy timing, there is one between each two copies as well.
+ */
+constexpr unsigned GPU_TIMER_SLOTS  = 4;
+constexpr unsigned MAX_TIMED_COPIES = 16; // copies after these are only in the total
+
+struct GpuTimerSlot
 {
-    if (!iface)
-        return E_INVALIDARG;
+    com::ptr<ID3D10Query> disjoint;
+    com::ptr<ID3D10Query> stamps[MAX_TIMED_COPIES + 2];
+    uint32_t captureIds[MAX_TIMED_COPIES] { 0 }; // whose copy ended at stamps[i+1]
+    unsigned stampCount { 0 };
+    unsigned timedCopies { 0 };
+    LONGLONG cpuTicks { 0 };
+    uint64_t pixels { 0 };
+    bool     pending { false };
+};
 
-    logger << "Hook: CreateDXGIFactory" << std::endl;
+struct GpuTimer
+{
+    com::ptr<ID3D10Device> device;
+    GpuTimerSlot slots[GPU_TIMER_SLOTS];
+    unsigned     next { 0 };   // slot for the next measurement
+    unsigned     oldest { 0 }; // oldest pending slot
+    bool         running { false };
+    bool         perCopy { false };
+};
 
-    HRESULT hr = g_trueCreateDXGIFactory(iid, iface);
-    if (SUCCEEDED(hr) && !g_createSwapChainHooked) {
-        com::ptr<IDXGIFactoryDWM> factory;
-        if SUCCEEDED(IUnknown_QueryInterface(reinterpret_cast<IUnknown*>(*iface), IID_IDXGIFactoryDWM, com::out_arg_void(factory))) {
-            // now hook the CreateSwapChain function
-            MH_STATUS status;
-
-            status = MH_CreateHook((void*)factory->lpVtbl->CreateSwapChain, (void*)OurCreateSwapChain, (void**)&g_trueCreateSwapChain);
-            if (status) {
-                logger << "MH_CreateHook() returned status " << status << std::endl;
-                return hr;
-            }
+GpuTimer         g_gpuTimer;
+sched::Scheduler g_scheduler;
+double           g_gpuTicksPerPixel = 0.0; // moving average, in QueryPerformanceCounter ticks
 
-            status = MH_EnableHook((void*)factory->lpVtbl->CreateSwapChain);
-            if (status) {
-                logger << "MH_EnableHook() returned status " << status << std::endl;
-                return hr;
-            }
+bool GpuTimerStamp(GpuTimerSlot &slot)
+{
+    com::ptr<ID3D10Query> &stamp = slot.stamps[slot.stampCount];
 
-            g_createSwapChainHooked = true;
-        } else {
-            logger << "Secret DWM interface not present? o.O" << std::endl;
+    if (!stamp) {
+        D3D10_QUERY_DESC desc = { .Query = D3D10_QUERY_TIMESTAMP, .MiscFlags = 0 };
+
+        HRESULT hr = ID3D10Device_CreateQuery(g_gpuTimer.device, &desc, com::out_arg(stamp));
+        if FAILED(hr) {
+            logger << "Failed to create timestamp query: " << util::hresult_to_utf8(hr) << std::endl;
+            return false;
         }
     }
 
-    return hr;
+    ID3D10Query_End(stamp);
+    slot.stampCount++;
+
+    return true;
 }
 
-bool HookIt()
+void GpuTimerBegin(ID3D10Device *device)
 {
-    util::dll_func<HRESULT (REFIID iid, void **iface)> createDxgiFactory { L"dxgi.dll", "CreateDXGIFactory" };
+    HRESULT hr;
+    GpuTimer &t = g_gpuTimer;
+
+    if (t.device.get() != device) {
+        // New device, the old queries are useless
+        for (GpuTimerSlot &slot : t.slots)
+            slot = GpuTimerSlot();
+        t.next = t.oldest = 0;
+        ID3D10Device_QueryInterface(device, IID_ID3D10Device, com::out_arg_void(t.device));
+    }
 
-    // Hook CreateDXGIFactory
-    MH_STATUS status;
+    GpuTimerSlot &slot = t.slots[t.next % GPU_TIMER_SLOTS];
+    if (slot.pending)
+        return; // the GPU is lagging behind, skip this one
 
-    status = MH_Initialize();
-    if (status) {
-        logger << "MH_Initialize() returned status " << status << std::endl;
-        return false;
-    }
+    if (!slot.disjoint) {
+        D3D10_QUERY_DESC desc = { .Query = D3D10_QUERY_TIMESTAMP_DISJOINT, .MiscFlags = 0 };
 
-    status = MH_CreateHook((void*)createDxgiFactory.raw_func_ptr(), (void*)OurCreateDXGIFactory, (void**)&g_trueCreateDXGIFactory);
-    if (status) {
-        logger << "MH_CreateHook() returned status " << status << std::endl;
-        return false;
+        hr = ID3D10Device_CreateQuery(device, &desc, com::out_arg(slot.disjoint));
+        if FAILED(hr) {
+            logger << "Failed to create disjoint query: " << util::hresult_to_utf8(hr) << std::endl;
+            return;
+        }
     }
 
-    status = MH_EnableHook((void*)createDxgiFactory.raw_func_ptr());
-    if (status) {
-        logger << "MH_EnableHook() returned status " << status << std::endl;
-        return false;
+    slot.stampCount  = 0;
+    slot.timedCopies = 0;
+
+    ID3D10Query_Begin(slot.disjoint);
+    if (!GpuTimerStamp(slot)) {
+        ID3D10Query_End(slot.disjoint);
+        return;
     }
 
-    g_createDXGIFactoryHooked = true;
-    return true;
+    t.running = true;
 }
 
-BOOLEAN WINAPI DllMain(HINSTANCE hDllHandle,
-                       DWORD     nReason,
-                       LPVOID    Reserved)
+// Called after each copy
+void GpuTimerCopied(const Capture &cap)
 {
-    g_instance = hDllHandle;
-    (void)Reserved;
+    GpuTimer &t = g_gpuTimer;
+    if (!t.running || !t.perCopy)
+        return;
 
-    switch (nReason)
-    {
-        case DLL_PROCESS_ATTACH:
-        {
-            DisableThreadLibraryCalls(hDllHandle);
+    GpuTimerSlot &slot = t.slots[t.next % GPU_TIMER_SLOTS];
+    if (slot.timedCopies == MAX_TIMED_COPIES)
+        return;
 
-            // "I don't wanna go to school
-            //  I just wanna break the rules"
-            //
-            // Don't do anything scary in DllMain.
-            // Raymond Chen will hate me.
+    if (GpuTimerStamp(slot))
+        slot.captureIds[slot.timedCopies++] = cap.id;
+}
 
-            HMODULE hDxgi = GetModuleHandleA("dxgi.dll");
-            HMODULE hDwm  = GetModuleHandleA("dwm.exe");
-            if (!hDxgi || !hDwm)
-                return FALSE;
+void GpuTimerEnd(LONGLONG cpuTicks, uint64_t pixels)
+{
+    GpuTimer &t = g_gpuTimer;
+    if (!t.running)
+        return;
 
-            logger << "Found DXGI.DLL inside DWM.EXE" << std::endl;
+    GpuTimerSlot &slot = t.slots[t.next % GPU_TIMER_SLOTS];
 
-            if (!HookIt()) {
-                logger << "Hoooking failed :(" << std::endl;
-                return FALSE;
+    // Without per-copy timing, or with too many copies, the end of the last one isn't there yet
+    if (slot.stampCount < 2 || slot.timedCopies == MAX_TIMED_COPIES)
+        GpuTimerStamp(slot);
+
+    ID3D10Query_End(slot.disjoint);
+    slot.cpuTicks = cpuTicks;
+    slot.pixels   = pixels;
+    slot.pending  = slot.stampCount >= 2;
+
+    if (slot.pending)
+        t.next++;
+    t.running = false;
+}
+
+// Puts the GPU time of a copy into the histogram of its capture, if it's still there
+void RecordGpuCopy(uint32_t captureId, uint64_t microseconds)
+{
+    for (Capture &cap : g_capturing) {
+        if (cap.id != captureId)
+            continue;
+
+        unsigned bucket = 0;
+        for (uint64_t us = microseconds; us && bucket < GPU_HISTOGRAM_BUCKETS - 1; us >>= 1)
+            ++bucket;
+
+        CaptureDwmStats &stats = cap.shared->dwmStats;
+        stats_write_begin(stats);
+        stats.gpuCopies++;
+        stats.gpuCopyTime += microseconds;
+        stats.gpuHistogram[bucket]++;
+        stats_write_end(stats);
+
+        trace::write(trace::EVENT_GPU_COPY_TIME, captureId, uint32_t(std::min<uint64_t>(microseconds, UINT32_MAX)));
+        return;
+    }
+}
+
+// Collects the measurements the GPU has finished
+void GpuTimerPoll()
+{
+    GpuTimer &t = g_gpuTimer;
+
+    while (t.oldest != t.next) {
+        GpuTimerSlot &slot = t.slots[t.oldest % GPU_TIMER_SLOTS];
+
+        D3D10_QUERY_DATA_TIMESTAMP_DISJOINT disjoint;
+        UINT64 stamps[MAX_TIMED_COPIES + 2];
+        if (ID3D10Query_GetData(slot.disjoint, &disjoint, sizeof(disjoint), D3D10_ASYNC_GETDATA_DONOTFLUSH) != S_OK)
+            return; // not there yet, and neither are the ones after it
+
+        bool valid = !disjoint.Disjoint && disjoint.Frequency;
+        for (unsigned i = 0; valid && i < slot.stampCount; ++i) {
+            valid = ID3D10Query_GetData(slot.stamps[i], &stamps[i], sizeof(UINT64), D3D10_ASYNC_GETDATA_DONOTFLUSH) == S_OK
+                    && (!i || stamps[i] >= stamps[i - 1]);
+        }
+
+        if (valid) {
+            UINT64 total = stamps[slot.stampCount - 1] - stamps[0];
+            LONGLONG gpuTicks = LONGLONG(total * uint64_t(QpcFrequency()) / disjoint.Frequency);
+            g_scheduler.reportCost(slot.cpuTicks + gpuTicks);
+            recording::write(recording::RECORD_COST, recording::ticks(slot.cpuTicks + gpuTicks));
+
+            if (slot.pixels) {
+                double perPixel = double(gpuTicks) / double(slot.pixels);
+                g_gpuTicksPerPixel = g_gpuTicksPerPixel > 0.0 ? (7.0 * g_gpuTicksPerPixel + perPixel) / 8.0 : perPixel;
             }
 
-            break;
+            for (unsigned i = 0; i < slot.timedCopies; ++i)
+                RecordGpuCopy(slot.captureIds[i], (stamps[i + 1] - stamps[i]) * 1000000 / disjoint.Frequency);
         }
-        case DLL_PROCESS_DETACH:
+
+        slot.pending = false;
+        t.oldest++;
+    }
+}
+
+// The budget is the DWORD CaptureBudget in microseconds, 0 turns the scheduler off
+LONGLONG ReadCaptureBudget()
+{
+    DWORD budget = ReadSetting(L"CaptureBudget", 2000); // 2ms, about an eighth of a 60Hz frame
+
+    return LONGLONG(budget) * QpcFrequency() / 1000000;
+}
+
+uint32_t TicksToMicroseconds(LONGLONG ticks)
+{
+    return uint32_t(std::min<LONGLONG>(ticks * 1000000 / QpcFrequency(), UINT32_MAX));
+}
+
+// Recording is off unless the DWORD CaptureRecording (size in megabytes) is set.
+// Starts with the first swap chain, so it's in the recording as well.
+void StartRecording()
+{
+    static bool started = false;
+    if (started)
+        return;
+
+    started = true;
+    recording::init(ReadSetting(L"CaptureRecording", 0), ReadCaptureBudget());
+}
+
+void RecordSwapChain(IDXGISwapChainDWM *swap)
+{
+    DXGI_SWAP_CHAIN_DESC desc;
+    if SUCCEEDED(IDXGISwapChainDWM_GetDesc(swap, &desc)) {
+        recording::write(recording::RECORD_SWAP_CHAIN, ChainId(swap), desc.BufferDesc.Width, desc.BufferDesc.Height,
+                         desc.BufferDesc.Format, desc.SampleDesc.Count);
+    }
+}
+
+// Copies what the scheduler knows into the statistics of a capture
+void PublishSchedulerStats(Capture &cap)
+{
+    const sched::Counters &global = g_scheduler.counters();
+    CaptureDwmStats &stats = cap.shared->dwmStats;
+
+    stats_write_begin(stats);
+    stats.throttledPresents  = global.throttledPresents;
+    stats.overBudgetPresents = global.overBudgetPresents;
+    stats.budget             = TicksToMicroseconds(g_scheduler.budget());
+    stats.lastCost           = TicksToMicroseconds(global.lastCost);
+    stats.estimatedCost      = TicksToMicroseconds(cap.costTicks);
+    stats_write_end(stats);
+}
+
+HWND g_window = 0; // created on the thread that presents, which runs its messages
+
+// Everything that has to happen on the thread that presents before capturing
+void InitializePresentThread()
+{
+    trace::init();
+    g_window = InitializeWindow();
+    g_scheduler.setBudget(ReadCaptureBudget());
+    g_gpuTimer.perCopy = ReadSetting(L"CaptureGpuTiming", 0) != 0;
+    StartRecording();
+}
+
+// Swap chains can go away on any thread and through any of their interfaces,
+// so captures only find out here that theirs is gone (see SwapChainWatch)
+void ForgetReleasedSwapChains()
+{
+    for (Capture &cap : g_capturing) {
+        if (cap.capturedChain && !g_swapChains.contains(cap.capturedChain)) {
+            cap.capturedChain = nullptr;
+            cap.outputChanged = false;
+        }
+    }
+}
+
+void BeforePresent(IDXGISwapChainDWM *swap)
+{
+    // Create window on first call
+    if (!g_window)
+        InitializePresentThread();
+
+    // Ghetto message loop
+    MSG msg;
+    ZeroMemory(&msg, sizeof(MSG));
+    while (PeekMessage(&msg, g_window, 0, 0, PM_REMOVE)) {
+        TranslateMessage(&msg);
+        DispatchMessage(&msg);
+    }
+
+    ForgetReleasedSwapChains();
+
+    // One timestamp for all captures, so they are paced against the same Present
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+
+    trace::write(trace::EVENT_PRESENT_BEGIN, uint32_t(g_capturing.size()));
+    recording::write(recording::RECORD_PRESENT, ChainId(swap), uint32_t(g_capturing.size()));
+
+    // Iterate over all capture tasks, and collect the live ones that want a copy
+    static std::vector<Capture*>          ready;
+    static std::vector<sched::Candidate> candidates;
+    ready.clear();
+    candidates.clear();
+
+    for (auto it = g_capturing.begin(); it != g_capturing.end();) {
+        // Check keep-alive mutex, remove if necessary
+        if (WaitForSingleObject(it->keepAliveMutex, 0) != WAIT_TIMEOUT) {
+            // If we get this, the remote client is dead.
+
+            logger << "Remote client left: " << it->monitor << std::endl;
+            trace::write(trace::EVENT_CAPTURE_REMOVED, it->id);
+            recording::write(recording::RECORD_CAPTURE_REMOVED, it->id);
+
+            // remove the capture
+            it = g_capturing.erase(it);
+            continue;
+        }
+
+        // the remote client still lives. Its statistics are only ever
+        // written in short bursts, clients poll them without locking.
+        stats_write_begin(it->shared->dwmStats);
+        it->shared->dwmStats.keepAliveChecks++;
+        stats_write_end(it->shared->dwmStats);
+
+        if (PrepareCapture(swap, *it, now.QuadPart)) {
+            ready.push_back(&*it);
+            candidates.push_back(sched::Candidate {
+                it->config.clientClass,
+                now.QuadPart - it->lastCopy,
+                it->costTicks,
+                false
+            });
+        }
+        ++it;
+    }
+
+    // See what the GPU did on earlier Presents
+    GpuTimerPoll();
+
+    // Copy what fits into the budget, the rest has to wait for the next Present
+    g_scheduler.schedule(candidates);
+
+    bool     timing   = false;
+    LONGLONG cpuTicks = 0;
+    uint64_t pixels   = 0;
+    uint32_t copied   = 0;
+    for (size_t i = 0; i < ready.size(); ++i) {
+        Capture &cap = *ready[i];
+
+        if (!candidates[i].selected) {
+            ReleaseMutex(cap.imageMutex);
+            stats_write_begin(cap.shared->dwmStats);
+            cap.shared->dwmStats.deferred++;
+            stats_write_end(cap.shared->dwmStats);
+            trace::write(trace::EVENT_COPY_DEFERRED, cap.id);
+            recording::write(recording::RECORD_DEFERRED, cap.id);
+            continue;
+        }
+
+        if (!timing) {
+            GpuTimerBegin(cap.device);
+            timing = true;
+        }
+
+        LONGLONG cost = CopyCapture(swap, cap, now.QuadPart);
+        GpuTimerCopied(cap);
+        cpuTicks += cost;
+        pixels   += CapturePixels(cap);
+
+        stats_write_begin(cap.shared->dwmStats);
+        cap.shared->dwmStats.copies++;
+        cap.shared->dwmStats.copyTicks += uint64_t(cost);
+        stats_write_end(cap.shared->dwmStats);
+        trace::write(trace::EVENT_COPY, cap.id, uint32_t(cap.shared->latestTarget), TicksToMicroseconds(cost));
+        ++copied;
+
+        // What the GPU took isn't known yet, so estimate it from the last measurements
+        LONGLONG sample = cost + LONGLONG(g_gpuTicksPerPixel * double(CapturePixels(cap)));
+        cap.costTicks = core::smooth(cap.costTicks, sample);
+
+        recording::write(recording::RECORD_COPY, cap.id, uint32_t(cap.shared->latestTarget), recording::ticks(cost), recording::ticks(sample));
+    }
+
+    if (timing)
+        GpuTimerEnd(cpuTicks, pixels);
+
+    for (Capture &cap : g_capturing)
+        PublishSchedulerStats(cap);
+
+    trace::write(trace::EVENT_PRESENT_END, uint32_t(ready.size()), copied);
+}
+
+// Called after the DWM resized a swap chain, which happens on mode changes
+void AfterResizeBuffers(IDXGISwapChainDWM *swap)
+{
+    for (Capture &cap : g_capturing) {
+        if (cap.capturedChain == swap)
+            cap.outputChanged = true;
+    }
+}
+
+// Called after the DWM created a new swap chain, which it does when
+// outputs come and go. Everything is matched up again on the next Present.
+void AfterCreateSwapChain()
+{
+    for (Capture &cap : g_capturing) {
+        cap.capturedChain = nullptr;
+        cap.outputChanged = false;
+    }
+}
+
+/*********************************
+ * HOOK SETS
+ *********************************/
+
+// The hooks that can be installed at one point. MinHook freezes all other
+// threads of the DWM to enable a hook, so the ones in a set are queued and
+// enabled together with one freeze. Method hooks go into the vtable right
+// away, they don't need one. If any hook fails, the set takes back what it
+// installed; vtable slots that an earlier set already hooked stay, since
+// other objects sharing that vtable still need them.
+class HookSet
+{
+    struct Method
+    {
+        void   *object;
+        size_t  index;
+        void   *replacement;
+    };
+
+    const char          *m_name;
+    std::vector<void *>  m_queued;
+    std::vector<Method>  m_methods; // installed by this set
+    bool                 m_ok { true };
+
+    static LONGLONG s_stallTicks; // spent in MH_ApplyQueued, all sets together
+
+    void rollback()
+    {
+        for (void *target : m_queued)
+            MH_RemoveHook(target);
+
+        for (const Method &m : m_methods)
+            vtable::unhook(m.object, m.index, m.replacement);
+    }
+
+public:
+    explicit HookSet(const char *name) : m_name(name) {}
+
+    // Inline detour of a function, <original> receives the trampoline
+    HookSet &function(void *target, void *detour, void **original)
+    {
+        MH_STATUS status = MH_CreateHook(target, detour, original);
+        if (status) {
+            logger << "Hooks " << m_name << ": MH_CreateHook() returned status " << status << std::endl;
+            m_ok = false;
+            return *this;
+        }
+
+        m_queued.push_back(target);
+
+        status = MH_QueueEnableHook(target);
+        if (status) {
+            logger << "Hooks " << m_name << ": MH_QueueEnableHook() returned status " << status << std::endl;
+            m_ok = false;
+        }
+
+        return *this;
+    }
+
+    // Method <index> in the vtable of <object>, see vtable.hpp
+    HookSet &method(void *object, size_t index, void *replacement)
+    {
+        if (vtable::hooked(object, index, replacement))
+            return *this;
+
+        if (!vtable::hook(object, index, replacement)) {
+            logger << "Hooks " << m_name << ": hooking vtable slot " << index << " failed" << std::endl;
+            m_ok = false;
+            return *this;
+        }
+
+        m_methods.push_back({ object, index, replacement });
+
+        return *this;
+    }
+
+    bool apply()
+    {
+        if (!m_ok) {
+            rollback();
+            return false;
+        }
+
+        if (m_queued.empty())
+            return true;
+
+        LARGE_INTEGER start, end;
+        QueryPerformanceCounter(&start);
+        MH_STATUS status = MH_ApplyQueued();
+        QueryPerformanceCounter(&end);
+
+        s_stallTicks += end.QuadPart - start.QuadPart;
+        logger << "Hooks " << m_name << ": enabled " << m_queued.size()
+               << " in " << TicksToMicroseconds(end.QuadPart - start.QuadPart) << "us"
+               << " (" << TicksToMicroseconds(s_stallTicks) << "us so far)" << std::endl;
+
+        if (status) {
+            logger << "Hooks " << m_name << ": MH_ApplyQueued() returned status " << status << std::endl;
+            rollback();
+            return false;
+        }
+
+        return true;
+    }
+};
+
+LONGLONG HookSet::s_stallTicks = 0;
+
+/*********************************
+ * DXGI HOOKING
+ *********************************/
+
+// Threads inside one of our hooks right now. After an upgrade,
+// the DLL stays loaded until they all returned.
+volatile LONG g_inFlight = 0;
+
+struct InFlight
+{
+    InFlight()  { InterlockedIncrement(&g_inFlight); }
+    ~InFlight() { InterlockedDecrement(&g_inFlight); }
+};
+
+// Set once a newer version took over, calls still in flight only pass through
+bool g_retired = false;
+
+HRESULT __stdcall OverriddenPresent(IDXGISwapChainDWM *swap, UINT sync_interval, UINT flags)
+{
+    InFlight inFlight;
+    auto truePresent = reinterpret_cast<decltype(&OverriddenPresent)>(
+        vtable::original(swap, VTABLE_INDEX(IDXGISwapChainDWMVtbl, Present)));
+
+    if (g_swapChains.contains(swap))
+        BeforePresent(swap);
+
+    return truePresent(swap, sync_interval, flags);
+}
+
+HRESULT __stdcall OverriddenResizeBuffers(IDXGISwapChainDWM *swap, UINT count, UINT width, UINT height, DXGI_FORMAT format, UINT flags)
+{
+    InFlight inFlight;
+    auto trueResizeBuffers = reinterpret_cast<decltype(&OverriddenResizeBuffers)>(
+        vtable::original(swap, VTABLE_INDEX(IDXGISwapChainDWMVtbl, ResizeBuffers)));
+
+    HRESULT hr = trueResizeBuffers(swap, count, width, height, format, flags);
+
+    if (SUCCEEDED(hr) && g_swapChains.contains(swap)) {
+        RecordSwapChain(swap);
+        AfterResizeBuffers(swap);
+    }
+
+    return hr;
+}
+
+/*
+ * Lives in the private data of every swap chain in g_swapChains, so DXGI
+ * releases it when the swap chain is destroyed. Hooking Release wouldn't do:
+ * the last reference might go through IDXGISwapChain, some IUnknown or DXGI
+ * itself, none of which use the vtable we hooked.
+ *
+ * Its code is ours, so it has to be taken out again before we're unloaded.
+ */
+struct SwapChainWatch
+{
+    IUnknown           unknown; // must be first
+    volatile LONG      refs;
+    IDXGISwapChainDWM *swap;
+    bool               detached; // taken out by us, the swap chain is still there
+};
+
+// {63d7e544-3dcd-44ca-a787-8538bb965cc1}
+const GUID DD4SEVEN_SWAP_CHAIN_WATCH = { 0x63d7e544, 0x3dcd, 0x44ca, { 0xa7, 0x87, 0x85, 0x38, 0xbb, 0x96, 0x5c, 0xc1 } };
+
+HRESULT __stdcall SwapChainWatch_QueryInterface(IUnknown *self, REFIID iid, void **object)
+{
+    if (!object)
+        return E_POINTER;
+
+    if (!IsEqualIID(iid, IID_IUnknown)) {
+        *object = nullptr;
+        return E_NOINTERFACE;
+    }
+
+    IUnknown_AddRef(self);
+    *object = self;
+    return S_OK;
+}
+
+ULONG __stdcall SwapChainWatch_AddRef(IUnknown *self)
+{
+    return ULONG(InterlockedIncrement(&reinterpret_cast<SwapChainWatch*>(self)->refs));
+}
+
+ULONG __stdcall SwapChainWatch_Release(IUnknown *self)
+{
+    SwapChainWatch *watch = reinterpret_cast<SwapChainWatch*>(self);
+
+    LONG refs = InterlockedDecrement(&watch->refs);
+    if (refs == 0) {
+        if (!watch->detached)
+            g_swapChains.remove(watch->swap);
+        delete watch;
+    }
+
+    return ULONG(refs);
+}
+
+IUnknownVtbl g_swapChainWatchVtbl = {
+    SwapChainWatch_QueryInterface,
+    SwapChainWatch_AddRef,
+    SwapChainWatch_Release
+};
+
+bool WatchSwapChain(IDXGISwapChainDWM *swap)
+{
+    SwapChainWatch *watch = new SwapChainWatch;
+    watch->unknown.lpVtbl = &g_swapChainWatchVtbl;
+    watch->refs           = 1;
+    watch->swap           = swap;
+    watch->detached       = false;
+
+    // The swap chain takes a reference of its own
+    HRESULT hr = IDXGISwapChainDWM_SetPrivateDataInterface(swap, DD4SEVEN_SWAP_CHAIN_WATCH, &watch->unknown);
+    if FAILED(hr) {
+        logger << "Can't watch swap chain: " << util::hresult_to_utf8(hr) << std::endl;
+        watch->detached = true;
+    }
+
+    IUnknown_Release(&watch->unknown);
+
+    return SUCCEEDED(hr);
+}
+
+// Takes our watch out of a swap chain, which stays in g_swapChains
+void UnwatchSwapChain(IDXGISwapChainDWM *swap)
+{
+    IUnknown *watch = nullptr;
+    UINT size = sizeof(watch);
+    if (FAILED(IDXGISwapChainDWM_GetPrivateData(swap, DD4SEVEN_SWAP_CHAIN_WATCH, &size, &watch)) || !watch)
+        return;
+
+    reinterpret_cast<SwapChainWatch*>(watch)->detached = true;
+    IUnknown_Release(watch);
+
+    IDXGISwapChainDWM_SetPrivateDataInterface(swap, DD4SEVEN_SWAP_CHAIN_WATCH, nullptr);
+}
+
+void UnwatchSwapChains()
+{
+    void *swapChains[DD4SEVEN_HANDOVER_SWAP_CHAINS];
+    size_t count = g_swapChains.snapshot(swapChains);
+
+    for (size_t i = 0; i < count; ++i)
+        UnwatchSwapChain((IDXGISwapChainDWM*)swapChains[i]);
+}
+
+bool HookSwapChainMethods(IDXGISwapChainDWM *swap)
+{
+    if (!WatchSwapChain(swap))
+        return false;
+
+    bool hooked = HookSet("SwapChain")
+        .method(swap, VTABLE_INDEX(IDXGISwapChainDWMVtbl, Present), (void*)OverriddenPresent)
+        .method(swap, VTABLE_INDEX(IDXGISwapChainDWMVtbl, ResizeBuffers), (void*)OverriddenResizeBuffers)
+        .apply();
+
+    if (!hooked)
+        UnwatchSwapChain(swap);
+
+    return hooked;
+}
+
+bool HookSwapChain(IDXGISwapChainDWM *swap)
+{
+    if (!g_swapChains.add(swap)) {
+        logger << "Too many swap chains" << std::endl;
+        return false;
+    }
+
+    bool hooked = HookSwapChainMethods(swap);
+    if (!hooked)
+        g_swapChains.remove(swap);
+
+    return hooked;
+}
+
+bool g_createSwapChainHooked = false;
+void *g_createSwapChain = nullptr;
+HRESULT(__stdcall *g_trueCreateSwapChain)(IDXGIFactoryDWM *factory,
+                                          IUnknown *pDevice,
+                                          DXGI_SWAP_CHAIN_DESC *pDesc,
+                                          IDXGIOutput *pOutput,
+                                          IDXGISwapChainDWM **ppSwapChainDWM);
+HRESULT __stdcall OurCreateSwapChain(IDXGIFactoryDWM *factory,
+                                     IUnknown *pDevice,
+                                     DXGI_SWAP_CHAIN_DESC *pDesc,
+                                     IDXGIOutput *pOutput,
+                                     IDXGISwapChainDWM **ppSwapChainDWM)
+{
+    InFlight inFlight;
+
+    if (!ppSwapChainDWM)
+        return E_INVALIDARG;
+
+    logger << "Hook: CreateSwapChain" << std::endl;
+
+    HRESULT hr;
+    hr = g_trueCreateSwapChain(factory, pDevice, pDesc, pOutput, ppSwapChainDWM);
+    if (g_retired)
+        return hr;
+
+    // Present to copy the desktop, ResizeBuffers to learn about mode changes,
+    // and a watch to forget the swap chain again
+    if (SUCCEEDED(hr) && !HookSwapChain(*ppSwapChainDWM))
+        return hr;
+
+    if SUCCEEDED(hr) {
+        StartRecording();
+        RecordSwapChain(*ppSwapChainDWM);
+        AfterCreateSwapChain();
+    }
+
+    return hr;
+}
+
+// The DWM's factory and the one StartupThread() creates might get here at the same time
+volatile LONG g_createSwapChainClaimed = 0;
+
+bool HookCreateSwapChain(void *createSwapChain)
+{
+    if (InterlockedCompareExchange(&g_createSwapChainClaimed, 1, 0) != 0)
+        return true;
+
+    g_createSwapChainHooked = HookSet("DXGIFactory")
+        .function(createSwapChain, (void*)OurCreateSwapChain, (void**)&g_trueCreateSwapChain)
+        .apply();
+
+    if (g_createSwapChainHooked)
+        g_createSwapChain = createSwapChain;
+    else
+        InterlockedExchange(&g_createSwapChainClaimed, 0);
+
+    return g_createSwapChainHooked;
+}
+
+// CreateSwapChain is the same for all factories, any of them will do to find it
+void HookFactory(IUnknown *object)
+{
+    com::ptr<IDXGIFactoryDWM> factory;
+    if SUCCEEDED(IUnknown_QueryInterface(object, IID_IDXGIFactoryDWM, com::out_arg_void(factory))) {
+        // now hook the CreateSwapChain function
+        HookCreateSwapChain((void*)factory->lpVtbl->CreateSwapChain);
+    } else {
+        logger << "Secret DWM interface not present? o.O" << std::endl;
+    }
+}
+
+bool g_createDXGIFactoryHooked = false;
+HRESULT (__stdcall *g_trueCreateDXGIFactory)(REFIID iid, void **iface);
+HRESULT __stdcall OurCreateDXGIFactory(REFIID iid, void **iface)
+{
+    InFlight inFlight;
+
+    if (!iface)
+        return E_INVALIDARG;
+
+    logger << "Hook: CreateDXGIFactory" << std::endl;
+
+    HRESULT hr = g_trueCreateDXGIFactory(iid, iface);
+    if (SUCCEEDED(hr) && !g_createSwapChainHooked && !g_retired)
+        HookFactory(reinterpret_cast<IUnknown*>(*iface));
+
+    return hr;
+}
+
+// Puts back everything we changed. Calls already inside a hook finish normally,
+// the trampolines stay until MH_Uninitialize().
+void Unhook()
+{
+    UnwatchSwapChains();
+    vtable::unhook_all();
+    imports::restore_all();
+
+    MH_STATUS status = MH_DisableHook(MH_ALL_HOOKS);
+    if (status && status != MH_ERROR_NOT_INITIALIZED)
+        logger << "MH_DisableHook() returned status " << status << std::endl;
+}
+
+/*********************************
+ * STARTUP
+ *********************************/
+
+// DllMain runs under the loader lock, where freezing threads to enable hooks
+// holds up the whole DWM (and can deadlock it). So it only looks around and
+// leaves the hooking to a thread of its own, which can't start before the
+// loader lock is released. The DWM's calls that come first wait for it, see
+// EarlyCreateDXGIFactory(). Every step is timed into the log and the trace.
+enum StartupStep : uint32_t {
+    STARTUP_DLLMAIN      = 0, // DllMain itself
+    STARTUP_WORKER       = 1, // until StartupThread() ran
+    STARTUP_MINHOOK      = 2, // MH_Initialize()
+    STARTUP_CREATE_HOOKS = 3, // MH_CreateHook() on CreateDXGIFactory
+    STARTUP_ENABLE_HOOKS = 4, // enabling it, with all threads frozen
+    STARTUP_FACTORY      = 5, // a factory of our own to hook CreateSwapChain with
+};
+
+const char *StartupStepName(StartupStep step)
+{
+    switch (step) {
+        case STARTUP_DLLMAIN:      return "DllMain";
+        case STARTUP_WORKER:       return "worker";
+        case STARTUP_MINHOOK:      return "MH_Initialize";
+        case STARTUP_CREATE_HOOKS: return "MH_CreateHook";
+        case STARTUP_ENABLE_HOOKS: return "MH_ApplyQueued";
+        case STARTUP_FACTORY:      return "factory";
+        default:                   return "unknown";
+    }
+}
+
+class StartupTimer
+{
+    LONGLONG m_last;
+
+public:
+    explicit StartupTimer(LONGLONG start) : m_last(start) {}
+
+    // Ends <step> at <end>, it started where the last one ended
+    void step(StartupStep step, LONGLONG end)
+    {
+        uint32_t us = TicksToMicroseconds(end - m_last);
+        logger << "Startup: " << StartupStepName(step) << " took " << us << "us" << std::endl;
+        trace::write(trace::EVENT_STARTUP_STEP, step, us);
+        m_last = end;
+    }
+
+    void step(StartupStep step)
+    {
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+        this->step(step, now.QuadPart);
+    }
+};
+
+LONGLONG g_attachStart = 0;
+LONGLONG g_attachEnd   = 0;
+HANDLE   g_started     = nullptr; // set once StartupThread() or TakeOver() is done
+
+// Where StartupThread() would have hooked, when an older version is loading us
+void *g_upgradeCreateDXGIFactory = nullptr;
+
+bool HookIt(void *createDxgiFactory, StartupTimer &timer)
+{
+    // Hook CreateDXGIFactory
+    MH_STATUS status;
+
+    status = MH_Initialize();
+    timer.step(STARTUP_MINHOOK);
+    if (status) {
+        logger << "MH_Initialize() returned status " << status << std::endl;
+        return false;
+    }
+
+    HookSet hooks("DXGI");
+    hooks.function(createDxgiFactory, (void*)OurCreateDXGIFactory, (void**)&g_trueCreateDXGIFactory);
+    timer.step(STARTUP_CREATE_HOOKS);
+
+    g_createDXGIFactoryHooked = hooks.apply();
+    timer.step(STARTUP_ENABLE_HOOKS);
+
+    return g_createDXGIFactoryHooked;
+}
+
+// The DWM might have created its factory while we weren't looking yet
+void HookOwnFactory(StartupTimer &timer)
+{
+    com::ptr<IUnknown> factory;
+    if SUCCEEDED(g_trueCreateDXGIFactory(IID_IDXGIFactory, com::out_arg_void(factory)))
+        HookFactory(factory.get());
+    timer.step(STARTUP_FACTORY);
+}
+
+// Holds a reference on our module, taken in DllMain
+DWORD WINAPI StartupThread(void *createDxgiFactory)
+{
+    trace::init();
+
+    StartupTimer timer(g_attachStart);
+    timer.step(STARTUP_DLLMAIN, g_attachEnd);
+    timer.step(STARTUP_WORKER);
+
+    if (HookIt(createDxgiFactory, timer)) {
+        HookOwnFactory(timer);
+    } else {
+        logger << "Hoooking failed :(" << std::endl;
+    }
+
+    // From now on the DWM's calls go to the detour, if anywhere
+    imports::restore_all();
+    SetEvent(g_started);
+
+    FreeLibraryAndExitThread(g_instance, 0);
+}
+
+// For hosts that can't have the hooks come in late, i.e. dd4seven-fakedwm.exe
+extern "C" __declspec(dllexport) BOOL __cdecl WaitForStartup(DWORD milliseconds)
+{
+    return g_started && WaitForSingleObject(g_started, milliseconds) == WAIT_OBJECT_0;
+}
+
+// The DWM might create its factory and swap chains before StartupThread() ran.
+// DllMain points the DWM's imports of CreateDXGIFactory here, so that the first
+// call finishes startup instead of racing it. Not for too long though: the DWM
+// would rather miss a few hooks than stop drawing.
+//
+// A call made under the loader lock (from some DllMain or static initializer)
+// doesn't wait at all: StartupThread() can't start before that lock is
+// released, so it would always wait the whole timeout for nothing.
+const DWORD EARLY_CALL_TIMEOUT_MS = 500;
+void *g_createDXGIFactory = nullptr; // the real one, with our detour once it's in
+
+HRESULT __stdcall EarlyCreateDXGIFactory(REFIID iid, void **iface)
+{
+    InFlight inFlight;
+
+    DWORD timeout = imports::loader_lock_held() ? 0 : EARLY_CALL_TIMEOUT_MS;
+    if (!WaitForStartup(timeout))
+        logger << "Startup: CreateDXGIFactory called before the hooks are in" << std::endl;
+
+    return reinterpret_cast<decltype(&EarlyCreateDXGIFactory)>(g_createDXGIFactory)(iid, iface);
+}
+
+/*********************************
+ * UPGRADES
+ *********************************/
+
+// Lets go of the DLL once no thread is inside our hooks anymore
+DWORD WINAPI UnloadThread(void *)
+{
+    while (g_inFlight)
+        Sleep(10);
+
+    // A deliberate grace period, nothing more: g_inFlight only counts from the
+    // InFlight in a detour's body. A thread that has just taken the jump into a
+    // detour or trampoline but not got there yet, or has left it but not
+    // returned through our last instructions, isn't counted. The hooks have
+    // been out since UpgradeTo(), so no thread can start down that path
+    // anymore, and the ones already on it are a few dozen instructions from
+    // done. 100ms covers them unless one was preempted right there and not
+    // scheduled again for that long, which is unlikely for the DWM's threads
+    // at their raised priority but not impossible.
+    Sleep(100);
+
+    MH_Uninitialize();
+    logger << "Unloading" << std::endl;
+
+    FreeLibraryAndExitThread(g_instance, 0);
+}
+
+// Hands everything over to a newer dd4seven-dwm.dll next to this one, see protocol.hpp.
+// Runs on the thread that presents, between two Presents, so no copy is in flight.
+BOOL UpgradeTo(HWND window, const COPYDATASTRUCT *copy)
+{
+    // Only a file name, the DLL has to be where only administrators could have put us
+    wchar_t name[MAX_PATH] = { 0 };
+    std::memcpy(name, copy->lpData, std::min<size_t>(copy->cbData, sizeof(name) - sizeof(wchar_t)));
+    if (!name[0] || std::wcspbrk(name, L"\\/:")) {
+        logger << "Illegal upgrade: " << util::wcsdup_to_utf8(name) << std::endl;
+        return FALSE;
+    }
+
+    wchar_t path[MAX_PATH];
+    DWORD length = GetModuleFileNameW(g_instance, path, MAX_PATH);
+    wchar_t *slash = length && length < MAX_PATH ? std::wcsrchr(path, L'\\') : nullptr;
+    if (!slash || size_t(slash + 1 - path) + std::wcslen(name) >= MAX_PATH) {
+        logger << "Couldn't locate " << util::wcsdup_to_utf8(name) << std::endl;
+        return FALSE;
+    }
+    std::wcscpy(slash + 1, name);
+
+    LARGE_INTEGER start, end;
+    QueryPerformanceCounter(&start);
+
+    // Everything the new version needs to carry on where we are
+    std::vector<CaptureHandover> captures;
+    for (const Capture &cap : g_capturing) {
+        CaptureHandover entry;
+        entry.request         = cap.request;
+        entry.request.monitor = cap.monitor;
+        entry.request.config  = cap.config;
+        entry.request.captureTargetCount = cap.captureTargetCount;
+        for (UINT i = 0; i < cap.captureTargetCount; ++i)
+            entry.request.captureTargets[i] = (uint32_t)PtrToUlong(cap.captureTargetHandles[i]);
+        entry.id                = cap.id;
+        entry.waitingForTargets = cap.waitingForTargets;
+        entry.targetsGeneration = cap.targetsGeneration;
+        entry.configGeneration  = cap.configGeneration;
+        captures.push_back(entry);
+    }
+
+    DwmHandover handover;
+    std::memset(&handover, 0, sizeof(handover));
+    handover.version         = DD4SEVEN_HANDOVER_VERSION;
+    handover.createSwapChain = g_createSwapChainHooked ? g_createSwapChain : nullptr;
+    handover.recording       = recording::g_file;
+    handover.swapChainCount  = uint32_t(g_swapChains.snapshot(handover.swapChains));
+    handover.captureCount    = uint32_t(captures.size());
+    handover.captures        = captures.data();
+
+    // Our hooks have to be out of the way before the new version puts in its own
+    Unhook();
+
+    // The new version hooks in TakeOver() then, instead of on a thread of its own
+    SetEnvironmentVariableW(DD4SEVEN_UPGRADE_VARIABLE, L"1");
+    HMODULE next = LoadLibraryW(path);
+    SetEnvironmentVariableW(DD4SEVEN_UPGRADE_VARIABLE, nullptr);
+
+    // Nothing is hooked by the new version before TakeOver(), and it only gets
+    // called if it speaks our handover version
+    auto handoverVersion = next ? (uint32_t (__cdecl *)())GetProcAddress(next, DD4SEVEN_HANDOVER_VERSION_EXPORT) : nullptr;
+    auto takeOver = next ? (BOOL (__cdecl *)(const DwmHandover *))GetProcAddress(next, DD4SEVEN_TAKE_OVER_EXPORT) : nullptr;
+    bool tookOver = false;
+    if (!handoverVersion || !takeOver)
+        logger << "Upgrade to " << util::wcsdup_to_utf8(path) << " failed: not loaded or no handover exports" << std::endl;
+    else if (handoverVersion() != DD4SEVEN_HANDOVER_VERSION)
+        logger << "Upgrade to " << util::wcsdup_to_utf8(path) << " failed: handover version " << handoverVersion() << std::endl;
+    else if (!takeOver(&handover))
+        logger << "Upgrade to " << util::wcsdup_to_utf8(path) << " failed in " << DD4SEVEN_TAKE_OVER_EXPORT << std::endl;
+    else
+        tookOver = true;
+
+    if (!tookOver) {
+        // The new version put back what it changed, if it got that far
+        if (next)
+            FreeLibrary(next);
+
+        // Carry on as if nothing happened
+        MH_STATUS status = MH_EnableHook(MH_ALL_HOOKS);
+        if (status)
+            logger << "Upgrade: MH_EnableHook() returned status " << status << std::endl;
+
+        for (uint32_t i = 0; i < handover.swapChainCount; ++i) {
+            // We wouldn't learn when it's gone
+            if (!HookSwapChainMethods((IDXGISwapChainDWM*)handover.swapChains[i])) {
+                logger << "Upgrade: lost swap chain " << handover.swapChains[i] << std::endl;
+                g_swapChains.remove(handover.swapChains[i]);
+            }
+        }
+
+        return FALSE;
+    }
+
+    // The new version has its own handles on everything now
+    g_retired = true;
+    for (uint32_t i = 0; i < handover.swapChainCount; ++i)
+        g_swapChains.remove(handover.swapChains[i]);
+    g_capturing.clear();
+    for (GpuTimerSlot &slot : g_gpuTimer.slots)
+        slot = GpuTimerSlot();
+    g_gpuTimer.device.reset();
+    recording::g_file = nullptr;
+
+    DestroyWindow(window);
+    UnregisterClass(DD4SEVEN_WINDOW_NAME, g_instance);
+
+    QueryPerformanceCounter(&end);
+    logger << "Handed " << handover.captureCount << " captures and " << handover.swapChainCount << " swap chains over to "
+           << util::wcsdup_to_utf8(path) << " in " << TicksToMicroseconds(end.QuadPart - start.QuadPart) << "us" << std::endl;
+
+    HANDLE thread = CreateThread(nullptr, 0, UnloadThread, nullptr, 0, nullptr);
+    if (thread)
+        CloseHandle(thread);
+    else
+        logger << "Staying loaded, CreateThread failed: " << GetLastError() << std::endl;
+
+    return TRUE;
+}
+
+extern "C" __declspec(dllexport) uint32_t __cdecl HandoverVersion()
+{
+    return DD4SEVEN_HANDOVER_VERSION;
+}
+
+// DllMain left out StartupThread(), its work is done here instead: waiting
+// for a thread of our own would hold up the DWM for as long as it takes to
+// get scheduled.
+bool TakeOverFrom(const DwmHandover *handover)
+{
+    if (!handover || handover->version != DD4SEVEN_HANDOVER_VERSION) {
+        logger << "Can't take over from version " << (handover ? handover->version : 0) << std::endl;
+        return false;
+    }
+
+    if (!g_upgradeCreateDXGIFactory) {
+        logger << "Not loaded for an upgrade" << std::endl;
+        return false;
+    }
+
+    LARGE_INTEGER start, end;
+    QueryPerformanceCounter(&start);
+
+    trace::init();
+
+    StartupTimer timer(start.QuadPart);
+    if (!HookIt(g_upgradeCreateDXGIFactory, timer))
+        return false;
+
+    if (!handover->createSwapChain)
+        HookOwnFactory(timer);
+    else if (!g_createSwapChainHooked && !HookCreateSwapChain(handover->createSwapChain))
+        return false;
+
+    for (uint32_t i = 0; i < handover->swapChainCount && i < DD4SEVEN_HANDOVER_SWAP_CHAINS; ++i) {
+        if (!HookSwapChain((IDXGISwapChainDWM*)handover->swapChains[i]))
+            return false;
+    }
+
+    // Before InitializePresentThread(), which would start a recording of its own
+    recording::g_file = (recording::Header*)handover->recording;
+
+    for (uint32_t i = 0; i < handover->captureCount; ++i) {
+        const CaptureHandover &entry = handover->captures[i];
+        CaptureRequest req = entry.request;
+        Capture cap;
+
+        if (!OpenCapture(req, cap)) {
+            logger << "Couldn't take over capture " << entry.id << std::endl;
+            continue;
+        }
+
+        // Bound to its swap chain again on the next Present
+        cap.id                = entry.id;
+        cap.waitingForTargets = entry.waitingForTargets != 0;
+        cap.targetsGeneration = entry.targetsGeneration;
+        cap.configGeneration  = entry.configGeneration;
+        g_nextCaptureId = std::max(g_nextCaptureId, cap.id + 1);
+
+        g_capturing.push_back(std::move(cap));
+    }
+
+    InitializePresentThread();
+    SetEvent(g_started);
+
+    QueryPerformanceCounter(&end);
+    logger << "Took over " << g_capturing.size() << " captures and " << handover->swapChainCount << " swap chains in "
+           << TicksToMicroseconds(end.QuadPart - start.QuadPart) << "us" << std::endl;
+    trace::write(trace::EVENT_TAKEN_OVER, uint32_t(g_capturing.size()), handover->swapChainCount,
+                 TicksToMicroseconds(end.QuadPart - start.QuadPart));
+
+    return true;
+}
+
+// Puts back everything TakeOverFrom() did, for the older version to carry on.
+// Our DLL_PROCESS_DETACH mustn't touch anything later, the hooks are theirs.
+void AbandonTakeOver()
+{
+    g_retired = true;
+
+    Unhook();
+    MH_Uninitialize();
+
+    void *swapChains[DD4SEVEN_HANDOVER_SWAP_CHAINS];
+    size_t count = g_swapChains.snapshot(swapChains);
+    for (size_t i = 0; i < count; ++i)
+        g_swapChains.remove(swapChains[i]);
+
+    g_capturing.clear();
+    recording::g_file = nullptr;
+}
+
+// Called by an older version in UpgradeTo(), on the thread that presents
+extern "C" __declspec(dllexport) BOOL __cdecl TakeOver(const DwmHandover *handover)
+{
+    if (TakeOverFrom(handover))
+        return TRUE;
+
+    AbandonTakeOver();
+    return FALSE;
+}
+
+BOOLEAN WINAPI DllMain(HINSTANCE hDllHandle,
+                       DWORD     nReason,
+                       LPVOID    Reserved)
+{
+    g_instance = hDllHandle;
+
+    switch (nReason)
+    {
+        case DLL_PROCESS_ATTACH:
+        {
+            LARGE_INTEGER start;
+            QueryPerformanceCounter(&start);
+            g_attachStart = start.QuadPart;
+
+            DisableThreadLibraryCalls(hDllHandle);
+
+            // "I don't wanna go to school
+            //  I just wanna break the rules"
+            //
+            // Don't do anything scary in DllMain.
+            // Raymond Chen will hate me.
+
+            void *createDxgiFactory = nullptr;
+            bool  realDwm = false;
+
+            HMODULE hDxgi = GetModuleHandleA("dxgi.dll");
+            HMODULE hDwm  = GetModuleHandleA("dwm.exe");
+            if (hDxgi && hDwm) {
+                logger << "Found DXGI.DLL inside DWM.EXE" << std::endl;
+
+                createDxgiFactory = (void*)GetProcAddress(hDxgi, "CreateDXGIFactory");
+                realDwm = true;
+            } else if (GetEnvironmentVariableW(FAKE_DWM_VARIABLE, nullptr, 0)) {
+                // dd4seven-fakedwm.exe hands out its own IDXGIFactoryDWM, see there
+                logger << "Running inside a stand-in DWM" << std::endl;
+
+                createDxgiFactory = (void*)GetProcAddress(GetModuleHandleW(nullptr), FAKE_DWM_FACTORY_EXPORT);
+            }
+
+            if (!createDxgiFactory)
+                return FALSE;
+
+            g_started = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+            if (g_started && GetEnvironmentVariableW(DD4SEVEN_UPGRADE_VARIABLE, nullptr, 0)) {
+                logger << "Loaded for an upgrade" << std::endl;
+                g_upgradeCreateDXGIFactory = createDxgiFactory;
+                break;
+            }
+
+            HANDLE thread = g_started ? CreateThread(nullptr, 0, StartupThread, createDxgiFactory, CREATE_SUSPENDED, nullptr) : nullptr;
+            if (!thread) {
+                logger << "Failed: CreateThread: " << GetLastError() << std::endl;
+                return FALSE;
+            }
+
+            // Keeps us loaded until StartupThread is done
+            HMODULE self = nullptr;
+            GetModuleHandleEx(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS, reinterpret_cast<LPCWSTR>(&StartupThread), &self);
+
+            // It should beat the DWM to creating its swap chains. If it doesn't,
+            // the DWM's CreateDXGIFactory waits for it.
+            SetThreadPriority(thread, THREAD_PRIORITY_HIGHEST);
+            if (realDwm) {
+                g_createDXGIFactory = createDxgiFactory;
+                size_t redirected = imports::redirect("dxgi.dll", createDxgiFactory, (void*)EarlyCreateDXGIFactory);
+                logger << "Startup: redirected " << redirected << " imports of CreateDXGIFactory" << std::endl;
+            }
+
+            LARGE_INTEGER end;
+            QueryPerformanceCounter(&end);
+            g_attachEnd = end.QuadPart;
+
+            ResumeThread(thread);
+            CloseHandle(thread);
+            break;
+        }
+        case DLL_PROCESS_DETACH:
+            // Unloaded without handing over (nothing to do when the process exits):
+            // nothing may point into this DLL anymore
+            if (!Reserved && !g_retired) {
+                Unhook();
+                MH_Uninitialize();
+            }
             break;
     }
 
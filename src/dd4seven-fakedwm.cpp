@@ -0,0 +1,715 @@
+// Copyright (C) 2015 Jonas Kümmerlin <rgcjonas@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+/*
+ * Stand-in for dwm.exe, to run dd4seven-dwm.dll without a real compositor
+ *
+ * Usage: dd4seven-fakedwm.exe [--fps <n>] [--seconds <n>]
+ *
+ * Loads dd4seven-dwm.dll into a process that hands out its own IDXGIFactoryDWM
+ * and IDXGISwapChainDWM, backed by a WARP device and covering the first output,
+ * and presents synthetic content at the given rate. Meanwhile, a second copy of
+ * itself duplicates that output through dd4seven-api.dll, like any application would.
+ *
+ * Both print what they measured as "name value" lines: the host how long its
+ * Presents took (that is, what the hook spent copying), the client how many frames
+ * it got and how long after the Present they arrived. Runs under Wine, too.
+ */
+
+#include <dxgi.h>
+#include <dxgi1_2.h>
+#include <dxgi_dwm.h>
+#include <d3d10_1.h>
+#include <d3d11.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <vector>
+
+#include "com.hpp"
+#include "util.hpp"
+#include "protocol.hpp"
+#include "dd4seven-api.hpp"
+
+// Shared between host and client, named after the host's process id
+struct PresentClock
+{
+    volatile LONG64 presents;
+    volatile LONG64 lastPresent; // QueryPerformanceCounter right before the latest Present, i.e. before the hook copied
+};
+
+static void clock_name(wchar_t (&buffer)[40], DWORD host)
+{
+    _snwprintf(buffer, 40, L"dd4seven-fakedwm-%lu", (unsigned long)host);
+}
+
+static double ticks_to_microseconds(LONGLONG ticks)
+{
+    static LARGE_INTEGER frequency;
+    static BOOL qpcAvailable = QueryPerformanceFrequency(&frequency);
+
+    return qpcAvailable ? double(ticks) * 1000000.0 / double(frequency.QuadPart) : 0.0;
+}
+
+static LONGLONG now()
+{
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+
+    return counter.QuadPart;
+}
+
+// The output a real DWM would draw to. Its DeviceName is what captures are matched by.
+static com::ptr<IDXGIOutput> first_output()
+{
+    util::dll_func<HRESULT (REFIID, void **)> createFactory { L"dxgi.dll", "CreateDXGIFactory" };
+
+    com::ptr<IDXGIFactory> factory;
+    com::ptr<IDXGIAdapter> adapter;
+    com::ptr<IDXGIOutput>  output;
+
+    if (!createFactory
+        || FAILED(createFactory(__uuidof(IDXGIFactory), com::out_arg_void(factory)))
+        || FAILED(factory->EnumAdapters(0, com::out_arg(adapter)))
+        || FAILED(adapter->EnumOutputs(0, com::out_arg(output))))
+    {
+        fprintf(stderr, "No output to present to\n");
+        return com::ptr<IDXGIOutput>();
+    }
+
+    return output;
+}
+
+/*********************************
+ * THE FAKE DWM INTERFACES
+ *********************************/
+
+class FakeSwapChain : public IDXGISwapChainDWM, public com::obj_impl_base
+{
+    com::ptr<ID3D10Device1>   m_device;
+    com::ptr<IDXGIOutput>     m_output;
+    com::ptr<ID3D10Texture2D> m_buffer;
+    DXGI_SWAP_CHAIN_DESC      m_desc;
+    UINT                      m_presents { 0 };
+
+    // One interface is enough for the DWM hook, which keeps a watch there
+    GUID                      m_privateGuid {};
+    com::ptr<IUnknown>        m_privateData;
+
+    HRESULT createBuffer()
+    {
+        D3D10_TEXTURE2D_DESC desc;
+        memset(&desc, 0, sizeof(desc));
+        desc.Width            = m_desc.BufferDesc.Width;
+        desc.Height           = m_desc.BufferDesc.Height;
+        desc.MipLevels        = 1;
+        desc.ArraySize        = 1;
+        desc.Format           = m_desc.BufferDesc.Format;
+        desc.SampleDesc.Count = 1;
+        desc.Usage            = D3D10_USAGE_DEFAULT;
+        desc.BindFlags        = D3D10_BIND_RENDER_TARGET | D3D10_BIND_SHADER_RESOURCE;
+
+        return m_device->CreateTexture2D(&desc, nullptr, com::out_arg(m_buffer));
+    }
+
+protected:
+    void *_queryInterface(REFIID iid)
+    {
+        return com::query_impl<IDXGISwapChainDWM, IDXGIDeviceSubObject, IDXGIObject>::on(this, iid);
+    }
+
+public:
+    FakeSwapChain(const com::ptr<ID3D10Device1> &device, const com::ptr<IDXGIOutput> &output, const DXGI_SWAP_CHAIN_DESC &desc)
+        : m_device(device)
+        , m_output(output)
+        , m_desc(desc)
+    {
+        createBuffer();
+    }
+
+    bool good()
+    {
+        return bool(m_buffer);
+    }
+
+    /*** IDXGIObject methods ***/
+    HRESULT STDMETHODCALLTYPE SetPrivateData(
+        REFGUID guid,
+        UINT data_size,
+        const void *data) override
+    {
+        (void)guid;
+        (void)data_size;
+        (void)data;
+
+        return E_NOTIMPL;
+    }
+
+    HRESULT STDMETHODCALLTYPE SetPrivateDataInterface(
+        REFGUID guid,
+        const IUnknown *object) override
+    {
+        if (m_privateData && guid != m_privateGuid)
+            return E_OUTOFMEMORY;
+
+        IUnknown *data = const_cast<IUnknown*>(object);
+        if (data)
+            data->AddRef();
+
+        m_privateGuid = guid;
+        m_privateData = com::take_ptr(data);
+
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE GetPrivateData(
+        REFGUID guid,
+        UINT *data_size,
+        void *data) override
+    {
+        if (!data_size)
+            return E_INVALIDARG;
+
+        if (!m_privateData || guid != m_privateGuid)
+            return DXGI_ERROR_NOT_FOUND;
+
+        if (!data || *data_size < sizeof(IUnknown*)) {
+            *data_size = sizeof(IUnknown*);
+            return data ? DXGI_ERROR_MORE_DATA : S_OK;
+        }
+
+        IUnknown *object = m_privateData;
+        object->AddRef();
+        std::memcpy(data, &object, sizeof(object));
+        *data_size = sizeof(object);
+
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE GetParent(
+        REFIID riid,
+        void **parent) override
+    {
+        (void)riid;
+        (void)parent;
+
+        return E_NOTIMPL;
+    }
+
+    /*** IDXGIDeviceSubObject methods ***/
+    HRESULT STDMETHODCALLTYPE GetDevice(
+        REFIID riid,
+        void **device) override
+    {
+        return m_device->QueryInterface(riid, device);
+    }
+
+    /*** IDXGISwapChainDWM methods ***/
+
+    // Present and ResizeBuffers get hooked by patching their code, so the
+    // compiler must not inline them where it can guess the dynamic type.
+    __attribute__((noinline))
+    HRESULT STDMETHODCALLTYPE Present(
+        UINT SyncInterval,
+        UINT Flags) override
+    {
+        (void)SyncInterval;
+        (void)Flags;
+
+        m_device->Flush();
+        m_presents++;
+
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE GetBuffer(
+        UINT Buffer,
+        REFIID riid,
+        void **ppSurface) override
+    {
+        if (Buffer != 0)
+            return DXGI_ERROR_INVALID_CALL;
+
+        return m_buffer->QueryInterface(riid, ppSurface);
+    }
+
+    HRESULT STDMETHODCALLTYPE GetDesc(
+        DXGI_SWAP_CHAIN_DESC *pDesc) override
+    {
+        if (!pDesc)
+            return E_INVALIDARG;
+
+        *pDesc = m_desc;
+        return S_OK;
+    }
+
+    __attribute__((noinline))
+    HRESULT STDMETHODCALLTYPE ResizeBuffers(
+        UINT BufferCount,
+        UINT Width,
+        UINT Height,
+        DXGI_FORMAT NewFormat,
+        UINT SwapChainFlags) override
+    {
+        (void)BufferCount;
+
+        m_desc.BufferDesc.Width  = Width;
+        m_desc.BufferDesc.Height = Height;
+        m_desc.Flags             = SwapChainFlags;
+        if (NewFormat != DXGI_FORMAT_UNKNOWN)
+            m_desc.BufferDesc.Format = NewFormat;
+
+        return createBuffer();
+    }
+
+    HRESULT STDMETHODCALLTYPE ResizeTarget(
+        const DXGI_MODE_DESC *pNewTargetParameters) override
+    {
+        (void)pNewTargetParameters;
+
+        return E_NOTIMPL;
+    }
+
+    HRESULT STDMETHODCALLTYPE GetContainingOutput(
+        IDXGIOutput **ppOutput) override
+    {
+        return m_output->QueryInterface(__uuidof(IDXGIOutput), reinterpret_cast<void**>(ppOutput));
+    }
+
+    HRESULT STDMETHODCALLTYPE GetFrameStatistics(
+        DXGI_FRAME_STATISTICS *pStats) override
+    {
+        (void)pStats;
+
+        return DXGI_ERROR_FRAME_STATISTICS_DISJOINT;
+    }
+
+    HRESULT STDMETHODCALLTYPE GetLastPresentCount(
+        UINT *pLastPresentCount) override
+    {
+        if (!pLastPresentCount)
+            return E_INVALIDARG;
+
+        *pLastPresentCount = m_presents;
+        return S_OK;
+    }
+};
+
+class FakeFactory : public IDXGIFactoryDWM, public com::obj_impl_base
+{
+protected:
+    void *_queryInterface(REFIID iid)
+    {
+        return com::query_impl<IDXGIFactoryDWM>::on(this, iid);
+    }
+
+public:
+    // Hooked as well, see FakeSwapChain::Present
+    __attribute__((noinline))
+    HRESULT STDMETHODCALLTYPE CreateSwapChain(
+        IUnknown *pDevice,
+        DXGI_SWAP_CHAIN_DESC *pDesc,
+        IDXGIOutput *pOutput,
+        IDXGISwapChainDWM **ppSwapChainDWM) override
+    {
+        if (!pDevice || !pDesc || !pOutput || !ppSwapChainDWM)
+            return E_INVALIDARG;
+
+        *ppSwapChainDWM = nullptr;
+
+        com::ptr<ID3D10Device1> device;
+        com::ptr<IDXGIOutput>   output;
+        if (FAILED(pDevice->QueryInterface(__uuidof(ID3D10Device1), com::out_arg_void(device)))
+            || FAILED(pOutput->QueryInterface(__uuidof(IDXGIOutput), com::out_arg_void(output))))
+        {
+            return E_INVALIDARG;
+        }
+
+        com::ptr<FakeSwapChain> chain = com::make_object<FakeSwapChain>(device, output, *pDesc);
+        if (!chain->good())
+            return E_OUTOFMEMORY;
+
+        com::ptr<IDXGISwapChainDWM> swap = chain;
+        *ppSwapChainDWM = swap.release();
+
+        return S_OK;
+    }
+};
+
+// What dd4seven-dwm.dll hooks instead of dxgi.dll!CreateDXGIFactory, see FAKE_DWM_FACTORY_EXPORT.
+// Like the real one, it hands out a factory that also implements IDXGIFactoryDWM.
+extern "C" __declspec(dllexport) __attribute__((noinline))
+HRESULT __stdcall FakeCreateDXGIFactory(REFIID iid, void **factory)
+{
+    if (!factory)
+        return E_INVALIDARG;
+
+    com::ptr<FakeFactory> fake = com::make_object<FakeFactory>();
+
+    return fake->QueryInterface(iid, factory);
+}
+
+/*********************************
+ * HOST: PRESENTS LIKE THE DWM
+ *********************************/
+
+static int run_host(unsigned fps, unsigned seconds)
+{
+    HRESULT hr;
+
+    // Load the hook like AppInit_DLLs would, but tell it to accept us as DWM.
+    // The client we start later shouldn't see the variable.
+    SetEnvironmentVariableW(FAKE_DWM_VARIABLE, L"1");
+    HMODULE hook = LoadLibraryW(L"dd4seven-dwm.dll");
+    SetEnvironmentVariableW(FAKE_DWM_VARIABLE, nullptr);
+    if (!hook) {
+        fprintf(stderr, "Couldn't load dd4seven-dwm.dll (error %lu)\n", (unsigned long)GetLastError());
+        return 1;
+    }
+
+    // The real DWM doesn't wait, it's just slower to create its swap chains than we are
+    auto waitForStartup = (BOOL (__cdecl *)(DWORD))GetProcAddress(hook, DWM_WAIT_FOR_STARTUP_EXPORT);
+    if (!waitForStartup || !waitForStartup(5000)) {
+        fprintf(stderr, "dd4seven-dwm.dll didn't start up\n");
+        return 1;
+    }
+
+    com::ptr<IDXGIOutput> output = first_output();
+    if (!output)
+        return 1;
+
+    DXGI_OUTPUT_DESC outputDesc;
+    output->GetDesc(&outputDesc);
+
+    util::dll_func<HRESULT (IDXGIAdapter *,
+                            D3D10_DRIVER_TYPE,
+                            HMODULE,
+                            UINT,
+                            D3D10_FEATURE_LEVEL1,
+                            UINT,
+                            ID3D10Device1 **)> createDevice { L"d3d10_1.dll", "D3D10CreateDevice1" };
+
+    com::ptr<ID3D10Device1> device;
+    if (!createDevice) {
+        fprintf(stderr, "No D3D10CreateDevice1\n");
+        return 1;
+    }
+
+    hr = createDevice(nullptr, D3D10_DRIVER_TYPE_WARP, nullptr, D3D10_CREATE_DEVICE_BGRA_SUPPORT,
+                      D3D10_FEATURE_LEVEL_10_1, D3D10_1_SDK_VERSION, com::out_arg(device));
+    if FAILED(hr) {
+        fprintf(stderr, "Couldn't create a WARP device: %s\n", util::hresult_to_utf8(hr).c_str());
+        return 1;
+    }
+
+    // Goes through the hook, which hooked CreateSwapChain on a factory of its own already
+    com::ptr<IDXGIFactoryDWM> factory;
+    hr = FakeCreateDXGIFactory(__uuidof(IDXGIFactoryDWM), com::out_arg_void(factory));
+    if FAILED(hr) {
+        fprintf(stderr, "Couldn't create the fake factory: %s\n", util::hresult_to_utf8(hr).c_str());
+        return 1;
+    }
+
+    DXGI_SWAP_CHAIN_DESC desc;
+    memset(&desc, 0, sizeof(desc));
+    desc.BufferDesc.Width  = UINT(outputDesc.DesktopCoordinates.right - outputDesc.DesktopCoordinates.left);
+    desc.BufferDesc.Height = UINT(outputDesc.DesktopCoordinates.bottom - outputDesc.DesktopCoordinates.top);
+    desc.BufferDesc.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
+    desc.SampleDesc.Count  = 1;
+    desc.BufferUsage       = DXGI_USAGE_RENDER_TARGET_OUTPUT;
+    desc.BufferCount       = 1;
+    desc.Windowed          = TRUE;
+
+    // And this goes through the hook as well, which then hooks Present and ResizeBuffers
+    com::ptr<IDXGISwapChainDWM> swap;
+    hr = factory->CreateSwapChain(device.get(), &desc, output.get(), com::out_arg(swap));
+    if FAILED(hr) {
+        fprintf(stderr, "Couldn't create the fake swap chain: %s\n", util::hresult_to_utf8(hr).c_str());
+        return 1;
+    }
+
+    com::ptr<ID3D10Texture2D>        buffer;
+    com::ptr<ID3D10RenderTargetView> renderTarget;
+    hr = swap->GetBuffer(0, __uuidof(ID3D10Texture2D), com::out_arg_void(buffer));
+    if SUCCEEDED(hr)
+        hr = device->CreateRenderTargetView(buffer.get(), nullptr, com::out_arg(renderTarget));
+    if FAILED(hr) {
+        fprintf(stderr, "Couldn't render to the fake swap chain: %s\n", util::hresult_to_utf8(hr).c_str());
+        return 1;
+    }
+
+    // Tell the client what we presented when
+    wchar_t name[40];
+    clock_name(name, GetCurrentProcessId());
+
+    HANDLE clockMapping = CreateFileMapping(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, sizeof(PresentClock), name);
+    PresentClock *clock = clockMapping ? (PresentClock*)MapViewOfFile(clockMapping, FILE_MAP_WRITE, 0, 0, sizeof(PresentClock)) : nullptr;
+    if (!clock) {
+        fprintf(stderr, "Couldn't share the present clock (error %lu)\n", (unsigned long)GetLastError());
+        return 1;
+    }
+
+    // The client is just another copy of us
+    wchar_t path[MAX_PATH];
+    wchar_t commandLine[MAX_PATH + 64];
+    GetModuleFileNameW(nullptr, path, MAX_PATH);
+    _snwprintf(commandLine, MAX_PATH + 64, L"\"%ls\" --client %lu --seconds %u",
+               path, (unsigned long)GetCurrentProcessId(), seconds);
+
+    STARTUPINFOW startup;
+    memset(&startup, 0, sizeof(startup));
+    startup.cb = sizeof(startup);
+    PROCESS_INFORMATION client;
+    if (!CreateProcessW(nullptr, commandLine, nullptr, nullptr, FALSE, 0, nullptr, nullptr, &startup, &client)) {
+        fprintf(stderr, "Couldn't start the client (error %lu)\n", (unsigned long)GetLastError());
+        return 1;
+    }
+    CloseHandle(client.hThread);
+
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+
+    const LONGLONG interval = frequency.QuadPart / std::max(fps, 1u);
+    const LONGLONG start    = now();
+    const LONGLONG deadline = start + (LONGLONG(seconds) + 10) * frequency.QuadPart; // in case the client hangs
+    LONGLONG       nextDue  = start;
+
+    uint64_t presents     = 0;
+    LONGLONG presentTicks = 0;
+    LONGLONG maxPresent   = 0;
+
+    while (WaitForSingleObject(client.hProcess, 0) == WAIT_TIMEOUT && now() < deadline) {
+        // Something that changes on every frame
+        float color[4] = { float(presents % 256) / 255.0f, 0.5f, float((presents / 256) % 256) / 255.0f, 1.0f };
+        device->ClearRenderTargetView(renderTarget.get(), color);
+
+        LONGLONG before = now();
+        InterlockedExchange64(&clock->lastPresent, before);
+        swap->Present(1, 0);
+        LONGLONG took = now() - before;
+        InterlockedIncrement64(&clock->presents);
+
+        presents++;
+        presentTicks += took;
+        maxPresent    = std::max(maxPresent, took);
+
+        // Sleep until the next frame is due, and spin for the last bit the scheduler can't do
+        nextDue += interval;
+        LONGLONG remaining = nextDue - now();
+        if (remaining < -interval) {
+            nextDue = now(); // too slow, don't try to catch up
+        } else {
+            if (remaining * 1000 / frequency.QuadPart > 1)
+                Sleep(DWORD(remaining * 1000 / frequency.QuadPart - 1));
+            while (now() < nextDue)
+                YieldProcessor();
+        }
+    }
+
+    double elapsed = ticks_to_microseconds(now() - start) / 1000000.0;
+
+    WaitForSingleObject(client.hProcess, INFINITE);
+    DWORD clientResult = 1;
+    GetExitCodeProcess(client.hProcess, &clientResult);
+    CloseHandle(client.hProcess);
+
+    printf("host.presents %llu\n", (unsigned long long)presents);
+    printf("host.fps %.2f\n", elapsed > 0 ? double(presents) / elapsed : 0.0);
+    printf("host.present_us_avg %.2f\n", presents ? ticks_to_microseconds(presentTicks) / double(presents) : 0.0);
+    printf("host.present_us_max %.2f\n", ticks_to_microseconds(maxPresent));
+    fflush(stdout);
+
+    UnmapViewOfFile(clock);
+    CloseHandle(clockMapping);
+
+    return int(clientResult);
+}
+
+/*********************************
+ * CLIENT: DUPLICATES THE OUTPUT
+ *********************************/
+
+static double percentile(const std::vector<double> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0.0;
+
+    return sorted[std::min(sorted.size() - 1, size_t(p * double(sorted.size())))];
+}
+
+static int run_client(DWORD host, unsigned seconds)
+{
+    HRESULT hr;
+
+    wchar_t name[40];
+    clock_name(name, host);
+
+    // Mapped writable only because the interlocked read below needs it
+    HANDLE clockMapping = OpenFileMapping(FILE_MAP_WRITE, FALSE, name);
+    PresentClock *clock = clockMapping ? (PresentClock*)MapViewOfFile(clockMapping, FILE_MAP_WRITE, 0, 0, sizeof(PresentClock)) : nullptr;
+    if (!clock) {
+        fprintf(stderr, "No present clock for process %lu\n", (unsigned long)host);
+        return 1;
+    }
+
+    util::dll_func<HRESULT (IDXGIOutput *, IUnknown *, IDXGIOutputDuplication **)> duplicate { L"dd4seven-api.dll", "DuplicateOutput" };
+    util::dll_func<HRESULT (IDXGIOutputDuplication *, DD4SEVEN_DUPLICATION_STATISTICS *)> statistics { L"dd4seven-api.dll", "GetDuplicationStatistics" };
+    util::dll_func<HRESULT (IDXGIAdapter *,
+                            D3D_DRIVER_TYPE,
+                            HMODULE,
+                            UINT,
+                            const D3D_FEATURE_LEVEL *,
+                            UINT,
+                            UINT,
+                            ID3D11Device **,
+                            D3D_FEATURE_LEVEL *,
+                            ID3D11DeviceContext **)> createDevice { L"d3d11.dll", "D3D11CreateDevice" };
+
+    if (!duplicate || !statistics || !createDevice) {
+        fprintf(stderr, "Couldn't load dd4seven-api.dll or d3d11.dll\n");
+        return 1;
+    }
+
+    com::ptr<IDXGIOutput> output = first_output();
+    if (!output)
+        return 1;
+
+    // Same adapter as the host, or the textures can't be shared
+    com::ptr<ID3D11Device>        device;
+    com::ptr<ID3D11DeviceContext> context;
+    hr = createDevice(nullptr, D3D_DRIVER_TYPE_WARP, nullptr, D3D11_CREATE_DEVICE_BGRA_SUPPORT,
+                      nullptr, 0, D3D11_SDK_VERSION, com::out_arg(device), nullptr, com::out_arg(context));
+    if FAILED(hr) {
+        fprintf(stderr, "Couldn't create a WARP device: %s\n", util::hresult_to_utf8(hr).c_str());
+        return 1;
+    }
+
+    // The hook only starts listening on the first Present
+    com::ptr<IDXGIOutputDuplication> duplication;
+    for (int attempt = 0; attempt < 50; ++attempt) {
+        hr = duplicate(output.get(), device.get(), com::out_arg(duplication));
+        if (hr != DXGI_ERROR_NOT_CURRENTLY_AVAILABLE)
+            break;
+
+        Sleep(100);
+    }
+
+    if FAILED(hr) {
+        fprintf(stderr, "DuplicateOutput failed: %s\n", util::hresult_to_utf8(hr).c_str());
+        return 1;
+    }
+
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+
+    const LONGLONG start = now();
+    const LONGLONG end   = start + LONGLONG(seconds) * frequency.QuadPart;
+
+    std::vector<double> latencies; // microseconds
+    uint64_t timeouts = 0;
+    bool     failed   = false;
+
+    while (now() < end) {
+        DXGI_OUTDUPL_FRAME_INFO  info;
+        com::ptr<IDXGIResource> resource;
+        hr = duplication->AcquireNextFrame(100, &info, com::out_arg(resource));
+        LONGLONG acquired = now();
+
+        if (hr == DXGI_ERROR_WAIT_TIMEOUT) {
+            timeouts++;
+            continue;
+        }
+
+        if (hr == DXGI_ERROR_MODE_CHANGE_IN_PROGRESS)
+            continue;
+
+        if FAILED(hr) {
+            fprintf(stderr, "AcquireNextFrame failed: %s\n", util::hresult_to_utf8(hr).c_str());
+            failed = true;
+            break;
+        }
+
+        // If we fell behind, this is the latest Present instead of the one we got
+        // the frame from, so the latency comes out a bit too good.
+        LONGLONG presented = InterlockedCompareExchange64(&clock->lastPresent, 0, 0);
+        latencies.push_back(ticks_to_microseconds(acquired - presented));
+
+        duplication->ReleaseFrame();
+    }
+
+    double elapsed = ticks_to_microseconds(now() - start) / 1000000.0;
+
+    std::vector<double> sorted(latencies);
+    std::sort(sorted.begin(), sorted.end());
+    double sum = 0.0;
+    for (double latency : sorted)
+        sum += latency;
+
+    printf("client.frames %llu\n", (unsigned long long)sorted.size());
+    printf("client.timeouts %llu\n", (unsigned long long)timeouts);
+    printf("client.fps %.2f\n", elapsed > 0 ? double(sorted.size()) / elapsed : 0.0);
+    printf("client.latency_us_avg %.2f\n", sorted.empty() ? 0.0 : sum / double(sorted.size()));
+    printf("client.latency_us_p50 %.2f\n", percentile(sorted, 0.50));
+    printf("client.latency_us_p99 %.2f\n", percentile(sorted, 0.99));
+    printf("client.latency_us_max %.2f\n", sorted.empty() ? 0.0 : sorted.back());
+
+    DD4SEVEN_DUPLICATION_STATISTICS stats;
+    if SUCCEEDED(statistics(duplication.get(), &stats)) {
+        printf("dwm.presents %llu\n", (unsigned long long)stats.FramesPresented);
+        printf("dwm.copies %llu\n", (unsigned long long)stats.FramesCopied);
+        printf("dwm.skipped_locked %llu\n", (unsigned long long)stats.FramesSkippedLocked);
+        printf("dwm.deferred %llu\n", (unsigned long long)stats.FramesDeferred);
+        printf("dwm.copy_us_avg %.2f\n", stats.FramesCopied ? double(stats.CopyTimeUs) / double(stats.FramesCopied) : 0.0);
+    }
+
+    fflush(stdout);
+
+    UnmapViewOfFile(clock);
+    CloseHandle(clockMapping);
+
+    return failed ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned fps     = 60;
+    unsigned seconds = 10;
+    DWORD    host    = 0;
+
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--fps") && i + 1 < argc) {
+            fps = unsigned(strtoul(argv[++i], nullptr, 10));
+        } else if (!strcmp(argv[i], "--seconds") && i + 1 < argc) {
+            seconds = unsigned(strtoul(argv[++i], nullptr, 10));
+        } else if (!strcmp(argv[i], "--client") && i + 1 < argc) {
+            host = DWORD(strtoul(argv[++i], nullptr, 10));
+        } else {
+            fprintf(stderr, "Usage: %s [--fps <n>] [--seconds <n>]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    if (host)
+        return run_client(host, seconds);
+
+    return run_host(fps, seconds);
+}
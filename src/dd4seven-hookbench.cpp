@@ -0,0 +1,541 @@
+// Copyright (C) 2015 Jonas Kümmerlin <rgcjonas@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+/*
+ * MinHook benchmark
+ *
+ * Usage: dd4seven-hookbench.exe [--hooks <n>] [--hot-patch] [--threads <n>] [--seconds <n>]
+ *                               [--idle-threads <n>] [--fragment-mb <n>]
+ *
+ * Generates <n> small functions (4096 by default) in executable memory of our own
+ * and runs MinHook through the life cycle of a hook for all of them, one call at
+ * a time: create, look up (MH_QueueEnableHook, which doesn't patch anything),
+ * enable, call, disable and remove. Creating and removing happens in random order,
+ * the way the targets of the DWM are scattered over its modules. With --hot-patch
+ * (x86 only), the functions start with MOV EDI, EDI like those of Windows itself,
+ * so MinHook can switch them without freezing threads.
+ *
+ * Then <threads> threads (4 by default) fight over MinHook's lock for <seconds>
+ * seconds: all of them queue hooks, which holds the lock only briefly, while
+ * one more thread keeps enabling and disabling a hook, which holds it while all
+ * other threads are frozen. That gives the time a call waits for the lock and the
+ * contention counters of MH_GetLockStatistics.
+ *
+ * Last, it starts up to <idle-threads> threads (1024 by default) that do nothing,
+ * in steps, and times enabling plus disabling a hook at each step, as MinHook
+ * freezes every thread of the process for that.
+ *
+ * For the trampolines, MinHook needs memory close to the target. To see how long
+ * it searches for that, the address space <fragment-mb> MB (16 by default) around
+ * a target gets littered with one reserved page per 64 KB, then a hook is created
+ * and removed over and over, each time reserving and releasing memory again.
+ *
+ * Everything is printed as "name value" lines, per operation the average, median,
+ * 99th percentile and maximum duration in microseconds.
+ */
+
+#include <windows.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include "MinHook.h"
+
+typedef int (WINAPI *TargetFunc)();
+
+struct Options
+{
+    unsigned hooks             { 4096 };
+    bool     hotPatch          { false };
+    unsigned threads           { 4 };
+    unsigned seconds           { 2 };
+    unsigned idleThreads       { 1024 };
+    unsigned fragmentMegabytes { 16 };
+};
+
+static double ticks_to_microseconds(LONGLONG ticks)
+{
+    static LARGE_INTEGER frequency;
+    static BOOL qpcAvailable = QueryPerformanceFrequency(&frequency);
+
+    return qpcAvailable ? double(ticks) * 1000000.0 / double(frequency.QuadPart) : 0.0;
+}
+
+static LONGLONG now()
+{
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+
+    return counter.QuadPart;
+}
+
+static double percentile(const std::vector<double> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0.0;
+
+    return sorted[std::min(sorted.size() - 1, size_t(p * double(sorted.size())))];
+}
+
+// Prints <prefix>.<name>_us_{avg,p50,p99,max}
+static void print_samples(const char *prefix, const char *name, std::vector<double> samples)
+{
+    std::sort(samples.begin(), samples.end());
+
+    double sum = 0.0;
+    for (double sample : samples)
+        sum += sample;
+
+    printf("%s.%s_us_avg %.2f\n", prefix, name, samples.empty() ? 0.0 : sum / double(samples.size()));
+    printf("%s.%s_us_p50 %.2f\n", prefix, name, percentile(samples, 0.50));
+    printf("%s.%s_us_p99 %.2f\n", prefix, name, percentile(samples, 0.99));
+    printf("%s.%s_us_max %.2f\n", prefix, name, samples.empty() ? 0.0 : samples.back());
+}
+
+/*********************************
+ * TARGETS
+ *********************************/
+
+// Every target gets a slot of its own, filled with int3 around the code,
+// which leaves room for a hot patch above it
+static const size_t TARGET_SLOT_SIZE = 32;
+static const size_t TARGET_OFFSET = 8;
+
+static int WINAPI Detour()
+{
+    return -1;
+}
+
+// Writes <count> functions returning their index. The prologue (push, mov and
+// the mov of the result) is longer than a jump, so MinHook patches them in place
+// unless they are hot-patchable.
+static std::vector<TargetFunc> make_targets(unsigned count, bool hotPatch)
+{
+    std::vector<TargetFunc> targets;
+
+    SIZE_T size = SIZE_T(count) * TARGET_SLOT_SIZE;
+    BYTE *code = (BYTE *)VirtualAlloc(nullptr, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (!code)
+        return targets;
+
+    memset(code, 0xCC, size);
+    for (unsigned i = 0; i < count; ++i) {
+        BYTE *p = code + i * TARGET_SLOT_SIZE + TARGET_OFFSET;
+        targets.push_back((TargetFunc)p);
+
+        if (hotPatch) {
+            *p++ = 0x8B;                // mov edi, edi
+            *p++ = 0xFF;
+        }
+        *p++ = 0x55;                    // push ebp/rbp
+#ifdef _WIN64
+        *p++ = 0x48;                    // mov rbp, rsp
+        *p++ = 0x89;
+        *p++ = 0xE5;
+#else
+        *p++ = 0x8B;                    // mov ebp, esp
+        *p++ = 0xEC;
+#endif
+        *p++ = 0xB8;                    // mov eax, i
+        memcpy(p, &i, sizeof(i));
+        p += sizeof(i);
+        *p++ = 0x5D;                    // pop ebp/rbp
+        *p++ = 0xC3;                    // ret
+    }
+
+    DWORD oldProtect;
+    VirtualProtect(code, size, PAGE_EXECUTE_READ, &oldProtect);
+    FlushInstructionCache(GetCurrentProcess(), code, size);
+
+    return targets;
+}
+
+/*********************************
+ * LIFE CYCLE
+ *********************************/
+
+// Runs op on every target in the given order, returns how many failed
+template<typename Op>
+static unsigned measure(const char *name, const std::vector<TargetFunc> &targets, Op op)
+{
+    std::vector<double> samples;
+    samples.reserve(targets.size());
+    unsigned failed = 0;
+
+    for (TargetFunc target : targets) {
+        LONGLONG t0 = now();
+        MH_STATUS status = op(target);
+        LONGLONG t1 = now();
+
+        samples.push_back(ticks_to_microseconds(t1 - t0));
+        if (status != MH_OK)
+            ++failed;
+    }
+
+    print_samples("hooks", name, samples);
+    if (failed)
+        printf("hooks.%s_failed %u\n", name, failed);
+
+    return failed;
+}
+
+static bool run_life_cycle(const Options &options)
+{
+    std::vector<TargetFunc> targets = make_targets(options.hooks, options.hotPatch);
+    if (targets.size() != options.hooks) {
+        fprintf(stderr, "Failed to allocate %u targets\n", options.hooks);
+        return false;
+    }
+
+    std::vector<TargetFunc> shuffled = targets;
+    std::mt19937 random(0x44344437);
+    std::shuffle(shuffled.begin(), shuffled.end(), random);
+
+    printf("hooks.count %u\n", options.hooks);
+    printf("hooks.hot_patch %d\n", options.hotPatch ? 1 : 0);
+
+    unsigned failed = 0;
+    LONGLONG start = now();
+
+    failed += measure("create", shuffled, [](TargetFunc target) {
+        return MH_CreateHook((LPVOID)target, (LPVOID)&Detour, nullptr);
+    });
+    failed += measure("lookup", targets, [](TargetFunc target) {
+        return MH_QueueEnableHook((LPVOID)target);
+    });
+    failed += measure("enable", targets, [](TargetFunc target) {
+        return MH_EnableHook((LPVOID)target);
+    });
+
+    unsigned detoured = 0;
+    for (TargetFunc target : targets) {
+        if (target() == -1)
+            ++detoured;
+    }
+    printf("hooks.detoured %u\n", detoured);
+
+    failed += measure("disable", targets, [](TargetFunc target) {
+        return MH_DisableHook((LPVOID)target);
+    });
+    failed += measure("remove", shuffled, [](TargetFunc target) {
+        return MH_RemoveHook((LPVOID)target);
+    });
+
+    printf("hooks.total_ms %.1f\n", ticks_to_microseconds(now() - start) / 1000.0);
+
+    return failed == 0 && detoured == options.hooks;
+}
+
+/*********************************
+ * LOCK CONTENTION
+ *********************************/
+
+// Hooks the contending threads queue and the freezing thread toggles
+static const unsigned CONTENDED_HOOKS = 64;
+
+// Samples per thread, reserved up front: a thread frozen inside the allocator
+// would deadlock the thread that froze it
+static const size_t MAX_SAMPLES = 1 << 20;
+
+struct Contender
+{
+    const std::vector<TargetFunc> *targets { nullptr };
+    volatile LONG *stop { nullptr };
+    bool freeze { false };
+
+    std::vector<double> samples;
+    unsigned failed { 0 };
+    HANDLE thread { nullptr };
+
+    static DWORD WINAPI run(LPVOID param)
+    {
+        Contender *self = (Contender *)param;
+        const std::vector<TargetFunc> &targets = *self->targets;
+
+        for (unsigned i = 0; !*self->stop; ++i) {
+            LPVOID target = (LPVOID)targets[self->freeze ? 0 : i % targets.size()];
+            bool enable = (i / targets.size()) % 2 == 0;
+
+            LONGLONG t0 = now();
+            MH_STATUS status;
+            if (self->freeze)
+                status = (i % 2 == 0) ? MH_EnableHook(target) : MH_DisableHook(target);
+            else
+                status = enable ? MH_QueueEnableHook(target) : MH_QueueDisableHook(target);
+            LONGLONG t1 = now();
+
+            if (self->samples.size() < MAX_SAMPLES)
+                self->samples.push_back(ticks_to_microseconds(t1 - t0));
+            if (status != MH_OK)
+                ++self->failed;
+        }
+
+        return 0;
+    }
+};
+
+static bool run_contention(const Options &options)
+{
+    std::vector<TargetFunc> targets = make_targets(CONTENDED_HOOKS, false);
+    if (targets.size() != CONTENDED_HOOKS) {
+        fprintf(stderr, "Failed to allocate %u targets\n", CONTENDED_HOOKS);
+        return false;
+    }
+
+    for (TargetFunc target : targets) {
+        if (MH_CreateHook((LPVOID)target, (LPVOID)&Detour, nullptr) != MH_OK) {
+            fprintf(stderr, "MH_CreateHook failed\n");
+            return false;
+        }
+    }
+
+    volatile LONG stop = 0;
+    std::vector<Contender> contenders(options.threads + 1);
+    for (size_t i = 0; i < contenders.size(); ++i) {
+        contenders[i].targets = &targets;
+        contenders[i].stop = &stop;
+        contenders[i].freeze = (i == options.threads);
+        contenders[i].samples.reserve(MAX_SAMPLES);
+    }
+
+    MH_LOCK_STATISTICS before, after;
+    MH_GetLockStatistics(&before);
+
+    for (Contender &contender : contenders)
+        contender.thread = CreateThread(nullptr, 0, &Contender::run, &contender, 0, nullptr);
+
+    Sleep(options.seconds * 1000);
+    InterlockedExchange(&stop, 1);
+
+    bool ok = true;
+    std::vector<double> queued, toggled;
+    unsigned failed = 0;
+    for (Contender &contender : contenders) {
+        if (!contender.thread) {
+            ok = false;
+            continue;
+        }
+
+        WaitForSingleObject(contender.thread, INFINITE);
+        CloseHandle(contender.thread);
+
+        std::vector<double> &samples = contender.freeze ? toggled : queued;
+        samples.insert(samples.end(), contender.samples.begin(), contender.samples.end());
+        failed += contender.failed;
+    }
+
+    MH_GetLockStatistics(&after);
+
+    for (TargetFunc target : targets)
+        MH_RemoveHook((LPVOID)target);
+
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+
+    printf("lock.threads %u\n", options.threads);
+    printf("lock.queue_ops %u\n", unsigned(queued.size()));
+    print_samples("lock", "queue", queued);
+    printf("lock.toggle_ops %u\n", unsigned(toggled.size()));
+    print_samples("lock", "toggle", toggled);
+    printf("lock.acquisitions %llu\n", (unsigned long long)(after.acquisitions - before.acquisitions));
+    printf("lock.spun %llu\n", (unsigned long long)(after.spun - before.spun));
+    printf("lock.yielded %llu\n", (unsigned long long)(after.yielded - before.yielded));
+    printf("lock.blocked %llu\n", (unsigned long long)(after.blocked - before.blocked));
+    printf("lock.blocked_ms %.1f\n", double(after.blockedTicks - before.blockedTicks) * 1000.0 / double(frequency.QuadPart));
+    if (failed)
+        printf("lock.failed %u\n", failed);
+
+    return ok && failed == 0;
+}
+
+/*********************************
+ * FREEZING THREADS
+ *********************************/
+
+static const unsigned FREEZE_STEPS[] = { 0, 16, 64, 256, 1024, 4096 };
+static const unsigned FREEZE_ROUNDS = 100;
+
+static DWORD WINAPI idle_thread(LPVOID param)
+{
+    WaitForSingleObject((HANDLE)param, INFINITE);
+    return 0;
+}
+
+static bool run_freeze(const Options &options)
+{
+    std::vector<TargetFunc> targets = make_targets(1, false);
+    if (targets.empty() || MH_CreateHook((LPVOID)targets[0], (LPVOID)&Detour, nullptr) != MH_OK) {
+        fprintf(stderr, "MH_CreateHook failed\n");
+        return false;
+    }
+
+    HANDLE release = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    std::vector<HANDLE> threads;
+    unsigned failed = 0;
+
+    for (unsigned step : FREEZE_STEPS) {
+        if (step > options.idleThreads)
+            break;
+
+        while (threads.size() < step) {
+            HANDLE thread = CreateThread(nullptr, 64 * 1024, &idle_thread, release, STACK_SIZE_PARAM_IS_A_RESERVATION, nullptr);
+            if (!thread)
+                break;
+            threads.push_back(thread);
+        }
+        if (threads.size() < step) {
+            fprintf(stderr, "Could only start %u threads\n", unsigned(threads.size()));
+            break;
+        }
+
+        std::vector<double> samples;
+        for (unsigned i = 0; i < FREEZE_ROUNDS; ++i) {
+            LONGLONG t0 = now();
+            MH_STATUS enabled = MH_EnableHook((LPVOID)targets[0]);
+            MH_STATUS disabled = MH_DisableHook((LPVOID)targets[0]);
+            LONGLONG t1 = now();
+
+            samples.push_back(ticks_to_microseconds(t1 - t0) / 2.0);
+            if (enabled != MH_OK || disabled != MH_OK)
+                ++failed;
+        }
+
+        char name[32];
+        snprintf(name, sizeof(name), "threads_%u", step);
+        print_samples("freeze", name, samples);
+    }
+
+    SetEvent(release);
+    for (HANDLE thread : threads) {
+        WaitForSingleObject(thread, INFINITE);
+        CloseHandle(thread);
+    }
+    CloseHandle(release);
+
+    MH_RemoveHook((LPVOID)targets[0]);
+
+    if (failed)
+        printf("freeze.failed %u\n", failed);
+
+    return failed == 0;
+}
+
+/*********************************
+ * FRAGMENTED ADDRESS SPACE
+ *********************************/
+
+static const unsigned ALLOCATION_ROUNDS = 200;
+
+static bool run_allocation(const Options &options)
+{
+    std::vector<TargetFunc> targets = make_targets(1, false);
+    if (targets.empty())
+        return false;
+
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    ULONG_PTR granularity = si.dwAllocationGranularity;
+    ULONG_PTR origin = (ULONG_PTR)targets[0] - (ULONG_PTR)targets[0] % granularity;
+    ULONG_PTR range = ULONG_PTR(options.fragmentMegabytes) << 20;
+
+    // A single page takes the whole 64 KB below it out of use, but leaves
+    // the rest of it looking free
+    std::vector<LPVOID> reserved;
+    for (ULONG_PTR address = origin > range + granularity ? origin - range : granularity;
+         address < origin + range;
+         address += granularity) {
+        LPVOID page = VirtualAlloc((LPVOID)address, si.dwPageSize, MEM_RESERVE, PAGE_NOACCESS);
+        if (page)
+            reserved.push_back(page);
+    }
+
+    std::vector<double> created, removed;
+    unsigned failed = 0;
+    for (unsigned i = 0; i < ALLOCATION_ROUNDS; ++i) {
+        LONGLONG t0 = now();
+        MH_STATUS create = MH_CreateHook((LPVOID)targets[0], (LPVOID)&Detour, nullptr);
+        LONGLONG t1 = now();
+        MH_STATUS remove = MH_RemoveHook((LPVOID)targets[0]);
+        LONGLONG t2 = now();
+
+        created.push_back(ticks_to_microseconds(t1 - t0));
+        removed.push_back(ticks_to_microseconds(t2 - t1));
+        if (create != MH_OK || remove != MH_OK)
+            ++failed;
+    }
+
+    for (LPVOID page : reserved)
+        VirtualFree(page, 0, MEM_RELEASE);
+
+    printf("alloc.fragment_mb %u\n", options.fragmentMegabytes);
+    printf("alloc.reserved_regions %u\n", unsigned(reserved.size()));
+    print_samples("alloc", "create", created);
+    print_samples("alloc", "remove", removed);
+    if (failed)
+        printf("alloc.failed %u\n", failed);
+
+    return failed == 0;
+}
+
+int main(int argc, char **argv)
+{
+    Options options;
+
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--hooks") && i + 1 < argc) {
+            options.hooks = unsigned(strtoul(argv[++i], nullptr, 10));
+#ifndef _WIN64
+        } else if (!strcmp(argv[i], "--hot-patch")) {
+            // MOV EDI, EDI would clear the upper half of RDI, which callers expect to be preserved
+            options.hotPatch = true;
+#endif
+        } else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+            options.threads = unsigned(strtoul(argv[++i], nullptr, 10));
+        } else if (!strcmp(argv[i], "--seconds") && i + 1 < argc) {
+            options.seconds = unsigned(strtoul(argv[++i], nullptr, 10));
+        } else if (!strcmp(argv[i], "--idle-threads") && i + 1 < argc) {
+            options.idleThreads = unsigned(strtoul(argv[++i], nullptr, 10));
+        } else if (!strcmp(argv[i], "--fragment-mb") && i + 1 < argc) {
+            options.fragmentMegabytes = unsigned(strtoul(argv[++i], nullptr, 10));
+        } else {
+            fprintf(stderr, "Usage: %s [--hooks <n>] [--hot-patch] [--threads <n>] [--seconds <n>] [--idle-threads <n>] [--fragment-mb <n>]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    if (MH_Initialize() != MH_OK) {
+        fprintf(stderr, "MH_Initialize failed\n");
+        return 1;
+    }
+
+    bool ok = run_life_cycle(options);
+    ok = run_contention(options) && ok;
+    ok = run_freeze(options) && ok;
+    ok = run_allocation(options) && ok;
+
+    MH_Uninitialize();
+
+    return ok ? 0 : 1;
+}
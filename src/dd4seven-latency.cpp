@@ -0,0 +1,454 @@
+// Copyright (C) 2015 Jonas Kümmerlin <rgcjonas@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+/*
+ * Measures the latency from drawing something on screen to getting it from AcquireNextFrame
+ *
+ * Usage: dd4seven-latency.exe [generate|check] [--seconds <n>] [--x <n>] [--y <n>]
+ *
+ * The generator paints a frame counter and the QueryPerformanceCounter value of the
+ * moment it painted it into a small window at (x, y), once per DWM frame. The checker
+ * duplicates the primary output, reads back just that part of every acquired frame,
+ * decodes it and prints the latency distribution and how many frames it missed or got
+ * twice, as "name value" lines. Without a mode, the checker starts a generator itself.
+ */
+
+#include <dxgi.h>
+#include <dxgi1_2.h>
+#include <d3d11.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <vector>
+
+#include "com.hpp"
+#include "util.hpp"
+
+/*
+ * The code is a grid of CODE_COLUMNS x CODE_ROWS cells, each one CELL_SIZE pixels
+ * wide and high and either black (0) or white (1), least significant bit first:
+ * - row 0: CODE_MARKER (16 bits), frame counter (32 bits), checksum (16 bits)
+ * - row 1: QueryPerformanceCounter (64 bits)
+ */
+constexpr unsigned CODE_COLUMNS = 64;
+constexpr unsigned CODE_ROWS    = 2;
+constexpr unsigned CELL_SIZE    = 8;
+constexpr unsigned CODE_WIDTH   = CODE_COLUMNS * CELL_SIZE;
+constexpr unsigned CODE_HEIGHT  = CODE_ROWS * CELL_SIZE;
+
+constexpr uint16_t CODE_MARKER  = 0xD4D7;
+
+struct FrameCode
+{
+    uint32_t frame;
+    uint64_t stamp;
+};
+
+static uint16_t checksum(const FrameCode &code)
+{
+    uint64_t folded = code.stamp ^ (uint64_t(code.frame) << 16) ^ 0xA5A5;
+
+    return uint16_t(folded ^ (folded >> 16) ^ (folded >> 32) ^ (folded >> 48));
+}
+
+// One 32bit BGRA pixel per cell
+static void encode(const FrameCode &code, uint32_t (&cells)[CODE_ROWS][CODE_COLUMNS])
+{
+    uint64_t rows[CODE_ROWS] = {
+        uint64_t(CODE_MARKER) | (uint64_t(code.frame) << 16) | (uint64_t(checksum(code)) << 48),
+        code.stamp,
+    };
+
+    for (unsigned row = 0; row < CODE_ROWS; ++row) {
+        for (unsigned column = 0; column < CODE_COLUMNS; ++column)
+            cells[row][column] = (rows[row] >> column) & 1 ? 0xFFFFFFFF : 0xFF000000;
+    }
+}
+
+// Samples the middle of each cell, so scaling or filtering at the edges doesn't hurt
+static bool decode(const uint8_t *pixels, UINT pitch, FrameCode &code)
+{
+    uint64_t rows[CODE_ROWS] = { 0, 0 };
+
+    for (unsigned row = 0; row < CODE_ROWS; ++row) {
+        const uint8_t *line = pixels + (row * CELL_SIZE + CELL_SIZE / 2) * pitch;
+
+        for (unsigned column = 0; column < CODE_COLUMNS; ++column) {
+            const uint8_t *pixel = line + (column * CELL_SIZE + CELL_SIZE / 2) * 4;
+            if (pixel[1] >= 128) // green is enough
+                rows[row] |= uint64_t(1) << column;
+        }
+    }
+
+    if (uint16_t(rows[0]) != CODE_MARKER)
+        return false;
+
+    code.frame = uint32_t(rows[0] >> 16);
+    code.stamp = rows[1];
+
+    return uint16_t(rows[0] >> 48) == checksum(code);
+}
+
+static LONGLONG now()
+{
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+
+    return counter.QuadPart;
+}
+
+static double ticks_to_microseconds(LONGLONG ticks)
+{
+    static LARGE_INTEGER frequency;
+    static BOOL qpcAvailable = QueryPerformanceFrequency(&frequency);
+
+    return qpcAvailable ? double(ticks) * 1000000.0 / double(frequency.QuadPart) : 0.0;
+}
+
+/*********************************
+ * GENERATOR
+ *********************************/
+
+static int run_generator(unsigned seconds, int x, int y)
+{
+    WNDCLASSEX wcex;
+    memset(&wcex, 0, sizeof(wcex));
+    wcex.cbSize        = sizeof(wcex);
+    wcex.lpfnWndProc   = DefWindowProc;
+    wcex.hCursor       = LoadCursor(NULL, IDC_ARROW);
+    wcex.lpszClassName = L"DD4SevenLatencyCode";
+    RegisterClassEx(&wcex);
+
+    HWND window = CreateWindowEx(WS_EX_TOPMOST | WS_EX_TOOLWINDOW | WS_EX_NOACTIVATE,
+                                 L"DD4SevenLatencyCode", L"dd4seven latency code",
+                                 WS_POPUP | WS_VISIBLE,
+                                 x, y, CODE_WIDTH, CODE_HEIGHT,
+                                 NULL, NULL, NULL, NULL);
+    if (!window) {
+        fprintf(stderr, "Couldn't create the code window (error %lu)\n", (unsigned long)GetLastError());
+        return 1;
+    }
+
+    // Waits for the next composition, so every DWM frame gets its own code
+    util::dll_func<HRESULT ()> dwmFlush { L"dwmapi.dll", "DwmFlush" };
+
+    BITMAPINFO bitmap;
+    memset(&bitmap, 0, sizeof(bitmap));
+    bitmap.bmiHeader.biSize        = sizeof(bitmap.bmiHeader);
+    bitmap.bmiHeader.biWidth       = CODE_COLUMNS;
+    bitmap.bmiHeader.biHeight      = -int(CODE_ROWS); // top-down
+    bitmap.bmiHeader.biPlanes      = 1;
+    bitmap.bmiHeader.biBitCount    = 32;
+    bitmap.bmiHeader.biCompression = BI_RGB;
+
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+
+    HDC dc = GetDC(window);
+    SetStretchBltMode(dc, COLORONCOLOR);
+
+    uint32_t cells[CODE_ROWS][CODE_COLUMNS];
+    const LONGLONG end = now() + LONGLONG(seconds) * frequency.QuadPart;
+
+    for (uint32_t frame = 0; now() < end; ++frame) {
+        MSG msg;
+        while (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE)) {
+            TranslateMessage(&msg);
+            DispatchMessage(&msg);
+        }
+
+        FrameCode code = { frame, uint64_t(now()) };
+        encode(code, cells);
+
+        StretchDIBits(dc, 0, 0, CODE_WIDTH, CODE_HEIGHT, 0, 0, CODE_COLUMNS, CODE_ROWS,
+                      cells, &bitmap, DIB_RGB_COLORS, SRCCOPY);
+        GdiFlush();
+
+        if (!dwmFlush || FAILED(dwmFlush()))
+            Sleep(1);
+    }
+
+    ReleaseDC(window, dc);
+    DestroyWindow(window);
+
+    return 0;
+}
+
+/*********************************
+ * CHECKER
+ *********************************/
+
+static double percentile(const std::vector<double> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0.0;
+
+    return sorted[std::min(sorted.size() - 1, size_t(p * double(sorted.size())))];
+}
+
+static int run_checker(unsigned seconds, int x, int y, bool spawnGenerator)
+{
+    HRESULT hr;
+
+    util::dll_func<HRESULT (IDXGIOutput *, IUnknown *, IDXGIOutputDuplication **)> duplicate { L"dd4seven-api.dll", "DuplicateOutput" };
+    util::dll_func<HRESULT (IDXGIAdapter *,
+                            D3D_DRIVER_TYPE,
+                            HMODULE,
+                            UINT,
+                            const D3D_FEATURE_LEVEL *,
+                            UINT,
+                            UINT,
+                            ID3D11Device **,
+                            D3D_FEATURE_LEVEL *,
+                            ID3D11DeviceContext **)> createDevice { L"d3d11.dll", "D3D11CreateDevice" };
+
+    if (!duplicate || !createDevice) {
+        fprintf(stderr, "Couldn't load dd4seven-api.dll or d3d11.dll\n");
+        return 1;
+    }
+
+    com::ptr<ID3D11Device>        device;
+    com::ptr<ID3D11DeviceContext> context;
+    hr = createDevice(nullptr, D3D_DRIVER_TYPE_HARDWARE, nullptr, D3D11_CREATE_DEVICE_BGRA_SUPPORT,
+                      nullptr, 0, D3D11_SDK_VERSION, com::out_arg(device), nullptr, com::out_arg(context));
+    if FAILED(hr) {
+        fprintf(stderr, "Couldn't create a device: %s\n", util::hresult_to_utf8(hr).c_str());
+        return 1;
+    }
+
+    // The output that contains the code
+    com::ptr<IDXGIDevice>  dxgiDevice = device.query<IDXGIDevice>();
+    com::ptr<IDXGIAdapter> adapter;
+    com::ptr<IDXGIOutput>  output;
+    DXGI_OUTPUT_DESC       outputDesc;
+    POINT                  codeOrigin = { x, y };
+
+    if (!dxgiDevice || FAILED(dxgiDevice->GetAdapter(com::out_arg(adapter)))) {
+        fprintf(stderr, "No adapter\n");
+        return 1;
+    }
+
+    for (UINT i = 0; SUCCEEDED(adapter->EnumOutputs(i, com::out_arg(output))); ++i) {
+        output->GetDesc(&outputDesc);
+        if (PtInRect(&outputDesc.DesktopCoordinates, codeOrigin))
+            break;
+
+        output.reset();
+    }
+
+    if (!output) {
+        fprintf(stderr, "No output contains %d,%d\n", x, y);
+        return 1;
+    }
+
+    D3D11_BOX box = {
+        UINT(x - outputDesc.DesktopCoordinates.left), UINT(y - outputDesc.DesktopCoordinates.top), 0,
+        UINT(x - outputDesc.DesktopCoordinates.left) + CODE_WIDTH, UINT(y - outputDesc.DesktopCoordinates.top) + CODE_HEIGHT, 1,
+    };
+    if (LONG(box.right) > outputDesc.DesktopCoordinates.right - outputDesc.DesktopCoordinates.left
+        || LONG(box.bottom) > outputDesc.DesktopCoordinates.bottom - outputDesc.DesktopCoordinates.top)
+    {
+        fprintf(stderr, "The code at %d,%d doesn't fit onto the output\n", x, y);
+        return 1;
+    }
+
+    // Only the code gets read back, not the whole frame
+    D3D11_TEXTURE2D_DESC stagingDesc;
+    memset(&stagingDesc, 0, sizeof(stagingDesc));
+    stagingDesc.Width            = CODE_WIDTH;
+    stagingDesc.Height           = CODE_HEIGHT;
+    stagingDesc.MipLevels        = 1;
+    stagingDesc.ArraySize        = 1;
+    stagingDesc.Format           = DXGI_FORMAT_B8G8R8A8_UNORM;
+    stagingDesc.SampleDesc.Count = 1;
+    stagingDesc.Usage            = D3D11_USAGE_STAGING;
+    stagingDesc.CPUAccessFlags   = D3D11_CPU_ACCESS_READ;
+
+    com::ptr<ID3D11Texture2D> staging;
+    hr = device->CreateTexture2D(&stagingDesc, nullptr, com::out_arg(staging));
+    if FAILED(hr) {
+        fprintf(stderr, "Couldn't create the readback texture: %s\n", util::hresult_to_utf8(hr).c_str());
+        return 1;
+    }
+
+    com::ptr<IDXGIOutputDuplication> duplication;
+    hr = duplicate(output.get(), device.get(), com::out_arg(duplication));
+    if FAILED(hr) {
+        fprintf(stderr, "DuplicateOutput failed: %s\n", util::hresult_to_utf8(hr).c_str());
+        return 1;
+    }
+
+    PROCESS_INFORMATION generator;
+    memset(&generator, 0, sizeof(generator));
+    if (spawnGenerator) {
+        wchar_t path[MAX_PATH];
+        wchar_t commandLine[MAX_PATH + 64];
+        GetModuleFileNameW(nullptr, path, MAX_PATH);
+        _snwprintf(commandLine, MAX_PATH + 64, L"\"%ls\" generate --seconds %u --x %d --y %d", path, seconds + 1, x, y);
+
+        STARTUPINFOW startup;
+        memset(&startup, 0, sizeof(startup));
+        startup.cb = sizeof(startup);
+        if (!CreateProcessW(nullptr, commandLine, nullptr, nullptr, FALSE, 0, nullptr, nullptr, &startup, &generator)) {
+            fprintf(stderr, "Couldn't start the generator (error %lu)\n", (unsigned long)GetLastError());
+            return 1;
+        }
+        CloseHandle(generator.hThread);
+    }
+
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+
+    const LONGLONG end = now() + LONGLONG(seconds) * frequency.QuadPart;
+
+    std::vector<double> latencies; // microseconds
+    uint64_t acquired     = 0;
+    uint64_t undecodable  = 0;
+    uint64_t dropped      = 0;
+    uint64_t duplicated   = 0;
+    LONGLONG readbackTicks = 0;
+    bool     haveLast     = false;
+    uint32_t lastFrame    = 0;
+    bool     failed       = false;
+
+    while (now() < end) {
+        DXGI_OUTDUPL_FRAME_INFO info;
+        com::ptr<IDXGIResource> resource;
+        hr = duplication->AcquireNextFrame(100, &info, com::out_arg(resource));
+        LONGLONG acquireTime = now();
+
+        if (hr == DXGI_ERROR_WAIT_TIMEOUT)
+            continue;
+
+        if (hr == DXGI_ERROR_MODE_CHANGE_IN_PROGRESS) {
+            fprintf(stderr, "The mode changed, results are unreliable from here\n");
+            continue;
+        }
+
+        if FAILED(hr) {
+            fprintf(stderr, "AcquireNextFrame failed: %s\n", util::hresult_to_utf8(hr).c_str());
+            failed = true;
+            break;
+        }
+
+        acquired++;
+
+        com::ptr<ID3D11Texture2D> frame = resource.query<ID3D11Texture2D>();
+        D3D11_MAPPED_SUBRESOURCE  mapped;
+        FrameCode                 code;
+        bool                      decoded = false;
+
+        if (frame) {
+            context->CopySubresourceRegion(staging.get(), 0, 0, 0, 0, frame.get(), 0, &box);
+
+            if SUCCEEDED(context->Map(staging.get(), 0, D3D11_MAP_READ, 0, &mapped)) {
+                decoded = decode(static_cast<const uint8_t*>(mapped.pData), mapped.RowPitch, code);
+                context->Unmap(staging.get(), 0);
+            }
+        }
+
+        readbackTicks += now() - acquireTime;
+        duplication->ReleaseFrame();
+
+        if (!decoded) {
+            undecodable++;
+            continue;
+        }
+
+        if (haveLast && code.frame == lastFrame) {
+            duplicated++;
+            continue;
+        }
+
+        if (haveLast && code.frame > lastFrame)
+            dropped += code.frame - lastFrame - 1;
+
+        haveLast  = true;
+        lastFrame = code.frame;
+        latencies.push_back(ticks_to_microseconds(acquireTime - LONGLONG(code.stamp)));
+    }
+
+    if (spawnGenerator) {
+        WaitForSingleObject(generator.hProcess, 5000);
+        CloseHandle(generator.hProcess);
+    }
+
+    std::vector<double> sorted(latencies);
+    std::sort(sorted.begin(), sorted.end());
+    double sum = 0.0;
+    for (double latency : sorted)
+        sum += latency;
+
+    printf("check.acquired %llu\n", (unsigned long long)acquired);
+    printf("check.frames %llu\n", (unsigned long long)sorted.size());
+    printf("check.undecodable %llu\n", (unsigned long long)undecodable);
+    printf("check.dropped %llu\n", (unsigned long long)dropped);
+    printf("check.duplicated %llu\n", (unsigned long long)duplicated);
+    printf("check.readback_us_avg %.2f\n", acquired ? ticks_to_microseconds(readbackTicks) / double(acquired) : 0.0);
+    printf("check.latency_us_avg %.2f\n", sorted.empty() ? 0.0 : sum / double(sorted.size()));
+    printf("check.latency_us_p50 %.2f\n", percentile(sorted, 0.50));
+    printf("check.latency_us_p90 %.2f\n", percentile(sorted, 0.90));
+    printf("check.latency_us_p99 %.2f\n", percentile(sorted, 0.99));
+    printf("check.latency_us_max %.2f\n", sorted.empty() ? 0.0 : sorted.back());
+
+    // Whole milliseconds, the last bucket takes everything beyond
+    constexpr unsigned HISTOGRAM_BUCKETS = 50;
+    uint64_t histogram[HISTOGRAM_BUCKETS] = {};
+    for (double latency : sorted)
+        histogram[std::min(unsigned(latency / 1000.0), HISTOGRAM_BUCKETS - 1)]++;
+    for (unsigned bucket = 0; bucket < HISTOGRAM_BUCKETS; ++bucket) {
+        if (histogram[bucket])
+            printf("check.latency_ms.%u %llu\n", bucket, (unsigned long long)histogram[bucket]);
+    }
+
+    return failed ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+    enum { BOTH, GENERATE, CHECK } mode = BOTH;
+    unsigned seconds = 10;
+    int      x       = 0;
+    int      y       = 0;
+
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "generate")) {
+            mode = GENERATE;
+        } else if (!strcmp(argv[i], "check")) {
+            mode = CHECK;
+        } else if (!strcmp(argv[i], "--seconds") && i + 1 < argc) {
+            seconds = unsigned(strtoul(argv[++i], nullptr, 10));
+        } else if (!strcmp(argv[i], "--x") && i + 1 < argc) {
+            x = int(strtol(argv[++i], nullptr, 10));
+        } else if (!strcmp(argv[i], "--y") && i + 1 < argc) {
+            y = int(strtol(argv[++i], nullptr, 10));
+        } else {
+            fprintf(stderr, "Usage: %s [generate|check] [--seconds <n>] [--x <n>] [--y <n>]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    if (mode == GENERATE)
+        return run_generator(seconds, x, y);
+
+    return run_checker(seconds, x, y, mode == BOTH);
+}
@@ -0,0 +1,104 @@
+// Copyright (C) 2015 Jonas Kümmerlin <rgcjonas@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+/*
+ * Prints the trace records of a running process using dd4seven-dwm.dll or dd4seven-api.dll
+ *
+ * Usage: dd4seven-tracedump.exe <pid>
+ *
+ * Columns: microseconds since the first record, thread id, event, and its three arguments
+ * (see trace.hpp for what they mean).
+ */
+
+#include "trace.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+int main(int argc, char **argv)
+{
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <pid>\n", argv[0]);
+        return 2;
+    }
+
+    DWORD process = DWORD(strtoul(argv[1], nullptr, 10));
+
+    wchar_t name[32];
+    trace::mapping_name(name, process);
+
+    HANDLE mapping = OpenFileMapping(FILE_MAP_READ, FALSE, name);
+    if (!mapping) {
+        fprintf(stderr, "No trace for process %lu (error %lu)\n", (unsigned long)process, (unsigned long)GetLastError());
+        return 1;
+    }
+
+    const trace::Header *ring = (const trace::Header*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!ring) {
+        fprintf(stderr, "Couldn't map the trace (error %lu)\n", (unsigned long)GetLastError());
+        return 1;
+    }
+
+    if (ring->magic != trace::MAGIC || ring->version != trace::VERSION || !ring->capacity
+        || (ring->capacity & (ring->capacity - 1)) || ring->frequency <= 0)
+    {
+        fprintf(stderr, "Unknown trace format\n");
+        return 1;
+    }
+
+    const trace::Record *records = reinterpret_cast<const trace::Record*>(ring + 1);
+
+    uint64_t end   = uint64_t(ring->next);
+    uint64_t begin = end > ring->capacity ? end - ring->capacity : 0;
+    uint64_t dumped = 0;
+    int64_t  first  = 0;
+
+    for (uint64_t i = begin; i < end; ++i) {
+        const trace::Record &shared = records[i & (ring->capacity - 1)];
+
+        // Same dance as stats_read(): only keep the record if it was complete
+        // before and after copying, and nobody wrapped around in the meantime
+        trace::Record record;
+        uint32_t before = shared.sequence;
+        MemoryBarrier();
+        std::memcpy(&record, &shared, sizeof(record));
+        MemoryBarrier();
+        if (before != uint32_t(i + 1) || shared.sequence != before)
+            continue;
+
+        if (!dumped)
+            first = record.timestamp;
+        ++dumped;
+
+        double us = double(record.timestamp - first) * 1000000.0 / double(ring->frequency);
+        printf("%14.3f %6lu %-20s %10lu %10lu %10lu\n",
+               us, (unsigned long)record.thread, trace::event_name(record.event),
+               (unsigned long)record.args[0], (unsigned long)record.args[1], (unsigned long)record.args[2]);
+    }
+
+    fprintf(stderr, "%llu records, %llu overwritten or incomplete\n",
+            (unsigned long long)dumped, (unsigned long long)(end - begin - dumped));
+
+    UnmapViewOfFile(ring);
+    CloseHandle(mapping);
+
+    return 0;
+}
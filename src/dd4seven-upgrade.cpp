@@ -0,0 +1,75 @@
+// Copyright (C) 2015 Jonas Kümmerlin <rgcjonas@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+/*
+ * Replaces the dd4seven-dwm.dll running inside the DWM with a newer build,
+ * without restarting the DWM or losing any duplication (see protocol.hpp).
+ *
+ * Usage: dd4seven-upgrade.exe <file name>
+ *
+ * The new DLL has to be copied next to the running one first, under another name,
+ * e.g. %WINDIR%\System32\dd4seven-dwm-2.dll. It takes over on the next Present.
+ */
+
+#include "protocol.hpp"
+
+#include <cstdio>
+#include <cwchar>
+
+int main(int argc, char **argv)
+{
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <file name>\n", argv[0]);
+        return 2;
+    }
+
+    wchar_t name[MAX_PATH];
+    if (!MultiByteToWideChar(CP_ACP, 0, argv[1], -1, name, MAX_PATH)) {
+        fprintf(stderr, "Illegal file name\n");
+        return 2;
+    }
+
+    HWND dwm = FindWindowEx(HWND_MESSAGE, NULL, DD4SEVEN_WINDOW_NAME, DD4SEVEN_WINDOW_NAME);
+    if (!dwm) {
+        fprintf(stderr, "dd4seven-dwm.dll is not running\n");
+        return 1;
+    }
+
+    COPYDATASTRUCT copy = {
+        .dwData = DD4SEVEN_COPYDATA_UPGRADE,
+        .cbData = DWORD((std::wcslen(name) + 1) * sizeof(wchar_t)),
+        .lpData = name
+    };
+
+    // The DWM only looks at its messages when it presents
+    DWORD_PTR result = FALSE;
+    if (!SendMessageTimeout(dwm, WM_COPYDATA, 0, (LPARAM)&copy, SMTO_BLOCK, 10000, &result)) {
+        fprintf(stderr, "The DWM didn't answer (error %lu)\n", (unsigned long)GetLastError());
+        return 1;
+    }
+
+    if (!result) {
+        fprintf(stderr, "The upgrade failed, the old version keeps running. See the DWM's log.\n");
+        return 1;
+    }
+
+    printf("Upgraded to %s\n", argv[1]);
+    return 0;
+}
@@ -0,0 +1,743 @@
+// Copyright (C) 2015 Jonas Kümmerlin <rgcjonas@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+/*
+ * Plays repeatable screen content, for tuning change detection and encoding
+ *
+ * Usage: dd4seven-workload.exe typing|scroll|video|drag|idle [--fps <n>] [--seconds <n>]
+ *                              [--x <n>] [--y <n>] [--width <n>] [--height <n>]
+ *                              [--manifest <file>]
+ *
+ * Opens a topmost window at (x, y) and changes its content at a fixed rate, the
+ * same way on every run:
+ * - typing: one character per frame, with a caret, page after page
+ * - scroll: a text document scrolling up by a few pixels per frame
+ * - video:  a region in the middle that changes completely on every frame
+ * - drag:   a box moving across a patterned background
+ * - idle:   nothing changes after the first frame
+ *
+ * Only what changed gets drawn, so the manifest lists exactly which parts of the
+ * screen changed on every frame, in desktop coordinates, one line per frame:
+ *
+ *   frame <n> <qpc> dirty <count> [<left> <top> <right> <bottom>]... move <count> [<x> <y> <left> <top> <right> <bottom>]...
+ *
+ * where <qpc> is QueryPerformanceCounter right after drawing, and a move means the
+ * content from (x, y) now is at the rectangle after it, like DXGI_OUTDUPL_MOVE_RECT.
+ * Moved areas aren't listed as dirty as well. A capture that got several frames at
+ * once should report their union. A header ("name value" lines) comes first.
+ *
+ * At the end, how many frames were drawn and how many pixels changed is printed
+ * as "name value" lines.
+ */
+
+#include <windows.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <vector>
+
+#include "core/region.hpp"
+
+static LONGLONG now()
+{
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+
+    return counter.QuadPart;
+}
+
+static double ticks_to_microseconds(LONGLONG ticks)
+{
+    static LARGE_INTEGER frequency;
+    static BOOL qpcAvailable = QueryPerformanceFrequency(&frequency);
+
+    return qpcAvailable ? double(ticks) * 1000000.0 / double(frequency.QuadPart) : 0.0;
+}
+
+// Deterministic, so every run draws the same pixels
+static uint32_t next_random(uint32_t &state)
+{
+    state = state * 1664525u + 1013904223u;
+    return state;
+}
+
+static const char *const TEXT[] = {
+    "Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor",
+    "incididunt ut labore et dolore magna aliqua. Ut enim ad minim veniam, quis",
+    "nostrud exercitation ullamco laboris nisi ut aliquip ex ea commodo consequat.",
+    "Duis aute irure dolor in reprehenderit in voluptate velit esse cillum dolore eu",
+    "fugiat nulla pariatur. Excepteur sint occaecat cupidatat non proident, sunt in",
+    "culpa qui officia deserunt mollit anim id est laborum.",
+    "",
+    "    HRESULT hr = duplication->AcquireNextFrame(100, &info, &resource);",
+    "    if (hr == DXGI_ERROR_WAIT_TIMEOUT)",
+    "        continue;",
+    "",
+};
+constexpr unsigned TEXT_LINES = sizeof(TEXT) / sizeof(TEXT[0]);
+
+/*********************************
+ * DRAWING
+ *********************************/
+
+// A top-down 32bit DIB section with a memory DC
+struct Canvas
+{
+    int      width  { 0 };
+    int      height { 0 };
+    HDC      dc     { nullptr };
+    HBITMAP  bitmap { nullptr };
+    HGDIOBJ  previousBitmap { nullptr };
+    HGDIOBJ  previousFont   { nullptr };
+    uint32_t *pixels { nullptr };
+
+    bool create(int w, int h)
+    {
+        BITMAPINFO info;
+        memset(&info, 0, sizeof(info));
+        info.bmiHeader.biSize        = sizeof(info.bmiHeader);
+        info.bmiHeader.biWidth       = w;
+        info.bmiHeader.biHeight      = -h; // top-down
+        info.bmiHeader.biPlanes      = 1;
+        info.bmiHeader.biBitCount    = 32;
+        info.bmiHeader.biCompression = BI_RGB;
+
+        dc = CreateCompatibleDC(nullptr);
+        if (!dc)
+            return false;
+
+        void *bits = nullptr;
+        bitmap = CreateDIBSection(dc, &info, DIB_RGB_COLORS, &bits, nullptr, 0);
+        if (!bitmap)
+            return false;
+
+        width  = w;
+        height = h;
+        pixels = static_cast<uint32_t*>(bits);
+
+        previousBitmap = SelectObject(dc, bitmap);
+        // Antialiasing and ClearType differ between machines, the stock fixed font doesn't
+        previousFont   = SelectObject(dc, GetStockObject(SYSTEM_FIXED_FONT));
+
+        return true;
+    }
+
+    void destroy()
+    {
+        if (dc) {
+            SelectObject(dc, previousFont);
+            SelectObject(dc, previousBitmap);
+            DeleteDC(dc);
+        }
+        if (bitmap)
+            DeleteObject(bitmap);
+
+        dc     = nullptr;
+        bitmap = nullptr;
+        pixels = nullptr;
+    }
+
+    core::Rect bounds() const
+    {
+        return core::make_rect(0, 0, width, height);
+    }
+
+    void fill(const core::Rect &r, COLORREF color)
+    {
+        HBRUSH brush = CreateSolidBrush(color);
+        FillRect(dc, &r, brush);
+        DeleteObject(brush);
+    }
+
+    // Text clipped to (and background filled within) r
+    void text(const core::Rect &r, int x, int y, const char *str, size_t length,
+              COLORREF foreground = RGB(0x20, 0x20, 0x20), COLORREF background = RGB(0xFF, 0xFF, 0xF0))
+    {
+        SetTextColor(dc, foreground);
+        SetBkColor(dc, background);
+        ExtTextOutA(dc, x, y, ETO_CLIPPED | ETO_OPAQUE, &r, str, UINT(length), nullptr);
+    }
+};
+
+// What changed on one frame, in window coordinates
+struct Changes
+{
+    struct Move
+    {
+        POINT      source;
+        core::Rect destination;
+    };
+
+    std::vector<core::Rect> dirty;
+    std::vector<Move>       moves;
+
+    void clear()
+    {
+        dirty.clear();
+        moves.clear();
+    }
+
+    void add(const core::Rect &r)
+    {
+        if (!core::is_empty(r))
+            dirty.push_back(r);
+    }
+};
+
+/*********************************
+ * WORKLOADS
+ *********************************/
+
+class Workload
+{
+public:
+    virtual ~Workload() {}
+
+    virtual unsigned defaultFps() const = 0;
+
+    // Draws the first frame, all of the canvas counts as changed
+    virtual void start(Canvas &canvas) = 0;
+
+    virtual void step(uint32_t frame, Canvas &canvas, Changes &changes) = 0;
+};
+
+// Lays TEXT out line by line, starting over when it runs out
+static void draw_text_page(Canvas &canvas, const core::Rect &r, int lineHeight, unsigned firstLine)
+{
+    canvas.fill(r, RGB(0xFF, 0xFF, 0xF0));
+
+    unsigned line = firstLine;
+    for (int y = r.top; y < r.bottom; y += lineHeight, ++line) {
+        const char *str = TEXT[line % TEXT_LINES];
+        canvas.text(core::make_rect(r.left, y, r.right, y + lineHeight), r.left + 4, y, str, strlen(str));
+    }
+}
+
+static void text_metrics(Canvas &canvas, int &charWidth, int &lineHeight)
+{
+    TEXTMETRICA metrics;
+    GetTextMetricsA(canvas.dc, &metrics);
+
+    charWidth  = metrics.tmAveCharWidth;
+    lineHeight = metrics.tmHeight;
+}
+
+class IdleWorkload : public Workload
+{
+public:
+    unsigned defaultFps() const override { return 60; }
+
+    void start(Canvas &canvas) override
+    {
+        int charWidth, lineHeight;
+        text_metrics(canvas, charWidth, lineHeight);
+
+        draw_text_page(canvas, canvas.bounds(), lineHeight, 0);
+    }
+
+    void step(uint32_t, Canvas &, Changes &) override
+    {
+    }
+};
+
+class TypingWorkload : public Workload
+{
+    int      m_charWidth  { 8 };
+    int      m_lineHeight { 16 };
+    int      m_column { 0 };
+    int      m_row    { 0 };
+    unsigned m_line   { 0 };  // in TEXT
+    size_t   m_offset { 0 };  // in that line
+
+    core::Rect cell(int column, int row) const
+    {
+        int x = 4 + column * m_charWidth;
+        int y = row * m_lineHeight;
+
+        return core::make_rect(x, y, x + m_charWidth, y + m_lineHeight);
+    }
+
+    void drawCaret(Canvas &canvas, Changes &changes)
+    {
+        core::Rect caret = cell(m_column, m_row);
+        caret.right = caret.left + 2;
+
+        canvas.fill(caret, RGB(0x20, 0x20, 0x20));
+        changes.add(caret);
+    }
+
+public:
+    unsigned defaultFps() const override { return 15; }
+
+    void start(Canvas &canvas) override
+    {
+        text_metrics(canvas, m_charWidth, m_lineHeight);
+        canvas.fill(canvas.bounds(), RGB(0xFF, 0xFF, 0xF0));
+
+        Changes ignored;
+        drawCaret(canvas, ignored);
+    }
+
+    void step(uint32_t, Canvas &canvas, Changes &changes) override
+    {
+        const int columns = (canvas.width - 8) / m_charWidth;
+        const int rows    = canvas.height / m_lineHeight;
+
+        const char *line = TEXT[m_line % TEXT_LINES];
+
+        // Wrap at the end of the line or of the window, start a new page at the bottom
+        if (m_offset >= strlen(line) || m_column >= columns) {
+            canvas.fill(cell(m_column, m_row), RGB(0xFF, 0xFF, 0xF0)); // the caret
+            changes.add(cell(m_column, m_row));
+
+            if (m_offset >= strlen(line)) {
+                m_line++;
+                m_offset = 0;
+            }
+
+            m_column = 0;
+            m_row++;
+
+            if (m_row >= rows) {
+                m_row = 0;
+                canvas.fill(canvas.bounds(), RGB(0xFF, 0xFF, 0xF0));
+                changes.clear();
+                changes.add(canvas.bounds());
+            }
+
+            drawCaret(canvas, changes);
+            return;
+        }
+
+        // The character replaces the caret, which moves on by one
+        core::Rect r = cell(m_column, m_row);
+        canvas.text(r, r.left, r.top, line + m_offset, 1);
+        changes.add(r);
+
+        m_offset++;
+        m_column++;
+
+        drawCaret(canvas, changes);
+    }
+};
+
+class ScrollWorkload : public Workload
+{
+    int      m_lineHeight { 16 };
+    int      m_speed      { 4 };  // pixels per frame
+    int      m_scrolled   { 0 };  // document position at the top of the window
+
+public:
+    unsigned defaultFps() const override { return 60; }
+
+    void start(Canvas &canvas) override
+    {
+        int charWidth;
+        text_metrics(canvas, charWidth, m_lineHeight);
+
+        draw_text_page(canvas, canvas.bounds(), m_lineHeight, 0);
+    }
+
+    void step(uint32_t, Canvas &canvas, Changes &changes) override
+    {
+        const int w = canvas.width;
+        const int h = canvas.height;
+
+        // Everything but the top moves up...
+        BitBlt(canvas.dc, 0, 0, w, h - m_speed, canvas.dc, 0, m_speed, SRCCOPY);
+        m_scrolled += m_speed;
+
+        Changes::Move move;
+        move.source.x    = 0;
+        move.source.y    = m_speed;
+        move.destination = core::make_rect(0, 0, w, h - m_speed);
+        changes.moves.push_back(move);
+
+        // ...and the document continues at the bottom
+        core::Rect exposed = core::make_rect(0, h - m_speed, w, h);
+        int documentY = m_scrolled + h - m_speed;
+        int line      = documentY / m_lineHeight;
+        for (int y = line * m_lineHeight - m_scrolled; y < h; y += m_lineHeight, ++line) {
+            const char *str = TEXT[unsigned(line) % TEXT_LINES];
+
+            core::Rect clip;
+            if (core::intersect(clip, exposed, core::make_rect(0, y, w, y + m_lineHeight)))
+                canvas.text(clip, 4, y, str, strlen(str));
+        }
+
+        changes.add(exposed);
+    }
+};
+
+class VideoWorkload : public Workload
+{
+    core::Rect m_region;
+    uint32_t   m_random { 0x12345678 };
+
+public:
+    unsigned defaultFps() const override { return 30; }
+
+    void start(Canvas &canvas) override
+    {
+        int charWidth, lineHeight;
+        text_metrics(canvas, charWidth, lineHeight);
+
+        draw_text_page(canvas, canvas.bounds(), lineHeight, 0);
+
+        // 16:9, half as wide as the window, in the middle
+        int w = canvas.width / 2;
+        int h = std::min(canvas.height, w * 9 / 16);
+        m_region = core::make_rect((canvas.width - w) / 2, (canvas.height - h) / 2,
+                                   (canvas.width + w) / 2, (canvas.height + h) / 2);
+
+        Changes ignored;
+        step(0, canvas, ignored);
+    }
+
+    // Moving color bars with some noise on top, so every pixel changes on every frame
+    void step(uint32_t frame, Canvas &canvas, Changes &changes) override
+    {
+        GdiFlush();
+
+        for (int y = m_region.top; y < m_region.bottom; ++y) {
+            uint32_t *row = canvas.pixels + size_t(y) * size_t(canvas.width);
+
+            for (int x = m_region.left; x < m_region.right; ++x) {
+                uint32_t bar   = uint32_t(x - m_region.left + int(frame) * 4) / 32;
+                uint32_t noise = next_random(m_random) >> 26;
+                uint32_t base  = (bar & 1 ? 0x40 : 0x00) | (bar & 2 ? 0x4000 : 0x00) | (bar & 4 ? 0x400000 : 0x00);
+
+                row[x] = 0xFF000000 | (base * 3) | ((frame + noise) & 0x3F) * 0x010101;
+            }
+        }
+
+        changes.add(m_region);
+    }
+};
+
+class DragWorkload : public Workload
+{
+    Canvas     m_background;
+    core::Rect m_box;
+    int        m_dx { 6 };
+    int        m_dy { 3 };
+
+    void drawBox(Canvas &canvas)
+    {
+        core::Rect title = m_box;
+        title.bottom = title.top + 24;
+
+        core::Rect body = m_box;
+        body.top = title.bottom;
+
+        canvas.fill(title, RGB(0x30, 0x60, 0xB0));
+        canvas.fill(body,  RGB(0xF0, 0xF0, 0xF0));
+
+        const char *caption = "dd4seven";
+        canvas.text(core::make_rect(title.left + 4, title.top + 4, title.right - 4, title.bottom - 4),
+                    title.left + 4, title.top + 4, caption, strlen(caption),
+                    RGB(0xFF, 0xFF, 0xFF), RGB(0x30, 0x60, 0xB0));
+    }
+
+public:
+    ~DragWorkload() override
+    {
+        m_background.destroy();
+    }
+
+    unsigned defaultFps() const override { return 60; }
+
+    void start(Canvas &canvas) override
+    {
+        m_background.create(canvas.width, canvas.height);
+
+        // A checkerboard, so a misplaced move shows up as changed pixels
+        for (int y = 0; y < canvas.height; y += 32) {
+            for (int x = 0; x < canvas.width; x += 32)
+                m_background.fill(core::make_rect(x, y, x + 32, y + 32),
+                                  ((x ^ y) & 32) ? RGB(0xA0, 0xB0, 0xC0) : RGB(0x80, 0x90, 0xA0));
+        }
+
+        BitBlt(canvas.dc, 0, 0, canvas.width, canvas.height, m_background.dc, 0, 0, SRCCOPY);
+
+        m_box = core::make_rect(0, 0, std::min(240, canvas.width / 2), std::min(180, canvas.height / 2));
+        drawBox(canvas);
+    }
+
+    void step(uint32_t, Canvas &canvas, Changes &changes) override
+    {
+        core::Rect old = m_box;
+
+        // Bounce off the edges
+        if (m_box.right + m_dx > canvas.width || m_box.left + m_dx < 0)
+            m_dx = -m_dx;
+        if (m_box.bottom + m_dy > canvas.height || m_box.top + m_dy < 0)
+            m_dy = -m_dy;
+
+        m_box = core::offset(m_box, m_dx, m_dy);
+
+        BitBlt(canvas.dc, m_box.left, m_box.top, core::width(m_box), core::height(m_box),
+               canvas.dc, old.left, old.top, SRCCOPY);
+
+        Changes::Move move;
+        move.source.x    = old.left;
+        move.source.y    = old.top;
+        move.destination = m_box;
+        changes.moves.push_back(move);
+
+        // Where the box was, the background shows again
+        core::Rect uncovered[4];
+        int count = core::subtract(uncovered, old, m_box);
+        for (int i = 0; i < count; ++i) {
+            BitBlt(canvas.dc, uncovered[i].left, uncovered[i].top, core::width(uncovered[i]), core::height(uncovered[i]),
+                   m_background.dc, uncovered[i].left, uncovered[i].top, SRCCOPY);
+            changes.add(uncovered[i]);
+        }
+    }
+};
+
+static Workload *make_workload(const char *name)
+{
+    if (!strcmp(name, "typing"))
+        return new TypingWorkload;
+    if (!strcmp(name, "scroll"))
+        return new ScrollWorkload;
+    if (!strcmp(name, "video"))
+        return new VideoWorkload;
+    if (!strcmp(name, "drag"))
+        return new DragWorkload;
+    if (!strcmp(name, "idle"))
+        return new IdleWorkload;
+
+    return nullptr;
+}
+
+/*********************************
+ * THE WINDOW
+ *********************************/
+
+static Canvas g_canvas;
+
+// Repaints (e.g. after something covered the window) show the current frame, they aren't in the manifest
+static LRESULT CALLBACK window_proc(HWND window, UINT msg, WPARAM wParam, LPARAM lParam)
+{
+    if (msg == WM_PAINT) {
+        PAINTSTRUCT paint;
+        HDC dc = BeginPaint(window, &paint);
+        BitBlt(dc, 0, 0, g_canvas.width, g_canvas.height, g_canvas.dc, 0, 0, SRCCOPY);
+        EndPaint(window, &paint);
+
+        return 0;
+    }
+
+    return DefWindowProc(window, msg, wParam, lParam);
+}
+
+static void write_rect(FILE *file, const core::Rect &r, const POINT &origin)
+{
+    fprintf(file, " %ld %ld %ld %ld",
+            long(r.left + origin.x), long(r.top + origin.y), long(r.right + origin.x), long(r.bottom + origin.y));
+}
+
+int main(int argc, char **argv)
+{
+    const char *name     = nullptr;
+    const char *manifest = nullptr;
+    unsigned    fps      = 0;
+    unsigned    seconds  = 10;
+    int         x        = 0;
+    int         y        = 0;
+    int         width    = 800;
+    int         height   = 600;
+
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--fps") && i + 1 < argc) {
+            fps = unsigned(strtoul(argv[++i], nullptr, 10));
+        } else if (!strcmp(argv[i], "--seconds") && i + 1 < argc) {
+            seconds = unsigned(strtoul(argv[++i], nullptr, 10));
+        } else if (!strcmp(argv[i], "--x") && i + 1 < argc) {
+            x = int(strtol(argv[++i], nullptr, 10));
+        } else if (!strcmp(argv[i], "--y") && i + 1 < argc) {
+            y = int(strtol(argv[++i], nullptr, 10));
+        } else if (!strcmp(argv[i], "--width") && i + 1 < argc) {
+            width = int(strtol(argv[++i], nullptr, 10));
+        } else if (!strcmp(argv[i], "--height") && i + 1 < argc) {
+            height = int(strtol(argv[++i], nullptr, 10));
+        } else if (!strcmp(argv[i], "--manifest") && i + 1 < argc) {
+            manifest = argv[++i];
+        } else if (argv[i][0] != '-' && !name) {
+            name = argv[i];
+        } else {
+            name = nullptr;
+            break;
+        }
+    }
+
+    Workload *workload = name ? make_workload(name) : nullptr;
+    if (!workload || width < 64 || height < 64) {
+        fprintf(stderr, "Usage: %s typing|scroll|video|drag|idle [--fps <n>] [--seconds <n>] "
+                        "[--x <n>] [--y <n>] [--width <n>] [--height <n>] [--manifest <file>]\n", argv[0]);
+        return 2;
+    }
+
+    if (!fps)
+        fps = workload->defaultFps();
+
+    char defaultManifest[64];
+    if (!manifest) {
+        snprintf(defaultManifest, sizeof(defaultManifest), "%s.manifest", name);
+        manifest = defaultManifest;
+    }
+
+    FILE *out = fopen(manifest, "w");
+    if (!out) {
+        fprintf(stderr, "Couldn't open %s\n", manifest);
+        return 1;
+    }
+
+    if (!g_canvas.create(width, height)) {
+        fprintf(stderr, "Couldn't create the canvas (error %lu)\n", (unsigned long)GetLastError());
+        return 1;
+    }
+
+    WNDCLASSEX wcex;
+    memset(&wcex, 0, sizeof(wcex));
+    wcex.cbSize        = sizeof(wcex);
+    wcex.lpfnWndProc   = window_proc;
+    wcex.hCursor       = LoadCursor(NULL, IDC_ARROW);
+    wcex.lpszClassName = L"DD4SevenWorkload";
+    RegisterClassEx(&wcex);
+
+    // Drawn before the window shows up, so the first frame is complete
+    workload->start(g_canvas);
+
+    HWND window = CreateWindowEx(WS_EX_TOPMOST | WS_EX_TOOLWINDOW | WS_EX_NOACTIVATE,
+                                 L"DD4SevenWorkload", L"dd4seven workload",
+                                 WS_POPUP | WS_VISIBLE,
+                                 x, y, width, height,
+                                 NULL, NULL, NULL, NULL);
+    if (!window) {
+        fprintf(stderr, "Couldn't create the window (error %lu)\n", (unsigned long)GetLastError());
+        return 1;
+    }
+
+    UpdateWindow(window);
+    GdiFlush();
+
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+
+    const POINT    origin = { x, y };
+    const LONGLONG period = frequency.QuadPart / LONGLONG(fps ? fps : 1);
+    const LONGLONG begin  = now();
+    const uint32_t frames = uint32_t(uint64_t(seconds) * fps);
+
+    fprintf(out, "workload %s\n", name);
+    fprintf(out, "fps %u\n", fps);
+    fprintf(out, "frequency %lld\n", (long long)frequency.QuadPart);
+    fprintf(out, "window %d %d %d %d\n", x, y, x + width, y + height);
+
+    // The window appearing is frame 0
+    fprintf(out, "frame 0 %lld dirty 1", (long long)begin);
+    write_rect(out, g_canvas.bounds(), origin);
+    fprintf(out, " move 0\n");
+
+    HDC dc = GetDC(window);
+
+    Changes  changes;
+    uint64_t dirtyPixels = 0;
+    uint64_t movedPixels = 0;
+    uint64_t late        = 0;
+
+    for (uint32_t frame = 1; frame <= frames; ++frame) {
+        MSG msg;
+        while (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE)) {
+            TranslateMessage(&msg);
+            DispatchMessage(&msg);
+        }
+
+        // Fixed rate: frame n is due at begin + n * period, no matter how late the previous one was
+        const LONGLONG due = begin + LONGLONG(frame) * period;
+        LONGLONG remaining = due - now();
+        if (remaining < 0)
+            late++;
+
+        while (remaining > 0) {
+            DWORD ms = DWORD(ticks_to_microseconds(remaining) / 1000.0);
+            if (ms > 2)
+                Sleep(ms - 2);
+            else
+                YieldProcessor();
+
+            remaining = due - now();
+        }
+
+        changes.clear();
+        workload->step(frame, g_canvas, changes);
+        GdiFlush();
+
+        // Only what the workload says changed makes it to the screen
+        for (const Changes::Move &move : changes.moves) {
+            const core::Rect &r = move.destination;
+            BitBlt(dc, r.left, r.top, core::width(r), core::height(r), g_canvas.dc, r.left, r.top, SRCCOPY);
+            movedPixels += uint64_t(core::width(r)) * uint64_t(core::height(r));
+        }
+        for (const core::Rect &r : changes.dirty) {
+            BitBlt(dc, r.left, r.top, core::width(r), core::height(r), g_canvas.dc, r.left, r.top, SRCCOPY);
+            dirtyPixels += uint64_t(core::width(r)) * uint64_t(core::height(r));
+        }
+        GdiFlush();
+
+        fprintf(out, "frame %u %lld dirty %u", frame, (long long)now(), unsigned(changes.dirty.size()));
+        for (const core::Rect &r : changes.dirty)
+            write_rect(out, r, origin);
+
+        fprintf(out, " move %u", unsigned(changes.moves.size()));
+        for (const Changes::Move &move : changes.moves) {
+            fprintf(out, " %ld %ld", long(move.source.x + origin.x), long(move.source.y + origin.y));
+            write_rect(out, move.destination, origin);
+        }
+        fprintf(out, "\n");
+    }
+
+    const double elapsed = ticks_to_microseconds(now() - begin) / 1000000.0;
+
+    ReleaseDC(window, dc);
+    DestroyWindow(window);
+    fclose(out);
+
+    delete workload;
+    g_canvas.destroy();
+
+    printf("workload.name %s\n", name);
+    printf("workload.manifest %s\n", manifest);
+    printf("workload.frames %u\n", frames + 1);
+    printf("workload.late_frames %llu\n", (unsigned long long)late);
+    printf("workload.fps %.2f\n", elapsed > 0 ? double(frames) / elapsed : 0.0);
+    printf("workload.dirty_pixels %llu\n", (unsigned long long)dirtyPixels);
+    printf("workload.moved_pixels %llu\n", (unsigned long long)movedPixels);
+    printf("workload.dirty_bytes_per_second %.0f\n", elapsed > 0 ? double(dirtyPixels) * 4.0 / elapsed : 0.0);
+
+    fflush(stdout);
+
+    return 0;
+}
@@ -0,0 +1,123 @@
+// Copyright (C) 2015 Jonas Kümmerlin <rgcjonas@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "imports.hpp"
+
+#include <winternl.h>
+
+namespace {
+    struct Redirect
+    {
+        void **slot;
+        void  *original;
+        void  *replacement;
+    };
+
+    const size_t MAX_REDIRECTS = 32;
+    Redirect     g_redirects[MAX_REDIRECTS];
+    size_t       g_count = 0;
+
+    // Import tables are usually read-only once the loader is done with them
+    bool swap_slot(void **slot, void *expected, void *value)
+    {
+        DWORD oldProtect;
+        if (!VirtualProtect(slot, sizeof(void *), PAGE_READWRITE, &oldProtect))
+            return false;
+
+        bool swapped = InterlockedCompareExchangePointer(slot, value, expected) == expected;
+
+        VirtualProtect(slot, sizeof(void *), oldProtect, &oldProtect);
+
+        return swapped;
+    }
+
+    template<typename T>
+    T *at(BYTE *base, DWORD rva)
+    {
+        return reinterpret_cast<T *>(base + rva);
+    }
+
+    void redirect_in(BYTE *base, const char *dll, void *function, void *replacement)
+    {
+        IMAGE_DOS_HEADER *dos = reinterpret_cast<IMAGE_DOS_HEADER *>(base);
+        if (dos->e_magic != IMAGE_DOS_SIGNATURE)
+            return;
+
+        IMAGE_NT_HEADERS *nt = at<IMAGE_NT_HEADERS>(base, dos->e_lfanew);
+        if (nt->Signature != IMAGE_NT_SIGNATURE)
+            return;
+
+        const IMAGE_DATA_DIRECTORY &dir = nt->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT];
+        if (!dir.VirtualAddress || !dir.Size)
+            return;
+
+        // Comparing the bound addresses works for imports by name and by ordinal alike
+        for (IMAGE_IMPORT_DESCRIPTOR *desc = at<IMAGE_IMPORT_DESCRIPTOR>(base, dir.VirtualAddress); desc->Name; ++desc) {
+            if (lstrcmpiA(at<char>(base, desc->Name), dll) != 0)
+                continue;
+
+            for (void **slot = at<void *>(base, desc->FirstThunk); *slot; ++slot) {
+                if (*slot != function || g_count >= MAX_REDIRECTS)
+                    continue;
+
+                if (swap_slot(slot, function, replacement))
+                    g_redirects[g_count++] = { slot, function, replacement };
+            }
+        }
+    }
+}
+
+size_t imports::redirect(const char *dll, void *function, void *replacement)
+{
+    size_t before = g_count;
+
+    // The loader's own list, walking it takes no locks
+    PEB_LDR_DATA *ldr = NtCurrentTeb()->ProcessEnvironmentBlock->Ldr;
+    LIST_ENTRY *head = &ldr->InMemoryOrderModuleList;
+
+    for (LIST_ENTRY *link = head->Flink; link != head; link = link->Flink) {
+        LDR_DATA_TABLE_ENTRY *module = CONTAINING_RECORD(link, LDR_DATA_TABLE_ENTRY, InMemoryOrderLinks);
+        if (module->DllBase)
+            redirect_in(static_cast<BYTE *>(module->DllBase), dll, function, replacement);
+    }
+
+    return g_count - before;
+}
+
+void imports::restore_all()
+{
+    for (size_t i = 0; i < g_count; ++i)
+        swap_slot(g_redirects[i].slot, g_redirects[i].replacement, g_redirects[i].original);
+}
+
+bool imports::loader_lock_held()
+{
+    // PEB::LoaderLock, at the same place since Windows 2000. winternl.h leaves it out.
+#ifdef _WIN64
+    const size_t LOADER_LOCK_OFFSET = 0x110;
+#else
+    const size_t LOADER_LOCK_OFFSET = 0xA0;
+#endif
+    BYTE *peb = reinterpret_cast<BYTE *>(NtCurrentTeb()->ProcessEnvironmentBlock);
+    CRITICAL_SECTION *lock = *reinterpret_cast<CRITICAL_SECTION **>(peb + LOADER_LOCK_OFFSET);
+
+    // A critical section keeps the ID of its owner, not a handle
+    return lock && HandleToUlong(lock->OwningThread) == GetCurrentThreadId();
+}
@@ -0,0 +1,52 @@
+// Copyright (C) 2015 Jonas Kümmerlin <rgcjonas@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#pragma once
+
+#include <windows.h>
+
+#include <cstddef>
+
+/*
+ * Redirecting calls by replacing pointers in the import tables of the
+ * modules that are loaded already.
+ *
+ * This is the one kind of hook that is safe to put in under the loader lock:
+ * it walks the loader's own module list and every change is a single atomic
+ * pointer store, with no thread frozen. It only catches calls made through
+ * those import tables though. Modules loaded later and callers that got the
+ * function from GetProcAddress() still call the real thing.
+ */
+
+namespace imports {
+    // Points every import of <function> from <dll> in the loaded modules at
+    // <replacement>. Returns how many import table entries it changed.
+    // Call it under the loader lock (i.e. from DllMain), which keeps the
+    // module list still. Not thread-safe against restore_all().
+    size_t redirect(const char *dll, void *function, void *replacement);
+
+    // Puts the original back into every entry redirect() changed, unless
+    // something else replaced ours in the meantime.
+    void restore_all();
+
+    // Whether the calling thread holds the loader lock, i.e. is inside some
+    // DllMain or a static initializer. Threads can't start until it's released.
+    bool loader_lock_held();
+}; // namespace imports
@@ -21,12 +21,14 @@
 #ifndef NDEBUG
 
 #include <iostream>
-#include <sstream>
+#include <cstring>
+#include <string>
 
 #include "logger.hpp"
 #include "util.hpp"
 
 #include <windows.h>
+#include <malloc.h>
 
 namespace {
     // trim from start
@@ -46,33 +48,220 @@ namespace {
         return ltrim(rtrim(s));
     }
 
-    class MyLogger : public std::stringbuf {
+    /*
+     * Every thread formats its lines into a buffer of its own. Finished lines
+     * are copied into a node from a preallocated pool and pushed onto a
+     * lock-free list, which a background thread writes out. So logging from the
+     * DWM render thread costs a copy and two interlocked operations instead of
+     * a blocking OutputDebugString, and never allocates. Longer lines are cut
+     * short, and when the flusher falls behind by a whole pool, lines are
+     * dropped and counted.
+     *
+     * The flusher thread holds a reference on our module and quits after a
+     * second without anything to do, so it never keeps the DLL from unloading
+     * for long and never runs code from an unloaded image.
+     */
+    const size_t LineLength = 500;
+    const size_t PoolSize   = 256;
+
+    struct LogLine {
+        SLIST_ENTRY entry; // must be first
+        size_t      length;
+        char        text[LineLength];
+    };
+
+    SLIST_HEADER  g_lines;
+    SLIST_HEADER  g_freeLines;
+    HANDLE        g_linesEvent = nullptr; // signaled when g_lines stops being empty
+    volatile LONG g_flusherRunning = 0;
+    volatile LONG g_droppedLines = 0;
+
+    const DWORD FlusherIdleTimeout = 1000;
+
+    void OutputLine(const std::string &text)
+    {
+        std::wstring u16 = std::wstring(L"DD4Seven DEBUG LOG: ") + util::utf8_to_utf16(trim(text)) + std::wstring(L"\r\n");
+        OutputDebugString(u16.c_str());
+    }
+
+    void OutputLines(PSLIST_ENTRY entries)
+    {
+        // The list hands them out newest first
+        PSLIST_ENTRY ordered = nullptr;
+        while (entries) {
+            PSLIST_ENTRY next = entries->Next;
+            entries->Next = ordered;
+            ordered = entries;
+            entries = next;
+        }
+
+        while (ordered) {
+            LogLine *line = reinterpret_cast<LogLine*>(ordered);
+            ordered = ordered->Next;
+
+            OutputLine(std::string(line->text, line->length));
+            InterlockedPushEntrySList(&g_freeLines, &line->entry);
+        }
+
+        if (LONG dropped = InterlockedExchange(&g_droppedLines, 0))
+            OutputLine(std::to_string(dropped) + " log lines dropped");
+    }
+
+    DWORD WINAPI FlusherThread(LPVOID param)
+    {
+        HMODULE self = static_cast<HMODULE>(param);
+
+        for (;;) {
+            OutputLines(InterlockedFlushSList(&g_lines));
+
+            if (WaitForSingleObject(g_linesEvent, FlusherIdleTimeout) != WAIT_TIMEOUT)
+                continue;
+
+            // Nothing to do for a while. Once g_flusherRunning is cleared, whoever
+            // pushes the next line starts a new flusher, so only keep running if
+            // a line slipped in before that and nobody else has taken over yet.
+            InterlockedExchange(&g_flusherRunning, 0);
+            if (!QueryDepthSList(&g_lines) || InterlockedCompareExchange(&g_flusherRunning, 1, 0) != 0)
+                break;
+        }
+
+        FreeLibraryAndExitThread(self, 0);
+        return 0;
+    }
+
+    void StartFlusher()
+    {
+        if (InterlockedCompareExchange(&g_flusherRunning, 1, 0) != 0)
+            return;
+
+        // Keeps us loaded until FlusherThread is done
+        HMODULE self = nullptr;
+        if (GetModuleHandleEx(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS, reinterpret_cast<LPCWSTR>(&FlusherThread), &self)) {
+            HANDLE thread = CreateThread(nullptr, 0, &FlusherThread, self, 0, nullptr);
+            if (thread) {
+                CloseHandle(thread);
+                return;
+            }
+
+            FreeLibrary(self);
+        }
+
+        // Try again with the next line
+        InterlockedExchange(&g_flusherRunning, 0);
+    }
+
+    bool InitQueue()
+    {
+        InitializeSListHead(&g_lines);
+        InitializeSListHead(&g_freeLines);
+
+        // Never freed, lines may still be in flight while we're unloaded.
+        // SList entries need more alignment than new guarantees on x64.
+        LogLine *pool = static_cast<LogLine*>(_aligned_malloc(PoolSize * sizeof(LogLine), MEMORY_ALLOCATION_ALIGNMENT));
+        if (!pool)
+            return false;
+
+        for (size_t i = 0; i < PoolSize; ++i)
+            InterlockedPushEntrySList(&g_freeLines, &pool[i].entry);
+
+        g_linesEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+
+        return g_linesEvent != nullptr;
+    }
+
+    void QueueLine(const char *text, size_t length)
+    {
+        static bool queueGood = InitQueue();
+        if (!queueGood)
+            return;
+
+        LogLine *line = reinterpret_cast<LogLine*>(InterlockedPopEntrySList(&g_freeLines));
+        if (!line) {
+            InterlockedIncrement(&g_droppedLines);
+            StartFlusher();
+            return;
+        }
+
+        line->length = length;
+        memcpy(line->text, text, length);
+
+        if (!InterlockedPushEntrySList(&g_lines, &line->entry))
+            SetEvent(g_linesEvent);
+
+        StartFlusher();
+    }
+
+    // Formats into a fixed buffer, anything beyond LineLength is lost
+    class MyLogger : public std::streambuf {
+        char m_buffer[LineLength];
+
     public:
-        virtual int sync()
+        MyLogger()
         {
-            std::string u8 = trim(this->str());
-            std::wstring u16 = std::wstring(L"DD4Seven DEBUG LOG: ") + util::utf8_to_utf16(u8) + std::wstring(L"\r\n");
+            setp(m_buffer, m_buffer + LineLength);
+        }
+
+    protected:
+        virtual int overflow(int c)
+        {
+            return traits_type::not_eof(c);
+        }
 
-            OutputDebugString(u16.c_str());
+        virtual int sync()
+        {
+            QueueLine(pbase(), size_t(pptr() - pbase()));
 
-            this->str(std::string());
+            setp(m_buffer, m_buffer + LineLength);
 
             return 0;
         }
     };
+
+    struct ThreadLogger {
+        MyLogger     buf;
+        std::ostream stream { &buf };
+    };
+
+    // Called on thread exit, and for all remaining threads when we're unloaded.
+    // Anything not terminated by std::endl yet is lost.
+    void WINAPI FreeThreadLogger(PVOID data)
+    {
+        delete static_cast<ThreadLogger*>(data);
+    }
+
+    // The slot has to go away with our module, or exiting threads would call
+    // into FreeThreadLogger after it has been unmapped.
+    struct ThreadLoggerSlot {
+        DWORD index = FlsAlloc(&FreeThreadLogger);
+
+        ~ThreadLoggerSlot()
+        {
+            if (index != FLS_OUT_OF_INDEXES)
+                FlsFree(index);
+        }
+    };
 }
 
 std::ostream* get_logger()
 {
-    static __thread MyLogger     *my_buf = nullptr;
-    static __thread std::ostream *my_stream = nullptr;
+    static ThreadLoggerSlot slot;
+
+    if (slot.index == FLS_OUT_OF_INDEXES) {
+        // Never freed, but better than nothing
+        static __thread ThreadLogger *fallback = nullptr;
+        if (!fallback)
+            fallback = new ThreadLogger;
 
-    if (!my_buf)
-        my_buf = new MyLogger;
-    if (!my_stream)
-        my_stream = new std::ostream(my_buf);
+        return &fallback->stream;
+    }
+
+    ThreadLogger *threadLogger = static_cast<ThreadLogger*>(FlsGetValue(slot.index));
+    if (!threadLogger) {
+        threadLogger = new ThreadLogger;
+        FlsSetValue(slot.index, threadLogger);
+    }
 
-    return my_stream;
+    return &threadLogger->stream;
 }
 
 #endif // NDEBUG
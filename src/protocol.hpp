@@ -0,0 +1,84 @@
+// Copyright (C) 2015 Jonas Kümmerlin <rgcjonas@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+/*
+ * Names shared between our binaries on Windows. The wire format itself
+ * lives in core/protocol.hpp.
+ */
+
+#pragma once
+
+#include <windows.h>
+
+#include "core/protocol.hpp"
+
+// Class and window name of the message-only window inside the DWM
+#define DD4SEVEN_WINDOW_NAME L"dd4seven-window-4B3A8226-9F55-4E9E-A276-9DE174B36166"
+
+// dd4seven-dwm.dll also hooks into processes that have this environment variable set
+// and export a CreateDXGIFactory replacement under this name (see dd4seven-fakedwm.cpp)
+#define FAKE_DWM_VARIABLE L"DD4SEVEN_FAKE_DWM"
+#ifdef _WIN64
+#define FAKE_DWM_FACTORY_EXPORT "FakeCreateDXGIFactory"
+#else
+#define FAKE_DWM_FACTORY_EXPORT "FakeCreateDXGIFactory@8" // stdcall decoration survives in the export table
+#endif
+
+// dd4seven-dwm.dll hooks from a thread of its own once it's loaded. A stand-in DWM
+// waits for that with this export: BOOL __cdecl WaitForStartup(DWORD milliseconds)
+#define DWM_WAIT_FOR_STARTUP_EXPORT "WaitForStartup"
+
+/*
+ * Replacing a running dd4seven-dwm.dll without restarting the DWM: its window is
+ * sent WM_COPYDATA with DD4SEVEN_COPYDATA_UPGRADE and the file name of the new
+ * DLL, which has to sit next to the running one (see dd4seven-upgrade.cpp).
+ * The running DLL takes its hooks out, loads the new one and passes what it knows
+ * to the DD4SEVEN_TAKE_OVER_EXPORT function there, then unloads itself.
+ *
+ * Both DLLs are in the same process, so this is a plain struct. A DLL refuses
+ * any other DD4SEVEN_HANDOVER_VERSION. When TakeOver() fails, the new DLL has
+ * put back everything it changed and the running one carries on.
+ */
+#define DD4SEVEN_COPYDATA_UPGRADE 0x52475055 // "UPGR", lpData is a zero-terminated file name
+#define DD4SEVEN_UPGRADE_VARIABLE L"DD4SEVEN_UPGRADE" // set while the new DLL loads, it hooks in TakeOver then
+#define DD4SEVEN_HANDOVER_VERSION_EXPORT "HandoverVersion" // uint32_t __cdecl HandoverVersion(), asked first
+#define DD4SEVEN_TAKE_OVER_EXPORT "TakeOver" // BOOL __cdecl TakeOver(const DwmHandover *handover)
+#define DD4SEVEN_HANDOVER_VERSION 1
+#define DD4SEVEN_HANDOVER_SWAP_CHAINS 16
+
+struct CaptureHandover
+{
+    CaptureRequest request;           // as registered, with the current monitor, targets and config
+    uint32_t       id;
+    uint32_t       waitingForTargets; // for new targets after a mode change
+    LONG           targetsGeneration;
+    LONG           configGeneration;
+};
+
+struct DwmHandover
+{
+    uint32_t               version;
+    void                  *createSwapChain; // hooked CreateSwapChain, nullptr if there was no factory yet
+    void                  *recording;       // recording::Header, if recording
+    uint32_t               swapChainCount;
+    void                  *swapChains[DD4SEVEN_HANDOVER_SWAP_CHAINS]; // IDXGISwapChainDWM
+    uint32_t               captureCount;
+    const CaptureHandover *captures;
+};
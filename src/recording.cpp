@@ -0,0 +1,81 @@
+// Copyright (C) 2015 Jonas Kümmerlin <rgcjonas@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "recording.hpp"
+#include "logger.hpp"
+#include "util.hpp"
+
+#include <algorithm>
+#include <cwchar>
+
+recording::Header *recording::g_file = nullptr;
+
+void recording::init(DWORD megabytes, int64_t budget)
+{
+    if (g_file || !megabytes)
+        return;
+
+    megabytes = std::min<DWORD>(megabytes, 1024);
+
+    wchar_t path[MAX_PATH + 48];
+    DWORD length = GetTempPathW(MAX_PATH, path);
+    if (!length || length >= MAX_PATH)
+        return;
+    _snwprintf(path + length, 48, L"dd4seven-recording-%lu.bin", (unsigned long)GetCurrentProcessId());
+
+    uint32_t capacity = uint32_t(uint64_t(megabytes) * 1024 * 1024 / sizeof(Record));
+    DWORD    size     = DWORD(sizeof(Header) + uint64_t(capacity) * sizeof(Record));
+
+    HANDLE file = CreateFileW(path, GENERIC_READ|GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        logger << "Couldn't create recording " << util::wcsdup_to_utf8(path) << ": " << GetLastError() << std::endl;
+        return;
+    }
+
+    HANDLE mapping = CreateFileMapping(file, nullptr, PAGE_READWRITE, 0, size, nullptr);
+    CloseHandle(file); // the mapping keeps it open
+    if (!mapping) {
+        logger << "Couldn't map recording: " << GetLastError() << std::endl;
+        return;
+    }
+
+    // Stays mapped for the lifetime of the process, the system writes it back
+    Header *header = (Header*)MapViewOfFile(mapping, FILE_MAP_READ|FILE_MAP_WRITE, 0, 0, size);
+    CloseHandle(mapping);
+    if (!header) {
+        logger << "Couldn't map recording: " << GetLastError() << std::endl;
+        return;
+    }
+
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+
+    header->version   = VERSION;
+    header->capacity  = capacity;
+    header->process   = GetCurrentProcessId();
+    header->frequency = frequency.QuadPart;
+    header->budget    = budget;
+    header->next      = 0;
+    header->magic     = MAGIC;
+
+    g_file = header;
+
+    logger << "Recording into " << util::wcsdup_to_utf8(path) << std::endl;
+}
@@ -0,0 +1,69 @@
+// Copyright (C) 2015 Jonas Kümmerlin <rgcjonas@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#pragma once
+
+#include <windows.h>
+
+#include "core/recording.hpp"
+
+/*
+ * Writes the recording (see core/recording.hpp) into
+ * %TEMP%\dd4seven-recording-<pid>.bin, a file mapping that is kept open,
+ * so the records are on disk even if the DWM crashes.
+ *
+ * Only the thread that presents may write, nothing here is synchronized.
+ */
+namespace recording {
+    // The header of the mapped file, or nullptr if nothing is recorded
+    extern Header *g_file;
+
+    // Creates the file with room for megabytes of records, unless that's 0.
+    // budget is the scheduler budget, in ticks.
+    void init(DWORD megabytes, int64_t budget);
+
+    inline void write(Type type, uint32_t arg0 = 0, uint32_t arg1 = 0, uint32_t arg2 = 0, uint32_t arg3 = 0, uint32_t arg4 = 0)
+    {
+        Header *file = g_file;
+        if (!file)
+            return;
+
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+
+        Record &record = reinterpret_cast<Record*>(file + 1)[file->next % file->capacity];
+        record.timestamp = now.QuadPart;
+        record.type      = type;
+        record.reserved  = 0;
+        record.args[0]   = arg0;
+        record.args[1]   = arg1;
+        record.args[2]   = arg2;
+        record.args[3]   = arg3;
+        record.args[4]   = arg4;
+
+        file->next++;
+    }
+
+    // Ticks squeezed into a record argument
+    inline uint32_t ticks(int64_t value)
+    {
+        return value <= 0 ? 0 : value >= int64_t(UINT32_MAX) ? UINT32_MAX : uint32_t(value);
+    }
+}
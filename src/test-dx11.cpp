@@ -29,8 +29,10 @@
 #include "logger.hpp"
 #include "util.hpp"
 #include "shaders.h"
+#include "core/pixels.hpp"
 
 constexpr UINT CURSOR_TEX_SIZE = 256;
+constexpr UINT DESKTOP_TEXTURES = 2; // the DWM fills one while we draw the other
 
 class DuplicationRenderer
 {
@@ -48,6 +50,7 @@ class DuplicationRenderer
                             ID3D11DeviceContext **)> m_d3dCreator { L"d3d11.dll", "D3D11CreateDeviceAndSwapChain" };
 
     util::dll_func<HRESULT(IDXGIOutput*,IUnknown*,IDXGIOutputDuplication**)> m_dd4seven_duplicate { L"dd4seven-api.dll", "DuplicateOutput" };
+    util::dll_func<HRESULT(IDXGIOutput*,UINT,IUnknown * const *,IDXGIOutputDuplication**)> m_dd4seven_duplicate_into { L"dd4seven-api.dll", "DuplicateOutputInto" };
 
     com::ptr<ID3D11Device>           m_device;
     com::ptr<ID3D11DeviceContext>    m_context;
@@ -59,8 +62,10 @@ class DuplicationRenderer
     com::ptr<ID3D11SamplerState>     m_sampler;
     com::ptr<ID3D11BlendState>       m_blendState;
 
-    com::ptr<ID3D11Texture2D>          m_desktopTexture;
-    com::ptr<ID3D11ShaderResourceView> m_desktopSrv;
+    com::ptr<ID3D11Texture2D>          m_desktopTextures[DESKTOP_TEXTURES];
+    com::ptr<ID3D11ShaderResourceView> m_desktopSrvs[DESKTOP_TEXTURES];
+    UINT                               m_desktopCurrent = 0;
+    bool                               m_desktopShared  = false; // the DWM writes into m_desktopTextures
     com::ptr<ID3D11Texture2D>          m_cursorTexture;
     com::ptr<ID3D11ShaderResourceView> m_cursorSrv;
     com::ptr<ID3D11Buffer>             m_desktopVBuffer;
@@ -232,19 +237,24 @@ class DuplicationRenderer
         return true;
     }
 
-    bool setupDesktopTextureAndVertices()
+    void releaseDesktopTextures()
+    {
+        for (UINT i = 0; i < DESKTOP_TEXTURES; ++i) {
+            m_desktopSrvs[i].reset();
+            m_desktopTextures[i].reset();
+        }
+    }
+
+    bool setupDesktopTextureAndVertices(bool shared)
     {
         HRESULT hr;
 
-        if (!m_duplication || !m_device)
+        if (!m_device)
             return false;
 
-        DXGI_OUTDUPL_DESC dpldesc;
-        m_duplication->GetDesc(&dpldesc);
-
         D3D11_TEXTURE2D_DESC texdsc = {
-            .Width = dpldesc.ModeDesc.Width,
-            .Height = dpldesc.ModeDesc.Height,
+            .Width = UINT(m_desktopWidth),
+            .Height = UINT(m_desktopHeight),
             .MipLevels = 1,
             .ArraySize = 1,
             .Format = DXGI_FORMAT_B8G8R8A8_UNORM,
@@ -255,19 +265,27 @@ class DuplicationRenderer
             .Usage = D3D11_USAGE_DEFAULT,
             .BindFlags = D3D11_BIND_SHADER_RESOURCE,
             .CPUAccessFlags = 0,
-            .MiscFlags = 0
+            .MiscFlags = shared ? UINT(D3D11_RESOURCE_MISC_SHARED) : 0
         };
 
-        hr = m_device->CreateTexture2D(&texdsc, nullptr, com::out_arg(m_desktopTexture));
-        if FAILED(hr) {
-            logger << "Failed: CreateTexture2D: " << util::hresult_to_utf8(hr) << std::endl;
-            return false;
-        }
+        m_desktopCurrent = 0;
+        releaseDesktopTextures();
+        for (UINT i = 0; i < DESKTOP_TEXTURES; ++i) {
+            // Without sharing, we copy every frame into the first texture
+            if (!shared && i > 0)
+                continue;
+
+            hr = m_device->CreateTexture2D(&texdsc, nullptr, com::out_arg(m_desktopTextures[i]));
+            if FAILED(hr) {
+                logger << "Failed: CreateTexture2D: " << util::hresult_to_utf8(hr) << std::endl;
+                return false;
+            }
 
-        hr = m_device->CreateShaderResourceView(m_desktopTexture, nullptr, com::out_arg(m_desktopSrv));
-        if FAILED(hr) {
-            logger << "Failed: CreateShaderResourceView: " << util::hresult_to_utf8(hr) << std::endl;
-            return false;
+            hr = m_device->CreateShaderResourceView(m_desktopTextures[i], nullptr, com::out_arg(m_desktopSrvs[i]));
+            if FAILED(hr) {
+                logger << "Failed: CreateShaderResourceView: " << util::hresult_to_utf8(hr) << std::endl;
+                return false;
+            }
         }
 
         // create vertex buffers
@@ -418,6 +436,20 @@ class DuplicationRenderer
         if (hr == DXGI_ERROR_WAIT_TIMEOUT)
             return; // This can happen if the screen is idle or whatever, it's not really fatal enough to log
 
+        if (hr == DXGI_ERROR_MODE_CHANGE_IN_PROGRESS) {
+            // The duplication survives a mode change, only our copy of the desktop has the wrong size now
+            DXGI_OUTDUPL_DESC desc;
+            m_duplication->GetDesc(&desc);
+
+            logger << "Display mode changed to " << desc.ModeDesc.Width << "x" << desc.ModeDesc.Height << std::endl;
+
+            m_desktopWidth  = int(desc.ModeDesc.Width);
+            m_desktopHeight = int(desc.ModeDesc.Height);
+            setupDesktopTextureAndVertices(false);
+
+            return;
+        }
+
         if (!(m_frameAcquired = SUCCEEDED(hr)))
             logger << "Failed: AcquireNextFrame: " << util::hresult_to_utf8(hr) << std::endl;
 
@@ -433,14 +465,23 @@ class DuplicationRenderer
 
     void updateDesktop()
     {
-        if (!m_desktopTexture || !m_frameAcquired || !m_device)
+        if (!m_desktopTextures[0] || !m_frameAcquired || !m_device)
             return;
 
         if (!m_duplInfo.LastPresentTime.QuadPart || !m_duplDesktopImage)
             return;
 
-        auto d3dresource = m_duplDesktopImage.query<ID3D11Resource>();
-        m_context->CopyResource(m_desktopTexture, d3dresource);
+        auto d3dresource = m_duplDesktopImage.query<ID3D11Texture2D>();
+
+        if (m_desktopShared) {
+            // The DWM wrote into one of our own textures, we just have to draw the right one
+            for (UINT i = 0; i < DESKTOP_TEXTURES; ++i) {
+                if (m_desktopTextures[i].get() == d3dresource.get())
+                    m_desktopCurrent = i;
+            }
+        } else {
+            m_context->CopyResource(m_desktopTextures[0], d3dresource);
+        }
     }
 
     void
@@ -511,26 +552,8 @@ class DuplicationRenderer
             //FIXME: We don't want to read the desktop image back into the CPU, so we pretend to
             //       apply the AND mask onto a black surface. This is incorrect, but doesn't look too bad.
 
-            uint8_t *and_map = buffer.get();
-            uint8_t *xor_map = and_map + pointer.Pitch*pointer.Height/2;
-
-            for (UINT row = 0; row < std::min(pointer.Height/2, CURSOR_TEX_SIZE); ++row)
-            {
-                uint8_t *and_row = &and_map[row * pointer.Pitch];
-                uint8_t *xor_row = &xor_map[row * pointer.Pitch];
-
-                for (UINT col = 0; col < std::min(pointer.Width, CURSOR_TEX_SIZE); ++col) {
-                    uint8_t *target = &reinterpret_cast<uint8_t*>(info.pData)[row*info.RowPitch + col*4];
-
-                    uint8_t alpha = util::get_pixel_from_row<1>(and_row, col) ? 0 : 0xFF;
-                    uint8_t rgb   = util::get_pixel_from_row<1>(xor_row, col) ? 0xFF : 0;
-
-                    target[0] = rgb;
-                    target[1] = rgb;
-                    target[2] = rgb;
-                    target[3] = alpha;
-                }
-            }
+            core::mono_cursor_to_bgra(buffer.get(), pointer.Pitch, pointer.Width, pointer.Height,
+                                      static_cast<uint8_t*>(info.pData), info.RowPitch, CURSOR_TEX_SIZE, CURSOR_TEX_SIZE);
         }
 
         m_context->Unmap(m_cursorTexture, 0);
@@ -628,6 +651,7 @@ public:
         m_duplication.reset();
         m_duplDesktopImage.reset();
         m_frameAcquired = false;
+        m_desktopShared = false;
 
         // find the matching output
         com::ptr<IDXGIDevice>  dev;
@@ -651,6 +675,24 @@ public:
 
                 if (util::check_windows_version<std::equal_to<DWORD>>(6, 1)) {
                     // Win7
+                    if (m_dd4seven_duplicate_into && setupDesktopTextureAndVertices(true)) {
+                        // Let the DWM draw right into our textures
+                        IUnknown *targets[DESKTOP_TEXTURES];
+                        for (UINT t = 0; t < DESKTOP_TEXTURES; ++t)
+                            targets[t] = m_desktopTextures[t];
+
+                        HRESULT hr = m_dd4seven_duplicate_into(output, UINT(DESKTOP_TEXTURES), targets, com::out_arg(m_duplication));
+                        if SUCCEEDED(hr) {
+                            m_desktopShared = true;
+                            break;
+                        }
+
+                        logger << "Attempted to duplicate display " << i << " into our textures but: " << util::hresult_to_utf8(hr) << std::endl;
+                    }
+
+                    // Copy the frames ourselves instead, the shared textures are no use for that
+                    releaseDesktopTextures();
+
                     if (!m_dd4seven_duplicate) {
                         logger << "DuplicationSource: Missing compatible dd4seven-api.dll :(" << std::endl;
                         break;
@@ -685,7 +727,8 @@ public:
             return false;
         }
 
-        setupDesktopTextureAndVertices();
+        if (!m_desktopShared)
+            setupDesktopTextureAndVertices(false);
         setupCursorTextureAndVertices();
 
         return true;
@@ -703,8 +746,6 @@ public:
 
         updateCursorPosition();
 
-        releaseFrame();
-
         // draw the scene
         float gray[4] = { 0.5, 0.5, 0.5, 1.0 };
         m_context->ClearRenderTargetView(m_renderTarget, gray);
@@ -713,7 +754,7 @@ public:
         UINT offset = 0;
         m_context->IASetVertexBuffers(0, 1, com::single_item_array(m_desktopVBuffer), &stride, &offset);
         m_context->IASetPrimitiveTopology(D3D10_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
-        m_context->PSSetShaderResources(0, 1, com::single_item_array(m_desktopSrv));
+        m_context->PSSetShaderResources(0, 1, com::single_item_array(m_desktopSrvs[m_desktopCurrent]));
         m_context->Draw(6, 0);
 
         if (m_cursorVisible) {
@@ -723,6 +764,9 @@ public:
             m_context->Draw(6, 0);
         }
 
+        // When drawing straight from the DWM's target, we must hold it until now
+        releaseFrame();
+
         m_swap->Present(1, 0);
     }
 
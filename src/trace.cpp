@@ -0,0 +1,120 @@
+// Copyright (C) 2015 Jonas Kümmerlin <rgcjonas@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "trace.hpp"
+
+#include <cwchar>
+
+trace::Header *trace::g_ring = nullptr;
+
+// How long init() waits for someone else to finish creating the ring
+static const DWORD INIT_TIMEOUT_MS = 100;
+
+void trace::mapping_name(wchar_t *buffer, DWORD process)
+{
+    _snwprintf(buffer, 32, L"dd4seven-trace-%lu", (unsigned long)process);
+    buffer[31] = 0;
+}
+
+void trace::init()
+{
+    if (g_ring)
+        return;
+
+    wchar_t name[32];
+    mapping_name(name, GetCurrentProcessId());
+
+    DWORD  size    = DWORD(sizeof(Header) + RECORDS * sizeof(Record));
+    HANDLE mapping = CreateFileMapping(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, size, name);
+    if (!mapping)
+        return;
+
+    // Somebody else in this process might have been faster
+    bool existed = GetLastError() == ERROR_ALREADY_EXISTS;
+
+    Header *ring = (Header*)MapViewOfFile(mapping, FILE_MAP_READ|FILE_MAP_WRITE, 0, 0, size);
+    if (!ring) {
+        CloseHandle(mapping);
+        return;
+    }
+
+    if (!existed) {
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+
+        ring->version   = VERSION;
+        ring->capacity  = RECORDS;
+        ring->process   = GetCurrentProcessId();
+        ring->frequency = frequency.QuadPart;
+        ring->next      = 0;
+        MemoryBarrier();
+        ring->magic     = MAGIC;
+    } else {
+        // Wait for whoever created it to finish. It may have died halfway
+        // (or been an earlier process with our ID, whose ring is still open
+        // in the dump tool), so don't wait forever: no trace is better than
+        // a hung caller.
+        DWORD start = GetTickCount();
+        while (*(volatile uint32_t*)&ring->magic != MAGIC) {
+            if (GetTickCount() - start > INIT_TIMEOUT_MS) {
+                UnmapViewOfFile(ring);
+                CloseHandle(mapping);
+                return;
+            }
+
+            Sleep(0);
+        }
+    }
+
+    // The mapping stays open for the lifetime of the process, so the
+    // dump tool can still look at it after a crash was caught in a debugger
+    if (InterlockedCompareExchangePointer((PVOID*)&g_ring, ring, nullptr) != nullptr) {
+        // but we only need one view of it
+        UnmapViewOfFile(ring);
+        CloseHandle(mapping);
+    }
+}
+
+const char *trace::event_name(uint16_t event)
+{
+    switch (event) {
+        case EVENT_PRESENT_BEGIN:        return "present-begin";
+        case EVENT_PRESENT_END:          return "present-end";
+        case EVENT_CAPTURE_REGISTERED:   return "capture-registered";
+        case EVENT_CAPTURE_REMOVED:      return "capture-removed";
+        case EVENT_CAPTURE_BOUND:        return "capture-bound";
+        case EVENT_MODE_CHANGE:          return "mode-change";
+        case EVENT_COPY:                 return "copy";
+        case EVENT_COPY_DEFERRED:        return "copy-deferred";
+        case EVENT_COPY_SKIPPED:         return "copy-skipped";
+        case EVENT_GPU_COPY_TIME:        return "gpu-copy-time";
+        case EVENT_CONFIG_APPLIED:       return "config-applied";
+        case EVENT_TAKEN_OVER:           return "taken-over";
+        case EVENT_STARTUP_STEP:         return "startup-step";
+        case EVENT_DUPLICATION_CREATED:  return "duplication-created";
+        case EVENT_ACQUIRE:              return "acquire";
+        case EVENT_ACQUIRE_TIMEOUT:      return "acquire-timeout";
+        case EVENT_ACQUIRE_FAILED:       return "acquire-failed";
+        case EVENT_RELEASE:              return "release";
+        case EVENT_RECONFIGURE:          return "reconfigure";
+        case EVENT_CLIENT_MODE_CHANGE:   return "client-mode-change";
+        default:                         return "unknown";
+    }
+}
@@ -0,0 +1,138 @@
+// Copyright (C) 2015 Jonas Kümmerlin <rgcjonas@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#pragma once
+
+#include <windows.h>
+
+#include <atomic>
+#include <cstdint>
+
+/*
+ * Binary tracing that's cheap enough to stay enabled in release builds.
+ *
+ * Every process has a ring of fixed-size records in a named file mapping,
+ * "dd4seven-trace-<pid>", that dd4seven-tracedump.exe can read while the
+ * process is running. Writing a record takes one interlocked increment and
+ * a QueryPerformanceCounter call; when the ring is full, the oldest records
+ * are overwritten.
+ *
+ * The layout only uses fixed-size types, so a 64bit dump tool can read the
+ * ring of a 32bit process and vice versa.
+ */
+namespace trace {
+    // Never reuse or renumber these, old dumps would be decoded wrong
+    enum Event : uint16_t {
+        EVENT_NONE = 0,
+
+        // dd4seven-dwm.dll
+        EVENT_PRESENT_BEGIN      = 1,  // captures, -, -
+        EVENT_PRESENT_END        = 2,  // ready, copied, -
+        EVENT_CAPTURE_REGISTERED = 3,  // capture id, width, height
+        EVENT_CAPTURE_REMOVED    = 4,  // capture id, -, -
+        EVENT_CAPTURE_BOUND      = 5,  // capture id, -, -
+        EVENT_MODE_CHANGE        = 6,  // capture id, width, height
+        EVENT_COPY               = 7,  // capture id, target, CPU microseconds
+        EVENT_COPY_DEFERRED      = 8,  // capture id, -, -
+        EVENT_COPY_SKIPPED       = 9,  // capture id, -, -   (image mutex was held)
+        EVENT_GPU_COPY_TIME      = 10, // capture id, GPU microseconds, -
+        EVENT_CONFIG_APPLIED     = 11, // capture id, flags, frame interval
+        EVENT_TAKEN_OVER         = 12, // captures, swap chains, microseconds
+        EVENT_STARTUP_STEP       = 13, // step (StartupStep in dd4seven-dwm.cpp), microseconds, -
+
+        // dd4seven-api.dll
+        EVENT_DUPLICATION_CREATED = 100, // width, height, targets
+        EVENT_ACQUIRE             = 101, // target, -, -
+        EVENT_ACQUIRE_TIMEOUT     = 102, // milliseconds waited so far, -, -
+        EVENT_ACQUIRE_FAILED      = 103, // HRESULT, -, -
+        EVENT_RELEASE             = 104, // microseconds held, -, -
+        EVENT_RECONFIGURE         = 105, // flags, frame interval, HRESULT
+        EVENT_CLIENT_MODE_CHANGE  = 106, // width, height, HRESULT
+    };
+
+    constexpr uint32_t MAGIC   = 0x43525444; // "DTRC"
+    constexpr uint32_t VERSION = 1;
+    constexpr uint32_t RECORDS = 1 << 16;    // must be a power of two
+
+    struct Header
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t capacity;      // number of records following the header
+        uint32_t process;
+        int64_t  frequency;     // of QueryPerformanceCounter
+        volatile LONG64 next;   // index of the next record, counts up forever
+        uint8_t  reserved[32];
+    };
+
+    struct Record
+    {
+        // Low 32 bits of index + 1 once the record is complete, 0 while it's written
+        volatile uint32_t sequence;
+        uint16_t event;         // Event
+        uint16_t reserved;
+        int64_t  timestamp;     // QueryPerformanceCounter
+        uint32_t thread;
+        uint32_t args[3];
+    };
+
+    static_assert(sizeof(Header) == 64, "trace header layout");
+    static_assert(sizeof(Record) == 32, "trace record layout");
+
+    // The ring of this process, or nullptr if tracing is not available
+    extern Header *g_ring;
+
+    // Creates the ring, if it isn't there yet. Safe to call from any thread.
+    void init();
+
+    // Fills a 32 character buffer with the file mapping name for a process
+    void mapping_name(wchar_t *buffer, DWORD process);
+
+    // Human-readable name of an event, for the dump tool
+    const char *event_name(uint16_t event);
+
+    inline void write(Event event, uint32_t arg0 = 0, uint32_t arg1 = 0, uint32_t arg2 = 0)
+    {
+        Header *ring = g_ring;
+        if (!ring)
+            return;
+
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+
+        uint64_t index  = uint64_t(InterlockedIncrement64(&ring->next) - 1);
+        Record  &record = reinterpret_cast<Record*>(ring + 1)[index & (ring->capacity - 1)];
+
+        // Readers check the sequence before and after copying a record, so
+        // x86 store ordering plus keeping the compiler in line is enough here
+        record.sequence = 0;
+        std::atomic_signal_fence(std::memory_order_release);
+
+        record.event     = event;
+        record.timestamp = now.QuadPart;
+        record.thread    = GetCurrentThreadId();
+        record.args[0]   = arg0;
+        record.args[1]   = arg1;
+        record.args[2]   = arg2;
+
+        std::atomic_signal_fence(std::memory_order_release);
+        record.sequence = uint32_t(index + 1);
+    }
+}
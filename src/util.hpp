@@ -102,24 +102,6 @@ namespace util {
         }
     }
 
-    /**
-     * return the next multiple of @param n being >= @param arg
-     */
-    template<typename T>
-    inline T next_multiple(T n, T arg)
-    {
-        if (arg % n == 0) return arg;
-        else return (arg / n) * n + n;
-    }
-
-    /**
-     * return the pixel value in an indexed pixel format with a bpp <= 8
-     */
-    template<unsigned bpp>
-    inline uint8_t get_pixel_from_row(uint8_t *row, int x) {
-        return (row[x * bpp / 8] >> (8 - bpp - (x % (8 / bpp)) * bpp)) & ((1 << bpp) - 1);
-    }
-
     template<typename TComparator = std::greater_equal<DWORD>>
     inline bool check_windows_version(DWORD major, DWORD minor, const TComparator& compare = TComparator())
     {
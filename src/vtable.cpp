@@ -0,0 +1,114 @@
+// Copyright (C) 2015 Jonas Kümmerlin <rgcjonas@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "vtable.hpp"
+
+namespace {
+    struct Hook
+    {
+        void **slot;
+        void  *original;
+        void  *replacement;
+    };
+
+    // Entries are never removed, so original() can scan them without locking
+    const LONG MAX_HOOKS = 32;
+    Hook          g_hooks[MAX_HOOKS];
+    volatile LONG g_count = 0;
+
+    void **slot_of(void *object, size_t index)
+    {
+        return *reinterpret_cast<void ***>(object) + index;
+    }
+
+    // Vtables live in read-only sections, possibly next to code
+    bool swap_slot(void **slot, void *expected, void *value)
+    {
+        DWORD oldProtect;
+        if (!VirtualProtect(slot, sizeof(void *), PAGE_EXECUTE_READWRITE, &oldProtect))
+            return false;
+
+        bool swapped = InterlockedCompareExchangePointer(slot, value, expected) == expected;
+
+        VirtualProtect(slot, sizeof(void *), oldProtect, &oldProtect);
+
+        return swapped;
+    }
+}
+
+bool vtable::hook(void *object, size_t index, void *replacement)
+{
+    void **slot = slot_of(object, index);
+    if (*slot == replacement)
+        return true;
+
+    for (LONG i = 0; i < g_count; ++i) {
+        if (g_hooks[i].slot == slot)
+            return g_hooks[i].replacement == replacement && swap_slot(slot, g_hooks[i].original, replacement);
+    }
+
+    if (g_count >= MAX_HOOKS)
+        return false;
+
+    // Publish the entry before the replacement can be called
+    Hook &entry = g_hooks[g_count];
+    entry.slot        = slot;
+    entry.original    = *slot;
+    entry.replacement = replacement;
+    InterlockedIncrement(&g_count);
+
+    return swap_slot(slot, entry.original, replacement);
+}
+
+bool vtable::hooked(void *object, size_t index, void *replacement)
+{
+    return *slot_of(object, index) == replacement;
+}
+
+bool vtable::unhook(void *object, size_t index, void *replacement)
+{
+    void **slot = slot_of(object, index);
+
+    // The entry stays, original() is still needed by calls in flight
+    for (LONG i = 0; i < g_count; ++i) {
+        if (g_hooks[i].slot == slot && g_hooks[i].replacement == replacement)
+            return swap_slot(slot, replacement, g_hooks[i].original);
+    }
+
+    return false;
+}
+
+void *vtable::original(void *object, size_t index)
+{
+    void **slot = slot_of(object, index);
+
+    for (LONG i = 0; i < g_count; ++i) {
+        if (g_hooks[i].slot == slot)
+            return g_hooks[i].original;
+    }
+
+    return nullptr;
+}
+
+void vtable::unhook_all()
+{
+    for (LONG i = 0; i < g_count; ++i)
+        swap_slot(g_hooks[i].slot, g_hooks[i].replacement, g_hooks[i].original);
+}
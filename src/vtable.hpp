@@ -0,0 +1,116 @@
+// Copyright (C) 2015 Jonas Kümmerlin <rgcjonas@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#pragma once
+
+#include <windows.h>
+
+#include <cstddef>
+
+/*
+ * Hooking COM methods by replacing the method pointer in the vtable.
+ *
+ * Unlike MinHook's inline detours, nothing gets disassembled or copied into
+ * a trampoline and no threads are frozen: switching a method is one atomic
+ * pointer store, and undoing it is another. The catch is that only calls made
+ * through that vtable are seen, so every other class implementing the same
+ * interface (and every other interface of the same object) is left alone.
+ *
+ * All objects sharing a vtable share the replacement. Replacements look up
+ * the method they replaced with original() and use an object_filter to skip
+ * objects they don't care about.
+ */
+
+// Index of a method in a C vtable struct, e.g. VTABLE_INDEX(IDXGISwapChainDWMVtbl, Present)
+#define VTABLE_INDEX(vtbl, method) (offsetof(vtbl, method) / sizeof(void *))
+
+namespace vtable {
+    // Replaces method <index> in the vtable of <object> with <replacement>.
+    // Does nothing if that slot already holds it. Not thread-safe against
+    // other calls of hook() and unhook_all().
+    bool hook(void *object, size_t index, void *replacement);
+
+    // Whether method <index> in the vtable of <object> is <replacement> right now
+    bool hooked(void *object, size_t index, void *replacement);
+
+    // Puts the original method <index> back into the vtable of <object>, if
+    // <replacement> is still there. Same thread-safety as hook().
+    bool unhook(void *object, size_t index, void *replacement);
+
+    // The method <index> of the vtable of <object> had before it was hooked,
+    // nullptr if it never was. Safe to call from any thread at any time.
+    void *original(void *object, size_t index);
+
+    // Puts the original methods back into all vtables, unless something else
+    // replaced ours in the meantime. original() keeps working for calls that
+    // are still in flight.
+    void unhook_all();
+
+    // Set of objects a replacement method cares about. Lock-free, so it can
+    // be checked on every call and changed from any thread.
+    template<size_t N>
+    class object_filter
+    {
+        void * volatile m_objects[N] = {};
+
+    public:
+        // false if the filter is full
+        bool add(void *object)
+        {
+            if (contains(object))
+                return true;
+
+            for (size_t i = 0; i < N; ++i) {
+                if (!InterlockedCompareExchangePointer(&m_objects[i], object, nullptr))
+                    return true;
+            }
+
+            return false;
+        }
+
+        void remove(void *object)
+        {
+            for (size_t i = 0; i < N; ++i)
+                InterlockedCompareExchangePointer(&m_objects[i], nullptr, object);
+        }
+
+        bool contains(void *object) const
+        {
+            for (size_t i = 0; i < N; ++i) {
+                if (m_objects[i] == object)
+                    return true;
+            }
+
+            return false;
+        }
+
+        // Copies the objects into <objects>, which has room for N. Returns how many there are.
+        size_t snapshot(void **objects) const
+        {
+            size_t count = 0;
+            for (size_t i = 0; i < N; ++i) {
+                if (void *object = m_objects[i])
+                    objects[count++] = object;
+            }
+
+            return count;
+        }
+    };
+}; // namespace vtable